@@ -50,6 +50,7 @@
 #include "mupdf/fitz/annotation.h"
 
 #include "mupdf/fitz/util.h"
+#include "mupdf/fitz/text-index.h"
 
 /* Output formats */
 #include "mupdf/fitz/output-pnm.h"
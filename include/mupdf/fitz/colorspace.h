@@ -82,6 +82,14 @@ struct fz_colorspace_s
 
 fz_colorspace *fz_new_colorspace(fz_context *ctx, char *name, int n);
 fz_colorspace *fz_new_indexed_colorspace(fz_context *ctx, fz_colorspace *base, int high, unsigned char *lookup);
+
+/*
+	fz_indexed_colorspace_lookup: Get the base colorspace and the
+	lookup table (of (high+1) * base->n bytes) of an indexed
+	colorspace, or return NULL if the colorspace is not indexed.
+	No references are taken.
+*/
+fz_colorspace *fz_indexed_colorspace_lookup(fz_context *ctx, fz_colorspace *cs, int *high, unsigned char **lookup);
 fz_colorspace *fz_keep_colorspace(fz_context *ctx, fz_colorspace *colorspace);
 void fz_drop_colorspace(fz_context *ctx, fz_colorspace *colorspace);
 void fz_drop_colorspace_imp(fz_context *ctx, fz_storable *colorspace);
@@ -17,8 +17,10 @@ typedef struct fz_colorspace_context_s fz_colorspace_context;
 typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_style_context_s fz_style_context;
 typedef struct fz_locks_context_s fz_locks_context;
+typedef struct fz_threads_context_s fz_threads_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_draw_pool_s fz_draw_pool;
 typedef struct fz_document_handler_context_s fz_document_handler_context;
 typedef struct fz_context_s fz_context;
 
@@ -104,6 +106,7 @@ struct fz_context_s
 	void *user;
 	const fz_alloc_context *alloc;
 	const fz_locks_context *locks;
+	const fz_threads_context *threads;
 	fz_id_context *id;
 	fz_error_context *error;
 	fz_warn_context *warn;
@@ -113,6 +116,7 @@ struct fz_context_s
 	fz_style_context *style;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_draw_pool *draw_pool;
 	fz_document_handler_context *handler;
 };
 
@@ -222,6 +226,36 @@ int fz_aa_level(fz_context *ctx);
 */
 void fz_set_aa_level(fz_context *ctx, int bits);
 
+/*
+	fz_aa_rasterizer: Get the scan converter used for antialiased
+	rendering.
+*/
+int fz_aa_rasterizer(fz_context *ctx);
+
+/*
+	fz_set_aa_rasterizer: Choose the scan converter used for
+	antialiased rendering.
+
+	FZ_RASTERIZER_EDGES (the default) sweeps a sorted edge list once
+	per sub-scanline, sampling coverage on a grid of up to 17x15
+	points per pixel.
+
+	FZ_RASTERIZER_CELLS walks each edge once, accumulating the area
+	it covers in each pixel, and applies the fill rule to the summed
+	coverage of each pixel. It draws the same shapes with the same
+	number of levels, but measures the exact area rather than
+	sampling points, so edges may differ slightly, and pixels where
+	a self-intersecting path crosses itself may differ more. It is
+	much faster for dense artwork with many edges.
+*/
+void fz_set_aa_rasterizer(fz_context *ctx, int rasterizer);
+
+enum
+{
+	FZ_RASTERIZER_EDGES,
+	FZ_RASTERIZER_CELLS
+};
+
 /*
 	fz_user_css: Get the user stylesheet source text.
 */
@@ -260,14 +294,65 @@ struct fz_locks_context_s
 	void (*unlock)(void *user, int lock);
 };
 
+/* The glyph cache is split into this many shards, each with its own lock. */
+#define FZ_GLYPH_CACHE_SHARDS 4
+
 enum {
 	FZ_LOCK_ALLOC = 0,
 	FZ_LOCK_FILE, /* Unused now */
 	FZ_LOCK_FREETYPE,
-	FZ_LOCK_GLYPHCACHE,
-	FZ_LOCK_MAX
+	FZ_LOCK_GLYPHCACHE, /* First of FZ_GLYPH_CACHE_SHARDS locks */
+	FZ_LOCK_MAX = FZ_LOCK_GLYPHCACHE + FZ_GLYPH_CACHE_SHARDS
 };
 
+/*
+	Threading functions
+
+	In the same way, MuPDF never creates threads of its own. A few
+	operations can split their work into independent jobs that can
+	usefully run at the same time (for example
+	fz_render_display_list_parallel). They hand these jobs to a
+	client provided function which runs them and returns once all
+	of them have finished.
+
+	run: Call fn(arg, i) for every i from 0 to count-1, in any order
+	and on any threads, and return once every call has returned.
+
+	Each job is given its own cloned context, so a threads context
+	only has an effect if locks were also supplied. Without one,
+	the jobs are simply run one after the other on the calling
+	thread.
+*/
+struct fz_threads_context_s
+{
+	void *user;
+	void (*run)(void *user, int count, void (*fn)(void *arg, int i), void *arg);
+};
+
+/*
+	fz_set_threads_context: Supply a function to run jobs in
+	parallel. The context (and any later clones of it) will keep
+	the pointer, so the data it points to must not be modified or
+	freed during the lifetime of the context. Pass NULL to go back
+	to running jobs one after the other.
+
+	Does not throw exceptions.
+*/
+void fz_set_threads_context(fz_context *ctx, const fz_threads_context *threads);
+
+/*
+	fz_run_jobs: Run fn(ctx, arg, i) for every i from 0 to count-1,
+	using the threads context if there is one. Each job gets a
+	cloned context of its own, and must only touch data that no
+	other job touches.
+
+	If any job throws, the first error is rethrown once all jobs
+	have finished.
+*/
+typedef void (fz_job_fn)(fz_context *ctx, void *arg, int i);
+
+void fz_run_jobs(fz_context *ctx, int count, fz_job_fn *fn, void *arg);
+
 /*
 	Memory Allocation and Scavenging:
 
@@ -445,6 +530,10 @@ void fz_new_aa_context(fz_context *ctx);
 void fz_drop_aa_context(fz_context *ctx);
 void fz_copy_aa_context(fz_context *dst, fz_context *src);
 
+void fz_drop_draw_pool_context(fz_context *ctx);
+int fz_scavenge_draw_pool(fz_context *ctx);
+void fz_add_draw_pool_stats(fz_context *ctx, int hits, int misses, size_t peak);
+
 void fz_new_document_handler_context(fz_context *ctx);
 void fz_drop_document_handler_context(fz_context *ctx);
 fz_document_handler_context *fz_keep_document_handler_context(fz_context *ctx);
@@ -489,15 +578,85 @@ fz_unlock(fz_context *ctx, int lock)
 	ctx->locks->unlock(ctx->locks->user, lock);
 }
 
+/*
+	Reference counting
+
+	Reference counts are changed using atomic operations wherever the
+	compiler gives us a way to do so (the __sync builtins of gcc and
+	clang, or the Interlocked intrinsics of MSVC), so that keeping and
+	dropping an object never needs to take FZ_LOCK_ALLOC. On other
+	compilers, or if FZ_NO_ATOMIC_REFS is defined, we fall back to
+	doing the same under the lock.
+
+	fz_refs_inc/fz_refs_dec (and the int8_t versions) are the raw
+	operations, returning the new value of the count. fz_refs_load
+	reads a count that may be changing on another thread, and
+	fz_refs_store sets one that other threads may be reading. If
+	FZ_ATOMIC_REFS is not defined, the caller must hold
+	FZ_LOCK_ALLOC when using them. Counts that are 0 or less belong
+	to static objects and are never changed by fz_keep_imp and
+	fz_drop_imp.
+
+	Note that atomic counts are only safe because a reference can
+	only be taken by someone who already holds one. The one
+	exception is the store, which hands out new references to its
+	contents under FZ_LOCK_ALLOC, and only evicts items whose sole
+	reference is its own.
+*/
+
+#if !defined(FZ_NO_ATOMIC_REFS)
+#if defined(__GNUC__) || defined(__clang__)
+#define FZ_ATOMIC_REFS
+#if defined(__ATOMIC_RELAXED)
+#define fz_refs_load(refs) __atomic_load_n((refs), __ATOMIC_RELAXED)
+#define fz_refs_load8(refs) __atomic_load_n((refs), __ATOMIC_RELAXED)
+#define fz_refs_store(refs, v) __atomic_store_n((refs), (v), __ATOMIC_RELAXED)
+#else
+#define fz_refs_load(refs) __sync_fetch_and_add((refs), 0)
+#define fz_refs_load8(refs) __sync_fetch_and_add((refs), 0)
+#define fz_refs_store(refs, v) ((void)__sync_lock_test_and_set((refs), (v)))
+#endif
+#define fz_refs_inc(refs) __sync_add_and_fetch((refs), 1)
+#define fz_refs_dec(refs) __sync_sub_and_fetch((refs), 1)
+#define fz_refs_inc8(refs) __sync_add_and_fetch((refs), 1)
+#define fz_refs_dec8(refs) __sync_sub_and_fetch((refs), 1)
+#elif defined(_MSC_VER) && _MSC_VER >= 1700 /* MSVC 2012 or newer */
+#include <intrin.h>
+#define FZ_ATOMIC_REFS
+#define fz_refs_load(refs) (*(volatile const int *)(refs))
+#define fz_refs_load8(refs) (*(volatile const int8_t *)(refs))
+#define fz_refs_store(refs, v) ((void)_InterlockedExchange((volatile long *)(refs), (v)))
+#define fz_refs_inc(refs) ((int)_InterlockedIncrement((volatile long *)(refs)))
+#define fz_refs_dec(refs) ((int)_InterlockedDecrement((volatile long *)(refs)))
+#define fz_refs_inc8(refs) ((int8_t)(_InterlockedExchangeAdd8((volatile char *)(refs), 1) + 1))
+#define fz_refs_dec8(refs) ((int8_t)(_InterlockedExchangeAdd8((volatile char *)(refs), -1) - 1))
+#endif
+#endif
+
+#ifndef FZ_ATOMIC_REFS
+#define fz_refs_load(refs) (*(refs))
+#define fz_refs_load8(refs) (*(refs))
+#define fz_refs_store(refs, v) (*(refs) = (v))
+#define fz_refs_inc(refs) (++*(refs))
+#define fz_refs_dec(refs) (--*(refs))
+#define fz_refs_inc8(refs) (++*(refs))
+#define fz_refs_dec8(refs) (--*(refs))
+#endif
+
 static inline void *
 fz_keep_imp(fz_context *ctx, void *p, int *refs)
 {
 	if (p)
 	{
+#ifdef FZ_ATOMIC_REFS
+		if (fz_refs_load(refs) > 0)
+			(void)fz_refs_inc(refs);
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 			++*refs;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 	}
 	return p;
 }
@@ -507,10 +666,15 @@ fz_keep_imp8(fz_context *ctx, void *p, int8_t *refs)
 {
 	if (p)
 	{
+#ifdef FZ_ATOMIC_REFS
+		if (fz_refs_load8(refs) > 0)
+			(void)fz_refs_inc8(refs);
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 			++*refs;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 	}
 	return p;
 }
@@ -521,12 +685,19 @@ fz_drop_imp(fz_context *ctx, void *p, int *refs)
 	if (p)
 	{
 		int drop;
+#ifdef FZ_ATOMIC_REFS
+		if (fz_refs_load(refs) > 0)
+			drop = fz_refs_dec(refs) == 0;
+		else
+			drop = 0;
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 			drop = --*refs == 0;
 		else
 			drop = 0;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 		return drop;
 	}
 	return 0;
@@ -538,12 +709,19 @@ fz_drop_imp8(fz_context *ctx, void *p, int8_t *refs)
 	if (p)
 	{
 		int drop;
+#ifdef FZ_ATOMIC_REFS
+		if (fz_refs_load8(refs) > 0)
+			drop = fz_refs_dec8(refs) == 0;
+		else
+			drop = 0;
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 			drop = --*refs == 0;
 		else
 			drop = 0;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 		return drop;
 	}
 	return 0;
@@ -9,6 +9,7 @@
 #include "mupdf/fitz/shade.h"
 #include "mupdf/fitz/path.h"
 #include "mupdf/fitz/text.h"
+#include "mupdf/fitz/bitmap.h"
 
 /*
 	The different format handlers (pdf, xps etc) interpret pages to a
@@ -124,7 +125,7 @@ struct fz_device_s
 
 	void (*pop_clip)(fz_context *, fz_device *);
 
-	void (*begin_mask)(fz_context *, fz_device *, const fz_rect *, int luminosity, fz_colorspace *, float *bc);
+	int (*begin_mask)(fz_context *, fz_device *, const fz_rect *, int luminosity, fz_colorspace *, float *bc, const fz_matrix *ctm, int id);
 	void (*end_mask)(fz_context *, fz_device *);
 	void (*begin_group)(fz_context *, fz_device *, const fz_rect *, int isolated, int knockout, int blendmode, float alpha);
 	void (*end_group)(fz_context *, fz_device *);
@@ -161,6 +162,7 @@ void fz_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, const fz_ma
 void fz_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha);
 void fz_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm);
 void fz_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *area, int luminosity, fz_colorspace *colorspace, float *bc);
+int fz_begin_mask_id(fz_context *ctx, fz_device *dev, const fz_rect *area, int luminosity, fz_colorspace *colorspace, float *bc, const fz_matrix *ctm, int id);
 void fz_end_mask(fz_context *ctx, fz_device *dev);
 void fz_begin_group(fz_context *ctx, fz_device *dev, const fz_rect *area, int isolated, int knockout, int blendmode, float alpha);
 void fz_end_group(fz_context *ctx, fz_device *dev);
@@ -322,6 +324,67 @@ fz_device *fz_new_draw_device(fz_context *ctx, fz_pixmap *dest);
 */
 fz_device *fz_new_draw_device_with_bbox(fz_context *ctx, fz_pixmap *dest, const fz_irect *clip);
 
+/*
+	fz_new_draw_device_for_band: Create a device to draw one band
+	of a larger area on a pixmap.
+
+	dest: Target pixmap for the band. Only dest is marked.
+
+	area: The whole area of which dest is a band. Paths, glyphs
+	and images are cut and placed as if all of area were drawn at
+	once, so that bands drawn by separate devices join up exactly.
+*/
+fz_device *fz_new_draw_device_for_band(fz_context *ctx, fz_pixmap *dest, const fz_irect *area);
+
 fz_device *fz_new_draw_device_type3(fz_context *ctx, fz_pixmap *dest);
 
+/*
+	fz_draw_device_pool_stats: Report how well a draw device reused
+	the pixel buffers of its group, mask, clip and knockout pixmaps.
+	Freed buffers are pooled in the context, so a device can reuse
+	those of earlier devices, such as the ones that drew the bands
+	above it. Cloned contexts each have a pool of their own.
+
+	hits, misses: Set to the number of buffers taken from the pool
+	and the number allocated afresh.
+
+	peak: Set to the largest number of bytes held in such buffers
+	at any one time.
+
+	Any of the pointers may be NULL. Devices other than draw devices
+	report zeros.
+*/
+void fz_draw_device_pool_stats(fz_context *ctx, fz_device *dev, int *hits, int *misses, size_t *peak);
+
+/*
+	fz_draw_pool_stats: Report the pool statistics of all the draw
+	devices dropped on this context since the last call, and start
+	counting afresh.
+
+	hits and misses are added up over the devices, and peak is the
+	largest of theirs. The devices fz_render_display_list_parallel
+	draws its bands with are counted here too, with their peaks
+	added up as the bands run at the same time.
+
+	Any of the pointers may be NULL.
+*/
+void fz_draw_pool_stats(fz_context *ctx, int *hits, int *misses, size_t *peak);
+
+/*
+	fz_new_bitmap_device: Create a device to draw 1 bit images and
+	image masks directly on a bitmap, without halftoning.
+
+	dest: Target bitmap for the device. As with the draw device, the
+	bitmap is not cleared first; see fz_clear_bitmap.
+
+	bbox: The area of device space covered by dest.
+
+	unsupported: Set to 1 (and interpretation aborted) if the page
+	contains anything other than solid 1 bit images and image masks
+	that are axis aligned and scaled by an integer ratio. The contents
+	of dest are undefined in that case, and the page should be drawn
+	with the draw device instead.
+*/
+fz_device *fz_new_bitmap_device(fz_context *ctx, fz_bitmap *dest, const fz_irect *bbox, int *unsupported);
+
 #endif
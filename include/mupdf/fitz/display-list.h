@@ -73,6 +73,105 @@ fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 */
 void fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *ctm, const fz_rect *area, fz_cookie *cookie);
 
+/*
+	fz_index_display_list: Build a spatial index over the contents
+	of a display list.
+
+	fz_run_display_list uses the index to go straight to the
+	commands that may be visible within its area, rather than
+	walking the whole list. This pays off when a list is replayed
+	many times through small areas, as for tiled or banded
+	rendering. It is used for transforms that keep rectangles axis
+	aligned; others replay the whole list as before.
+
+	Call this once the list device that populated the list has
+	been dropped, and before the list is shared between threads.
+	Adding to the list afterwards discards the index.
+*/
+void fz_index_display_list(fz_context *ctx, fz_display_list *list);
+
+/*
+	fz_save_display_list: Save a display list to a file, so that
+	it can be replayed later (or by another process) without
+	interpreting the document again.
+
+	Everything the list refers to is saved along with it, so that
+	the loaded list draws exactly as this one does. Files are only
+	readable by builds of MuPDF with the same byte order and pointer
+	size as the one that wrote them.
+
+	Throws if the list cannot be saved. Lists that use colorspaces
+	other than the device and indexed ones cannot be.
+*/
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+
+/*
+	fz_load_display_list: Load a display list saved by
+	fz_save_display_list.
+
+	The file is read into memory, and the nodes of the list are used
+	from there in place rather than copied. Lists loaded from a file
+	cannot be added to.
+
+	Throws if the file cannot be read or is not a compatible display
+	list file.
+*/
+fz_display_list *fz_load_display_list(fz_context *ctx, const char *filename);
+
+/*
+	fz_render_display_list_parallel: Draw a display list into a
+	pixmap, splitting the pixmap into horizontal bands that are
+	rendered at the same time.
+
+	Each band is drawn on its own cloned context by a draw device
+	of its own, using the threads context supplied through
+	fz_set_threads_context. Without one (or without locks) the
+	bands are drawn one after the other. The call returns once
+	every band has been drawn.
+
+	ctm: Transform to apply to the display list contents.
+
+	pix: The pixmap to draw into. As with fz_new_draw_device, it
+	should be cleared by the caller beforehand.
+
+	hints: Hints to enable on each draw device (see
+	fz_enable_device_hints).
+
+	nthreads: The number of bands to split the pixmap into.
+
+	cookie: Communication mechanism between caller and library, as
+	for fz_run_display_list. Setting abort stops every band. Each
+	band counts its own progress and errors, and these are added to
+	the cookie as the bands finish; progress_max covers all the
+	bands. May be NULL.
+*/
+void fz_render_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *pix, int hints, int nthreads, fz_cookie *cookie);
+
+/*
+	fz_optimize_display_list: Rewrite a display list so that it is
+	quicker to draw, without changing how it looks.
+
+	Drawing commands that lie entirely outside the clips and groups
+	they are drawn within are removed, as are clips and groups that
+	are left with nothing in them, and anything hidden beneath a later
+	opaque rectangle filled outside of any clip. Rectangular clips
+	directly within one another are merged into a single clip, and
+	runs of text filled with the same font, color and transform are
+	filled as one. Tiles and the contents of soft masks are left as
+	they are.
+
+	Anti-aliased edges hidden beneath an opaque rectangle can show
+	through very slightly differently once what lay beneath them has
+	gone. Text that is removed is lost to text extraction too, so
+	this is intended for lists that are only going to be drawn.
+
+	Call this once the list device that populated the list has been
+	dropped. Any index made by fz_index_display_list is discarded.
+
+	Throws if the list cannot be rewritten, leaving it unchanged.
+*/
+void fz_optimize_display_list(fz_context *ctx, fz_display_list *list);
+
 /*
 	fz_keep_display_list: Keep a reference to a display list.
 
@@ -83,6 +83,9 @@ fz_font *fz_new_font_from_memory(fz_context *ctx, const char *name, unsigned cha
 fz_font *fz_new_font_from_buffer(fz_context *ctx, const char *name, fz_buffer *buffer, int index, int use_glyph_bbox);
 fz_font *fz_new_font_from_file(fz_context *ctx, const char *name, const char *path, int index, int use_glyph_bbox);
 
+/* fz_font_data returns the font file a FreeType font was loaded from, and the face index within it; NULL for type3 fonts */
+fz_buffer *fz_font_data(fz_context *ctx, fz_font *font, int *index);
+
 fz_font *fz_keep_font(fz_context *ctx, fz_font *font);
 void fz_drop_font(fz_context *ctx, fz_font *font);
 
@@ -18,6 +18,21 @@ void fz_drop_function(fz_context *ctx, fz_function *func);
 unsigned int fz_function_size(fz_context *ctx, fz_function *func);
 void fz_print_function(fz_context *ctx, fz_output *out, fz_function *func);
 
+/*
+	fz_new_separation_colorspace: Create a Separation (for n == 1) or
+	DeviceN colorspace of n components, whose colors are drawn as the
+	colors in base that the tint function maps them to. Takes
+	ownership of base and tint.
+*/
+fz_colorspace *fz_new_separation_colorspace(fz_context *ctx, int n, fz_colorspace *base, fz_function *tint);
+
+/*
+	fz_separation_colorspace_tint: Get the alternate colorspace and
+	the tint function of a Separation or DeviceN colorspace, or return
+	NULL if the colorspace is neither. No references are taken.
+*/
+fz_colorspace *fz_separation_colorspace_tint(fz_context *ctx, fz_colorspace *cs, fz_function **tint);
+
 enum
 {
 	FZ_FN_MAXN = FZ_MAX_COLORS,
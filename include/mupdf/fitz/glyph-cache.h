@@ -18,6 +18,14 @@ fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 void fz_purge_glyph_cache(fz_context *ctx);
 
+/*
+	fz_set_glyph_cache_budget: Set the number of bytes of rendered
+	glyphs that the glyph cache may hold (1MB by default). If the
+	cache currently holds more, the least recently used glyphs are
+	evicted straight away.
+*/
+void fz_set_glyph_cache_budget(fz_context *ctx, unsigned int budget);
+
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm);
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm);
 fz_glyph *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, const fz_matrix *trm, int aa);
@@ -22,8 +22,13 @@ void fz_write_pixmap_as_png(fz_context *ctx, fz_output *out, const fz_pixmap *pi
 
 typedef struct fz_png_output_context_s fz_png_output_context;
 
-fz_png_output_context *fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int savealpha);
-void fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *samples, int savealpha, fz_png_output_context *poc);
+/*
+	Write a PNG image a band at a time. n is the number of components
+	per pixel in the samples, and alpha says whether the last of them
+	is alpha. savealpha has no effect if there is no alpha to save.
+*/
+fz_png_output_context *fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int savealpha);
+void fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int band, int bandheight, unsigned char *samples, int savealpha, fz_png_output_context *poc);
 void fz_write_png_trailer(fz_context *ctx, fz_output *out, fz_png_output_context *poc);
 
 /*
@@ -66,6 +66,8 @@ void fz_drop_path(fz_context *ctx, fz_path *path);
 void fz_trim_path(fz_context *ctx, fz_path *path);
 int fz_packed_path_size(const fz_path *path);
 int fz_pack_path(fz_context *ctx, uint8_t *pack, int max, const fz_path *path);
+int fz_packed_path_data(fz_context *ctx, const fz_path *path, int *cmd_len, const uint8_t **cmds, int *coord_len, const float **coords);
+void fz_repack_path(fz_context *ctx, fz_path *pack, int open, int cmd_len, const uint8_t *cmds, int coord_len, const float *coords);
 fz_path *fz_clone_path(fz_context *ctx, fz_path *path);
 
 fz_point fz_currentpoint(fz_context *ctx, fz_path *path);
@@ -10,8 +10,12 @@
 /*
 	Pixmaps represent a set of pixels for a 2 dimensional region of a
 	plane. Each pixel has n components per pixel, the last of which is
-	always alpha. The data is in premultiplied alpha when rendering, but
+	normally alpha. The data is in premultiplied alpha when rendering, but
 	non-premultiplied for colorspace conversions and rescaling.
+
+	Opaque pixmaps, such as page renderings that are going straight to an
+	output format without transparency, may be created without an alpha
+	component to save memory and bandwidth.
 */
 typedef struct fz_pixmap_s fz_pixmap;
 
@@ -64,6 +68,35 @@ fz_pixmap *fz_new_pixmap(fz_context *ctx, fz_colorspace *cs, int w, int h);
 */
 fz_pixmap *fz_new_pixmap_with_bbox(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *bbox);
 
+/*
+	fz_new_pixmap_with_alpha: Create a new pixmap, with its origin at
+	(0,0), that may or may not have an alpha component.
+
+	cs: The colorspace to use for the pixmap, or NULL for an alpha
+	plane/mask (which always has alpha).
+
+	w, h: The width and height of the pixmap (in pixels).
+
+	alpha: 0 for an opaque pixmap with just the color components of
+	cs for each pixel, non-zero for one with an alpha component too.
+
+	Returns a pointer to the new pixmap. Throws exception on failure to
+	allocate.
+*/
+fz_pixmap *fz_new_pixmap_with_alpha(fz_context *ctx, fz_colorspace *cs, int w, int h, int alpha);
+
+/*
+	fz_new_pixmap_with_bbox_and_alpha: Create a pixmap of a given
+	size and location, that may or may not have an alpha component.
+	See fz_new_pixmap_with_bbox and fz_new_pixmap_with_alpha.
+
+	Opaque pixmaps can be used as the target of a draw device, and
+	written out by the pnm, pam, png, tga, pwg and pcl writers, but
+	most other pixmap operations (colorspace conversion, scaling)
+	expect an alpha component.
+*/
+fz_pixmap *fz_new_pixmap_with_bbox_and_alpha(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *bbox, int alpha);
+
 /*
 	fz_new_pixmap_with_data: Create a new pixmap, with it's origin at
 	(0,0) using the supplied data block.
@@ -103,6 +136,18 @@ fz_pixmap *fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, i
 */
 fz_pixmap *fz_new_pixmap_with_bbox_and_data(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *rect, unsigned char *samples);
 
+/*
+	fz_new_pixmap_with_bbox_alpha_and_data: Create a pixmap of a
+	given size and location, that may or may not have an alpha
+	component, using the supplied data block. See
+	fz_new_pixmap_with_bbox_and_data and fz_new_pixmap_with_alpha.
+
+	samples: The data block to keep the samples in. Rows follow each
+	other with no padding, so each is w * n bytes long, where n
+	counts the alpha component only when there is one.
+*/
+fz_pixmap *fz_new_pixmap_with_bbox_alpha_and_data(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *rect, int alpha, unsigned char *samples);
+
 /*
 	fz_keep_pixmap: Take a reference to a pixmap.
 
@@ -136,6 +181,13 @@ fz_colorspace *fz_pixmap_colorspace(fz_context *ctx, fz_pixmap *pix);
 */
 int fz_pixmap_components(fz_context *ctx, fz_pixmap *pix);
 
+/*
+	fz_pixmap_alpha: Return whether a pixmap has an alpha component.
+
+	Does not throw exceptions.
+*/
+int fz_pixmap_alpha(fz_context *ctx, fz_pixmap *pix);
+
 /*
 	fz_pixmap_samples: Returns a pointer to the pixel data of a pixmap.
 
@@ -152,7 +204,8 @@ void fz_pixmap_set_resolution(fz_pixmap *pix, int res);
 
 	value: Values in the range 0 to 255 are valid. Each component
 	sample for each pixel in the pixmap will be set to this value,
-	while alpha will always be set to 255 (non-transparent).
+	while alpha (if present) will always be set to 255
+	(non-transparent).
 
 	Does not throw exceptions.
 */
@@ -229,7 +282,8 @@ void fz_unmultiply_pixmap(fz_context *ctx, fz_pixmap *pix);
 
 /*
 	fz_convert_pixmap: Convert from one pixmap to another (assumed to be
-	the same size, but possibly with a different colorspace).
+	the same size, but possibly with a different colorspace). Both
+	pixmaps must have alpha.
 
 	dst: the source pixmap.
 
@@ -240,16 +294,21 @@ void fz_convert_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src);
 /*
 	Pixmaps represent a set of pixels for a 2 dimensional region of a
 	plane. Each pixel has n components per pixel, the last of which is
-	always alpha. The data is in premultiplied alpha when rendering, but
-	non-premultiplied for colorspace conversions and rescaling.
+	alpha if the pixmap has one. The data is in premultiplied alpha when
+	rendering, but non-premultiplied for colorspace conversions and
+	rescaling.
 
 	x, y: The minimum x and y coord of the region in pixels.
 
 	w, h: The width and height of the region in pixels.
 
-	n: The number of color components in the image. Always
-	includes a separate alpha channel. For mask images n=1, for greyscale
-	(plus alpha) images n=2, for rgb (plus alpha) images n=4.
+	n: The number of components in the image, including a separate
+	alpha channel if there is one. For mask images n=1, for greyscale
+	(plus alpha) images n=2, for rgb (plus alpha) images n=4. Opaque
+	greyscale and rgb images have n=1 and n=3.
+
+	alpha: 1 if the last component is alpha, 0 if the pixmap is opaque
+	and has only color components. Masks always have alpha.
 
 	interpolate: A boolean flag set to non-zero if the image
 	will be drawn using linear interpolation, or set to zero if
@@ -273,6 +332,7 @@ struct fz_pixmap_s
 {
 	fz_storable storable;
 	int x, y, w, h, n;
+	int alpha;
 	int interpolate;
 	int xres, yres;
 	fz_colorspace *colorspace;
@@ -57,6 +57,15 @@ void fz_drop_storable(fz_context *, fz_storable *);
 	to an fz_store_hash structure. If make_hash_key function returns 0,
 	then the key is determined not to be hashable, and the value is
 	not stored in the hash table.
+
+	Such values are instead kept in a secondary index, and found by
+	calling cmp_key on the candidates. Types whose keys cannot be put
+	into an fz_store_hash can supply a hash_key function returning any
+	value that is the same for keys that cmp_key considers equal; this
+	keeps lookups fast however many items of that type are stored.
+	Without it, all the items of a type are candidates.
+
+	The name is used when printing store statistics.
 */
 typedef struct fz_store_hash_s fz_store_hash;
 
@@ -93,6 +102,8 @@ struct fz_store_type_s
 	void (*drop_key)(fz_context *,void *);
 	int (*cmp_key)(fz_context *ctx, void *, void *);
 	void (*print)(fz_context *ctx, fz_output *out, void *);
+	unsigned int (*hash_key)(fz_context *ctx, void *);
+	const char *name;
 };
 
 /*
@@ -133,6 +144,20 @@ fz_store *fz_keep_store_context(fz_context *ctx);
 */
 void *fz_store_item(fz_context *ctx, void *key, void *val, unsigned int itemsize, fz_store_type *type);
 
+/*
+	fz_store_item_with_cost: Add an item to the store, as for
+	fz_store_item, recording how expensive it was to create.
+
+	cost: The time taken to create the value, in microseconds, or 0
+	if unknown.
+
+	When the store needs to make space, it prefers to evict items
+	that are cheap to recreate for the amount of space they take up,
+	so that (for instance) a large but slow to decode image is kept
+	in favour of several quickly decoded ones.
+*/
+void *fz_store_item_with_cost(fz_context *ctx, void *key, void *val, unsigned int itemsize, fz_store_type *type, unsigned int cost);
+
 /*
 	fz_find_item: Find an item within the store.
 
@@ -192,6 +217,50 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
 */
 int fz_shrink_store(fz_context *ctx, unsigned int percent);
 
+/*
+	fz_store_stats: Statistics about the use of the store, for one
+	type of item.
+
+	items, bytes: The number of items of this type currently in the
+	store, and the number of bytes they account for.
+
+	hits, misses: The number of lookups that found, or failed to
+	find, an item of this type.
+
+	evictions: The number of items of this type that were evicted
+	to make space.
+*/
+typedef struct fz_store_stats_s fz_store_stats;
+
+struct fz_store_stats_s
+{
+	fz_store_type *type;
+	int items;
+	unsigned int bytes;
+	int hits;
+	int misses;
+	int evictions;
+};
+
+/*
+	fz_get_store_stats: Get the statistics for each type of item that has
+	been used with the store.
+
+	stats: Array to fill in, or NULL.
+
+	max: Number of entries in stats.
+
+	Returns the number of types with statistics, which may be more
+	than max.
+*/
+int fz_get_store_stats(fz_context *ctx, fz_store_stats *stats, int max);
+
+/*
+	fz_print_store_stats: Print the statistics for each type of item
+	in the store.
+*/
+void fz_print_store_stats(fz_context *ctx, fz_output *out);
+
 /*
 	fz_print_store: Dump the contents of the store for debugging.
 */
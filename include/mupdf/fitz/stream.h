@@ -152,6 +152,28 @@ fz_buffer *fz_read_all(fz_context *ctx, fz_stream *stm, int initial);
 */
 fz_buffer *fz_read_file(fz_context *ctx, const char *filename);
 
+/*
+	fz_map_file: Map all the contents of a file into memory, or read
+	them in where the file cannot be mapped.
+
+	The mapping is private: the data may be written to, but the
+	changes are never written back to the file. As with any mapped
+	file, the data changes if the file is changed while it is mapped.
+
+	data, len: Set to the start and length of the contents.
+
+	Returns a handle to release the contents with fz_unmap_file.
+*/
+typedef struct fz_file_mapping_s fz_file_mapping;
+
+fz_file_mapping *fz_map_file(fz_context *ctx, const char *filename, unsigned char **data, size_t *len);
+
+/*
+	fz_unmap_file: Release the contents of a file mapped with
+	fz_map_file.
+*/
+void fz_unmap_file(fz_context *ctx, fz_file_mapping *map);
+
 /*
 	fz_read_[u]int(16|24|32|64)(_le)?
 
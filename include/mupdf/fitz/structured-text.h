@@ -250,6 +250,42 @@ void fz_print_stext_page(fz_context *ctx, fz_output *out, fz_stext_page *page);
 */
 int fz_search_stext_page(fz_context *ctx, fz_stext_page *text, const char *needle, fz_rect *hit_bbox, int hit_max);
 
+/*
+	fz_stext_index: A flattened copy of the characters and character
+	bboxes of a text page, with a pseudo-newline at the end of each
+	line. Searching and selecting through an index costs time linear
+	in the length of the page, and one index can be reused for any
+	number of queries.
+*/
+typedef struct fz_stext_index_s fz_stext_index;
+
+/*
+	fz_new_stext_index: Build a search index for a text page.
+
+	The index is a snapshot; it does not track later changes to the
+	page (such as fz_analyze_text).
+*/
+fz_stext_index *fz_new_stext_index(fz_context *ctx, fz_stext_page *page);
+void fz_drop_stext_index(fz_context *ctx, fz_stext_index *index);
+
+/*
+	fz_search_stext_index: As fz_search_stext_page, but using a
+	previously built index.
+*/
+int fz_search_stext_index(fz_context *ctx, fz_stext_index *index, const char *needle, fz_rect *hit_bbox, int hit_max);
+
+/*
+	fz_highlight_stext_index: As fz_highlight_selection, but using a
+	previously built index.
+*/
+int fz_highlight_stext_index(fz_context *ctx, fz_stext_index *index, fz_rect rect, fz_rect *hit_bbox, int hit_max);
+
+/*
+	fz_copy_stext_index: As fz_copy_selection, but using a previously
+	built index.
+*/
+char *fz_copy_stext_index(fz_context *ctx, fz_stext_index *index, fz_rect rect);
+
 /*
 	fz_highlight_selection: Return a list of rectangles to highlight given a selection rectangle.
 
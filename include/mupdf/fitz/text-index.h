@@ -0,0 +1,99 @@
+#ifndef MUPDF_FITZ_TEXT_INDEX_H
+#define MUPDF_FITZ_TEXT_INDEX_H
+
+#include "mupdf/fitz/system.h"
+#include "mupdf/fitz/context.h"
+#include "mupdf/fitz/math.h"
+#include "mupdf/fitz/buffer.h"
+#include "mupdf/fitz/output.h"
+#include "mupdf/fitz/document.h"
+
+/*
+	fz_text_index: An inverted index of the words in a document.
+
+	The index maps every word to the pages, character offsets and
+	bounding boxes where it occurs, so that a document can be searched
+	repeatedly without interpreting its pages again.
+
+	Words are the runs of characters between whitespace and
+	punctuation: ASCII and Latin-1 punctuation, the Unicode general
+	punctuation block (typographic quotes, dashes, spaces and so on)
+	and CJK and fullwidth punctuation. A word also ends where the
+	script changes, and each ideograph, kana and Hangul character is
+	a word of its own (as is each character of Thai, Lao, Myanmar
+	and Khmer), so that a search in those scripts matches a run of
+	characters. Typographic single quotes and apostrophes (U+2018,
+	U+2019) count as ASCII apostrophes, so that a search for don't
+	matches the typeset form. Words are compared ignoring ASCII case.
+	Character offsets count characters in the structured text of the
+	page plus one for the end of each line, as with fz_stext_char_at.
+
+	The serialized index consists of fixed size little-endian records
+	laid out so that a file can be used in place (for example when
+	mapped into memory) without any further parsing.
+*/
+typedef struct fz_text_index_s fz_text_index;
+
+/*
+	fz_text_index_hit: A search hit in a text index.
+
+	page: The page number (counting from 0).
+
+	ofs: The character offset of the start of the match on the page.
+
+	bbox: The bounding box of the match on the page, in the same
+	space as the rectangles returned by fz_search_page. A match
+	spanning several lines produces one hit per line, all with the
+	same page and offset.
+*/
+typedef struct fz_text_index_hit_s fz_text_index_hit;
+
+struct fz_text_index_hit_s
+{
+	int page;
+	int ofs;
+	fz_rect bbox;
+};
+
+/*
+	fz_write_text_index: Extract the text of every page in a document
+	and write an index of its words to an output stream.
+
+	Pages that fail to load are indexed as empty, with a warning.
+*/
+void fz_write_text_index(fz_context *ctx, fz_output *out, fz_document *doc);
+
+/*
+	fz_new_text_index_from_buffer: Open a serialized text index held
+	in a buffer. The index takes a reference to the buffer and reads
+	the records from it directly.
+
+	Throws if the buffer does not hold a valid index.
+*/
+fz_text_index *fz_new_text_index_from_buffer(fz_context *ctx, fz_buffer *buf);
+
+/*
+	fz_open_text_index: Open a text index file, as written by
+	fz_write_text_index.
+*/
+fz_text_index *fz_open_text_index(fz_context *ctx, const char *filename);
+
+void fz_drop_text_index(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_count_text_index_pages: Return the number of pages in the
+	document the index was built from.
+*/
+int fz_count_text_index_pages(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_search_text_index: Search for the words of 'needle' occurring
+	consecutively in the indexed document.
+
+	Records the hits in page order in the hits array and returns the
+	number of hits. Will stop looking once it has filled hit_max
+	entries.
+*/
+int fz_search_text_index(fz_context *ctx, fz_text_index *index, const char *needle, fz_text_index_hit *hits, int hit_max);
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef MUPDF_HELPERS_MU_THREADS_H
+#define MUPDF_HELPERS_MU_THREADS_H
+
+/*
+	Simple threading helper library.
+
+	MuPDF itself is kept deliberately free of any knowledge of
+	particular threading systems (see the locking functions in
+	mupdf/fitz/context.h). Applications that want to use several
+	threads need some portable primitives though, and this is a
+	minimal set of them, implemented over pthreads or the Windows
+	API, for use by our own tools and by anyone else who wants them.
+
+	Define DISABLE_MUTHREADS to build without threading support; all
+	creation functions will then fail (return non-zero).
+
+	All functions return 0 on success, or non-zero on failure.
+*/
+
+#if !defined(DISABLE_MUTHREADS)
+#if defined(_WIN32) || defined(_WIN64)
+#define MU_THREADS_WINDOWS
+#include <windows.h>
+#else
+#define MU_THREADS_PTHREADS
+#include <pthread.h>
+#endif
+#endif
+
+typedef struct mu_thread_s mu_thread;
+typedef struct mu_semaphore_s mu_semaphore;
+typedef struct mu_mutex_s mu_mutex;
+
+#if defined(MU_THREADS_WINDOWS)
+
+struct mu_thread_s
+{
+	HANDLE handle;
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct mu_semaphore_s
+{
+	HANDLE handle;
+};
+
+struct mu_mutex_s
+{
+	CRITICAL_SECTION mutex;
+};
+
+#elif defined(MU_THREADS_PTHREADS)
+
+struct mu_thread_s
+{
+	pthread_t thread;
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct mu_semaphore_s
+{
+	int count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct mu_mutex_s
+{
+	pthread_mutex_t mutex;
+};
+
+#else
+
+struct mu_thread_s
+{
+	void *dummy;
+};
+
+struct mu_semaphore_s
+{
+	void *dummy;
+};
+
+struct mu_mutex_s
+{
+	void *dummy;
+};
+
+#endif
+
+/*
+	Semaphores. A semaphore starts untriggered; every call to
+	mu_trigger_semaphore allows exactly one call to
+	mu_wait_semaphore to return.
+*/
+int mu_create_semaphore(mu_semaphore *sem);
+void mu_destroy_semaphore(mu_semaphore *sem);
+int mu_trigger_semaphore(mu_semaphore *sem);
+int mu_wait_semaphore(mu_semaphore *sem);
+
+/*
+	Threads. mu_create_thread starts fn(arg) running on a new thread.
+	mu_destroy_thread waits for the thread to finish; it must be
+	called exactly once for every successfully created thread.
+*/
+typedef void (mu_thread_fn)(void *arg);
+
+int mu_create_thread(mu_thread *th, mu_thread_fn *fn, void *arg);
+void mu_destroy_thread(mu_thread *th);
+
+/*
+	Mutexes. These are not recursive.
+*/
+int mu_create_mutex(mu_mutex *mutex);
+void mu_destroy_mutex(mu_mutex *mutex);
+void mu_lock_mutex(mu_mutex *mutex);
+void mu_unlock_mutex(mu_mutex *mutex);
+
+/*
+	mu_run_jobs: Run fn(arg, i) for every i from 0 to count-1, each
+	on a thread of its own, and return once all of them have
+	finished. Jobs whose thread cannot be created are run on the
+	calling thread instead.
+
+	This matches the run function of an fz_threads_context, so
+	that an application can simply do:
+
+		static fz_threads_context threads = { NULL, mu_run_jobs };
+		fz_set_threads_context(ctx, &threads);
+*/
+void mu_run_jobs(void *user, int count, void (*fn)(void *arg, int i), void *arg);
+
+/*
+	mu_num_cpus: Return the number of processors available, or 1 if
+	this cannot be determined.
+*/
+int mu_num_cpus(void);
+
+#endif
@@ -311,6 +311,13 @@ struct pdf_write_options_s
 	int continue_on_error; /* If non-zero, errors are (optionally)
 					counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
+	int do_threads; /* If greater than 1, deflate streams in this many
+				parallel jobs (see fz_run_jobs) ahead of
+				writing them. The output is unchanged. */
+	int do_use_objstms; /* If non-zero then pack objects into compressed
+				object streams and write a cross reference
+				stream. Not with incremental writes or
+				linearisation. */
 };
 
 /*
@@ -67,6 +67,8 @@ struct pdf_xobject_s
 	pdf_obj *contents;
 	pdf_obj *me;
 	int iteration;
+	int id;
+	int inherits_state;
 };
 
 pdf_xobject *pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *obj);
@@ -2598,7 +2598,7 @@ JNI_FN(MuPDFCore_saveInternal)(JNIEnv * env, jobject thiz)
 	if (idoc && glo->current_path)
 	{
 		char *tmp;
-		pdf_write_options opts;
+		pdf_write_options opts = { 0 };
 		opts.do_incremental = 1;
 		opts.do_ascii = 0;
 		opts.do_expand = 0;
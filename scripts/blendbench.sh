@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Time the blend mode code by drawing a page that composites a
+# page-sized group in each of the 15 blend modes, once with isolated
+# groups and once with non-isolated ones.
+#
+# usage: scripts/blendbench.sh [-r resolution] path/to/mutool [path/to/mutool ...]
+#
+# Give several builds of mutool to compare them, for example one made
+# with XCFLAGS=-DFZ_NO_SIMD. Each prints its time and the MD5 checksum
+# of the page it drew; the checksums should match.
+
+RES=300
+if [ "$1" = "-r" ]
+then
+	RES=$2
+	shift 2
+fi
+
+if [ $# = 0 ]
+then
+	echo "usage: $0 [-r resolution] path/to/mutool [path/to/mutool ...]"
+	exit 2
+fi
+
+T=$(mktemp -d)
+trap 'rm -rf $T' EXIT
+
+MODES="Multiply Screen Overlay Darken Lighten ColorDodge ColorBurn HardLight SoftLight Difference Exclusion Hue Saturation Color Luminosity"
+
+# $1 is the file to write, $2 is true for isolated groups or false.
+make_pdf()
+{
+	local gs="" page="0.5 0.8 0.2 rg 0 0 612 792 re f"$'\n' i=0 m
+	for m in $MODES
+	do
+		gs+="/G$i<</BM/$m>>"
+		page+="q /G$i gs /X Do Q"$'\n'
+		i=$((i+1))
+	done
+	local form="0.2 0.6 0.9 rg 0 0 612 792 re f 0.9 0.3 0.1 rg 100 100 400 600 re f"$'\n'
+	local obj=(
+		"<</Type/Catalog/Pages 2 0 R>>"
+		"<</Type/Pages/Kids[3 0 R]/Count 1>>"
+		"<</Type/Page/Parent 2 0 R/MediaBox[0 0 612 792]/Contents 4 0 R/Resources<</ExtGState<<$gs>>/XObject<</X 5 0 R>>>>>>"
+		"<</Length ${#page}>>"$'\nstream\n'"$page"'endstream'
+		"<</Type/XObject/Subtype/Form/BBox[0 0 612 792]/Group<</S/Transparency/I $2>>/Length ${#form}>>"$'\nstream\n'"$form"'endstream'
+	)
+	local out=$'%PDF-1.4\n' xref="" n
+	for n in "${!obj[@]}"
+	do
+		xref+=$(printf "%010d 00000 n " ${#out})$'\n'
+		out+="$((n+1)) 0 obj"$'\n'"${obj[$n]}"$'\nendobj\n'
+	done
+	printf "%sxref\n0 6\n0000000000 65535 f \n%strailer\n<</Size 6/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n" \
+		"$out" "$xref" ${#out} > $1
+}
+
+make_pdf $T/isolated.pdf true
+make_pdf $T/nonisolated.pdf false
+
+for kind in isolated nonisolated
+do
+	for mutool in "$@"
+	do
+		echo "$kind groups, $mutool:"
+		$mutool draw -s t5 -r $RES -o $T/out.ppm $T/$kind.pdf || exit 1
+	done
+done
@@ -263,6 +263,10 @@ void fz_drop_glyph_cache_context(fz_context *ctx)
 {
 }
 
+void fz_drop_draw_pool_context(fz_context *ctx)
+{
+}
+
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx)
 {
 	return NULL;
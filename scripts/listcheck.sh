@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Check that display lists saved with 'mutool draw -L' and drawn again
+# with 'mutool draw -l' render exactly as the pages they came from.
+#
+# usage: scripts/listcheck.sh [-r resolution] path/to/mutool [file.pdf ...]
+#
+# Besides the files given, a small page with an unfiltered, magnified
+# image is always checked.
+
+RES=72
+if [ "$1" = "-r" ]
+then
+	RES=$2
+	shift 2
+fi
+
+MUTOOL=$1
+shift
+if [ -z "$MUTOOL" ]
+then
+	echo "usage: $0 [-r resolution] path/to/mutool [file.pdf ...]"
+	exit 2
+fi
+
+T=$(mktemp -d)
+trap 'rm -rf $T' EXIT
+
+# A 4x4 DeviceGray image with printable samples, drawn 50 times larger
+# than its size and without /Interpolate.
+make_pdf()
+{
+	local content="q 200 0 0 200 10 10 cm /Im0 Do Q"
+	local obj=(
+		"<< /Type /Catalog /Pages 2 0 R >>"
+		"<< /Type /Pages /Kids [3 0 R] /Count 1 >>"
+		"<< /Type /Page /Parent 2 0 R /MediaBox [0 0 220 220] /Resources << /XObject << /Im0 5 0 R >> >> /Contents 4 0 R >>"
+		"<< /Length ${#content} >>"$'\nstream\n'"$content"$'\nendstream'
+		"<< /Type /XObject /Subtype /Image /Width 4 /Height 4 /ColorSpace /DeviceGray /BitsPerComponent 8 /Length 16 >>"$'\nstream\n'"AP!zK~0c_e@Y8.|m"$'\nendstream'
+	)
+	local out=$'%PDF-1.4\n' xref="" i
+	for i in "${!obj[@]}"
+	do
+		xref+=$(printf "%010d 00000 n " ${#out})$'\n'
+		out+="$((i+1)) 0 obj"$'\n'"${obj[$i]}"$'\nendobj\n'
+	done
+	printf "%sxref\n0 6\n0000000000 65535 f \n%strailer\n<< /Size 6 /Root 1 0 R >>\nstartxref\n%d\n%%%%EOF\n" \
+		"$out" "$xref" ${#out} > $1
+}
+
+make_pdf $T/image.pdf
+
+FAILED=0
+for input in $T/image.pdf "$@"
+do
+	rm -f $T/*.pam $T/*.list
+	$MUTOOL draw -r $RES -o $T/page-%d.pam "$input" || FAILED=1
+	$MUTOOL draw -r $RES -L $T/%d.list -o $T/unused.pam "$input" || FAILED=1
+	for list in $T/*.list
+	do
+		[ -e "$list" ] || continue
+		n=$(basename $list .list)
+		$MUTOOL draw -r $RES -l -o $T/list-$n.pam $list || FAILED=1
+		if ! cmp -s $T/page-$n.pam $T/list-$n.pam
+		then
+			echo "$input: page $n differs when drawn from a saved list"
+			FAILED=1
+		fi
+	done
+done
+
+if [ $FAILED = 0 ]
+then
+	echo "all pages match"
+fi
+exit $FAILED
@@ -132,12 +132,13 @@ fz_bbox_pop_clip(fz_context *ctx, fz_device *dev)
 		fz_warn(ctx, "unexpected pop clip");
 }
 
-static void
-fz_bbox_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color)
+static int
+fz_bbox_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
 {
 	fz_bbox_device *bdev = (fz_bbox_device*)dev;
 	fz_bbox_add_rect(ctx, dev, rect, 1);
 	bdev->ignore++;
+	return 0;
 }
 
 static void
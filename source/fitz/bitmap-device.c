@@ -0,0 +1,392 @@
+#include "mupdf/fitz.h"
+
+/*
+	The bitmap device paints 1 bit images and image masks straight
+	into a 1 bit per pixel fz_bitmap, without going through 8 bit
+	pixmaps or halftoning. This covers scanned and faxed pages, which
+	typically consist of nothing but a single 1 bpp image. Images are
+	only handled when they are axis aligned and scaled by an integer
+	ratio; anything else is reported back as unsupported, and the
+	caller is expected to fall back to the draw device.
+*/
+
+typedef struct fz_bitmap_device_s
+{
+	fz_device super;
+	fz_bitmap *dest;
+	int x, y;
+	int *unsupported;
+} fz_bitmap_device;
+
+static void
+fz_bitmap_unsupported(fz_context *ctx, fz_device *dev_)
+{
+	fz_bitmap_device *dev = (fz_bitmap_device*)dev_;
+
+	*dev->unsupported = 1;
+	dev->super.hints |= FZ_IGNORE_IMAGE | FZ_IGNORE_SHADE;
+	fz_throw(ctx, FZ_ERROR_ABORT, "Page cannot be drawn as a bitmap; stopping interpretation");
+}
+
+/* Work out the integer scale factor between n source pixels and dn
+ * destination pixels. Returns 0 if the ratio is not an integer. */
+static int
+bitmap_ratio(int n, int dn, int *up)
+{
+	if (dn >= n && dn % n == 0)
+	{
+		*up = 1;
+		return dn / n;
+	}
+	if (dn > 0 && n % dn == 0)
+	{
+		*up = 0;
+		return n / dn;
+	}
+	return 0;
+}
+
+/* Round an image edge to the pixel grid. Edges within rounding error
+ * of a pixel boundary are snapped to it, others are moved outwards as
+ * the draw device would do. */
+static int
+bitmap_snap(float f, int up)
+{
+	float r = floorf(f + 0.5f);
+	if (fabsf(f - r) < 0.01f)
+		return (int)r;
+	return (int)(up ? ceilf(f) : floorf(f));
+}
+
+/* Fetch the next row of the image as packed bits where 1 marks a
+ * painted (mask) or black (image) pixel. */
+static void
+bitmap_get_row(fz_context *ctx, fz_image *image, fz_stream *stm, int y, int mark, unsigned char *row, int stride)
+{
+	int i, len;
+
+	if (stm)
+	{
+		len = fz_read(ctx, stm, row, stride);
+		if (len < stride)
+			memset(row + len, 0, stride - len);
+		if (mark == 0)
+			for (i = 0; i < stride; i++)
+				row[i] = ~row[i];
+	}
+	else
+	{
+		fz_pixmap *tile = image->tile;
+		unsigned char *s = tile->samples + y * tile->w * tile->n;
+		memset(row, 0, stride);
+		for (i = 0; i < image->w; i++, s += tile->n)
+			if (image->imagemask ? *s >= 128 : *s < 128)
+				row[i >> 3] |= 0x80 >> (i & 7);
+	}
+}
+
+/*
+	Paint a 1 bit image into the bitmap, sampling the nearest source
+	pixel. Pixels marked in the image are set to ink; if opaque, the
+	unmarked pixels are set to !ink.
+*/
+static void
+bitmap_paint_image(fz_context *ctx, fz_bitmap_device *dev, fz_image *image, const fz_matrix *ctm, int ink, int opaque)
+{
+	fz_bitmap *bit = dev->dest;
+	fz_stream *stm = NULL;
+	unsigned char *row = NULL;
+	fz_matrix m = *ctm;
+	int mark, x0, y0, dw, dh, hflip, vflip;
+	int kx, ky, upx, upy, stride;
+	int i0, i1, j0, j1;
+	int sy, i, j;
+
+	if (image->w == 0 || image->h == 0)
+		return;
+
+	if (image->bpc != 1 || image->n != 1 || image->mask || image->usecolorkey)
+		fz_bitmap_unsupported(ctx, &dev->super);
+	if (!image->imagemask && image->colorspace != fz_device_gray(ctx))
+		fz_bitmap_unsupported(ctx, &dev->super);
+	if (image->buffer)
+	{
+		/* These are the types fz_open_image_decomp_stream can decode.
+		 * JBIG2 images are decoded as they are loaded, and arrive
+		 * here as FZ_IMAGE_RAW; FZ_IMAGE_JBIG2 is only a placeholder,
+		 * and its data would be read as raw samples. */
+		switch (image->buffer->params.type)
+		{
+		case FZ_IMAGE_FAX:
+		case FZ_IMAGE_RAW:
+		case FZ_IMAGE_RLD:
+		case FZ_IMAGE_FLATE:
+		case FZ_IMAGE_LZW:
+			break;
+		default:
+			fz_bitmap_unsupported(ctx, &dev->super);
+		}
+	}
+	else if (!image->tile || image->tile->w != image->w || image->tile->h != image->h)
+		fz_bitmap_unsupported(ctx, &dev->super);
+
+	/* Which sample value marks a pixel, after applying the decode array */
+	if (image->decode[0] == 0 && image->decode[1] == 1)
+		mark = 0;
+	else if (image->decode[0] == 1 && image->decode[1] == 0)
+		mark = 1;
+	else
+		fz_bitmap_unsupported(ctx, &dev->super);
+
+	if (fabsf(m.b) >= FLT_EPSILON || fabsf(m.c) >= FLT_EPSILON)
+		fz_bitmap_unsupported(ctx, &dev->super);
+
+	hflip = m.a < 0;
+	vflip = m.d < 0;
+	x0 = bitmap_snap(fz_min(m.e, m.e + m.a), 0);
+	y0 = bitmap_snap(fz_min(m.f, m.f + m.d), 0);
+	dw = bitmap_snap(fz_max(m.e, m.e + m.a), 1) - x0;
+	dh = bitmap_snap(fz_max(m.f, m.f + m.d), 1) - y0;
+
+	kx = bitmap_ratio(image->w, dw, &upx);
+	ky = bitmap_ratio(image->h, dh, &upy);
+	if (kx == 0 || ky == 0)
+		fz_bitmap_unsupported(ctx, &dev->super);
+
+	/* Visible destination columns and rows, counted from the first
+	 * source pixel rather than from the device origin. */
+	if (hflip)
+	{
+		i0 = x0 + dw - (dev->x + bit->w);
+		i1 = x0 + dw - dev->x;
+	}
+	else
+	{
+		i0 = dev->x - x0;
+		i1 = dev->x + bit->w - x0;
+	}
+	if (vflip)
+	{
+		j0 = y0 + dh - (dev->y + bit->h);
+		j1 = y0 + dh - dev->y;
+	}
+	else
+	{
+		j0 = dev->y - y0;
+		j1 = dev->y + bit->h - y0;
+	}
+	i0 = fz_maxi(i0, 0);
+	i1 = fz_mini(i1, dw);
+	j0 = fz_maxi(j0, 0);
+	j1 = fz_mini(j1, dh);
+	if (i0 >= i1 || j0 >= j1)
+		return;
+
+	fz_var(stm);
+	fz_var(row);
+
+	fz_try(ctx)
+	{
+		stride = (image->w + 7) >> 3;
+		row = fz_malloc(ctx, stride);
+		if (image->buffer)
+			stm = fz_open_image_decomp_stream_from_buffer(ctx, image->buffer, NULL);
+
+		sy = 0;
+		for (j = 0; j < j1; j++)
+		{
+			/* Nearest source row; read up to it in order */
+			int ty = upy ? j / ky : j * ky + ky / 2;
+			unsigned char *d;
+
+			while (sy <= ty)
+				bitmap_get_row(ctx, image, stm, sy++, mark, row, stride);
+			if (j < j0)
+				continue;
+
+			d = bit->samples + ((vflip ? y0 + dh - 1 - j : y0 + j) - dev->y) * bit->stride;
+			for (i = i0; i < i1; i++)
+			{
+				int tx = upx ? i / kx : i * kx + kx / 2;
+				int x = (hflip ? x0 + dw - 1 - i : x0 + i) - dev->x;
+				if (row[tx >> 3] & (0x80 >> (tx & 7)))
+				{
+					if (ink)
+						d[x >> 3] |= 0x80 >> (x & 7);
+					else
+						d[x >> 3] &= ~(0x80 >> (x & 7));
+				}
+				else if (opaque)
+				{
+					if (ink)
+						d[x >> 3] &= ~(0x80 >> (x & 7));
+					else
+						d[x >> 3] |= 0x80 >> (x & 7);
+				}
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		fz_free(ctx, row);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fz_bitmap_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha)
+{
+	if (alpha == 0)
+		return;
+	if (alpha != 1)
+		fz_bitmap_unsupported(ctx, dev);
+	bitmap_paint_image(ctx, (fz_bitmap_device*)dev, image, ctm, 1, 1);
+}
+
+static void
+fz_bitmap_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm,
+	fz_colorspace *colorspace, float *color, float alpha)
+{
+	float gray;
+
+	if (alpha == 0)
+		return;
+	if (alpha != 1)
+		fz_bitmap_unsupported(ctx, dev);
+
+	/* Only solid black and solid white survive halftoning unchanged */
+	fz_convert_color(ctx, fz_device_gray(ctx), &gray, colorspace, color);
+	if ((int)(gray * 255) == 0)
+		bitmap_paint_image(ctx, (fz_bitmap_device*)dev, image, ctm, 1, 0);
+	else if ((int)(gray * 255) == 255)
+		bitmap_paint_image(ctx, (fz_bitmap_device*)dev, image, ctm, 0, 0);
+	else
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_fill_path(fz_context *ctx, fz_device *dev, fz_path *path, int even_odd, const fz_matrix *ctm,
+	fz_colorspace *colorspace, float *color, float alpha)
+{
+	if (alpha != 0)
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_stroke_path(fz_context *ctx, fz_device *dev, fz_path *path, fz_stroke_state *stroke,
+	const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	if (alpha != 0)
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_fill_text(fz_context *ctx, fz_device *dev, fz_text *text, const fz_matrix *ctm,
+	fz_colorspace *colorspace, float *color, float alpha)
+{
+	if (alpha != 0)
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_stroke_text(fz_context *ctx, fz_device *dev, fz_text *text, fz_stroke_state *stroke,
+	const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	if (alpha != 0)
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha)
+{
+	if (alpha != 0)
+		fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_clip_path(fz_context *ctx, fz_device *dev, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_clip_stroke_path(fz_context *ctx, fz_device *dev, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_clip_text(fz_context *ctx, fz_device *dev, fz_text *text, const fz_matrix *ctm)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_clip_stroke_text(fz_context *ctx, fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static void
+fz_bitmap_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static int
+fz_bitmap_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
+{
+	fz_bitmap_unsupported(ctx, dev);
+	return 0;
+}
+
+static void
+fz_bitmap_begin_group(fz_context *ctx, fz_device *dev, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
+{
+	fz_bitmap_unsupported(ctx, dev);
+}
+
+static int
+fz_bitmap_begin_tile(fz_context *ctx, fz_device *dev, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+	fz_bitmap_unsupported(ctx, dev);
+	return 0;
+}
+
+fz_device *
+fz_new_bitmap_device(fz_context *ctx, fz_bitmap *dest, const fz_irect *bbox, int *unsupported)
+{
+	fz_bitmap_device *dev = fz_new_device(ctx, sizeof *dev);
+
+	dev->super.fill_path = fz_bitmap_fill_path;
+	dev->super.stroke_path = fz_bitmap_stroke_path;
+	dev->super.clip_path = fz_bitmap_clip_path;
+	dev->super.clip_stroke_path = fz_bitmap_clip_stroke_path;
+
+	dev->super.fill_text = fz_bitmap_fill_text;
+	dev->super.stroke_text = fz_bitmap_stroke_text;
+	dev->super.clip_text = fz_bitmap_clip_text;
+	dev->super.clip_stroke_text = fz_bitmap_clip_stroke_text;
+
+	dev->super.fill_shade = fz_bitmap_fill_shade;
+	dev->super.fill_image = fz_bitmap_fill_image;
+	dev->super.fill_image_mask = fz_bitmap_fill_image_mask;
+	dev->super.clip_image_mask = fz_bitmap_clip_image_mask;
+
+	dev->super.begin_mask = fz_bitmap_begin_mask;
+	dev->super.begin_group = fz_bitmap_begin_group;
+	dev->super.begin_tile = fz_bitmap_begin_tile;
+
+	dev->dest = dest;
+	dev->x = bbox->x0;
+	dev->y = bbox->y0;
+	dev->unsupported = unsupported;
+
+	*dev->unsupported = 0;
+
+	return (fz_device*)dev;
+}
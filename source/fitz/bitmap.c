@@ -92,6 +92,13 @@ int fz_pixmap_components(fz_context *ctx, fz_pixmap *pix)
 	return pix->n;
 }
 
+int fz_pixmap_alpha(fz_context *ctx, fz_pixmap *pix)
+{
+	if (!pix)
+		return 0;
+	return pix->alpha;
+}
+
 unsigned char *fz_pixmap_samples(fz_context *ctx, fz_pixmap *pix)
 {
 	if (!pix)
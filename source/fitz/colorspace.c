@@ -253,37 +253,53 @@ fz_lookup_device_colorspace(fz_context *ctx, char *name)
 void
 fz_set_device_gray(fz_context *ctx, fz_colorspace *cs)
 {
+	fz_colorspace *old;
+
+	cs = fz_keep_colorspace(ctx, cs);
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_drop_colorspace(ctx, ctx->colorspace->gray);
-	ctx->colorspace->gray = fz_keep_colorspace(ctx, cs);
+	old = ctx->colorspace->gray;
+	ctx->colorspace->gray = cs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_drop_colorspace(ctx, old);
 }
 
 void
 fz_set_device_rgb(fz_context *ctx, fz_colorspace *cs)
 {
+	fz_colorspace *old;
+
+	cs = fz_keep_colorspace(ctx, cs);
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_drop_colorspace(ctx, ctx->colorspace->rgb);
-	ctx->colorspace->rgb = fz_keep_colorspace(ctx, cs);
+	old = ctx->colorspace->rgb;
+	ctx->colorspace->rgb = cs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_drop_colorspace(ctx, old);
 }
 
 void
 fz_set_device_bgr(fz_context *ctx, fz_colorspace *cs)
 {
+	fz_colorspace *old;
+
+	cs = fz_keep_colorspace(ctx, cs);
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_drop_colorspace(ctx, ctx->colorspace->bgr);
-	ctx->colorspace->bgr = fz_keep_colorspace(ctx, cs);
+	old = ctx->colorspace->bgr;
+	ctx->colorspace->bgr = cs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_drop_colorspace(ctx, old);
 }
 
 void
 fz_set_device_cmyk(fz_context *ctx, fz_colorspace *cs)
 {
+	fz_colorspace *old;
+
+	cs = fz_keep_colorspace(ctx, cs);
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	fz_drop_colorspace(ctx, ctx->colorspace->cmyk);
-	ctx->colorspace->cmyk = fz_keep_colorspace(ctx, cs);
+	old = ctx->colorspace->cmyk;
+	ctx->colorspace->cmyk = cs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_drop_colorspace(ctx, old);
 }
 
 int
@@ -961,6 +977,9 @@ fz_convert_pixmap(fz_context *ctx, fz_pixmap *dp, fz_pixmap *sp)
 
 	assert(ss && ds);
 
+	if (!sp->alpha || !dp->alpha)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot convert pixmaps without alpha");
+
 	dp->interpolate = sp->interpolate;
 
 	if (ss == fz_default_gray)
@@ -1185,6 +1204,73 @@ fz_convert_color(fz_context *ctx, fz_colorspace *ds, float *dv, fz_colorspace *s
 	cc.convert(ctx, &cc, dv, sv);
 }
 
+/* Separation and DeviceN */
+
+struct separation
+{
+	fz_colorspace *base;
+	fz_function *tint;
+};
+
+static void
+separation_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *color, float *rgb)
+{
+	struct separation *sep = cs->data;
+	float alt[FZ_MAX_COLORS];
+	fz_eval_function(ctx, sep->tint, color, cs->n, alt, sep->base->n);
+	sep->base->to_rgb(ctx, sep->base, alt, rgb);
+}
+
+static void
+free_separation(fz_context *ctx, fz_colorspace *cs)
+{
+	struct separation *sep = cs->data;
+	fz_drop_colorspace(ctx, sep->base);
+	fz_drop_function(ctx, sep->tint);
+	fz_free(ctx, sep);
+}
+
+fz_colorspace *
+fz_separation_colorspace_tint(fz_context *ctx, fz_colorspace *cs, fz_function **tint)
+{
+	struct separation *sep;
+
+	if (!cs || cs->to_rgb != separation_to_rgb)
+		return NULL;
+	sep = cs->data;
+	*tint = sep->tint;
+	return sep->base;
+}
+
+fz_colorspace *
+fz_new_separation_colorspace(fz_context *ctx, int n, fz_colorspace *base, fz_function *tint)
+{
+	fz_colorspace *cs;
+	struct separation *sep;
+
+	if (n < 1 || n > FZ_MAX_COLORS)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "too many components in colorspace");
+
+	sep = fz_malloc_struct(ctx, struct separation);
+	sep->base = base;
+	sep->tint = tint;
+
+	fz_try(ctx)
+	{
+		cs = fz_new_colorspace(ctx, n == 1 ? "Separation" : "DeviceN", n);
+		cs->to_rgb = separation_to_rgb;
+		cs->free_data = free_separation;
+		cs->data = sep;
+		cs->size += sizeof(struct separation) + base->size + fz_function_size(ctx, tint);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, sep);
+		fz_rethrow(ctx);
+	}
+	return cs;
+}
+
 /* Indexed */
 
 struct indexed
@@ -1217,6 +1303,19 @@ free_indexed(fz_context *ctx, fz_colorspace *cs)
 	fz_free(ctx, idx);
 }
 
+fz_colorspace *
+fz_indexed_colorspace_lookup(fz_context *ctx, fz_colorspace *cs, int *high, unsigned char **lookup)
+{
+	struct indexed *idx;
+
+	if (!cs || cs->to_rgb != indexed_to_rgb)
+		return NULL;
+	idx = cs->data;
+	*high = idx->high;
+	*lookup = idx->lookup;
+	return idx->base;
+}
+
 fz_colorspace *
 fz_new_indexed_colorspace(fz_context *ctx, fz_colorspace *base, int high, unsigned char *lookup)
 {
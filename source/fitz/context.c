@@ -86,6 +86,7 @@ fz_drop_context(fz_context *ctx)
 	fz_drop_document_handler_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
 	fz_drop_store_context(ctx);
+	fz_drop_draw_pool_context(ctx);
 	fz_drop_aa_context(ctx);
 	fz_drop_style_context(ctx);
 	fz_drop_colorspace_context(ctx);
@@ -223,6 +224,8 @@ fz_clone_context_internal(fz_context *ctx)
 	/* Inherit AA defaults from old context. */
 	fz_copy_aa_context(new_ctx, ctx);
 
+	new_ctx->threads = ctx->threads;
+
 	/* Keep thread lock checking happy by copying pointers first and locking under new context */
 	new_ctx->user = ctx->user;
 	new_ctx->store = ctx->store;
@@ -233,6 +236,7 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->colorspace = fz_keep_colorspace_context(new_ctx);
 	new_ctx->font = ctx->font;
 	new_ctx->font = fz_keep_font_context(new_ctx);
+	fz_drop_style_context(new_ctx);
 	new_ctx->style = ctx->style;
 	new_ctx->style = fz_keep_style_context(new_ctx);
 	new_ctx->id = ctx->id;
@@ -256,6 +260,90 @@ fz_gen_id(fz_context *ctx)
 	return id;
 }
 
+void
+fz_set_threads_context(fz_context *ctx, const fz_threads_context *threads)
+{
+	if (ctx != NULL)
+		ctx->threads = threads;
+}
+
+typedef struct
+{
+	fz_context *ctx;
+	fz_job_fn *fn;
+	void *arg;
+	int failed;
+	int errcode;
+	char message[256];
+} fz_job;
+
+static void
+fz_run_job(void *arg, int i)
+{
+	fz_job *job = &((fz_job *)arg)[i];
+	fz_context *ctx = job->ctx;
+
+	fz_try(ctx)
+		job->fn(ctx, job->arg, i);
+	fz_catch(ctx)
+	{
+		job->failed = 1;
+		job->errcode = fz_caught(ctx);
+		fz_strlcpy(job->message, fz_caught_message(ctx), sizeof job->message);
+	}
+}
+
+void
+fz_run_jobs(fz_context *ctx, int count, fz_job_fn *fn, void *arg)
+{
+	fz_job *jobs;
+	int i;
+
+	if (count <= 0)
+		return;
+
+	if (count == 1 || ctx->threads == NULL || ctx->locks == &fz_locks_default)
+	{
+		for (i = 0; i < count; i++)
+			fn(ctx, arg, i);
+		return;
+	}
+
+	jobs = fz_calloc(ctx, count, sizeof *jobs);
+	for (i = 0; i < count; i++)
+	{
+		jobs[i].fn = fn;
+		jobs[i].arg = arg;
+		jobs[i].ctx = fz_clone_context(ctx);
+		if (jobs[i].ctx == NULL)
+		{
+			while (i-- > 0)
+				fz_drop_context(jobs[i].ctx);
+			fz_free(ctx, jobs);
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot clone context for job");
+		}
+	}
+
+	ctx->threads->run(ctx->threads->user, count, fz_run_job, jobs);
+
+	for (i = 0; i < count; i++)
+		fz_drop_context(jobs[i].ctx);
+
+	for (i = 0; i < count; i++)
+	{
+		if (jobs[i].failed)
+		{
+			int errcode = jobs[i].errcode;
+			char message[256];
+			fz_strlcpy(message, jobs[i].message, sizeof message);
+			fz_free(ctx, jobs);
+			fz_throw(ctx, errcode, "%s", message);
+		}
+	}
+
+	fz_free(ctx, jobs);
+}
+
 void fz_set_user_context(fz_context *ctx, void *user)
 {
 	if (ctx != NULL)
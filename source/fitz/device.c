@@ -315,18 +315,28 @@ fz_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_re
 void
 fz_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *area, int luminosity, fz_colorspace *colorspace, float *bc)
 {
+	(void)fz_begin_mask_id(ctx, dev, area, luminosity, colorspace, bc, NULL, 0);
+}
+
+int
+fz_begin_mask_id(fz_context *ctx, fz_device *dev, const fz_rect *area, int luminosity, fz_colorspace *colorspace, float *bc, const fz_matrix *ctm, int id)
+{
+	int ret = 0;
+
 	if (dev->error_depth)
 	{
 		dev->error_depth++;
-		return;
+		return 0;
 	}
 
+	fz_var(ret);
+
 	fz_try(ctx)
 	{
 		if (dev->hints & FZ_MAINTAIN_CONTAINER_STACK)
 			push_clip_stack(ctx, dev, area, fz_device_container_stack_in_mask);
 		if (dev->begin_mask)
-			dev->begin_mask(ctx, dev, area, luminosity, colorspace, bc);
+			ret = dev->begin_mask(ctx, dev, area, luminosity, colorspace, bc, ctm, id);
 	}
 	fz_catch(ctx)
 	{
@@ -334,6 +344,7 @@ fz_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *area, int luminosi
 		strcpy(dev->errmess, fz_caught_message(ctx));
 		/* Error swallowed */
 	}
+	return ret;
 }
 
 void
@@ -22,10 +22,14 @@ static inline byte *sample_nearest(byte *s, int w, int h, int n, int u, int v)
 	return s + (v * w + u) * n;
 }
 
+/* In the painters below, n counts the source components including alpha.
+ * da is 0 when the destination has no alpha plane; it is then treated as
+ * opaque, and each destination pixel is one byte shorter. */
+
 /* Blend premultiplied source image in constant alpha over destination */
 
 static inline void
-fz_paint_affine_alpha_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
+fz_paint_affine_alpha_N_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
 {
 	int k;
 	int n1 = n-1;
@@ -51,11 +55,12 @@ fz_paint_affine_alpha_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 				int x = bilerp(a[k], b[k], c[k], d[k], uf, vf);
 				dp[k] = fz_mul255(x, alpha) + fz_mul255(dp[k], t);
 			}
-			dp[n1] = xa + fz_mul255(dp[n1], t);
+			if (da)
+				dp[n1] = xa + fz_mul255(dp[n1], t);
 			if (hp)
 				hp[0] = xa + fz_mul255(hp[0], t);
 		}
-		dp += n;
+		dp += n1 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -65,7 +70,7 @@ fz_paint_affine_alpha_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 
 /* Special case code for gray -> rgb */
 static inline void
-fz_paint_affine_alpha_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int alpha, byte *hp)
+fz_paint_affine_alpha_g2rgb_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int alpha, byte *hp)
 {
 	while (w--)
 	{
@@ -88,11 +93,12 @@ fz_paint_affine_alpha_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int
 			dp[0] = x + fz_mul255(dp[0], t);
 			dp[1] = x + fz_mul255(dp[1], t);
 			dp[2] = x + fz_mul255(dp[2], t);
-			dp[3] = y + fz_mul255(dp[3], t);
+			if (da)
+				dp[3] = y + fz_mul255(dp[3], t);
 			if (hp)
 				hp[0] = y + fz_mul255(hp[0], t);
 		}
-		dp += 4;
+		dp += 3 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -101,7 +107,7 @@ fz_paint_affine_alpha_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int
 }
 
 static inline void
-fz_paint_affine_alpha_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
+fz_paint_affine_alpha_N_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
 {
 	int k;
 	int n1 = n-1;
@@ -123,11 +129,12 @@ fz_paint_affine_alpha_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 				int t = 255 - a;
 				for (k = 0; k < n1; k++)
 					dp[k] = fz_mul255(sample[k], alpha) + fz_mul255(dp[k], t);
-				dp[n1] = a + fz_mul255(dp[n1], t);
+				if (da)
+					dp[n1] = a + fz_mul255(dp[n1], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			v += fb;
@@ -149,11 +156,12 @@ fz_paint_affine_alpha_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 				int t = 255 - a;
 				for (k = 0; k < n1; k++)
 					dp[k] = fz_mul255(sample[k], alpha) + fz_mul255(dp[k], t);
-				dp[n1] = a + fz_mul255(dp[n1], t);
+				if (da)
+					dp[n1] = a + fz_mul255(dp[n1], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -172,11 +180,12 @@ fz_paint_affine_alpha_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 				int t = 255 - a;
 				for (k = 0; k < n1; k++)
 					dp[k] = fz_mul255(sample[k], alpha) + fz_mul255(dp[k], t);
-				dp[n1] = a + fz_mul255(dp[n1], t);
+				if (da)
+					dp[n1] = a + fz_mul255(dp[n1], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -186,7 +195,7 @@ fz_paint_affine_alpha_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 }
 
 static inline void
-fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int alpha, byte *hp)
+fz_paint_affine_alpha_g2rgb_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int alpha, byte *hp)
 {
 	if (fa == 0)
 	{
@@ -207,11 +216,12 @@ fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 				dp[0] = x + fz_mul255(dp[0], t);
 				dp[1] = x + fz_mul255(dp[1], t);
 				dp[2] = x + fz_mul255(dp[2], t);
-				dp[3] = a + fz_mul255(dp[3], t);
+				if (da)
+					dp[3] = a + fz_mul255(dp[3], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			v += fb;
@@ -235,11 +245,12 @@ fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 				dp[0] = x + fz_mul255(dp[0], t);
 				dp[1] = x + fz_mul255(dp[1], t);
 				dp[2] = x + fz_mul255(dp[2], t);
-				dp[3] = a + fz_mul255(dp[3], t);
+				if (da)
+					dp[3] = a + fz_mul255(dp[3], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -260,11 +271,12 @@ fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 				dp[0] = x + fz_mul255(dp[0], t);
 				dp[1] = x + fz_mul255(dp[1], t);
 				dp[2] = x + fz_mul255(dp[2], t);
-				dp[3] = a + fz_mul255(dp[3], t);
+				if (da)
+					dp[3] = a + fz_mul255(dp[3], t);
 				if (hp)
 					hp[0] = a + fz_mul255(hp[0], t);
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -276,7 +288,7 @@ fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 /* Blend premultiplied source image over destination */
 
 static inline void
-fz_paint_affine_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *hp)
+fz_paint_affine_N_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *hp)
 {
 	int k;
 	int n1 = n-1;
@@ -300,11 +312,12 @@ fz_paint_affine_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 				int x = bilerp(a[k], b[k], c[k], d[k], uf, vf);
 				dp[k] = x + fz_mul255(dp[k], t);
 			}
-			dp[n1] = y + fz_mul255(dp[n1], t);
+			if (da)
+				dp[n1] = y + fz_mul255(dp[n1], t);
 			if (hp)
 				hp[0] = y + fz_mul255(hp[0], t);
 		}
-		dp += n;
+		dp += n1 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -313,7 +326,7 @@ fz_paint_affine_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 }
 
 static inline void
-fz_paint_affine_solid_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, byte *hp)
+fz_paint_affine_solid_g2rgb_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, byte *hp)
 {
 	while (w--)
 	{
@@ -333,11 +346,12 @@ fz_paint_affine_solid_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int
 			dp[0] = x + fz_mul255(dp[0], t);
 			dp[1] = x + fz_mul255(dp[1], t);
 			dp[2] = x + fz_mul255(dp[2], t);
-			dp[3] = y + fz_mul255(dp[3], t);
+			if (da)
+				dp[3] = y + fz_mul255(dp[3], t);
 			if (hp)
 				hp[0] = y + fz_mul255(hp[0], t);
 		}
-		dp += 4;
+		dp += 3 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -346,7 +360,7 @@ fz_paint_affine_solid_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int
 }
 
 static inline void
-fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *hp)
+fz_paint_affine_N_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *hp)
 {
 	int k;
 	int n1 = n-1;
@@ -371,7 +385,7 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					int t = 255 - a;
 					if (t == 0)
 					{
-						if (n == 4)
+						if (n == 4 && da)
 						{
 							*(int *)dp = *(int *)sample;
 						}
@@ -379,7 +393,8 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 						{
 							for (k = 0; k < n1; k++)
 								dp[k] = sample[k];
-							dp[n1] = a;
+							if (da)
+								dp[n1] = a;
 						}
 						if (hp)
 							hp[0] = a;
@@ -388,13 +403,14 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					{
 						for (k = 0; k < n1; k++)
 							dp[k] = sample[k] + fz_mul255(dp[k], t);
-						dp[n1] = a + fz_mul255(dp[n1], t);
+						if (da)
+							dp[n1] = a + fz_mul255(dp[n1], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			v += fb;
@@ -419,7 +435,7 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					int t = 255 - a;
 					if (t == 0)
 					{
-						if (n == 4)
+						if (n == 4 && da)
 						{
 							*(int *)dp = *(int *)sample;
 						}
@@ -427,7 +443,8 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 						{
 							for (k = 0; k < n1; k++)
 								dp[k] = sample[k];
-							dp[n1] = a;
+							if (da)
+								dp[n1] = a;
 						}
 						if (hp)
 							hp[0] = a;
@@ -436,13 +453,14 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					{
 						for (k = 0; k < n1; k++)
 							dp[k] = sample[k] + fz_mul255(dp[k], t);
-						dp[n1] = a + fz_mul255(dp[n1], t);
+						if (da)
+							dp[n1] = a + fz_mul255(dp[n1], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -464,7 +482,7 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					int t = 255 - a;
 					if (t == 0)
 					{
-						if (n == 4)
+						if (n == 4 && da)
 						{
 							*(int *)dp = *(int *)sample;
 						}
@@ -472,7 +490,8 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 						{
 							for (k = 0; k < n1; k++)
 								dp[k] = sample[k];
-							dp[n1] = a;
+							if (da)
+								dp[n1] = a;
 						}
 						if (hp)
 							hp[0] = a;
@@ -481,13 +500,14 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 					{
 						for (k = 0; k < n1; k++)
 							dp[k] = sample[k] + fz_mul255(dp[k], t);
-						dp[n1] = a + fz_mul255(dp[n1], t);
+						if (da)
+							dp[n1] = a + fz_mul255(dp[n1], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += n;
+			dp += n1 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -497,7 +517,7 @@ fz_paint_affine_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa,
 }
 
 static inline void
-fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, byte *hp)
+fz_paint_affine_solid_g2rgb_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, byte *hp)
 {
 	if (fa == 0)
 	{
@@ -522,7 +542,8 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x;
 						dp[1] = x;
 						dp[2] = x;
-						dp[3] = a;
+						if (da)
+							dp[3] = a;
 						if (hp)
 							hp[0] = a;
 					}
@@ -531,13 +552,14 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x + fz_mul255(dp[0], t);
 						dp[1] = x + fz_mul255(dp[1], t);
 						dp[2] = x + fz_mul255(dp[2], t);
-						dp[3] = a + fz_mul255(dp[3], t);
+						if (da)
+							dp[3] = a + fz_mul255(dp[3], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			v += fb;
@@ -565,7 +587,8 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x;
 						dp[1] = x;
 						dp[2] = x;
-						dp[3] = a;
+						if (da)
+							dp[3] = a;
 						if (hp)
 							hp[0] = a;
 					}
@@ -574,13 +597,14 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x + fz_mul255(dp[0], t);
 						dp[1] = x + fz_mul255(dp[1], t);
 						dp[2] = x + fz_mul255(dp[2], t);
-						dp[3] = a + fz_mul255(dp[3], t);
+						if (da)
+							dp[3] = a + fz_mul255(dp[3], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -605,7 +629,8 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x;
 						dp[1] = x;
 						dp[2] = x;
-						dp[3] = a;
+						if (da)
+							dp[3] = a;
 						if (hp)
 							hp[0] = a;
 					}
@@ -614,13 +639,14 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 						dp[0] = x + fz_mul255(dp[0], t);
 						dp[1] = x + fz_mul255(dp[1], t);
 						dp[2] = x + fz_mul255(dp[2], t);
-						dp[3] = a + fz_mul255(dp[3], t);
+						if (da)
+							dp[3] = a + fz_mul255(dp[3], t);
 						if (hp)
 							hp[0] = a + fz_mul255(hp[0], t);
 					}
 				}
 			}
-			dp += 4;
+			dp += 3 + da;
 			if (hp)
 				hp++;
 			u += fa;
@@ -632,7 +658,7 @@ fz_paint_affine_solid_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 /* Blend non-premultiplied color in source image mask over destination */
 
 static inline void
-fz_paint_affine_color_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+fz_paint_affine_color_N_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
 {
 	int n1 = n - 1;
 	int sa = color[n1];
@@ -654,11 +680,12 @@ fz_paint_affine_color_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
 			for (k = 0; k < n1; k++)
 				dp[k] = FZ_BLEND(color[k], dp[k], masa);
-			dp[n1] = FZ_BLEND(255, dp[n1], masa);
+			if (da)
+				dp[n1] = FZ_BLEND(255, dp[n1], masa);
 			if (hp)
 				hp[0] = FZ_BLEND(255, hp[0], masa);
 		}
-		dp += n;
+		dp += n1 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -667,7 +694,7 @@ fz_paint_affine_color_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 }
 
 static inline void
-fz_paint_affine_color_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+fz_paint_affine_color_N_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
 {
 	int n1 = n-1;
 	int sa = color[n1];
@@ -683,11 +710,12 @@ fz_paint_affine_color_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
 			for (k = 0; k < n1; k++)
 				dp[k] = FZ_BLEND(color[k], dp[k], masa);
-			dp[n1] = FZ_BLEND(255, dp[n1], masa);
+			if (da)
+				dp[n1] = FZ_BLEND(255, dp[n1], masa);
 			if (hp)
 				hp[0] = FZ_BLEND(255, hp[0], masa);
 		}
-		dp += n;
+		dp += n1 + da;
 		if (hp)
 			hp++;
 		u += fa;
@@ -696,103 +724,407 @@ fz_paint_affine_color_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 }
 
 static void
-fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+fz_paint_affine_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
 {
 	if (alpha == 255)
 	{
 		switch (n)
 		{
-		case 1: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 1, hp); break;
-		case 2: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 2, hp); break;
-		case 4: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, hp); break;
-		default: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, n, hp); break;
+		case 1: fz_paint_affine_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 1, hp); break;
+		case 2: fz_paint_affine_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, hp); break;
+		case 4: fz_paint_affine_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, hp); break;
+		default: fz_paint_affine_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, n, hp); break;
 		}
 	}
 	else if (alpha > 0)
 	{
 		switch (n)
 		{
-		case 1: fz_paint_affine_alpha_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 1, alpha, hp); break;
-		case 2: fz_paint_affine_alpha_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 2, alpha, hp); break;
-		case 4: fz_paint_affine_alpha_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, alpha, hp); break;
-		default: fz_paint_affine_alpha_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp); break;
+		case 1: fz_paint_affine_alpha_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 1, alpha, hp); break;
+		case 2: fz_paint_affine_alpha_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, alpha, hp); break;
+		case 4: fz_paint_affine_alpha_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, alpha, hp); break;
+		default: fz_paint_affine_alpha_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp); break;
 		}
 	}
 }
 
 static void
-fz_paint_affine_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+fz_paint_affine_g2rgb_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
 {
 	if (alpha == 255)
 	{
-		fz_paint_affine_solid_g2rgb_lerp(dp, sp, sw, sh, u, v, fa, fb, w, hp);
+		fz_paint_affine_solid_g2rgb_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, hp);
 	}
 	else if (alpha > 0)
 	{
-		fz_paint_affine_alpha_g2rgb_lerp(dp, sp, sw, sh, u, v, fa, fb, w, alpha, hp);
+		fz_paint_affine_alpha_g2rgb_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, alpha, hp);
 	}
 }
 
 static void
-fz_paint_affine_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused */, byte *hp)
+fz_paint_affine_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused */, byte *hp)
 {
 	if (alpha == 255)
 	{
 		switch (n)
 		{
-		case 1: fz_paint_affine_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 1, hp); break;
-		case 2: fz_paint_affine_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 2, hp); break;
-		case 4: fz_paint_affine_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 4, hp); break;
-		default: fz_paint_affine_N_near(dp, sp, sw, sh, u, v, fa, fb, w, n, hp); break;
+		case 1: fz_paint_affine_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 1, hp); break;
+		case 2: fz_paint_affine_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, hp); break;
+		case 4: fz_paint_affine_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, hp); break;
+		default: fz_paint_affine_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, n, hp); break;
 		}
 	}
 	else if (alpha > 0)
 	{
 		switch (n)
 		{
-		case 1: fz_paint_affine_alpha_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 1, alpha, hp); break;
-		case 2: fz_paint_affine_alpha_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 2, alpha, hp); break;
-		case 4: fz_paint_affine_alpha_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 4, alpha, hp); break;
-		default: fz_paint_affine_alpha_N_near(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp); break;
+		case 1: fz_paint_affine_alpha_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 1, alpha, hp); break;
+		case 2: fz_paint_affine_alpha_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, alpha, hp); break;
+		case 4: fz_paint_affine_alpha_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, alpha, hp); break;
+		default: fz_paint_affine_alpha_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp); break;
 		}
 	}
 }
 
 static void
-fz_paint_affine_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+fz_paint_affine_g2rgb_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
 {
 	if (alpha == 255)
 	{
-		fz_paint_affine_solid_g2rgb_near(dp, sp, sw, sh, u, v, fa, fb, w, hp);
+		fz_paint_affine_solid_g2rgb_near(dp, da, sp, sw, sh, u, v, fa, fb, w, hp);
 	}
 	else if (alpha > 0)
 	{
-		fz_paint_affine_alpha_g2rgb_near(dp, sp, sw, sh, u, v, fa, fb, w, alpha, hp);
+		fz_paint_affine_alpha_g2rgb_near(dp, da, sp, sw, sh, u, v, fa, fb, w, alpha, hp);
 	}
 }
 
 static void
-fz_paint_affine_color_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha/*unused*/, byte *color, byte *hp)
+fz_paint_affine_color_lerp(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha/*unused*/, byte *color, byte *hp)
 {
 	switch (n)
 	{
-	case 2: fz_paint_affine_color_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
-	case 4: fz_paint_affine_color_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
-	default: fz_paint_affine_color_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, n, color, hp); break;
+	case 2: fz_paint_affine_color_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
+	case 4: fz_paint_affine_color_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
+	default: fz_paint_affine_color_N_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, n, color, hp); break;
 	}
 }
 
 static void
-fz_paint_affine_color_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha/*unused*/, byte *color, byte *hp)
+fz_paint_affine_color_near(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha/*unused*/, byte *color, byte *hp)
 {
 	switch (n)
 	{
-	case 2: fz_paint_affine_color_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
-	case 4: fz_paint_affine_color_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
-	default: fz_paint_affine_color_N_near(dp, sp, sw, sh, u, v, fa, fb, w, n, color, hp); break;
+	case 2: fz_paint_affine_color_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
+	case 4: fz_paint_affine_color_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
+	default: fz_paint_affine_color_N_near(dp, da, sp, sw, sh, u, v, fa, fb, w, n, color, hp); break;
+	}
+}
+
+#ifdef FZ_SSE2
+
+/*
+	SSE2 versions of the painters for n == 2, n == 4 and gray to rgb.
+
+	Each pass gathers the source samples for 8 components worth of
+	destination pixels (2 pixels for n == 4, otherwise 4), and then does
+	the bilinear interpolation and compositing for all of them at once
+	in 16 bit lanes. Destination pixels that fall outside the image get
+	zero samples, which leaves them unchanged. The results are the same
+	as those of the scalar code above.
+
+	Destinations without alpha are loaded with zero in the alpha lanes,
+	and only their color components are stored back.
+*/
+
+/* lerp() for t in 0..65535. The signed high multiply sees t >= 32768
+ * as t - 65536, so add back (b - a) in those lanes. */
+static inline __m128i
+sse2_lerp(__m128i a, __m128i b, __m128i t)
+{
+	__m128i x = _mm_sub_epi16(b, a);
+	__m128i r = _mm_mulhi_epi16(x, t);
+	r = _mm_add_epi16(r, _mm_and_si128(x, _mm_srai_epi16(t, 15)));
+	return _mm_add_epi16(a, r);
+}
+
+static inline __m128i
+sse2_mul255(__m128i a, __m128i b)
+{
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	x = _mm_add_epi16(x, _mm_srli_epi16(x, 8));
+	return _mm_srli_epi16(x, 8);
+}
+
+/* s + fz_mul255(d, 255 - sa) for each component, where s has n
+ * components per pixel. If skip is set, pixels with zero source
+ * alpha are left alone, as the solid nearest painters do. */
+static inline __m128i
+sse2_affine_over(__m128i s, __m128i d, int n, int skip)
+{
+	__m128i sa, t, r;
+
+	if (n == 4)
+		sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+	else
+		sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xF5), 0xF5);
+	t = _mm_sub_epi16(_mm_set1_epi16(255), sa);
+	r = _mm_and_si128(_mm_add_epi16(s, sse2_mul255(d, t)), _mm_set1_epi16(255));
+	if (skip)
+	{
+		__m128i z = _mm_cmpeq_epi16(sa, _mm_setzero_si128());
+		r = _mm_or_si128(_mm_and_si128(z, d), _mm_andnot_si128(z, r));
 	}
+	return r;
+}
+
+/* Offsets of the four samples to interpolate between for (u, v), clamped
+ * at the image edges in the same way as sample_nearest. */
+static inline int
+lerp_offsets(int sw, int sh, int n, int u, int v, int *o)
+{
+	int ui = u >> 16;
+	int vi = v >> 16;
+	int ui1, vi1;
+	if (ui < 0 || ui >= sw || vi < 0 || vi >= sh)
+		return 0;
+	ui1 = ui + 1 < sw ? ui + 1 : ui;
+	vi1 = vi + 1 < sh ? vi + 1 : vi;
+	o[0] = (vi * sw + ui) * n;
+	o[1] = (vi * sw + ui1) * n;
+	o[2] = (vi1 * sw + ui) * n;
+	o[3] = (vi1 * sw + ui1) * n;
+	return 1;
 }
 
+static inline int
+near_offset(int sw, int sh, int n, int u, int v, int *o)
+{
+	int ui = u >> 16;
+	int vi = v >> 16;
+	if (ui < 0 || ui >= sw || vi < 0 || vi >= sh)
+		return 0;
+	o[0] = (vi * sw + ui) * n;
+	return 1;
+}
+
+/* Load 4 gray pixels into the even 16 bit lanes, and store them back */
+static inline __m128i
+sse2_load_gray4(const byte *p)
+{
+	int a;
+	memcpy(&a, p, 4);
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_setzero_si128()), _mm_setzero_si128());
+}
+
+static inline void
+sse2_store_gray4(byte *p, __m128i x)
+{
+	int a;
+	x = _mm_packs_epi32(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_setzero_si128());
+	a = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+	memcpy(p, &a, 4);
+}
+
+/* Paint as many whole groups of pixels as we can, and return how many
+ * pixels that was. n is the number of source components. */
+static FZ_FORCE_INLINE int
+fz_paint_affine_sse2(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int g2rgb, int alpha, byte *hp, int lerp)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i va = _mm_set1_epi16(alpha);
+	int skip = !lerp && alpha == 255;
+	int ns = lerp ? 4 : 1;
+	int np = 8 / n;
+	int dn = g2rgb ? 3 + da : n - 1 + da;
+	int done = 0;
+	int opaque = 0;
+	int c[4][4], f[2][4], o[4];
+	int i, k;
+
+	for (; w >= np; w -= np, done += np)
+	{
+		__m128i s[4], x;
+
+		for (i = 0; i < np; i++)
+		{
+			int ok = lerp ? lerp_offsets(sw, sh, n, u, v, o) : near_offset(sw, sh, n, u, v, o);
+			for (k = 0; k < ns; k++)
+			{
+				if (!ok)
+					c[k][i] = 0;
+				else if (n == 4)
+					memcpy(&c[k][i], sp + o[k], 4);
+				else
+					c[k][i] = sp[o[k]] | (sp[o[k] + 1] << 8);
+			}
+			f[0][i] = u & 0xffff;
+			f[1][i] = v & 0xffff;
+			u += fa;
+			v += fb;
+		}
+
+		for (k = 0; k < ns; k++)
+		{
+			if (n == 4)
+				s[k] = _mm_setr_epi32(c[k][0], c[k][1], 0, 0);
+			else
+				s[k] = _mm_setr_epi16(c[k][0], c[k][1], c[k][2], c[k][3], 0, 0, 0, 0);
+			s[k] = _mm_unpacklo_epi8(s[k], zero);
+		}
+
+		if (lerp)
+		{
+			__m128i uf, vf;
+			if (n == 4)
+			{
+				uf = _mm_unpacklo_epi64(_mm_set1_epi16(f[0][0]), _mm_set1_epi16(f[0][1]));
+				vf = _mm_unpacklo_epi64(_mm_set1_epi16(f[1][0]), _mm_set1_epi16(f[1][1]));
+			}
+			else
+			{
+				uf = _mm_setr_epi16(f[0][0], f[0][0], f[0][1], f[0][1], f[0][2], f[0][2], f[0][3], f[0][3]);
+				vf = _mm_setr_epi16(f[1][0], f[1][0], f[1][1], f[1][1], f[1][2], f[1][2], f[1][3], f[1][3]);
+			}
+			x = sse2_lerp(sse2_lerp(s[0], s[1], uf), sse2_lerp(s[2], s[3], uf), vf);
+		}
+		else
+			x = s[0];
+
+		if (alpha != 255)
+			x = sse2_mul255(x, va);
+
+		if (hp)
+		{
+			short y[8];
+			_mm_storeu_si128((__m128i *)y, x);
+			for (i = 0; i < np; i++)
+			{
+				int a = y[i * n + n - 1];
+				if (a != 0 || !skip)
+					hp[i] = a + fz_mul255(hp[i], 255 - a);
+			}
+			hp += np;
+		}
+
+		if (!da)
+		{
+			/* A group that is opaque throughout covers the destination,
+			 * so there is no need to load it. */
+			int am = n == 4 ? 0xc0c0 : 0xcccc;
+			opaque = (_mm_movemask_epi8(_mm_cmpeq_epi16(x, _mm_set1_epi16(255))) & am) == am;
+		}
+
+		if (g2rgb)
+		{
+			/* Spread gray, alpha pairs out to gray, gray, gray, alpha */
+			__m128i lo = _mm_unpacklo_epi32(x, x);
+			__m128i hi = _mm_unpackhi_epi32(x, x);
+			lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0x40), 0x40);
+			hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0x40), 0x40);
+			if (da)
+			{
+				__m128i d = _mm_loadu_si128((__m128i *)dp);
+				lo = sse2_affine_over(lo, _mm_unpacklo_epi8(d, zero), 4, skip);
+				hi = sse2_affine_over(hi, _mm_unpackhi_epi8(d, zero), 4, skip);
+				_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+			}
+			else if (opaque)
+			{
+				sse2_store_rgb2(dp, lo);
+				sse2_store_rgb2(dp + 6, hi);
+			}
+			else
+			{
+				sse2_store_rgb2(dp, sse2_affine_over(lo, sse2_load_rgb2(dp), 4, skip));
+				sse2_store_rgb2(dp + 6, sse2_affine_over(hi, sse2_load_rgb2(dp + 6), 4, skip));
+			}
+		}
+		else if (!da)
+		{
+			if (n == 4)
+				sse2_store_rgb2(dp, opaque ? x : sse2_affine_over(x, sse2_load_rgb2(dp), 4, skip));
+			else
+				sse2_store_gray4(dp, opaque ? x : sse2_affine_over(x, sse2_load_gray4(dp), 2, skip));
+		}
+		else
+		{
+			__m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)dp), zero);
+			x = sse2_affine_over(x, d, n, skip);
+			_mm_storel_epi64((__m128i *)dp, _mm_packus_epi16(x, x));
+		}
+		dp += np * dn;
+	}
+
+	return done;
+}
+
+static void
+fz_paint_affine_lerp_sse2(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if ((n == 2 || n == 4) && alpha > 0)
+	{
+		int done = fz_paint_affine_sse2(dp, da, sp, sw, sh, u, v, fa, fb, w, n, 0, alpha, hp, 1);
+		dp += done * (n - 1 + da);
+		if (hp)
+			hp += done;
+		u += done * fa;
+		v += done * fb;
+		w -= done;
+	}
+	fz_paint_affine_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+}
+
+static void
+fz_paint_affine_g2rgb_lerp_sse2(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if (alpha > 0)
+	{
+		int done = fz_paint_affine_sse2(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, 1, alpha, hp, 1);
+		dp += done * (3 + da);
+		if (hp)
+			hp += done;
+		u += done * fa;
+		v += done * fb;
+		w -= done;
+	}
+	fz_paint_affine_g2rgb_lerp(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+}
+
+static void
+fz_paint_affine_near_sse2(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if ((n == 2 || n == 4) && alpha > 0)
+	{
+		int done = fz_paint_affine_sse2(dp, da, sp, sw, sh, u, v, fa, fb, w, n, 0, alpha, hp, 0);
+		dp += done * (n - 1 + da);
+		if (hp)
+			hp += done;
+		u += done * fa;
+		v += done * fb;
+		w -= done;
+	}
+	fz_paint_affine_near(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+}
+
+static void
+fz_paint_affine_g2rgb_near_sse2(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if (alpha > 0)
+	{
+		int done = fz_paint_affine_sse2(dp, da, sp, sw, sh, u, v, fa, fb, w, 2, 1, alpha, hp, 0);
+		dp += done * (3 + da);
+		if (hp)
+			hp += done;
+		u += done * fa;
+		v += done * fb;
+		w -= done;
+	}
+	fz_paint_affine_g2rgb_near(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+}
+
+#endif /* FZ_SSE2 */
+
 /* RJW: The following code was originally written to be sensitive to
  * FLT_EPSILON. Given the way the 'minimum representable difference'
  * between 2 floats changes size as we scale, we now pick a larger
@@ -985,15 +1317,19 @@ fz_gridfit_matrix(int as_tiled, fz_matrix *m)
 /* Draw an image with an affine transform on destination */
 
 static void
-fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, byte *color, int alpha, int lerp_allowed, int as_tiled)
+fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, const fz_irect *clip, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, byte *color, int alpha, int lerp_allowed, int as_tiled)
 {
 	byte *dp, *sp, *hp;
 	int u, v, fa, fb, fc, fd;
-	int x, y, w, h;
+	int x, y, w, h, x0, y0;
 	int sw, sh, n, hw;
+	int da;
 	fz_irect bbox;
 	int dolerp;
-	void (*paintfn)(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
+	void (*paintfn)(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
+#ifdef FZ_DEBUG_SIMD
+	void (*scalarfn)(byte *dp, int da, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
+#endif
 	fz_matrix local_ctm = *ctm;
 	fz_rect rect;
 	int is_rectilinear;
@@ -1022,6 +1358,9 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 
 	rect = fz_unit_rect;
 	fz_irect_from_rect(&bbox, fz_transform_rect(&rect, &local_ctm));
+	fz_intersect_irect(&bbox, clip);
+	x0 = bbox.x0;
+	y0 = bbox.y0;
 	fz_intersect_irect(&bbox, scissor);
 
 	x = bbox.x0;
@@ -1055,8 +1394,11 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 	/* Calculate initial texture positions. Do a half step to start. */
 	/* Bug 693021: Keep calculation in float for as long as possible to
 	 * avoid overflow. */
-	u = (int)((local_ctm.a * x) + (local_ctm.c * y) + local_ctm.e + ((local_ctm.a + local_ctm.c) * .5f));
-	v = (int)((local_ctm.b * x) + (local_ctm.d * y) + local_ctm.f + ((local_ctm.b + local_ctm.d) * .5f));
+	/* Start from where the clip lets us start, rather than the scissor,
+	 * and step on from there as the loops below do, so that a band
+	 * samples the image at the same places as the whole would. */
+	u = (int)((local_ctm.a * x0) + (local_ctm.c * y0) + local_ctm.e + ((local_ctm.a + local_ctm.c) * .5f));
+	v = (int)((local_ctm.b * x0) + (local_ctm.d * y0) + local_ctm.f + ((local_ctm.b + local_ctm.d) * .5f));
 
 	/* RJW: The following is voodoo. No idea why it works, but it gives
 	 * the best match between scaled/unscaled/interpolated/non-interpolated
@@ -1073,8 +1415,12 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 		}
 	}
 
+	u += (int)((int64_t)(x - x0) * fa + (int64_t)(y - y0) * fc);
+	v += (int)((int64_t)(x - x0) * fb + (int64_t)(y - y0) * fd);
+
 	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
-	n = dst->n;
+	da = dst->alpha;
+	n = dst->n + !da;
 	sp = img->samples;
 	sw = img->w;
 	sh = img->h;
@@ -1091,7 +1437,7 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 
 	/* TODO: if (fb == 0 && fa == 1) call fz_paint_span */
 
-	if (dst->n == 4 && img->n == 2)
+	if (n == 4 && img->n == 2)
 	{
 		assert(!color);
 		if (dolerp)
@@ -1117,10 +1463,30 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 		}
 	}
 
+#ifdef FZ_DEBUG_SIMD
+	scalarfn = paintfn;
+#endif
+#ifdef FZ_SSE2
+	if (fz_simd_level() >= FZ_SIMD_SSE2)
+	{
+		if (paintfn == fz_paint_affine_lerp)
+			paintfn = fz_paint_affine_lerp_sse2;
+		else if (paintfn == fz_paint_affine_near)
+			paintfn = fz_paint_affine_near_sse2;
+		else if (paintfn == fz_paint_affine_g2rgb_lerp)
+			paintfn = fz_paint_affine_g2rgb_lerp_sse2;
+		else if (paintfn == fz_paint_affine_g2rgb_near)
+			paintfn = fz_paint_affine_g2rgb_near_sse2;
+	}
+#endif
+
+	/* The scalar check is given no shape, so that it is not painted twice */
 	while (h--)
 	{
-		paintfn(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
-		dp += dst->w * n;
+		FZ_SIMD_CALL("fz_paint_affine_sse2", dp, w * dst->n,
+			paintfn(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp),
+			scalarfn(dp, da, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, NULL));
+		dp += dst->w * dst->n;
 		hp += hw;
 		u += fc;
 		v += fd;
@@ -1128,15 +1494,15 @@ fz_paint_image_imp(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz
 }
 
 void
-fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, byte *color, int lerp_allowed, int as_tiled)
+fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, const fz_irect *clip, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, byte *color, int lerp_allowed, int as_tiled)
 {
 	assert(img->n == 1);
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, color, 255, lerp_allowed, as_tiled);
+	fz_paint_image_imp(dst, scissor, clip, shape, img, ctm, color, 255, lerp_allowed, as_tiled);
 }
 
 void
-fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha, int lerp_allowed, int as_tiled)
+fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, const fz_irect *clip, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha, int lerp_allowed, int as_tiled)
 {
-	assert(dst->n == img->n || (dst->n == 4 && img->n == 2));
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, NULL, alpha, lerp_allowed, as_tiled);
+	assert(dst->n - dst->alpha == img->n - 1 || (dst->n - dst->alpha == 3 && img->n == 2));
+	fz_paint_image_imp(dst, scissor, clip, shape, img, ctm, NULL, alpha, lerp_allowed, as_tiled);
 }
@@ -571,10 +571,410 @@ fz_blend_nonseparable_nonisolated(byte * restrict bp, byte * restrict sp, int w,
 	}
 }
 
+#ifdef FZ_SSE2
+
+/*
+	SSE2 versions of the isolated blending loops.
+
+	The separable modes work on 2 (gray) or 4 (rgb) component pixels,
+	8 components at a time in 16 bit lanes. The non-separable modes
+	work on 4 rgb pixels at a time, with one pixel in each 32 bit
+	lane. Both give the same results as the scalar code; any group of
+	pixels with a component greater than its alpha, which the 16 bit
+	arithmetic cannot cope with, is passed to the scalar code instead.
+	Color dodge, color burn and soft light are always done by the
+	scalar code.
+
+	The non-isolated loops have no SSE2 versions. They branch on the
+	shape and alphas of every pixel and divide by three of them, and
+	non-isolated groups are rare.
+*/
+
+static inline __m128i
+sse2_mul255(__m128i a, __m128i b)
+{
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	x = _mm_add_epi16(x, _mm_srli_epi16(x, 8));
+	return _mm_srli_epi16(x, 8);
+}
+
+/* 255 * 256 / a for the alpha values in the 32 bit lanes of a, or 0
+ * where a is 0. Double precision division always truncates to the
+ * same result as integer division for these ranges. */
+static inline __m128i
+sse2_div_epi32(__m128i num, __m128i den)
+{
+	__m128i lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(num), _mm_cvtepi32_pd(den)));
+	__m128i hi = _mm_cvttpd_epi32(_mm_div_pd(
+		_mm_cvtepi32_pd(_mm_shuffle_epi32(num, 0xEE)),
+		_mm_cvtepi32_pd(_mm_shuffle_epi32(den, 0xEE))));
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+static inline __m128i
+sse2_inv_alpha(__m128i a)
+{
+	__m128i z = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+	a = _mm_or_si128(a, _mm_and_si128(z, _mm_set1_epi32(1)));
+	return _mm_andnot_si128(z, sse2_div_epi32(_mm_set1_epi32(255 * 256), a));
+}
+
+static inline __m128i
+sse2_screen(__m128i b, __m128i s)
+{
+	return _mm_sub_epi16(_mm_add_epi16(b, s), sse2_mul255(b, s));
+}
+
+static inline __m128i
+sse2_hard_light(__m128i b, __m128i s)
+{
+	__m128i s2 = _mm_slli_epi16(s, 1);
+	__m128i lo = sse2_mul255(b, s2);
+	__m128i hi = sse2_screen(b, _mm_sub_epi16(s2, _mm_set1_epi16(255)));
+	__m128i m = _mm_cmpgt_epi16(s, _mm_set1_epi16(127));
+	return _mm_or_si128(_mm_and_si128(m, hi), _mm_andnot_si128(m, lo));
+}
+
+static inline __m128i
+sse2_blend_separable_byte(__m128i b, __m128i s, int blendmode)
+{
+	switch (blendmode)
+	{
+	default:
+	case FZ_BLEND_NORMAL: return s;
+	case FZ_BLEND_MULTIPLY: return sse2_mul255(b, s);
+	case FZ_BLEND_SCREEN: return sse2_screen(b, s);
+	case FZ_BLEND_OVERLAY: return sse2_hard_light(s, b);
+	case FZ_BLEND_DARKEN: return _mm_min_epi16(b, s);
+	case FZ_BLEND_LIGHTEN: return _mm_max_epi16(b, s);
+	case FZ_BLEND_HARD_LIGHT: return sse2_hard_light(b, s);
+	case FZ_BLEND_DIFFERENCE: return _mm_sub_epi16(_mm_max_epi16(b, s), _mm_min_epi16(b, s));
+	case FZ_BLEND_EXCLUSION: return _mm_sub_epi16(_mm_add_epi16(b, s), _mm_slli_epi16(sse2_mul255(b, s), 1));
+	}
+}
+
+static int
+sse2_blend_separable_supported(int blendmode)
+{
+	return blendmode != FZ_BLEND_COLOR_DODGE &&
+		blendmode != FZ_BLEND_COLOR_BURN &&
+		blendmode != FZ_BLEND_SOFT_LIGHT;
+}
+
+static void
+fz_blend_separable_sse2(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i k255 = _mm_set1_epi16(255);
+	__m128i amask = n == 4 ? _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1) : _mm_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+	int np = 8 / n;
+
+	for (; w >= np; w -= np, sp += 8, bp += 8)
+	{
+		__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)sp), zero);
+		__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)bp), zero);
+		__m128i sa, ba, a32, invsa, invba, sc, bc, rc, saba, r;
+
+		if (n == 4)
+		{
+			sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+			ba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, 0xFF), 0xFF);
+		}
+		else
+		{
+			sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xF5), 0xF5);
+			ba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, 0xF5), 0xF5);
+		}
+
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi16(s, sa), _mm_cmpgt_epi16(b, ba))))
+		{
+			fz_blend_separable(bp, sp, n, np, blendmode);
+			continue;
+		}
+
+		/* Reciprocals of the alphas, spread back out to 16 bit lanes */
+		if (n == 4)
+		{
+			__m128i p0 = _mm_srli_epi64(_mm_unpacklo_epi64(s, b), 48);
+			__m128i p1 = _mm_srli_epi64(_mm_unpackhi_epi64(s, b), 48);
+			a32 = _mm_unpacklo_epi64(_mm_unpacklo_epi32(p0, p1), _mm_unpackhi_epi32(p0, p1));
+			a32 = sse2_inv_alpha(a32);
+			a32 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a32, 0xA0), 0xA0);
+			invsa = _mm_unpacklo_epi32(a32, a32);
+			invba = _mm_unpackhi_epi32(a32, a32);
+		}
+		else
+		{
+			invsa = sse2_inv_alpha(_mm_srli_epi32(s, 16));
+			invba = sse2_inv_alpha(_mm_srli_epi32(b, 16));
+			invsa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(invsa, 0xA0), 0xA0);
+			invba = _mm_shufflehi_epi16(_mm_shufflelo_epi16(invba, 0xA0), 0xA0);
+		}
+
+		/* (x * inv) >> 8 == ((x << 8) * inv) >> 16 */
+		sc = _mm_mulhi_epu16(_mm_slli_epi16(s, 8), invsa);
+		bc = _mm_mulhi_epu16(_mm_slli_epi16(b, 8), invba);
+		rc = sse2_blend_separable_byte(bc, sc, blendmode);
+
+		saba = sse2_mul255(sa, ba);
+		r = _mm_add_epi16(sse2_mul255(_mm_sub_epi16(k255, sa), b), sse2_mul255(_mm_sub_epi16(k255, ba), s));
+		r = _mm_and_si128(_mm_add_epi16(r, sse2_mul255(saba, rc)), k255);
+		r = _mm_or_si128(_mm_andnot_si128(amask, r), _mm_and_si128(amask, _mm_sub_epi16(_mm_add_epi16(ba, sa), saba)));
+		_mm_storel_epi64((__m128i *)bp, _mm_packus_epi16(r, r));
+	}
+	fz_blend_separable(bp, sp, n, w, blendmode);
+}
+
+/* The non-separable modes, one pixel per 32 bit lane. */
+
+static inline __m128i
+sse2_mullo_epi32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08), _mm_shuffle_epi32(odd, 0x08));
+}
+
+static inline __m128i
+sse2_select(__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static inline __m128i
+sse2_min_epi32(__m128i a, __m128i b)
+{
+	return sse2_select(_mm_cmpgt_epi32(a, b), b, a);
+}
+
+static inline __m128i
+sse2_max_epi32(__m128i a, __m128i b)
+{
+	return sse2_select(_mm_cmpgt_epi32(a, b), a, b);
+}
+
+/* fz_mul255 of values in 0..255; madd is safe as the high halves are 0 */
+static inline __m128i
+sse2_mul255_epi32(__m128i a, __m128i b)
+{
+	__m128i x = _mm_add_epi32(_mm_madd_epi16(a, b), _mm_set1_epi32(128));
+	x = _mm_add_epi32(x, _mm_srli_epi32(x, 8));
+	return _mm_srli_epi32(x, 8);
+}
+
+/* (77 * r + 151 * g + 28 * b + 0x80) >> 8 for r, g, b in -255..255 */
+static inline __m128i
+sse2_lum(__m128i r, __m128i g, __m128i b)
+{
+	__m128i y = _mm_add_epi32(_mm_madd_epi16(r, _mm_set1_epi32(77)), _mm_madd_epi16(g, _mm_set1_epi32(151)));
+	y = _mm_add_epi32(y, _mm_madd_epi16(b, _mm_set1_epi32(28)));
+	return _mm_srai_epi32(_mm_add_epi32(y, _mm_set1_epi32(0x80)), 8);
+}
+
+/* y + (((x - y) * scale + 0x8000) >> 16) */
+static inline __m128i
+sse2_rescale(__m128i x, __m128i y, __m128i scale)
+{
+	__m128i d = sse2_mullo_epi32(_mm_sub_epi32(x, y), scale);
+	return _mm_add_epi32(y, _mm_srai_epi32(_mm_add_epi32(d, _mm_set1_epi32(0x8000)), 16));
+}
+
+/* Clamp to 0..255; the values here always fit in 16 bits */
+static inline __m128i
+sse2_clamp_byte(__m128i x)
+{
+	return _mm_min_epi16(_mm_max_epi16(x, _mm_setzero_si128()), _mm_set1_epi32(255));
+}
+
+static inline __m128i
+sse2_any_clipped(__m128i r, __m128i g, __m128i b)
+{
+	__m128i x = _mm_and_si128(_mm_or_si128(_mm_or_si128(r, g), b), _mm_set1_epi32(0x100));
+	return _mm_cmpeq_epi32(x, _mm_set1_epi32(0x100));
+}
+
+static inline void
+sse2_luminosity_rgb(__m128i *rd, __m128i *gd, __m128i *bd, __m128i rb, __m128i gb, __m128i bb, __m128i rs, __m128i gs, __m128i bs)
+{
+	__m128i delta = sse2_lum(_mm_sub_epi32(rs, rb), _mm_sub_epi32(gs, gb), _mm_sub_epi32(bs, bb));
+	__m128i r = _mm_add_epi32(rb, delta);
+	__m128i g = _mm_add_epi32(gb, delta);
+	__m128i b = _mm_add_epi32(bb, delta);
+	__m128i clip = sse2_any_clipped(r, g, b);
+
+	if (_mm_movemask_epi8(clip))
+	{
+		__m128i one = _mm_set1_epi32(1);
+		__m128i y = sse2_lum(rs, gs, bs);
+		__m128i pos = _mm_cmpgt_epi32(delta, _mm_setzero_si128());
+		__m128i max = sse2_max_epi32(r, sse2_max_epi32(g, b));
+		__m128i min = sse2_min_epi32(r, sse2_min_epi32(g, b));
+		__m128i num = _mm_slli_epi32(sse2_select(pos, _mm_sub_epi32(_mm_set1_epi32(255), y), y), 16);
+		__m128i den = sse2_select(pos, _mm_sub_epi32(max, y), _mm_sub_epi32(y, min));
+		__m128i z = _mm_or_si128(_mm_cmpeq_epi32(den, _mm_setzero_si128()), _mm_andnot_si128(clip, _mm_set1_epi32(-1)));
+		__m128i scale = _mm_andnot_si128(z, sse2_div_epi32(num, sse2_select(z, one, den)));
+		r = sse2_select(clip, sse2_rescale(r, y, scale), r);
+		g = sse2_select(clip, sse2_rescale(g, y, scale), g);
+		b = sse2_select(clip, sse2_rescale(b, y, scale), b);
+	}
+
+	*rd = sse2_clamp_byte(r);
+	*gd = sse2_clamp_byte(g);
+	*bd = sse2_clamp_byte(b);
+}
+
+static inline void
+sse2_saturation_rgb(__m128i *rd, __m128i *gd, __m128i *bd, __m128i rb, __m128i gb, __m128i bb, __m128i rs, __m128i gs, __m128i bs)
+{
+	__m128i one = _mm_set1_epi32(1);
+	__m128i minb = sse2_min_epi32(rb, sse2_min_epi32(gb, bb));
+	__m128i maxb = sse2_max_epi32(rb, sse2_max_epi32(gb, bb));
+	__m128i mins = sse2_min_epi32(rs, sse2_min_epi32(gs, bs));
+	__m128i maxs = sse2_max_epi32(rs, sse2_max_epi32(gs, bs));
+	/* backdrop with zero saturation gives gray; avoid divide by 0 */
+	__m128i flat = _mm_cmpeq_epi32(minb, maxb);
+	__m128i den = sse2_select(flat, one, _mm_sub_epi32(maxb, minb));
+	__m128i scale = sse2_div_epi32(_mm_slli_epi32(_mm_sub_epi32(maxs, mins), 16), den);
+	__m128i y = sse2_lum(rb, gb, bb);
+	__m128i r = sse2_rescale(rb, y, scale);
+	__m128i g = sse2_rescale(gb, y, scale);
+	__m128i b = sse2_rescale(bb, y, scale);
+	__m128i clip = _mm_andnot_si128(flat, sse2_any_clipped(r, g, b));
+
+	if (_mm_movemask_epi8(clip))
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i k255 = _mm_set1_epi32(255);
+		__m128i unit = _mm_set1_epi32(0x10000);
+		__m128i min = sse2_min_epi32(r, sse2_min_epi32(g, b));
+		__m128i max = sse2_max_epi32(r, sse2_max_epi32(g, b));
+		__m128i lo = _mm_and_si128(clip, _mm_cmplt_epi32(min, zero));
+		__m128i hi = _mm_and_si128(clip, _mm_cmpgt_epi32(max, k255));
+		__m128i scalemin = sse2_div_epi32(_mm_slli_epi32(y, 16), sse2_select(lo, _mm_sub_epi32(y, min), one));
+		__m128i scalemax = sse2_div_epi32(_mm_slli_epi32(_mm_sub_epi32(k255, y), 16), sse2_select(hi, _mm_sub_epi32(max, y), one));
+		scalemin = sse2_select(lo, scalemin, unit);
+		scalemax = sse2_select(hi, scalemax, unit);
+		scale = sse2_min_epi32(scalemin, scalemax);
+		r = sse2_select(clip, sse2_rescale(r, y, scale), r);
+		g = sse2_select(clip, sse2_rescale(g, y, scale), g);
+		b = sse2_select(clip, sse2_rescale(b, y, scale), b);
+	}
+
+	gb = sse2_clamp_byte(gb);
+	*rd = sse2_select(flat, gb, sse2_clamp_byte(r));
+	*gd = sse2_select(flat, gb, sse2_clamp_byte(g));
+	*bd = sse2_select(flat, gb, sse2_clamp_byte(b));
+}
+
+static void
+fz_blend_nonseparable_sse2(byte * restrict bp, byte * restrict sp, int w, int blendmode)
+{
+	__m128i k255 = _mm_set1_epi32(255);
+
+	for (; w >= 4; w -= 4, sp += 16, bp += 16)
+	{
+		__m128i s = _mm_loadu_si128((__m128i *)sp);
+		__m128i b = _mm_loadu_si128((__m128i *)bp);
+		__m128i sa = _mm_srli_epi32(s, 24);
+		__m128i ba = _mm_srli_epi32(b, 24);
+		__m128i sr = _mm_and_si128(s, k255);
+		__m128i sg = _mm_and_si128(_mm_srli_epi32(s, 8), k255);
+		__m128i sb = _mm_and_si128(_mm_srli_epi32(s, 16), k255);
+		__m128i br = _mm_and_si128(b, k255);
+		__m128i bg = _mm_and_si128(_mm_srli_epi32(b, 8), k255);
+		__m128i bb = _mm_and_si128(_mm_srli_epi32(b, 16), k255);
+		__m128i invsa, invba, saba, nsa, nba, rr, rg, rb, tr, tg, tb, x;
+		__m128i ur, ug, ub, vr, vg, vb;
+
+		x = _mm_or_si128(_mm_cmpgt_epi32(sr, sa), _mm_cmpgt_epi32(sg, sa));
+		x = _mm_or_si128(x, _mm_cmpgt_epi32(sb, sa));
+		x = _mm_or_si128(x, _mm_cmpgt_epi32(br, ba));
+		x = _mm_or_si128(x, _mm_cmpgt_epi32(bg, ba));
+		x = _mm_or_si128(x, _mm_cmpgt_epi32(bb, ba));
+		if (_mm_movemask_epi8(x))
+		{
+			fz_blend_nonseparable(bp, sp, 4, blendmode);
+			continue;
+		}
+
+		/* ugh, division to get non-premul components */
+		invsa = sse2_inv_alpha(sa);
+		invba = sse2_inv_alpha(ba);
+		ur = _mm_srli_epi32(sse2_mullo_epi32(sr, invsa), 8);
+		ug = _mm_srli_epi32(sse2_mullo_epi32(sg, invsa), 8);
+		ub = _mm_srli_epi32(sse2_mullo_epi32(sb, invsa), 8);
+		vr = _mm_srli_epi32(sse2_mullo_epi32(br, invba), 8);
+		vg = _mm_srli_epi32(sse2_mullo_epi32(bg, invba), 8);
+		vb = _mm_srli_epi32(sse2_mullo_epi32(bb, invba), 8);
+
+		switch (blendmode)
+		{
+		default:
+		case FZ_BLEND_HUE:
+			sse2_luminosity_rgb(&tr, &tg, &tb, ur, ug, ub, vr, vg, vb);
+			sse2_saturation_rgb(&rr, &rg, &rb, tr, tg, tb, vr, vg, vb);
+			break;
+		case FZ_BLEND_SATURATION:
+			sse2_saturation_rgb(&rr, &rg, &rb, vr, vg, vb, ur, ug, ub);
+			break;
+		case FZ_BLEND_COLOR:
+			sse2_luminosity_rgb(&rr, &rg, &rb, ur, ug, ub, vr, vg, vb);
+			break;
+		case FZ_BLEND_LUMINOSITY:
+			sse2_luminosity_rgb(&rr, &rg, &rb, vr, vg, vb, ur, ug, ub);
+			break;
+		}
+
+		saba = sse2_mul255_epi32(sa, ba);
+		nsa = _mm_sub_epi32(k255, sa);
+		nba = _mm_sub_epi32(k255, ba);
+		rr = _mm_add_epi32(_mm_add_epi32(sse2_mul255_epi32(nsa, br), sse2_mul255_epi32(nba, sr)), sse2_mul255_epi32(saba, rr));
+		rg = _mm_add_epi32(_mm_add_epi32(sse2_mul255_epi32(nsa, bg), sse2_mul255_epi32(nba, sg)), sse2_mul255_epi32(saba, rg));
+		rb = _mm_add_epi32(_mm_add_epi32(sse2_mul255_epi32(nsa, bb), sse2_mul255_epi32(nba, sb)), sse2_mul255_epi32(saba, rb));
+		x = _mm_sub_epi32(_mm_add_epi32(ba, sa), saba);
+		x = _mm_or_si128(_mm_slli_epi32(x, 24), _mm_slli_epi32(_mm_and_si128(rb, k255), 16));
+		x = _mm_or_si128(x, _mm_or_si128(_mm_slli_epi32(_mm_and_si128(rg, k255), 8), _mm_and_si128(rr, k255)));
+		_mm_storeu_si128((__m128i *)bp, x);
+	}
+	fz_blend_nonseparable(bp, sp, w, blendmode);
+}
+
+#endif /* FZ_SSE2 */
+
+static void
+fz_blend_row(unsigned char *dp, unsigned char *sp, int n, int w, int blendmode, int isolated, unsigned char *hp, int alpha)
+{
+	if (!isolated)
+	{
+		if (n == 4 && blendmode >= FZ_BLEND_HUE)
+			fz_blend_nonseparable_nonisolated(dp, sp, w, blendmode, hp, alpha);
+		else
+			fz_blend_separable_nonisolated(dp, sp, n, w, blendmode, hp, alpha);
+	}
+	else
+	{
+#ifdef FZ_SSE2
+		if (n == 4 && blendmode >= FZ_BLEND_HUE)
+			FZ_SIMD_CALL("fz_blend_nonseparable_sse2", dp, w * n,
+				fz_blend_nonseparable_sse2(dp, sp, w, blendmode),
+				fz_blend_nonseparable(dp, sp, w, blendmode));
+		else if ((n == 2 || n == 4) && sse2_blend_separable_supported(blendmode))
+			FZ_SIMD_CALL("fz_blend_separable_sse2", dp, w * n,
+				fz_blend_separable_sse2(dp, sp, n, w, blendmode),
+				fz_blend_separable(dp, sp, n, w, blendmode));
+		else
+#endif
+		if (n == 4 && blendmode >= FZ_BLEND_HUE)
+			fz_blend_nonseparable(dp, sp, w, blendmode);
+		else
+			fz_blend_separable(dp, sp, n, w, blendmode);
+	}
+}
+
 void
 fz_blend_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha, int blendmode, int isolated, fz_pixmap *shape)
 {
-	unsigned char *sp, *dp;
+	unsigned char *sp, *dp, *hp;
 	fz_irect bbox;
 	fz_irect bbox2;
 	int x, y, w, h, n;
@@ -602,35 +1002,43 @@ fz_blend_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha, int blendmode, int is
 
 	n = src->n;
 	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * n);
-	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * n);
+	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+	hp = NULL;
+	if (!isolated)
+		hp = shape->samples + (unsigned int)((y - shape->y) * shape->w + (x - shape->x));
 
-	assert(src->n == dst->n);
+	assert(src->n - src->alpha == dst->n - dst->alpha && src->alpha);
 
-	if (!isolated)
+	if (!dst->alpha)
 	{
-		unsigned char *hp = shape->samples + (unsigned int)((y - shape->y) * shape->w + (x - shape->x));
+		/* The blenders all expect a destination alpha, so blend each
+		 * row in pieces through a copy that has one. */
+		unsigned char buf[4096];
+		int chunk = sizeof buf / n;
 
 		while (h--)
 		{
-			if (n == 4 && blendmode >= FZ_BLEND_HUE)
-				fz_blend_nonseparable_nonisolated(dp, sp, w, blendmode, hp, alpha);
-			else
-				fz_blend_separable_nonisolated(dp, sp, n, w, blendmode, hp, alpha);
+			for (x = 0; x < w; x += chunk)
+			{
+				int cw = fz_mini(chunk, w - x);
+				fz_add_span_alpha(buf, dp + x * (n - 1), n - 1, cw);
+				fz_blend_row(buf, sp + x * n, n, cw, blendmode, isolated, hp ? hp + x : NULL, alpha);
+				fz_drop_span_alpha(dp + x * (n - 1), buf, n - 1, cw);
+			}
 			sp += src->w * n;
-			dp += dst->w * n;
-			hp += shape->w;
+			dp += dst->w * dst->n;
+			if (hp)
+				hp += shape->w;
 		}
+		return;
 	}
-	else
+
+	while (h--)
 	{
-		while (h--)
-		{
-			if (n == 4 && blendmode >= FZ_BLEND_HUE)
-				fz_blend_nonseparable(dp, sp, w, blendmode);
-			else
-				fz_blend_separable(dp, sp, n, w, blendmode);
-			sp += src->w * n;
-			dp += dst->w * n;
-		}
+		fz_blend_row(dp, sp, n, w, blendmode, isolated, hp, alpha);
+		sp += src->w * n;
+		dp += dst->w * n;
+		if (hp)
+			hp += shape->w;
 	}
 }
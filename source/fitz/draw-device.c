@@ -3,6 +3,16 @@
 
 #define STACK_SIZE 96
 
+/* Sizes for the pool of pixel buffers kept for group, mask, clip and
+ * knockout pixmaps. Buffers are bucketed by the log2 of their size,
+ * with at most POOL_SLOTS free buffers kept per bucket, and at most
+ * POOL_MAX_FREE bytes kept in total. The pool belongs to the context,
+ * so that the devices drawing later bands and pages reuse the buffers
+ * of earlier ones. */
+#define POOL_BUCKETS 32
+#define POOL_SLOTS 4
+#define POOL_MAX_FREE (64<<20)
+
 /* Enable the following to attempt to support knockout and/or isolated
  * blending groups. */
 #define ATTEMPT_KNOCKOUT_AND_ISOLATED
@@ -23,6 +33,7 @@ typedef struct fz_draw_state_s fz_draw_state;
 
 struct fz_draw_state_s {
 	fz_irect scissor;
+	fz_irect clip; /* scissor before cutting to the band; see fz_new_draw_device_for_band */
 	fz_pixmap *dest;
 	fz_pixmap *mask;
 	fz_pixmap *shape;
@@ -30,11 +41,41 @@ struct fz_draw_state_s {
 	int luminosity;
 	int id;
 	float alpha;
+	float bc;
 	fz_matrix ctm;
 	float xstep, ystep;
 	fz_irect area;
 };
 
+typedef struct fz_draw_buffer_s fz_draw_buffer;
+
+struct fz_draw_buffer_s {
+	fz_pixmap *pix;
+	unsigned char *samples;
+	size_t size;
+};
+
+/* Cloned contexts each have their own pool, so it needs no locking.
+ * hits, misses and peak total up the devices dropped since the last
+ * call to fz_draw_pool_stats. */
+struct fz_draw_pool_s {
+	fz_draw_buffer free[POOL_BUCKETS][POOL_SLOTS];
+	int count[POOL_BUCKETS];
+	size_t free_bytes;
+	int hits, misses;
+	size_t peak;
+};
+
+/* The buffers a device has taken, so they can be given back. */
+typedef struct fz_draw_pool_use_s fz_draw_pool_use;
+
+struct fz_draw_pool_use_s {
+	fz_draw_buffer *used;
+	int used_len, used_cap;
+	size_t bytes, peak;
+	int hits, misses;
+};
+
 struct fz_draw_device_s
 {
 	fz_device super;
@@ -46,6 +87,7 @@ struct fz_draw_device_s
 	fz_draw_state *stack;
 	int stack_cap;
 	fz_draw_state init_stack[STACK_SIZE];
+	fz_draw_pool_use pool;
 };
 
 #ifdef DUMP_GROUP_BLENDS
@@ -117,6 +159,255 @@ static void fz_grow_stack(fz_context *ctx, fz_draw_device *dev)
 	dev->stack_cap = max;
 }
 
+static int pool_bucket(size_t size)
+{
+	int b = 0;
+	while (size > 1 && b < POOL_BUCKETS-1)
+	{
+		size >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/* On success, size is updated to the size of the buffer returned. */
+static unsigned char *pool_take(fz_context *ctx, size_t *size)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+	int b = pool_bucket(*size);
+	int end = fz_mini(b+2, POOL_BUCKETS);
+	unsigned char *samples;
+
+	if (!pool)
+		return NULL;
+
+	/* Buffers in bucket b may be too small; anything in bucket b+1
+	 * is big enough, and at most 4 times larger than required. */
+	for (; b < end; b++)
+	{
+		fz_draw_buffer *slot = pool->free[b];
+		int i, best = -1;
+		for (i = 0; i < pool->count[b]; i++)
+			if (slot[i].size >= *size && (best < 0 || slot[i].size < slot[best].size))
+				best = i;
+		if (best >= 0)
+		{
+			samples = slot[best].samples;
+			*size = slot[best].size;
+			pool->free_bytes -= *size;
+			slot[best] = slot[--pool->count[b]];
+			return samples;
+		}
+	}
+	return NULL;
+}
+
+static void pool_give(fz_context *ctx, unsigned char *samples, size_t size)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+	int b = pool_bucket(size);
+
+	if (!pool)
+		pool = ctx->draw_pool = fz_calloc_no_throw(ctx, 1, sizeof *pool);
+	if (!pool || pool->count[b] == POOL_SLOTS || pool->free_bytes + size > POOL_MAX_FREE)
+	{
+		fz_free(ctx, samples);
+		return;
+	}
+	pool->free[b][pool->count[b]].pix = NULL;
+	pool->free[b][pool->count[b]].samples = samples;
+	pool->free[b][pool->count[b]].size = size;
+	pool->count[b]++;
+	pool->free_bytes += size;
+}
+
+/* Create a pixmap for use on the graphics stack, with its samples taken
+ * from the pool if possible. The contents are undefined. Pixmaps made
+ * here must be released with fz_draw_drop_pixmap. */
+static fz_pixmap *
+fz_draw_new_pixmap(fz_context *ctx, fz_draw_device *dev, fz_colorspace *colorspace, const fz_irect *bbox)
+{
+	fz_draw_pool_use *pool = &dev->pool;
+	int w = bbox->x1 - bbox->x0;
+	int h = bbox->y1 - bbox->y0;
+	int n = colorspace ? colorspace->n + 1 : 1;
+	unsigned char *samples;
+	fz_pixmap *pix = NULL;
+	size_t size;
+
+	/* Leave empty and unreasonable pixmaps to the usual code. */
+	if (w <= 0 || h <= 0 || w > INT_MAX / n)
+		return fz_new_pixmap_with_bbox(ctx, colorspace, bbox);
+	size = (size_t)w * n * h;
+
+	samples = pool_take(ctx, &size);
+	if (samples)
+		pool->hits++;
+	else
+	{
+		samples = fz_malloc_array(ctx, h, w * n);
+		pool->misses++;
+	}
+
+	fz_try(ctx)
+	{
+		if (pool->used_len == pool->used_cap)
+		{
+			int max = pool->used_cap ? pool->used_cap * 2 : 16;
+			pool->used = fz_resize_array(ctx, pool->used, max, sizeof *pool->used);
+			pool->used_cap = max;
+		}
+		pix = fz_new_pixmap_with_bbox_and_data(ctx, colorspace, bbox, samples);
+	}
+	fz_catch(ctx)
+	{
+		pool_give(ctx, samples, size);
+		fz_rethrow(ctx);
+	}
+
+	pool->used[pool->used_len].pix = pix;
+	pool->used[pool->used_len].samples = samples;
+	pool->used[pool->used_len].size = size;
+	pool->used_len++;
+	pool->bytes += size;
+	if (pool->bytes > pool->peak)
+		pool->peak = pool->bytes;
+
+	return pix;
+}
+
+/* Drop a pixmap from the graphics stack, returning its samples to the
+ * pool if they came from there. Pixmaps that did not come from
+ * fz_draw_new_pixmap are simply dropped. */
+static void
+fz_draw_drop_pixmap(fz_context *ctx, fz_draw_device *dev, fz_pixmap *pix)
+{
+	fz_draw_pool_use *pool = &dev->pool;
+	fz_draw_buffer buf;
+	int i;
+
+	if (!pix)
+		return;
+
+	for (i = pool->used_len-1; i >= 0; i--)
+		if (pool->used[i].pix == pix)
+			break;
+	if (i < 0)
+	{
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	buf = pool->used[i];
+	pool->used[i] = pool->used[--pool->used_len];
+	pool->bytes -= buf.size;
+
+	if (fz_refs_load(&pix->storable.refs) > 1)
+	{
+		/* Someone else still holds the pixmap; hand the samples
+		 * over to it rather than reusing them. */
+		pix->free_samples = 1;
+		fz_drop_pixmap(ctx, pix);
+		return;
+	}
+
+	fz_drop_pixmap(ctx, pix);
+	pool_give(ctx, buf.samples, buf.size);
+}
+
+static void
+fz_draw_drop_pool(fz_context *ctx, fz_draw_device *dev)
+{
+	fz_draw_pool_use *pool = &dev->pool;
+	int i;
+
+	fz_add_draw_pool_stats(ctx, pool->hits, pool->misses, pool->peak);
+
+	/* Anything still in use has been leaked by the stack; let the
+	 * pixmaps own their samples. */
+	for (i = 0; i < pool->used_len; i++)
+		pool->used[i].pix->free_samples = 1;
+	fz_free(ctx, pool->used);
+}
+
+static void
+pool_empty(fz_context *ctx, fz_draw_pool *pool)
+{
+	int b, i;
+
+	for (b = 0; b < POOL_BUCKETS; b++)
+	{
+		for (i = 0; i < pool->count[b]; i++)
+			fz_free(ctx, pool->free[b][i].samples);
+		pool->count[b] = 0;
+	}
+	pool->free_bytes = 0;
+}
+
+void
+fz_drop_draw_pool_context(fz_context *ctx)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+
+	if (!pool)
+		return;
+	pool_empty(ctx, pool);
+	fz_free(ctx, pool);
+	ctx->draw_pool = NULL;
+}
+
+void
+fz_add_draw_pool_stats(fz_context *ctx, int hits, int misses, size_t peak)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+
+	if (hits == 0 && misses == 0)
+		return;
+	if (!pool)
+		pool = ctx->draw_pool = fz_calloc_no_throw(ctx, 1, sizeof *pool);
+	if (!pool)
+		return;
+	pool->hits += hits;
+	pool->misses += misses;
+	if (peak > pool->peak)
+		pool->peak = peak;
+}
+
+void
+fz_draw_pool_stats(fz_context *ctx, int *hits, int *misses, size_t *peak)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+
+	if (hits)
+		*hits = pool ? pool->hits : 0;
+	if (misses)
+		*misses = pool ? pool->misses : 0;
+	if (peak)
+		*peak = pool ? pool->peak : 0;
+	if (pool)
+	{
+		pool->hits = 0;
+		pool->misses = 0;
+		pool->peak = 0;
+	}
+}
+
+/* Called by the store scavenger, with the alloc lock held. Gives back
+ * the free buffers of this context's pool. Returns 1 if any memory
+ * was freed. */
+int
+fz_scavenge_draw_pool(fz_context *ctx)
+{
+	fz_draw_pool *pool = ctx->draw_pool;
+
+	if (!pool || pool->free_bytes == 0)
+		return 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	pool_empty(ctx, pool);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	return 1;
+}
+
 /* 'Push' the stack. Returns a pointer to the current state, with state[1]
  * already having been initialised to contain the same thing. Simply
  * change any contents of state[1] that you want to and continue. */
@@ -136,11 +427,11 @@ push_stack(fz_context *ctx, fz_draw_device *dev)
 static void emergency_pop_stack(fz_context *ctx, fz_draw_device *dev, fz_draw_state *state)
 {
 	if (state[1].mask != state[0].mask)
-		fz_drop_pixmap(ctx, state[1].mask);
+		fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 	if (state[1].dest != state[0].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[1].shape != state[0].shape)
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	dev->top--;
 	STACK_POPPED("emergency");
 	fz_rethrow(ctx);
@@ -162,7 +453,7 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 
 	fz_pixmap_bbox(ctx, state->dest, &bbox);
 	fz_intersect_irect(&bbox, &state->scissor);
-	dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, &bbox);
+	dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, &bbox);
 
 	if (isolated)
 	{
@@ -193,7 +484,7 @@ fz_knockout_begin(fz_context *ctx, fz_draw_device *dev)
 	}
 	else
 	{
-		shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, shape);
 	}
 #ifdef DUMP_GROUP_BLENDS
@@ -249,12 +540,12 @@ static void fz_knockout_end(fz_context *ctx, fz_draw_device *dev)
 	 * errors can cause the stack to get out of sync, and this saves our
 	 * bacon. */
 	if (state[0].dest != state[1].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[0].shape != state[1].shape)
 	{
 		if (state[0].shape)
 			fz_paint_pixmap(state[0].shape, state[1].shape, 255);
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	}
 #ifdef DUMP_GROUP_BLENDS
 	fz_dump_blend(ctx, state[0].dest, " to get ");
@@ -286,7 +577,7 @@ fz_draw_fill_path(fz_context *ctx, fz_device *devp, fz_path *path, int even_odd,
 	if (flatness < 0.001f)
 		flatness = 0.001f;
 
-	fz_reset_gel(ctx, gel, &state->scissor);
+	fz_reset_gel(ctx, gel, &state->clip);
 	fz_flatten_fill_path(ctx, gel, path, ctm, flatness);
 	fz_sort_gel(ctx, gel);
 
@@ -306,7 +597,7 @@ fz_draw_fill_path(fz_context *ctx, fz_device *devp, fz_path *path, int even_odd,
 	fz_scan_convert(ctx, gel, even_odd, &bbox, state->dest, colorbv);
 	if (state->shape)
 	{
-		fz_reset_gel(ctx, gel, &state->scissor);
+		fz_reset_gel(ctx, gel, &state->clip);
 		fz_flatten_fill_path(ctx, gel, path, ctm, flatness);
 		fz_sort_gel(ctx, gel);
 
@@ -343,7 +634,7 @@ fz_draw_stroke_path(fz_context *ctx, fz_device *devp, fz_path *path, fz_stroke_s
 	if (flatness < 0.001f)
 		flatness = 0.001f;
 
-	fz_reset_gel(ctx, gel, &state->scissor);
+	fz_reset_gel(ctx, gel, &state->clip);
 	if (stroke->dash_len > 0)
 		fz_flatten_dash_path(ctx, gel, path, stroke, ctm, flatness, linewidth);
 	else
@@ -366,7 +657,7 @@ fz_draw_stroke_path(fz_context *ctx, fz_device *devp, fz_path *path, fz_stroke_s
 	fz_scan_convert(ctx, gel, 0, &bbox, state->dest, colorbv);
 	if (state->shape)
 	{
-		fz_reset_gel(ctx, gel, &state->scissor);
+		fz_reset_gel(ctx, gel, &state->clip);
 		if (stroke->dash_len > 0)
 			fz_flatten_dash_path(ctx, gel, path, stroke, ctm, flatness, linewidth);
 		else
@@ -396,7 +687,7 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, fz_path *path, const fz_rect
 	if (flatness < 0.001f)
 		flatness = 0.001f;
 
-	fz_reset_gel(ctx, gel, &state->scissor);
+	fz_reset_gel(ctx, gel, &state->clip);
 	fz_flatten_fill_path(ctx, gel, path, ctm, flatness);
 	fz_sort_gel(ctx, gel);
 
@@ -404,12 +695,15 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, fz_path *path, const fz_rect
 	STACK_PUSHED("clip path");
 	model = state->dest->colorspace;
 
-	fz_intersect_irect(fz_bound_gel(ctx, gel, &bbox), &state->scissor);
+	fz_bound_gel(ctx, gel, &bbox);
 	if (rect)
 	{
 		fz_irect bbox2;
 		fz_intersect_irect(&bbox, fz_irect_from_rect(&bbox2, rect));
 	}
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
+	fz_intersect_irect(&bbox, &state->scissor);
 
 	if (fz_is_empty_irect(&bbox) || fz_is_rect_gel(ctx, gel))
 	{
@@ -423,13 +717,13 @@ fz_draw_clip_path(fz_context *ctx, fz_device *devp, fz_path *path, const fz_rect
 
 	fz_try(ctx)
 	{
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, state[1].mask);
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 		fz_clear_pixmap(ctx, state[1].dest);
 		if (state[1].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 
@@ -465,7 +759,7 @@ fz_draw_clip_stroke_path(fz_context *ctx, fz_device *devp, fz_path *path, const
 	if (flatness < 0.001f)
 		flatness = 0.001f;
 
-	fz_reset_gel(ctx, gel, &state->scissor);
+	fz_reset_gel(ctx, gel, &state->clip);
 	if (stroke->dash_len > 0)
 		fz_flatten_dash_path(ctx, gel, path, stroke, ctm, flatness, linewidth);
 	else
@@ -476,22 +770,25 @@ fz_draw_clip_stroke_path(fz_context *ctx, fz_device *devp, fz_path *path, const
 	STACK_PUSHED("clip stroke");
 	model = state->dest->colorspace;
 
-	fz_intersect_irect(fz_bound_gel(ctx, gel, &bbox), &state->scissor);
+	fz_bound_gel(ctx, gel, &bbox);
 	if (rect)
 	{
 		fz_irect bbox2;
 		fz_intersect_irect(&bbox, fz_irect_from_rect(&bbox2, rect));
 	}
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
+	fz_intersect_irect(&bbox, &state->scissor);
 
 	fz_try(ctx)
 	{
-		state[1].mask = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		state[1].mask = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, state[1].mask);
-		state[1].dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		state[1].dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 		fz_clear_pixmap(ctx, state[1].dest);
 		if (state->shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 
@@ -548,9 +845,9 @@ draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_glyph *glyph,
 		while (h--)
 		{
 			if (dst->colorspace)
-				fz_paint_span_with_color(dp, mp, dst->n, w, colorbv);
+				fz_paint_span_with_color(dp, mp, dst->n, w, colorbv, dst->alpha);
 			else
-				fz_paint_span(dp, mp, 1, w, 255);
+				fz_paint_span(dp, 1, mp, 1, w, 255);
 			dp += dst->w * dst->n;
 			mp += msk->w;
 		}
@@ -597,7 +894,7 @@ fz_draw_fill_text(fz_context *ctx, fz_device *devp, fz_text *text, const fz_matr
 			tm.f = span->items[i].y;
 			fz_concat(&trm, &tm, ctm);
 
-			glyph = fz_render_glyph(ctx, span->font, gid, &trm, model, &state->scissor);
+			glyph = fz_render_glyph(ctx, span->font, gid, &trm, model, &state->clip);
 			if (glyph)
 			{
 				fz_pixmap *pixmap = glyph->pixmap;
@@ -614,7 +911,7 @@ fz_draw_fill_text(fz_context *ctx, fz_device *devp, fz_text *text, const fz_matr
 					fz_matrix mat;
 					mat.a = pixmap->w; mat.b = mat.c = 0; mat.d = pixmap->h;
 					mat.e = x + pixmap->x; mat.f = y + pixmap->y;
-					fz_paint_image(state->dest, &state->scissor, state->shape, pixmap, &mat, alpha * 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
+					fz_paint_image(state->dest, &state->scissor, &state->clip, state->shape, pixmap, &mat, alpha * 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
 				}
 				fz_drop_glyph(ctx, glyph);
 			}
@@ -677,7 +974,7 @@ fz_draw_stroke_text(fz_context *ctx, fz_device *devp, fz_text *text, fz_stroke_s
 			tm.f = span->items[i].y;
 			fz_concat(&trm, &tm, ctm);
 
-			glyph = fz_render_stroked_glyph(ctx, span->font, gid, &trm, ctm, stroke, &state->scissor);
+			glyph = fz_render_stroked_glyph(ctx, span->font, gid, &trm, ctm, stroke, &state->clip);
 			if (glyph)
 			{
 				int x = (int)trm.e;
@@ -727,17 +1024,19 @@ fz_draw_clip_text(fz_context *ctx, fz_device *devp, fz_text *text, const fz_matr
 
 	/* make the mask the exact size needed */
 	fz_irect_from_rect(&bbox, fz_bound_text(ctx, text, NULL, ctm, &rect));
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
 	fz_intersect_irect(&bbox, &state->scissor);
 
 	fz_try(ctx)
 	{
-		mask = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		mask = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, mask);
-		dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 		fz_clear_pixmap(ctx, dest);
 		if (state->shape)
 		{
-			shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, shape);
 		}
 		else
@@ -768,7 +1067,7 @@ fz_draw_clip_text(fz_context *ctx, fz_device *devp, fz_text *text, const fz_matr
 					tm.f = span->items[i].y;
 					fz_concat(&trm, &tm, ctm);
 
-					glyph = fz_render_glyph(ctx, span->font, gid, &trm, model, &state->scissor);
+					glyph = fz_render_glyph(ctx, span->font, gid, &trm, model, &state->clip);
 					if (glyph)
 					{
 						int x = (int)trm.e;
@@ -837,17 +1136,19 @@ fz_draw_clip_stroke_text(fz_context *ctx, fz_device *devp, fz_text *text, fz_str
 	STACK_PUSHED("clip stroke text");
 	/* make the mask the exact size needed */
 	fz_irect_from_rect(&bbox, fz_bound_text(ctx, text, stroke, ctm, &rect));
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
 	fz_intersect_irect(&bbox, &state->scissor);
 
 	fz_try(ctx)
 	{
-		state[1].mask = mask = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		state[1].mask = mask = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, mask);
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 		fz_clear_pixmap(ctx, dest);
 		if (state->shape)
 		{
-			state[1].shape = shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, shape);
 		}
 		else
@@ -875,7 +1176,7 @@ fz_draw_clip_stroke_text(fz_context *ctx, fz_device *devp, fz_text *text, fz_str
 					tm.f = span->items[i].y;
 					fz_concat(&trm, &tm, ctm);
 
-					glyph = fz_render_stroked_glyph(ctx, span->font, gid, &trm, ctm, stroke, &state->scissor);
+					glyph = fz_render_stroked_glyph(ctx, span->font, gid, &trm, ctm, stroke, &state->clip);
 					if (glyph)
 					{
 						int x = (int)trm.e;
@@ -965,11 +1266,11 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, const fz_m
 
 	if (alpha < 1)
 	{
-		dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, &bbox);
+		dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, &bbox);
 		fz_clear_pixmap(ctx, dest);
 		if (shape)
 		{
-			shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, shape);
 		}
 	}
@@ -1013,11 +1314,11 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, const fz_m
 	if (alpha < 1)
 	{
 		fz_paint_pixmap(state->dest, dest, alpha * 255);
-		fz_drop_pixmap(ctx, dest);
+		fz_draw_drop_pixmap(ctx, dev, dest);
 		if (shape)
 		{
 			fz_paint_pixmap(state->shape, shape, alpha * 255);
-			fz_drop_pixmap(ctx, shape);
+			fz_draw_drop_pixmap(ctx, dev, shape);
 		}
 	}
 
@@ -1171,7 +1472,7 @@ fz_draw_fill_image(fz_context *ctx, fz_device *devp, fz_image *image, const fz_m
 			}
 		}
 
-		fz_paint_image(state->dest, &state->scissor, state->shape, pixmap, &local_ctm, alpha * 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
+		fz_paint_image(state->dest, &state->scissor, &state->clip, state->shape, pixmap, &local_ctm, alpha * 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
 
 		if (state->blendmode & FZ_BLEND_KNOCKOUT)
 			fz_knockout_end(ctx, dev);
@@ -1242,7 +1543,7 @@ fz_draw_fill_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, const
 			colorbv[i] = colorfv[i] * 255;
 		colorbv[i] = alpha * 255;
 
-		fz_paint_image_with_color(state->dest, &state->scissor, state->shape, pixmap, &local_ctm, colorbv, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
+		fz_paint_image_with_color(state->dest, &state->scissor, &state->clip, state->shape, pixmap, &local_ctm, colorbv, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
 
 		if (scaled)
 			fz_drop_pixmap(ctx, scaled);
@@ -1294,6 +1595,7 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, const
 		dump_spaces(dev->top-1, "Clip (image mask) (empty) begin\n");
 #endif
 		state[1].scissor = fz_empty_irect;
+		state[1].clip = fz_empty_irect;
 		state[1].mask = NULL;
 		return;
 	}
@@ -1304,12 +1606,14 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, const
 
 	urect = fz_unit_rect;
 	fz_irect_from_rect(&bbox, fz_transform_rect(&urect, &local_ctm));
-	fz_intersect_irect(&bbox, &state->scissor);
 	if (rect)
 	{
 		fz_irect bbox2;
 		fz_intersect_irect(&bbox, fz_irect_from_rect(&bbox2, rect));
 	}
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
+	fz_intersect_irect(&bbox, &state->scissor);
 
 	dx = sqrtf(local_ctm.a * local_ctm.a + local_ctm.b * local_ctm.b);
 	dy = sqrtf(local_ctm.c * local_ctm.c + local_ctm.d * local_ctm.d);
@@ -1319,14 +1623,14 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, const
 		pixmap = fz_image_get_pixmap(ctx, image, dx, dy);
 		orig_pixmap = pixmap;
 
-		state[1].mask = mask = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+		state[1].mask = mask = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 		fz_clear_pixmap(ctx, mask);
 
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 		fz_clear_pixmap(ctx, dest);
 		if (state->shape)
 		{
-			state[1].shape = shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, shape);
 		}
 
@@ -1348,7 +1652,7 @@ fz_draw_clip_image_mask(fz_context *ctx, fz_device *devp, fz_image *image, const
 			if (scaled)
 				pixmap = scaled;
 		}
-		fz_paint_image(mask, &bbox, state->shape, pixmap, &local_ctm, 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
+		fz_paint_image(mask, &bbox, &state[1].clip, state->shape, pixmap, &local_ctm, 255, !(devp->hints & FZ_DONT_INTERPOLATE_IMAGES), devp->flags & FZ_DEVFLAG_GRIDFIT_AS_TILED);
 	}
 	fz_always(ctx)
 	{
@@ -1394,15 +1698,15 @@ fz_draw_pop_clip(fz_context *ctx, fz_device *devp)
 		if (state[0].shape != state[1].shape)
 		{
 			fz_paint_pixmap_with_mask(state[0].shape, state[1].shape, state[1].mask);
-			fz_drop_pixmap(ctx, state[1].shape);
+			fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 		}
 		/* The following tests should not be required, but just occasionally
 		 * errors can cause the stack to get out of sync, and this might save
 		 * our bacon. */
 		if (state[0].mask != state[1].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
+			fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 		if (state[0].dest != state[1].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 #ifdef DUMP_GROUP_BLENDS
 		fz_dump_blend(ctx, state[0].dest, " to get ");
 		if (state[0].shape)
@@ -1418,21 +1722,167 @@ fz_draw_pop_clip(fz_context *ctx, fz_device *devp)
 	}
 }
 
+typedef struct
+{
+	int refs;
+	int id;
+	int luminosity;
+	float bc;
+	int aa;
+	fz_matrix ctm;
+	fz_irect bbox;
+} mask_key;
+
+/* The key does not fit in an fz_store_hash, so keep masks in the
+ * secondary index instead, where fz_cmp_mask_key decides on a match. */
+static int
+fz_make_hash_mask_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	return 0;
+}
+
+static unsigned int
+fz_hash_mask_key(fz_context *ctx, void *key_)
+{
+	mask_key *key = (mask_key *)key_;
+	unsigned int h = key->id;
+
+	h = h * 31 + key->luminosity;
+	h = h * 31 + key->aa;
+	h = h * 31 + (int)(key->bc * 255);
+	h = h * 31 + (int)(key->ctm.a * 1000);
+	h = h * 31 + (int)(key->ctm.d * 1000);
+	h = h * 31 + (int)key->ctm.e;
+	h = h * 31 + (int)key->ctm.f;
+	h = h * 31 + key->bbox.x0;
+	h = h * 31 + key->bbox.y0;
+	h = h * 31 + key->bbox.x1;
+	h = h * 31 + key->bbox.y1;
+	return h;
+}
+
+static void *
+fz_keep_mask_key(fz_context *ctx, void *key_)
+{
+	mask_key *key = (mask_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
 static void
-fz_draw_begin_mask(fz_context *ctx, fz_device *devp, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *colorfv)
+fz_drop_mask_key(fz_context *ctx, void *key_)
+{
+	mask_key *key = (mask_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+fz_cmp_mask_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	mask_key *k0 = (mask_key *)k0_;
+	mask_key *k1 = (mask_key *)k1_;
+	/* As for pdf_objcmp, 0 means the keys match. */
+	return !(k0->id == k1->id && k0->luminosity == k1->luminosity && k0->bc == k1->bc && k0->aa == k1->aa &&
+		k0->ctm.a == k1->ctm.a && k0->ctm.b == k1->ctm.b && k0->ctm.c == k1->ctm.c &&
+		k0->ctm.d == k1->ctm.d && k0->ctm.e == k1->ctm.e && k0->ctm.f == k1->ctm.f &&
+		k0->bbox.x0 == k1->bbox.x0 && k0->bbox.y0 == k1->bbox.y0 &&
+		k0->bbox.x1 == k1->bbox.x1 && k0->bbox.y1 == k1->bbox.y1);
+}
+
+static void
+fz_print_mask(fz_context *ctx, fz_output *out, void *key_)
+{
+	mask_key *key = (mask_key *)key_;
+	fz_printf(ctx, out, "(mask id=%x, ctm=%g %g %g %g %g %g, bbox=%d %d %d %d) ", key->id,
+		key->ctm.a, key->ctm.b, key->ctm.c, key->ctm.d, key->ctm.e, key->ctm.f,
+		key->bbox.x0, key->bbox.y0, key->bbox.x1, key->bbox.y1);
+}
+
+static fz_store_type fz_mask_store_type =
+{
+	fz_make_hash_mask_key,
+	fz_keep_mask_key,
+	fz_drop_mask_key,
+	fz_cmp_mask_key,
+	fz_print_mask,
+	fz_hash_mask_key,
+	"fz_mask"
+};
+
+static void
+fz_init_mask_key(fz_context *ctx, mask_key *key, fz_draw_state *state)
+{
+	key->refs = 1;
+	key->id = state->id;
+	key->luminosity = state->luminosity;
+	key->bc = state->bc;
+	key->aa = fz_aa_level(ctx);
+	key->ctm = state->ctm;
+	key->bbox = state->scissor;
+}
+
+static int
+fz_draw_begin_mask(fz_context *ctx, fz_device *devp, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *colorfv, const fz_matrix *ctm, int id)
 {
 	fz_draw_device *dev = (fz_draw_device*)devp;
 	fz_pixmap *dest;
 	fz_irect bbox;
-	fz_draw_state *state = push_stack(ctx, dev);
-	fz_pixmap *shape = state->shape;
+	fz_draw_state *state;
+	fz_pixmap *shape;
+	float bc = 0;
 
+	if (luminosity)
+	{
+		if (!colorspace)
+			colorspace = fz_device_gray(ctx);
+		fz_convert_color(ctx, fz_device_gray(ctx), &bc, colorspace, colorfv);
+	}
+
+	state = push_stack(ctx, dev);
+	shape = state->shape;
 	STACK_PUSHED("mask");
-	fz_intersect_irect(fz_irect_from_rect(&bbox, rect), &state->scissor);
+	fz_irect_from_rect(&bbox, rect);
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
+	fz_intersect_irect(&bbox, &state->scissor);
+
+	/* What is drawn inside a knockout group depends on what lies
+	 * beneath it, so only cache masks outside of them. */
+	if (!ctm || (state->blendmode & FZ_BLEND_KNOCKOUT))
+		id = 0;
+	state[1].id = id;
+	state[1].bc = bc;
+	state[1].luminosity = luminosity;
+	if (ctm)
+		state[1].ctm = *ctm;
+	state[1].scissor = bbox;
+
+	/* Check to see if we have one cached */
+	if (id)
+	{
+		mask_key mk;
+		fz_pixmap *mask;
+
+		fz_init_mask_key(ctx, &mk, &state[1]);
+		mask = fz_find_item(ctx, fz_drop_pixmap_imp, &mk, &fz_mask_store_type);
+		if (mask)
+		{
+			/* Leave the mask in place for fz_draw_end_mask to
+			 * find. Nothing is drawn in the meantime; the empty
+			 * scissor makes sure of that if anything tries. */
+#ifdef DUMP_GROUP_BLENDS
+			dump_spaces(dev->top-1, "Mask begin (cached)\n");
+#endif
+			state[1].mask = mask;
+			state[1].scissor.x1 = state[1].scissor.x0;
+			state[1].scissor.y1 = state[1].scissor.y0;
+			return 1;
+		}
+	}
 
 	fz_try(ctx)
 	{
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), &bbox);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, fz_device_gray(ctx), &bbox);
 		if (state->shape)
 		{
 			/* FIXME: If we ever want to support AIS true, then
@@ -1446,10 +1896,6 @@ fz_draw_begin_mask(fz_context *ctx, fz_device *devp, const fz_rect *rect, int lu
 
 		if (luminosity)
 		{
-			float bc;
-			if (!colorspace)
-				colorspace = fz_device_gray(ctx);
-			fz_convert_color(ctx, fz_device_gray(ctx), &bc, colorspace, colorfv);
 			fz_clear_pixmap_with_value(ctx, dest, bc * 255);
 			if (shape)
 				fz_clear_pixmap_with_value(ctx, shape, 255);
@@ -1464,13 +1910,45 @@ fz_draw_begin_mask(fz_context *ctx, fz_device *devp, const fz_rect *rect, int lu
 #ifdef DUMP_GROUP_BLENDS
 		dump_spaces(dev->top-1, "Mask begin\n");
 #endif
-		state[1].scissor = bbox;
-		state[1].luminosity = luminosity;
 	}
 	fz_catch(ctx)
 	{
 		emergency_pop_stack(ctx, dev, state);
 	}
+
+	return 0;
+}
+
+/* Try to cache a rendered mask. Any failure here will just result in
+ * us not caching. */
+static void
+fz_cache_mask(fz_context *ctx, fz_draw_state *state)
+{
+	mask_key *key = NULL;
+	fz_pixmap *existing;
+
+	fz_var(key);
+
+	fz_try(ctx)
+	{
+		key = fz_malloc_struct(ctx, mask_key);
+		fz_init_mask_key(ctx, key, state);
+		existing = fz_store_item(ctx, key, state->mask, fz_pixmap_size(ctx, state->mask), &fz_mask_store_type);
+		if (existing)
+		{
+			/* We already have one; produced by a racing thread,
+			 * or already in the store. Both are the same. */
+			fz_drop_pixmap(ctx, existing);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_mask_key(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
 }
 
 static void
@@ -1497,21 +1975,29 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 #endif
 	fz_try(ctx)
 	{
-		/* convert to alpha mask */
-		temp = fz_alpha_from_gray(ctx, state[1].dest, luminosity);
 		if (state[1].mask != state[0].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
-		state[1].mask = temp;
-		if (state[1].dest != state[0].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+		{
+			/* fz_draw_begin_mask found the mask in the cache */
+			temp = state[1].mask;
+		}
+		else
+		{
+			/* convert to alpha mask */
+			temp = fz_alpha_from_gray(ctx, state[1].dest, luminosity);
+			state[1].mask = temp;
+			if (state[1].dest != state[0].dest)
+				fz_draw_drop_pixmap(ctx, dev, state[1].dest);
+			if (state[1].shape != state[0].shape)
+				fz_draw_drop_pixmap(ctx, dev, state[1].shape);
+			if (state[1].id)
+				fz_cache_mask(ctx, &state[1]);
+		}
 		state[1].dest = NULL;
-		if (state[1].shape != state[0].shape)
-			fz_drop_pixmap(ctx, state[1].shape);
 		state[1].shape = NULL;
 
 		/* create new dest scratch buffer */
 		fz_pixmap_bbox(ctx, temp, &bbox);
-		dest = fz_new_pixmap_with_bbox(ctx, state->dest->colorspace, &bbox);
+		dest = fz_draw_new_pixmap(ctx, dev, state->dest->colorspace, &bbox);
 		fz_clear_pixmap(ctx, dest);
 
 		/* push soft mask as clip mask */
@@ -1521,7 +2007,7 @@ fz_draw_end_mask(fz_context *ctx, fz_device *devp)
 		 * clip mask when we pop. So create a new shape now. */
 		if (state[0].shape)
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 		state[1].scissor = bbox;
@@ -1546,11 +2032,14 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, const fz_rect *rect, int i
 
 	state = push_stack(ctx, dev);
 	STACK_PUSHED("group");
-	fz_intersect_irect(fz_irect_from_rect(&bbox, rect), &state->scissor);
+	fz_irect_from_rect(&bbox, rect);
+	state[1].clip = bbox;
+	fz_intersect_irect(&state[1].clip, &state->clip);
+	fz_intersect_irect(&bbox, &state->scissor);
 
 	fz_try(ctx)
 	{
-		state[1].dest = dest = fz_new_pixmap_with_bbox(ctx, model, &bbox);
+		state[1].dest = dest = fz_draw_new_pixmap(ctx, dev, model, &bbox);
 
 #ifndef ATTEMPT_KNOCKOUT_AND_ISOLATED
 		knockout = 0;
@@ -1574,7 +2063,7 @@ fz_draw_begin_group(fz_context *ctx, fz_device *devp, const fz_rect *rect, int i
 		}
 		else
 		{
-			state[1].shape = fz_new_pixmap_with_bbox(ctx, NULL, &bbox);
+			state[1].shape = fz_draw_new_pixmap(ctx, dev, NULL, &bbox);
 			fz_clear_pixmap(ctx, state[1].shape);
 		}
 
@@ -1638,12 +2127,12 @@ fz_draw_end_group(fz_context *ctx, fz_device *devp)
 	 * errors can cause the stack to get out of sync, and this might save
 	 * our bacon. */
 	if (state[0].dest != state[1].dest)
-		fz_drop_pixmap(ctx, state[1].dest);
+		fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 	if (state[0].shape != state[1].shape)
 	{
 		if (state[0].shape)
 			fz_paint_pixmap(state[0].shape, state[1].shape, alpha * 255);
-		fz_drop_pixmap(ctx, state[1].shape);
+		fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	}
 #ifdef DUMP_GROUP_BLENDS
 	fz_dump_blend(ctx, state[0].dest, " to get ");
@@ -1719,7 +2208,9 @@ static fz_store_type fz_tile_store_type =
 	fz_keep_tile_key,
 	fz_drop_tile_key,
 	fz_cmp_tile_key,
-	fz_print_tile
+	fz_print_tile,
+	NULL,
+	"fz_tile"
 };
 
 static void
@@ -1810,6 +2301,7 @@ fz_draw_begin_tile(fz_context *ctx, fz_device *devp, const fz_rect *area, const
 #endif
 
 			state[1].scissor = bbox;
+			state[1].clip = bbox;
 			fz_drop_tile_record(ctx, tile);
 			return 1;
 		}
@@ -1836,6 +2328,7 @@ fz_draw_begin_tile(fz_context *ctx, fz_device *devp, const fz_rect *area, const
 #endif
 
 		state[1].scissor = bbox;
+		state[1].clip = bbox;
 	}
 	fz_catch(ctx)
 	{
@@ -1845,6 +2338,161 @@ fz_draw_begin_tile(fz_context *ctx, fz_device *devp, const fz_rect *area, const
 	return 0;
 }
 
+/* Copy pixels tx0 to tx1 of row ty of a tile that repeats every
+ * tile->w or more pixels; anything beyond the tile itself is clear. */
+static unsigned char *
+put_tile_span(unsigned char *d, fz_pixmap *tile, int ty, int tx0, int tx1)
+{
+	int n = tile->n;
+
+	if (ty < tile->h && tx0 < tile->w)
+	{
+		int len = fz_mini(tx1, tile->w) - tx0;
+		memcpy(d, tile->samples + (ty * tile->w + tx0) * n, len * n);
+		d += len * n;
+		tx0 += len;
+	}
+	memset(d, 0, (tx1 - tx0) * n);
+	return d + (tx1 - tx0) * n;
+}
+
+/* Make a pixmap covering area that holds copies of tile repeated every
+ * sx pixels across and sy pixels down, starting from (ox, oy). The tiles
+ * must not overlap. One period of the first rows is built up, which is
+ * then doubled across and down. */
+static fz_pixmap *
+fz_replicate_tile(fz_context *ctx, fz_draw_device *dev, fz_pixmap *tile, const fz_irect *area, int ox, int oy, int sx, int sy)
+{
+	fz_pixmap *pix = fz_draw_new_pixmap(ctx, dev, tile->colorspace, area);
+	int n = pix->n;
+	int w = pix->w;
+	int h = pix->h;
+	int stride = w * n;
+	int px = (area->x0 - ox) % sx;
+	int py = (area->y0 - oy) % sy;
+	int rows = fz_mini(sy, h);
+	int len, y;
+
+	if (px < 0)
+		px += sx;
+	if (py < 0)
+		py += sy;
+
+	for (y = 0; y < rows; y++)
+	{
+		unsigned char *row = pix->samples + y * stride;
+		int ty = (py + y) % sy;
+
+		len = fz_mini(sx, w);
+		if (px + len <= sx)
+			put_tile_span(row, tile, ty, px, px + len);
+		else
+			put_tile_span(put_tile_span(row, tile, ty, px, sx), tile, ty, 0, px + len - sx);
+		while (len < w)
+		{
+			int copy = fz_mini(len, w - len);
+			memcpy(row + len * n, row, copy * n);
+			len += copy;
+		}
+	}
+
+	len = rows;
+	while (len < h)
+	{
+		int copy = fz_mini(len, h - len);
+		memcpy(pix->samples + len * stride, pix->samples, copy * stride);
+		len += copy;
+	}
+
+	return pix;
+}
+
+/* Paint the tiles for x0 <= x < x1, y0 <= y < y1 in one go, for tiles
+ * that sit on an integer grid with no overlaps. Returns 0 if the tiles
+ * are not suitable, leaving the caller to paint them one at a time. */
+static int
+fz_draw_paint_tiles(fz_context *ctx, fz_draw_device *dev, fz_draw_state *state, const fz_matrix *ctm, float xstep, float ystep, int x0, int y0, int x1, int y1)
+{
+	fz_pixmap *tile = state[1].dest;
+	fz_pixmap *dest = NULL;
+	fz_pixmap *shape = NULL;
+	fz_matrix ttm;
+	int sx, sy, ox, oy, x, y;
+	fz_irect area, bbox;
+	int64_t w = (int64_t)x1 - x0;
+	int64_t h = (int64_t)y1 - y0;
+
+	if (ctm->b != 0 || ctm->c != 0)
+		return 0;
+	/* Check the spans before their product, which cannot overflow
+	 * once they are bounded. */
+	if (w <= 0 || h <= 0 || w > 65536 || h > 65536 || w * h < 16)
+		return 0;
+
+	sx = (int)floorf(xstep * ctm->a + 0.5f);
+	sy = (int)floorf(ystep * ctm->d + 0.5f);
+
+	/* Only go on if every tile lands exactly where painting them one
+	 * at a time would put it. */
+	for (x = x0; x < x1; x++)
+	{
+		ttm = *ctm;
+		fz_pre_translate(&ttm, x * xstep, y0 * ystep);
+		if ((int)ttm.e != tile->x + x * sx)
+			return 0;
+	}
+	for (y = y0; y < y1; y++)
+	{
+		ttm = *ctm;
+		fz_pre_translate(&ttm, x0 * xstep, y * ystep);
+		if ((int)ttm.f != tile->y + y * sy)
+			return 0;
+	}
+
+	/* Set the grid running left to right and top to bottom. */
+	ox = tile->x + (sx < 0 ? (x1 - 1) : x0) * sx;
+	oy = tile->y + (sy < 0 ? (y1 - 1) : y0) * sy;
+	sx = abs(sx);
+	sy = abs(sy);
+	if (sx < tile->w || sy < tile->h)
+		return 0;
+
+	/* Sparse tiles are cheaper to paint one by one. */
+	if (tile->w * tile->h * 4 < sx * sy)
+		return 0;
+
+	area.x0 = ox;
+	area.y0 = oy;
+	area.x1 = ox + (x1 - x0 - 1) * sx + tile->w;
+	area.y1 = oy + (y1 - y0 - 1) * sy + tile->h;
+	fz_intersect_irect(&area, &state[0].scissor);
+	fz_intersect_irect(&area, fz_pixmap_bbox(ctx, state[0].dest, &bbox));
+	if (fz_is_empty_irect(&area))
+		return 1;
+
+	fz_var(dest);
+	fz_var(shape);
+
+	fz_try(ctx)
+	{
+		dest = fz_replicate_tile(ctx, dev, tile, &area, ox, oy, sx, sy);
+		if (state[1].shape)
+			shape = fz_replicate_tile(ctx, dev, state[1].shape, &area, ox, oy, sx, sy);
+	}
+	fz_catch(ctx)
+	{
+		fz_draw_drop_pixmap(ctx, dev, dest);
+		return 0;
+	}
+
+	fz_paint_pixmap_with_bbox(state[0].dest, dest, 255, state[0].scissor);
+	if (shape && state[0].shape)
+		fz_paint_pixmap_with_bbox(state[0].shape, shape, 255, state[0].scissor);
+	fz_draw_drop_pixmap(ctx, dev, dest);
+	fz_draw_drop_pixmap(ctx, dev, shape);
+	return 1;
+}
+
 static void
 fz_draw_end_tile(fz_context *ctx, fz_device *devp)
 {
@@ -1913,26 +2561,29 @@ fz_draw_end_tile(fz_context *ctx, fz_device *devp)
 		fz_dump_blend(ctx, state[0].shape, "/");
 #endif
 
-	for (y = y0; y < y1; y++)
+	if (!fz_draw_paint_tiles(ctx, dev, state, &ctm, xstep, ystep, x0, y0, x1, y1))
 	{
-		for (x = x0; x < x1; x++)
+		for (y = y0; y < y1; y++)
 		{
-			ttm = ctm;
-			fz_pre_translate(&ttm, x * xstep, y * ystep);
-			state[1].dest->x = ttm.e;
-			state[1].dest->y = ttm.f;
-			if (state[1].dest->x > 0 && state[1].dest->x + state[1].dest->w < 0)
-				continue;
-			if (state[1].dest->y > 0 && state[1].dest->y + state[1].dest->h < 0)
-				continue;
-			fz_paint_pixmap_with_bbox(state[0].dest, state[1].dest, 255, state[0].scissor);
-			if (state[1].shape)
+			for (x = x0; x < x1; x++)
 			{
-				ttm = shapectm;
+				ttm = ctm;
 				fz_pre_translate(&ttm, x * xstep, y * ystep);
-				state[1].shape->x = ttm.e;
-				state[1].shape->y = ttm.f;
-				fz_paint_pixmap_with_bbox(state[0].shape, state[1].shape, 255, state[0].scissor);
+				state[1].dest->x = ttm.e;
+				state[1].dest->y = ttm.f;
+				if (state[1].dest->x > 0 && state[1].dest->x + state[1].dest->w < 0)
+					continue;
+				if (state[1].dest->y > 0 && state[1].dest->y + state[1].dest->h < 0)
+					continue;
+				fz_paint_pixmap_with_bbox(state[0].dest, state[1].dest, 255, state[0].scissor);
+				if (state[1].shape)
+				{
+					ttm = shapectm;
+					fz_pre_translate(&ttm, x * xstep, y * ystep);
+					state[1].shape->x = ttm.e;
+					state[1].shape->y = ttm.f;
+					fz_paint_pixmap_with_bbox(state[0].shape, state[1].shape, 255, state[0].scissor);
+				}
 			}
 		}
 	}
@@ -2016,11 +2667,11 @@ fz_draw_drop_imp(fz_context *ctx, fz_device *devp)
 	{
 		fz_draw_state *state = &dev->stack[dev->top];
 		if (state[1].mask != state[0].mask)
-			fz_drop_pixmap(ctx, state[1].mask);
+			fz_draw_drop_pixmap(ctx, dev, state[1].mask);
 		if (state[1].dest != state[0].dest)
-			fz_drop_pixmap(ctx, state[1].dest);
+			fz_draw_drop_pixmap(ctx, dev, state[1].dest);
 		if (state[1].shape != state[0].shape)
-			fz_drop_pixmap(ctx, state[1].shape);
+			fz_draw_drop_pixmap(ctx, dev, state[1].shape);
 	}
 	/* We never free the dest/mask/shape at level 0, as:
 	 * 1) dest is passed in and ownership remains with the caller.
@@ -2028,6 +2679,7 @@ fz_draw_drop_imp(fz_context *ctx, fz_device *devp)
 	 */
 	if (dev->stack != &dev->init_stack[0])
 		fz_free(ctx, dev->stack);
+	fz_draw_drop_pool(ctx, dev);
 	fz_drop_scale_cache(ctx, dev->cache_x);
 	fz_drop_scale_cache(ctx, dev->cache_y);
 	fz_drop_gel(ctx, gel);
@@ -2088,6 +2740,7 @@ fz_new_draw_device(fz_context *ctx, fz_pixmap *dest)
 	dev->stack[0].scissor.y0 = dest->y;
 	dev->stack[0].scissor.x1 = dest->x + dest->w;
 	dev->stack[0].scissor.y1 = dest->y + dest->h;
+	dev->stack[0].clip = dev->stack[0].scissor;
 
 	fz_try(ctx)
 	{
@@ -2117,6 +2770,17 @@ fz_new_draw_device_with_bbox(fz_context *ctx, fz_pixmap *dest, const fz_irect *c
 		dev->stack[0].scissor.y0 = clip->y0;
 	if (clip->y1 < dev->stack[0].scissor.y1)
 		dev->stack[0].scissor.y1 = clip->y1;
+	dev->stack[0].clip = dev->stack[0].scissor;
+
+	return (fz_device*)dev;
+}
+
+fz_device *
+fz_new_draw_device_for_band(fz_context *ctx, fz_pixmap *dest, const fz_irect *area)
+{
+	fz_draw_device *dev = (fz_draw_device*)fz_new_draw_device(ctx, dest);
+
+	dev->stack[0].clip = *area;
 
 	return (fz_device*)dev;
 }
@@ -2129,6 +2793,21 @@ fz_new_draw_device_type3(fz_context *ctx, fz_pixmap *dest)
 	return (fz_device*)dev;
 }
 
+void
+fz_draw_device_pool_stats(fz_context *ctx, fz_device *devp, int *hits, int *misses, size_t *peak)
+{
+	fz_draw_pool_use *pool = NULL;
+
+	if (devp && devp->drop_imp == fz_draw_drop_imp)
+		pool = &((fz_draw_device *)devp)->pool;
+	if (hits)
+		*hits = pool ? pool->hits : 0;
+	if (misses)
+		*misses = pool ? pool->misses : 0;
+	if (peak)
+		*peak = pool ? pool->peak : 0;
+}
+
 fz_irect *
 fz_bound_path_accurate(fz_context *ctx, fz_irect *bbox, const fz_irect *scissor, fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, float flatness, float linewidth)
 {
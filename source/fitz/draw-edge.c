@@ -22,12 +22,14 @@ struct fz_aa_context_s
 	int vscale;
 	int scale;
 	int bits;
+	int rasterizer;
 };
 
 void fz_new_aa_context(fz_context *ctx)
 {
-#ifndef AA_BITS
 	ctx->aa = fz_malloc_struct(ctx, fz_aa_context);
+	ctx->aa->rasterizer = FZ_RASTERIZER_EDGES;
+#ifndef AA_BITS
 	ctx->aa->hscale = 17;
 	ctx->aa->vscale = 15;
 	ctx->aa->scale = 256;
@@ -50,10 +52,8 @@ void fz_copy_aa_context(fz_context *dst, fz_context *src)
 
 void fz_drop_aa_context(fz_context *ctx)
 {
-#ifndef AA_BITS
 	fz_free(ctx, ctx->aa);
 	ctx->aa = NULL;
-#endif
 }
 
 #ifdef AA_BITS
@@ -139,6 +139,21 @@ fz_set_aa_level(fz_context *ctx, int level)
 #endif
 }
 
+int
+fz_aa_rasterizer(fz_context *ctx)
+{
+	return ctx->aa->rasterizer;
+}
+
+void
+fz_set_aa_rasterizer(fz_context *ctx, int rasterizer)
+{
+	if (rasterizer == FZ_RASTERIZER_CELLS)
+		ctx->aa->rasterizer = FZ_RASTERIZER_CELLS;
+	else
+		ctx->aa->rasterizer = FZ_RASTERIZER_EDGES;
+}
+
 /*
  * Global Edge List -- list of straight path segments for scan conversion
  *
@@ -165,6 +180,8 @@ struct fz_gel_s
 	fz_edge *edges;
 	int acap, alen;
 	fz_edge **active;
+	int ccap;
+	float *cells;
 };
 
 #ifdef DUMP_GELS
@@ -248,6 +265,7 @@ fz_drop_gel(fz_context *ctx, fz_gel *gel)
 {
 	if (gel == NULL)
 		return;
+	fz_free(ctx, gel->cells);
 	fz_free(ctx, gel->active);
 	fz_free(ctx, gel->edges);
 	fz_free(ctx, gel);
@@ -672,6 +690,53 @@ advance_active(fz_context *ctx, fz_gel *gel, int inc)
 	}
 }
 
+/* Step an edge on by k scanlines, exactly as k calls to advance_active
+ * would, but without looping. */
+static void
+skip_edge(fz_edge *edge, int k)
+{
+	int64_t e = edge->e + (int64_t)k * edge->adj_up;
+	int carry = 0;
+
+	if (e > 0)
+	{
+		carry = (int)((e + edge->adj_down - 1) / edge->adj_down);
+		e -= (int64_t)carry * edge->adj_down;
+	}
+	edge->x += k * edge->xmove + carry * edge->xdir;
+	edge->e = (int)e;
+	edge->y += k;
+	edge->h -= k;
+}
+
+/* Step the edge list on to scanline y without sweeping the scanlines
+ * above it: edges that end by then are dropped, and those that cross
+ * it are made active and stepped on to it exactly. Edges are left as
+ * a sweep down to y would leave them, so whatever part of a gel is
+ * drawn, every scanline comes out the same. */
+static void
+skip_active(fz_context *ctx, fz_gel *gel, int y, int *e_)
+{
+	fz_edge *edge;
+	int e = *e_;
+
+	while (e < gel->len && gel->edges[e].y < y)
+	{
+		edge = &gel->edges[e++];
+		if (edge->y + edge->h <= y)
+			continue;
+		if (gel->alen + 1 == gel->acap) {
+			int newcap = gel->acap + 64;
+			fz_edge **newactive = fz_resize_array(ctx, gel->active, newcap, sizeof(fz_edge*));
+			gel->active = newactive;
+			gel->acap = newcap;
+		}
+		skip_edge(edge, y - edge->y);
+		gel->active[gel->alen++] = edge;
+	}
+	*e_ = e;
+}
+
 /*
  * Anti-aliased scan conversion.
  */
@@ -765,9 +830,9 @@ blit_aa(fz_pixmap *dst, int x, int y, unsigned char *mp, int w, unsigned char *c
 	unsigned char *dp;
 	dp = dst->samples + (unsigned int)(( (y - dst->y) * dst->w + (x - dst->x) ) * dst->n);
 	if (color)
-		fz_paint_span_with_color(dp, mp, dst->n, w, color);
+		fz_paint_span_with_color(dp, mp, dst->n, w, color, dst->alpha);
 	else
-		fz_paint_span(dp, mp, 1, w, 255);
+		fz_paint_span(dp, 1, mp, 1, w, 255);
 }
 
 static void
@@ -821,41 +886,12 @@ fz_scan_convert_aa(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *cli
 	y = gel->edges[0].y;
 	yd = fz_idiv(y, fz_aa_vscale);
 
-	/* Quickly skip to the start of the clip region */
-	while (yd < clip->y0 && (gel->alen > 0 || e < gel->len))
+	/* Skip to the start of the clip region */
+	if (y < clip->y0 * fz_aa_vscale)
 	{
-		/* rh = remaining height = number of subscanlines left to be
-		 * inserted into the current scanline, which will be plotted
-		 * at yd. */
-		rh = (yd+1)*fz_aa_vscale - y;
-
-		/* height = The number of subscanlines with identical edge
-		 * positions (i.e. 1 if we have any non vertical edges). */
-		height = insert_active(ctx, gel, y, &e);
-		h0 = height;
-		if (h0 >= rh)
-		{
-			/* We have enough subscanlines to skip to the next
-			 * scanline. */
-			h0 -= rh;
-			yd++;
-		}
-		/* Skip any whole scanlines we can */
-		while (yd < clip->y0 && h0 >= fz_aa_vscale)
-		{
-			h0 -= fz_aa_vscale;
-			yd++;
-		}
-		/* If we haven't hit the start of the clip region, then we
-		 * have less than a scanline left. */
-		if (yd < clip->y0)
-		{
-			h0 = 0;
-		}
-		height -= h0;
-		advance_active(ctx, gel, height);
-
-		y += height;
+		y = clip->y0 * fz_aa_vscale;
+		yd = clip->y0;
+		skip_active(ctx, gel, y, &e);
 	}
 
 	/* Now do the active lines */
@@ -949,6 +985,235 @@ clip_ended:
 	fz_free(ctx, alphas);
 }
 
+/*
+ * Cell based anti-aliased scan conversion.
+ *
+ * Rather than sweeping the active edge list once per sub-scanline, we
+ * walk each edge once per pixel row it crosses, and accumulate in each
+ * pixel (cell) it passes through the signed change in coverage that it
+ * makes to that cell and the next, from the area of the cell to the
+ * right of the edge. Summing along a row gives the winding number of
+ * each cell, weighted by area, to which the fill rule is applied.
+ *
+ * The edges are rebuilt from the same sub-pixel end points that the
+ * edge list uses, so describe the same shape; the coverage is the exact
+ * area rather than a count of sample points, rounded to the same number
+ * of levels. As the fill rule is applied to the area weighted winding
+ * of a whole cell, where edges of a self-intersecting path cross within
+ * a cell the cell may be filled more or less than the sampled coverage.
+ * To bound the memory used, the clip region is converted in bands of
+ * rows holding at most CELL_MAX cells (or a single row).
+ */
+
+#define CELL_MAX 65536
+
+/* Accumulate the part of an edge within a row, from xa to xb, covering
+ * d of the height of the row (negated for upwards edges). */
+static inline void
+cell_span(float *row, int *span, float xa, float xb, float d)
+{
+	float x0 = fz_min(xa, xb);
+	float x1 = fz_max(xa, xb);
+	float x0f = floorf(x0);
+	float x1c = ceilf(x1);
+	int x0i = (int)x0f;
+	int x1i = (int)x1c;
+	int i;
+
+	if (x1i <= x0i + 1)
+	{
+		/* Within a single cell */
+		float xm = 0.5f * (xa + xb) - x0f;
+		row[x0i] += d - d * xm;
+		row[x0i + 1] += d * xm;
+		x1i = x0i + 1;
+	}
+	else
+	{
+		float s = 1 / (x1 - x0);
+		float f0 = x0 - x0f;
+		float f1 = x1 - x1c + 1;
+		float a0 = 0.5f * s * (1 - f0) * (1 - f0);
+		float am = 0.5f * s * f1 * f1;
+
+		row[x0i] += d * a0;
+		if (x1i == x0i + 2)
+			row[x0i + 1] += d * (1 - a0 - am);
+		else
+		{
+			float a1 = s * (1.5f - f0);
+			float a2 = a1 + (x1i - x0i - 3) * s;
+			row[x0i + 1] += d * (a1 - a0);
+			for (i = x0i + 2; i < x1i - 1; i++)
+				row[i] += d * s;
+			row[x1i - 1] += d * (1 - a2 - am);
+		}
+		row[x1i] += d * am;
+	}
+
+	if (x0i < span[0])
+		span[0] = x0i;
+	if (x1i > span[1])
+		span[1] = x1i;
+}
+
+/* Accumulate the part of an edge within the rows t to b. */
+static void
+cell_edge(fz_aa_context *ctxaa, fz_edge *edge, float *cells, int *spans, int stride, int xofs, int t, int b)
+{
+	float hs = fz_aa_hscale;
+	float vs = fz_aa_vscale;
+	int width = fz_absi(edge->xmove) * edge->h + edge->adj_up;
+	float x0 = edge->x / hs - xofs;
+	float x1 = (edge->x + edge->xdir * width) / hs - xofs;
+	float y0 = edge->y / vs;
+	float y1 = (edge->y + edge->h) / vs;
+	float lo = fz_min(x0, x1);
+	float hi = fz_max(x0, x1);
+	float dxdy = (x1 - x0) / (y1 - y0);
+	int y = fz_maxi(t, (int)floorf(y0));
+	int yend = fz_mini(b, (int)ceilf(y1));
+
+	for (; y < yend; y++)
+	{
+		float ya = fz_max(y, y0);
+		float yb = fz_min(y + 1, y1);
+		float xa, xb;
+		if (ya >= yb)
+			continue;
+		xa = fz_clamp(x0 + (ya - y0) * dxdy, lo, hi);
+		xb = fz_clamp(x0 + (yb - y0) * dxdy, lo, hi);
+		cell_span(cells + (y - t) * stride, spans + (y - t) * 2, xa, xb, (yb - ya) * edge->ydir);
+	}
+}
+
+/* Sum the cells of a row into coverage, applying the fill rule to each,
+ * and clear them for the next band. */
+static void
+sweep_cells(fz_aa_context *ctxaa, float *row, unsigned char *alphas, int lo, int hi, int eofill)
+{
+	float levels = fz_aa_hscale * fz_aa_vscale;
+	float c = 0;
+	float v;
+	int x;
+
+	for (x = lo; x <= hi; x++)
+	{
+		c += row[x];
+		row[x] = 0;
+		v = fabsf(c);
+		if (eofill)
+		{
+			v -= 2 * floorf(v * 0.5f);
+			if (v > 1)
+				v = 2 - v;
+		}
+		else if (v > 1)
+			v = 1;
+		alphas[x] = AA_SCALE((int)(v * levels + 0.5f));
+	}
+}
+
+static void
+fz_scan_convert_cells(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *clip, fz_pixmap *dst, unsigned char *color)
+{
+	fz_aa_context *ctxaa = ctx->aa;
+	int xmin = fz_idiv(gel->bbox.x0, fz_aa_hscale);
+	int xmax = fz_idiv(gel->bbox.x1, fz_aa_hscale) + 1;
+	int stride = xmax - xmin + 2;
+	int skipx = clip->x0 - xmin;
+	int clipn = clip->x1 - clip->x0;
+	int r0 = fz_maxi(clip->y0, fz_idiv(gel->bbox.y0, fz_aa_vscale));
+	int r1 = fz_mini(clip->y1, fz_idiv(gel->bbox.y1, fz_aa_vscale) + 1);
+	unsigned char *alphas = NULL;
+	int *spans = NULL;
+	int band, e, i, n, t, b, y, lo, hi;
+
+	if (gel->len == 0 || r0 >= r1)
+		return;
+
+	assert(clip->x0 >= xmin);
+	assert(clip->x1 <= xmax);
+
+	band = fz_clampi(CELL_MAX / stride, 1, r1 - r0);
+
+	fz_var(alphas);
+	fz_var(spans);
+
+	fz_try(ctx)
+	{
+		if (band * stride > gel->ccap)
+		{
+			fz_free(ctx, gel->cells);
+			gel->cells = NULL;
+			gel->ccap = 0;
+			gel->cells = fz_calloc(ctx, band * stride, sizeof(float));
+			gel->ccap = band * stride;
+		}
+		alphas = fz_malloc(ctx, stride);
+		spans = fz_malloc_array(ctx, band * 2, sizeof(int));
+
+		gel->alen = 0;
+		e = 0;
+		for (t = r0; t < r1; t = b)
+		{
+			b = fz_mini(t + band, r1);
+			for (y = 0; y < b - t; y++)
+			{
+				spans[y * 2] = INT_MAX;
+				spans[y * 2 + 1] = INT_MIN;
+			}
+
+			/* Activate the edges that start above the bottom of
+			 * the band, and retire those that end above its top */
+			while (e < gel->len && gel->edges[e].y < b * fz_aa_vscale)
+			{
+				if (gel->alen + 1 == gel->acap)
+				{
+					int newcap = gel->acap + 64;
+					gel->active = fz_resize_array(ctx, gel->active, newcap, sizeof(fz_edge*));
+					gel->acap = newcap;
+				}
+				gel->active[gel->alen++] = &gel->edges[e++];
+			}
+			for (i = 0, n = 0; i < gel->alen; i++)
+			{
+				fz_edge *edge = gel->active[i];
+				if (edge->y + edge->h <= t * fz_aa_vscale)
+					continue;
+				gel->active[n++] = edge;
+				cell_edge(ctxaa, edge, gel->cells, spans, stride, xmin, t, b);
+			}
+			gel->alen = n;
+
+			for (y = t; y < b; y++)
+			{
+				float *row = gel->cells + (y - t) * stride;
+				lo = spans[(y - t) * 2];
+				hi = spans[(y - t) * 2 + 1];
+				if (lo > hi)
+					continue;
+				sweep_cells(ctxaa, row, alphas, lo, hi, eofill);
+
+				/* Only the covered part of the row needs painting */
+				lo = fz_maxi(lo, skipx);
+				hi = fz_mini(hi + 1, skipx + clipn);
+				if (lo < hi)
+					blit_aa(dst, xmin + lo, y, alphas + lo, hi - lo, color);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, spans);
+		fz_free(ctx, alphas);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 /*
  * Sharp (not anti-aliased) scan conversion
  */
@@ -963,7 +1228,7 @@ blit_sharp(int x0, int x1, int y, const fz_irect *clip, fz_pixmap *dst, unsigned
 	{
 		dp = dst->samples + (unsigned int)(( (y - dst->y) * dst->w + (x0 - dst->x) ) * dst->n);
 		if (color)
-			fz_paint_solid_color(dp, dst->n, x1 - x0, color);
+			fz_paint_solid_color(dp, dst->n, x1 - x0, color, dst->alpha);
 		else
 			fz_paint_solid_alpha(dp, x1 - x0, 255);
 	}
@@ -1015,16 +1280,8 @@ fz_scan_convert_sharp(fz_context *ctx,
 	/* Skip any lines before the clip region */
 	if (y < clip->y0)
 	{
-		while (gel->alen > 0 || e < gel->len)
-		{
-			height = insert_active(ctx, gel, y, &e);
-			y += height;
-			if (y >= clip->y0)
-			{
-				y = clip->y0;
-				break;
-			}
-		}
+		y = clip->y0;
+		skip_active(ctx, gel, y, &e);
 	}
 
 	/* Now process as lines within the clip region */
@@ -1067,7 +1324,12 @@ fz_scan_convert(fz_context *ctx, fz_gel *gel, int eofill, const fz_irect *clip,
 		return;
 
 	if (fz_aa_bits > 0)
-		fz_scan_convert_aa(ctx, gel, eofill, &local_clip, dst, color);
+	{
+		if (ctxaa->rasterizer == FZ_RASTERIZER_CELLS)
+			fz_scan_convert_cells(ctx, gel, eofill, &local_clip, dst, color);
+		else
+			fz_scan_convert_aa(ctx, gel, eofill, &local_clip, dst, color);
+	}
 	else
 		fz_scan_convert_sharp(ctx, gel, eofill, &local_clip, dst, color);
 }
@@ -2,11 +2,12 @@
 #include "draw-imp.h"
 
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
+#define DEFAULT_CACHE_SIZE (1024*1024)
 
-#define GLYPH_HASH_LEN 509
+#define INITIAL_HASH_LEN 64 /* per shard; must be a power of 2 */
 
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
+typedef struct fz_glyph_cache_shard_s fz_glyph_cache_shard;
 typedef struct fz_glyph_key_s fz_glyph_key;
 
 struct fz_glyph_key_s
@@ -30,104 +31,197 @@ struct fz_glyph_cache_entry_s
 	fz_glyph *val;
 };
 
-struct fz_glyph_cache_s
+/*
+	The cache is split into FZ_GLYPH_CACHE_SHARDS independent shards,
+	chosen by the hash of the key. Each has its own lock
+	(FZ_LOCK_GLYPHCACHE + shard number), hash table, LRU chain and an
+	equal part of the budget, so that threads rendering different
+	glyphs rarely wait for each other. We never hold more than one
+	shard lock at a time.
+*/
+struct fz_glyph_cache_shard_s
 {
-	int refs;
-	int total;
-#ifndef NDEBUG
-	int num_evictions;
-	int evicted;
-#endif
-	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	unsigned int total;
+	int count;
+	int len;
+	fz_glyph_cache_entry **entry;
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
+	int hits;
+	int misses;
+	int num_evictions;
+	int evicted;
+};
+
+struct fz_glyph_cache_s
+{
+	int refs;
+	unsigned int budget;
+	fz_glyph_cache_shard shard[FZ_GLYPH_CACHE_SHARDS];
 };
 
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
+	fz_try(ctx)
+	{
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+		{
+			cache->shard[i].len = INITIAL_HASH_LEN;
+			cache->shard[i].entry = fz_calloc(ctx, INITIAL_HASH_LEN, sizeof(fz_glyph_cache_entry *));
+		}
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+			fz_free(ctx, cache->shard[i].entry);
+		fz_free(ctx, cache);
+		fz_rethrow(ctx);
+	}
+	cache->budget = DEFAULT_CACHE_SIZE;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	if (entry->lru_prev)
 		entry->lru_prev->lru_next = entry->lru_next;
 	else
-		cache->lru_head = entry->lru_next;
-	cache->total -= fz_glyph_size(ctx, entry->val);
+		shard->lru_head = entry->lru_next;
+	shard->total -= fz_glyph_size(ctx, entry->val);
+	shard->count--;
 	if (entry->bucket_next)
 		entry->bucket_next->bucket_prev = entry->bucket_prev;
 	if (entry->bucket_prev)
 		entry->bucket_prev->bucket_next = entry->bucket_next;
 	else
-		cache->entry[entry->hash] = entry->bucket_next;
+		shard->entry[entry->hash & (shard->len - 1)] = entry->bucket_next;
 	fz_drop_font(ctx, entry->key.font);
 	fz_drop_glyph(ctx, entry->val);
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard lock is always held when these functions are called. */
 static void
-do_purge(fz_context *ctx)
+do_purge(fz_context *ctx, fz_glyph_cache_shard *shard)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
+	while (shard->lru_head)
+		drop_glyph_cache_entry(ctx, shard, shard->lru_head);
+}
+
+static void
+do_evict(fz_context *ctx, fz_glyph_cache_shard *shard, unsigned int budget)
+{
+	while (shard->total > budget && shard->lru_tail)
+	{
+		shard->num_evictions++;
+		shard->evicted += fz_glyph_size(ctx, shard->lru_tail->val);
+		drop_glyph_cache_entry(ctx, shard, shard->lru_tail);
+	}
+}
+
+/* Double the number of buckets. If we can't get the memory, we simply
+ * carry on with longer chains. */
+static void
+grow_hash(fz_context *ctx, fz_glyph_cache_shard *shard)
+{
+	fz_glyph_cache_entry **entry;
+	fz_glyph_cache_entry *e;
+	int len = shard->len * 2;
 	int i;
 
-	for (i = 0; i < GLYPH_HASH_LEN; i++)
+	entry = fz_calloc_no_throw(ctx, len, sizeof(*entry));
+	if (entry == NULL)
+		return;
+
+	for (i = 0; i < shard->len; i++)
 	{
-		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+		while ((e = shard->entry[i]) != NULL)
+		{
+			unsigned h = e->hash & (len - 1);
+			shard->entry[i] = e->bucket_next;
+			e->bucket_prev = NULL;
+			e->bucket_next = entry[h];
+			if (e->bucket_next)
+				e->bucket_next->bucket_prev = e;
+			entry[h] = e;
+		}
 	}
 
-	cache->total = 0;
+	fz_free(ctx, shard->entry);
+	shard->entry = entry;
+	shard->len = len;
 }
 
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		do_purge(ctx, &cache->shard[i]);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
+}
+
+void
+fz_set_glyph_cache_budget(fz_context *ctx, unsigned int budget)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	if (!cache)
+		return;
+
+	cache->budget = budget;
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		do_evict(ctx, &cache->shard[i], budget / FZ_GLYPH_CACHE_SHARDS);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
-	if (!ctx->glyph_cache)
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	if (!cache)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	if (fz_drop_imp(ctx, cache, &cache->refs))
 	{
-		do_purge(ctx);
-		fz_free(ctx, ctx->glyph_cache);
+		/* Nobody else can see the cache any more */
+		for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+		{
+			do_purge(ctx, &cache->shard[i]);
+			fz_free(ctx, cache->shard[i].entry);
+		}
+		fz_free(ctx, cache);
 		ctx->glyph_cache = NULL;
 	}
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
 fz_glyph_cache *
 fz_keep_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs++;
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-	return ctx->glyph_cache;
+	return fz_keep_imp(ctx, ctx->glyph_cache, &ctx->glyph_cache->refs);
 }
 
 float
@@ -221,7 +315,7 @@ static unsigned do_hash(unsigned char *s, int len)
 }
 
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *shard, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -231,19 +325,33 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
-		cache->lru_tail = entry->lru_prev;
+		shard->lru_tail = entry->lru_prev;
 	/* Relink */
-	entry->lru_next = cache->lru_head;
+	entry->lru_next = shard->lru_head;
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry;
-	cache->lru_head = entry;
+	shard->lru_head = entry;
 	entry->lru_prev = NULL;
 }
 
+static fz_glyph_cache_entry *
+find_entry(fz_glyph_cache_shard *shard, fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_cache_entry *entry = shard->entry[hash & (shard->len - 1)];
+	while (entry)
+	{
+		if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+			break;
+		entry = entry->bucket_next;
+	}
+	return entry;
+}
+
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor)
 {
-	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *shard;
+	int lock;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
@@ -276,8 +384,6 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		do_cache = 0;
 	}
 
-	cache = ctx->glyph_cache;
-
 	key.font = font;
 	key.gid = gid;
 	key.a = subpix_ctm.a * 65536;
@@ -286,20 +392,22 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = fz_aa_level(ctx);
 
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	entry = cache->entry[hash];
-	while (entry)
+	hash = do_hash((unsigned char *)&key, sizeof(key));
+	lock = (hash >> 16) % FZ_GLYPH_CACHE_SHARDS;
+	shard = &ctx->glyph_cache->shard[lock];
+	lock += FZ_LOCK_GLYPHCACHE;
+
+	fz_lock(ctx, lock);
+	entry = find_entry(shard, &key, hash);
+	if (entry)
 	{
-		if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-		{
-			move_to_front(cache, entry);
-			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			return val;
-		}
-		entry = entry->bucket_next;
+		shard->hits++;
+		move_to_front(shard, entry);
+		val = fz_keep_glyph(ctx, entry->val);
+		fz_unlock(ctx, lock);
+		return val;
 	}
+	shard->misses++;
 
 	locked = 1;
 	caching = 0;
@@ -322,10 +430,10 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 			 * we insert ours to find one already there, we
 			 * abandon ours, and use the one there already.
 			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 			locked = 0;
 			val = fz_render_t3_glyph(ctx, font, gid, &subpix_ctm, model, scissor);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_lock(ctx, lock);
 			locked = 1;
 		}
 		else
@@ -343,46 +451,39 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				{
 					/* We had to unlock. Someone else might
 					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
+					entry = find_entry(shard, &key, hash);
+					if (entry)
 					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
+						fz_drop_glyph(ctx, val);
+						move_to_front(shard, entry);
+						val = fz_keep_glyph(ctx, entry->val);
+						goto unlock_and_return_val;
 					}
 				}
 
+				if (shard->count >= shard->len)
+					grow_hash(ctx, shard);
+
 				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 				entry->key = key;
 				entry->hash = hash;
-				entry->bucket_next = cache->entry[hash];
+				entry->bucket_next = shard->entry[hash & (shard->len - 1)];
 				if (entry->bucket_next)
 					entry->bucket_next->bucket_prev = entry;
-				cache->entry[hash] = entry;
+				shard->entry[hash & (shard->len - 1)] = entry;
 				entry->val = fz_keep_glyph(ctx, val);
 				fz_keep_font(ctx, key.font);
 
-				entry->lru_next = cache->lru_head;
+				entry->lru_next = shard->lru_head;
 				if (entry->lru_next)
 					entry->lru_next->lru_prev = entry;
 				else
-					cache->lru_tail = entry;
-				cache->lru_head = entry;
+					shard->lru_tail = entry;
+				shard->lru_head = entry;
 
-				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+				shard->total += fz_glyph_size(ctx, val);
+				shard->count++;
+				do_evict(ctx, shard, ctx->glyph_cache->budget / FZ_GLYPH_CACHE_SHARDS);
 
 			}
 		}
@@ -393,7 +494,7 @@ unlock_and_return_val:
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 	}
 	fz_catch(ctx)
 	{
@@ -452,9 +553,25 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_shard total = { 0 };
+	int i;
+
+	for (i = 0; i < FZ_GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &cache->shard[i];
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		total.total += shard->total;
+		total.count += shard->count;
+		total.len += shard->len;
+		total.hits += shard->hits;
+		total.misses += shard->misses;
+		total.num_evictions += shard->num_evictions;
+		total.evicted += shard->evicted;
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
 
-	printf("Glyph Cache Size: %d\n", cache->total);
-#ifndef NDEBUG
-	printf("Glyph Cache Evictions: %d (%d bytes)\n", cache->num_evictions, cache->evicted);
-#endif
+	printf("Glyph Cache Size: %u (budget %u)\n", total.total, cache->budget);
+	printf("Glyph Cache Entries: %d (%d buckets in %d shards)\n", total.count, total.len, FZ_GLYPH_CACHE_SHARDS);
+	printf("Glyph Cache Hits: %d Misses: %d\n", total.hits, total.misses);
+	printf("Glyph Cache Evictions: %d (%d bytes)\n", total.num_evictions, total.evicted);
 }
@@ -25,18 +25,137 @@ void fz_flatten_dash_path(fz_context *ctx, fz_gel *gel, fz_path *path, const fz_
 
 fz_irect *fz_bound_path_accurate(fz_context *ctx, fz_irect *bbox, const fz_irect *scissor, fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, float flatness, float linewidth);
 
+/*
+ * SIMD support.
+ *
+ * On x86-64 SSE2 is always available, and AVX2 code is compiled in
+ * where the compiler can target it, to be used if fz_simd_level says
+ * the processor supports it. Define FZ_NO_SIMD to use only the scalar
+ * code, or FZ_DEBUG_SIMD to check each SIMD call against it.
+ * FZ_FORCE_INLINE marks the kernels that must be specialised for the
+ * constant arguments of each of their callers to run fast.
+ */
+
+#if !defined(FZ_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define FZ_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#define FZ_FORCE_INLINE __forceinline
+#else
+#define FZ_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define FZ_AVX2
+#define FZ_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && _MSC_VER >= 1800
+#define FZ_AVX2
+#define FZ_TARGET_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+enum
+{
+	FZ_SIMD_NONE,
+	FZ_SIMD_SSE2,
+	FZ_SIMD_AVX2
+};
+
+int fz_simd_level(void);
+
+#ifdef FZ_SSE2
+/*
+	Load 2 pixels of 3 components into the 16 bit lanes of a register,
+	laid out as 4 component pixels with zero in the fourth lanes, and
+	store them back again. This lets the 4 component SIMD code work on
+	destinations without alpha. The 6 bytes are moved as a 4 and a 2
+	byte word, as smaller accesses through memory stall the loads.
+*/
+static inline __m128i
+sse2_load_rgb2(const unsigned char *p)
+{
+	const __m128i lo = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+	const __m128i hi = _mm_setr_epi16(0, 0, 0, 0, -1, -1, -1, 0);
+	unsigned int a;
+	unsigned short b;
+	__m128i x;
+	memcpy(&a, p, 4);
+	memcpy(&b, p + 4, 2);
+	x = _mm_cvtsi64_si128((long long)a | ((long long)b << 32));
+	x = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+	return _mm_or_si128(_mm_and_si128(x, lo), _mm_and_si128(_mm_slli_si128(x, 2), hi));
+}
+
+static inline void
+sse2_store_rgb2(unsigned char *p, __m128i x)
+{
+	const __m128i lo = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+	const __m128i hi = _mm_setr_epi16(0, 0, 0, -1, -1, -1, 0, 0);
+	long long r;
+	unsigned int a;
+	unsigned short b;
+	x = _mm_or_si128(_mm_and_si128(x, lo), _mm_and_si128(_mm_srli_si128(x, 2), hi));
+	r = _mm_cvtsi128_si64(_mm_packus_epi16(x, x));
+	a = (unsigned int)r;
+	b = (unsigned short)(r >> 32);
+	memcpy(p, &a, 4);
+	memcpy(p + 4, &b, 2);
+}
+#endif
+
+/*
+	With FZ_DEBUG_SIMD, FZ_SIMD_CALL checks a SIMD call against the
+	scalar code, by running SCALAR on a copy of the LEN bytes at DP
+	first. SCALAR must write through the variable DP.
+*/
+#ifdef FZ_DEBUG_SIMD
+#define FZ_SIMD_CALL(NAME, DP, LEN, CALL, SCALAR) \
+	do { \
+		unsigned char *dp0 = DP; \
+		unsigned char *ref = malloc(LEN); \
+		if (ref) \
+		{ \
+			memcpy(ref, DP, LEN); \
+			DP = ref; \
+			SCALAR; \
+			DP = dp0; \
+		} \
+		CALL; \
+		if (ref && memcmp(ref, DP, LEN)) \
+			fprintf(stderr, "error: %s differs from scalar code\n", NAME); \
+		free(ref); \
+	} while (0)
+#else
+#define FZ_SIMD_CALL(NAME, DP, LEN, CALL, SCALAR) CALL
+#endif
+
 /*
  * Plotting functions.
+ *
+ * da says whether the destination has an alpha component. For the
+ * color painters n is the number of destination components, and the
+ * color has the alpha to paint with after its n - da color components.
+ * For fz_paint_span n is the number of source components, which
+ * always include alpha.
  */
 
 void fz_paint_solid_alpha(unsigned char * restrict dp, int w, int alpha);
-void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color);
+void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color, int da);
 
-void fz_paint_span(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w, int alpha);
-void fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restrict mp, int n, int w, unsigned char *color);
+void fz_paint_span(unsigned char * restrict dp, int da, unsigned char * restrict sp, int n, int w, int alpha);
+void fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restrict mp, int n, int w, unsigned char *color, int da);
+
+/*
+	Painters without a destination alpha variant run on a copy of
+	the destination span with an opaque alpha added, which is then
+	copied back. n is the number of components without alpha.
+*/
+void fz_add_span_alpha(unsigned char * restrict dp, const unsigned char * restrict sp, int n, int w);
+void fz_drop_span_alpha(unsigned char * restrict dp, const unsigned char * restrict sp, int n, int w);
 
-void fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha, int lerp_allowed, int gridfit_as_tiled);
-void fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, unsigned char *colorbv, int lerp_allowed, int gridfit_as_tiled);
+void fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, const fz_irect *clip, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha, int lerp_allowed, int gridfit_as_tiled);
+void fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, const fz_irect *clip, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, unsigned char *colorbv, int lerp_allowed, int gridfit_as_tiled);
 
 void fz_paint_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha);
 void fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk);
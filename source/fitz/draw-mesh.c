@@ -49,7 +49,8 @@ static void paint_scan(fz_pixmap *restrict pix, int y, int fx0, int fx1, int cx0
 			*p++ = c[k]>>16;
 			c[k] += dc[k];
 		}
-		*p++ = 255;
+		if (pix->alpha)
+			*p++ = 255;
 	}
 }
 
@@ -197,6 +198,200 @@ do_paint_tri(fz_context *ctx, void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex
 	fz_paint_triangle(dest, vertices, 2 + dest->colorspace->n, ptd->bbox);
 }
 
+/*
+ * Axial and radial shadings are drawn directly, working out for each
+ * pixel how far along the shading it lies and looking its color up in
+ * the table sampled from the shading function, rather than being split
+ * up into a mesh and painted as a pixmap of table indexes first. The
+ * colors are painted straight over the destination; pixels outside the
+ * shading are left as they are.
+ */
+
+static inline int shade_index(float t)
+{
+	if (t < 0)
+		t = 0;
+	else if (t > 1)
+		t = 1;
+	return (int)(t * 255 + 0.5f);
+}
+
+/* Paint the premultiplied color c, with nc components and then alpha,
+ * over p. da is set if p has an alpha to update. */
+static inline void put_color(unsigned char *restrict p, const unsigned char *restrict c, int nc, int da)
+{
+	int a = c[nc];
+	int k;
+
+	if (a == 255)
+	{
+		for (k = 0; k < nc; k++)
+			p[k] = c[k];
+		if (da)
+			p[nc] = 255;
+	}
+	else if (a != 0)
+	{
+		int t = 255 - a;
+		for (k = 0; k < nc; k++)
+			p[k] = c[k] + fz_mul255(p[k], t);
+		if (da)
+			p[nc] = a + fz_mul255(p[nc], t);
+	}
+}
+
+static void
+paint_axial(fz_shade *shade, const fz_matrix *inv, fz_pixmap *pix, const fz_irect *bbox, unsigned char (*clut)[FZ_MAX_COLORS])
+{
+	float x0 = shade->u.l_or_r.coords[0][0];
+	float y0 = shade->u.l_or_r.coords[0][1];
+	float dx = shade->u.l_or_r.coords[1][0] - x0;
+	float dy = shade->u.l_or_r.coords[1][1] - y0;
+	int extend0 = shade->u.l_or_r.extend[0];
+	int extend1 = shade->u.l_or_r.extend[1];
+	float len = dx * dx + dy * dy;
+	int n = pix->n;
+	int da = pix->alpha;
+	int nc = n - da;
+	float ds;
+	int x, y;
+
+	/* t is linear in x along a scanline. It is worked out from x = 0
+	 * rather than from the edge of bbox, so that a pixel gets the same
+	 * color however the destination is clipped or banded. */
+	dx /= len;
+	dy /= len;
+	ds = inv->a * dx + inv->b * dy;
+
+	for (y = bbox->y0; y < bbox->y1; y++)
+	{
+		unsigned char *p = pix->samples + ((bbox->x0 - pix->x) + (y - pix->y) * pix->w) * n;
+		float qx = 0.5f * inv->a + (y + 0.5f) * inv->c + inv->e;
+		float qy = 0.5f * inv->b + (y + 0.5f) * inv->d + inv->f;
+		float s0 = (qx - x0) * dx + (qy - y0) * dy;
+
+		for (x = bbox->x0; x < bbox->x1; x++)
+		{
+			float s = s0 + x * ds;
+			if ((s >= 0 || extend0) && (s <= 1 || extend1))
+				put_color(p, clut[shade_index(s)], nc, da);
+			p += n;
+		}
+	}
+}
+
+static void
+paint_radial(fz_shade *shade, const fz_matrix *inv, fz_pixmap *pix, const fz_irect *bbox, unsigned char (*clut)[FZ_MAX_COLORS])
+{
+	float x0 = shade->u.l_or_r.coords[0][0];
+	float y0 = shade->u.l_or_r.coords[0][1];
+	float r0 = shade->u.l_or_r.coords[0][2];
+	float cdx = shade->u.l_or_r.coords[1][0] - x0;
+	float cdy = shade->u.l_or_r.coords[1][1] - y0;
+	float dr = shade->u.l_or_r.coords[1][2] - r0;
+	int extend0 = shade->u.l_or_r.extend[0];
+	int extend1 = shade->u.l_or_r.extend[1];
+	float a = cdx * cdx + cdy * cdy - dr * dr;
+	int n = pix->n;
+	int da = pix->alpha;
+	int nc = n - da;
+	int x, y;
+
+	/* The point q lies on the circle for s when
+	 * |q - c(s)| = r(s), where c(s) = c0 + s * (c1 - c0) and
+	 * r(s) = r0 + s * (r1 - r0). That is a quadratic in s, of
+	 * which we want the largest root that gives a circle with
+	 * a radius of zero or more, within the extended range. */
+	for (y = bbox->y0; y < bbox->y1; y++)
+	{
+		unsigned char *p = pix->samples + ((bbox->x0 - pix->x) + (y - pix->y) * pix->w) * n;
+		float qx = 0.5f * inv->a + (y + 0.5f) * inv->c + inv->e - x0;
+		float qy = 0.5f * inv->b + (y + 0.5f) * inv->d + inv->f - y0;
+
+		for (x = bbox->x0; x < bbox->x1; x++)
+		{
+			/* As for axial shadings, from x = 0 on each scanline. */
+			float px = qx + x * inv->a;
+			float py = qy + x * inv->b;
+			float b = px * cdx + py * cdy + r0 * dr;
+			float c = px * px + py * py - r0 * r0;
+			float s, s1 = 0, s2 = 0;
+			int roots = 0;
+
+			if (a != 0)
+			{
+				float disc = b * b - a * c;
+				if (disc >= 0)
+				{
+					disc = sqrtf(disc);
+					s1 = (b + disc) / a;
+					s2 = (b - disc) / a;
+					if (s2 > s1)
+					{
+						s = s1; s1 = s2; s2 = s;
+					}
+					roots = 2;
+				}
+			}
+			else if (b != 0)
+			{
+				s1 = c / (2 * b);
+				roots = 1;
+			}
+
+			while (roots--)
+			{
+				s = s1;
+				s1 = s2;
+				if (r0 + s * dr >= 0 && (s >= 0 || extend0) && (s <= 1 || extend1))
+				{
+					put_color(p, clut[shade_index(s)], nc, da);
+					break;
+				}
+			}
+
+			p += n;
+		}
+	}
+}
+
+static int
+paint_shade_direct(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *pix, const fz_irect *scissor, unsigned char (*clut)[FZ_MAX_COLORS])
+{
+	unsigned char pclut[256][FZ_MAX_COLORS];
+	int nc = pix->colorspace->n;
+	fz_irect bbox;
+	fz_matrix inv;
+	int i, k;
+
+	if (shade->type != FZ_LINEAR && shade->type != FZ_RADIAL)
+		return 0;
+	if (fz_try_invert_matrix(&inv, ctm))
+		return 0;
+	if (shade->type == FZ_LINEAR &&
+		shade->u.l_or_r.coords[0][0] == shade->u.l_or_r.coords[1][0] &&
+		shade->u.l_or_r.coords[0][1] == shade->u.l_or_r.coords[1][1])
+		return 0;
+
+	fz_intersect_irect(fz_pixmap_bbox_no_ctx(pix, &bbox), scissor);
+	if (fz_is_empty_irect(&bbox))
+		return 1;
+
+	for (i = 0; i < 256; i++)
+	{
+		int a = clut[i][nc];
+		for (k = 0; k < nc; k++)
+			pclut[i][k] = fz_mul255(clut[i][k], a);
+		pclut[i][k] = a;
+	}
+
+	if (shade->type == FZ_LINEAR)
+		paint_axial(shade, &inv, pix, &bbox, pclut);
+	else
+		paint_radial(shade, &inv, pix, &bbox, pclut);
+	return 1;
+}
+
 void
 fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *dest, const fz_irect *bbox)
 {
@@ -226,23 +421,29 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 					clut[i][k] = color[k] * 255;
 				clut[i][k] = shade->function[i][shade->colorspace->n] * 255;
 			}
-			conv = fz_new_pixmap_with_bbox(ctx, dest->colorspace, bbox);
-			temp = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), bbox);
-			fz_clear_pixmap(ctx, temp);
+			if (!paint_shade_direct(ctx, shade, &local_ctm, dest, bbox, clut))
+			{
+				conv = fz_new_pixmap_with_bbox(ctx, dest->colorspace, bbox);
+				temp = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), bbox);
+				fz_clear_pixmap(ctx, temp);
+			}
 		}
 		else
 		{
 			temp = dest;
 		}
 
-		ptd.dest = temp;
-		ptd.shade = shade;
-		ptd.bbox = bbox;
+		if (temp)
+		{
+			ptd.dest = temp;
+			ptd.shade = shade;
+			ptd.bbox = bbox;
 
-		fz_init_cached_color_converter(ctx, &ptd.cc, temp->colorspace, shade->colorspace);
-		fz_process_mesh(ctx, shade, &local_ctm, &prepare_vertex, &do_paint_tri, &ptd);
+			fz_init_cached_color_converter(ctx, &ptd.cc, temp->colorspace, shade->colorspace);
+			fz_process_mesh(ctx, shade, &local_ctm, &prepare_vertex, &do_paint_tri, &ptd);
+		}
 
-		if (shade->use_function)
+		if (conv)
 		{
 			unsigned char *s = temp->samples;
 			unsigned char *d = conv->samples;
@@ -267,7 +468,8 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 	fz_catch(ctx)
 	{
 		fz_drop_pixmap(ctx, conv);
-		fz_drop_pixmap(ctx, temp);
+		if (temp != dest)
+			fz_drop_pixmap(ctx, temp);
 		fz_rethrow(ctx);
 	}
 }
@@ -69,6 +69,11 @@ az = 1), then:
 Sadly, this is not true in the general case, so we abandon this effort
 and stick to using the premultiplied form.
 
+Destinations without an alpha plane are treated as opaque (az = 1). The
+premultiplied color equations above are used unchanged, and ar (which is
+always 1) is simply not stored; the '_noda' (no destination alpha)
+functions below do just that.
+
 */
 
 typedef unsigned char byte;
@@ -187,14 +192,30 @@ fz_paint_solid_color_N(byte * restrict dp, int n, int w, byte *color)
 	}
 }
 
-void
-fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
+static inline void
+fz_paint_solid_color_N_noda(byte * restrict dp, int n, int w, byte *color)
 {
-	switch (n)
+	int k;
+	int sa = FZ_EXPAND(color[n]);
+	if (sa == 0)
+		return;
+	if (sa == 256)
 	{
-	case 2: fz_paint_solid_color_2(dp, w, color); break;
-	case 4: fz_paint_solid_color_4(dp, w, color); break;
-	default: fz_paint_solid_color_N(dp, n, w, color); break;
+		while (w--)
+		{
+			for (k = 0; k < n; k++)
+				dp[k] = color[k];
+			dp += n;
+		}
+	}
+	else
+	{
+		while (w--)
+		{
+			for (k = 0; k < n; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], sa);
+			dp += n;
+		}
 	}
 }
 
@@ -357,14 +378,28 @@ fz_paint_span_with_color_N(byte * restrict dp, byte * restrict mp, int n, int w,
 	}
 }
 
-void
-fz_paint_span_with_color(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
+static inline void
+fz_paint_span_with_color_N_noda(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
 {
-	switch (n)
+	int k;
+	int sa = FZ_EXPAND(color[n]);
+	if (sa == 0)
+		return;
+	while (w--)
 	{
-	case 2: fz_paint_span_with_color_2(dp, mp, w, color); break;
-	case 4: fz_paint_span_with_color_4(dp, mp, w, color); break;
-	default: fz_paint_span_with_color_N(dp, mp, n, w, color); break;
+		int ma = *mp++;
+		ma = FZ_COMBINE(FZ_EXPAND(ma), sa);
+		if (ma == 256)
+		{
+			for (k = 0; k < n; k++)
+				dp[k] = color[k];
+		}
+		else if (ma != 0)
+		{
+			for (k = 0; k < n; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], ma);
+		}
+		dp += n;
 	}
 }
 
@@ -515,14 +550,43 @@ fz_paint_span_with_mask_N(byte * restrict dp, byte * restrict sp, byte * restric
 	}
 }
 
-static void
-fz_paint_span_with_mask(byte * restrict dp, byte * restrict sp, byte * restrict mp, int n, int w)
+static inline void
+fz_paint_span_with_mask_N_noda(byte * restrict dp, byte * restrict sp, byte * restrict mp, int n, int w)
 {
-	switch (n)
+	int n1 = n - 1;
+	while (w--)
 	{
-	case 2: fz_paint_span_with_mask_2(dp, sp, mp, w); break;
-	case 4: fz_paint_span_with_mask_4(dp, sp, mp, w); break;
-	default: fz_paint_span_with_mask_N(dp, sp, mp, n, w); break;
+		int k;
+		int ma = *mp++;
+		ma = FZ_EXPAND(ma);
+		if (ma == 0)
+		{
+		}
+		else if (ma == 256)
+		{
+			int masa = 255 - sp[n1];
+			if (masa == 0)
+			{
+				for (k = 0; k < n1; k++)
+					dp[k] = sp[k];
+			}
+			else
+			{
+				masa = FZ_EXPAND(masa);
+				for (k = 0; k < n1; k++)
+					dp[k] = sp[k] + FZ_COMBINE(dp[k], masa);
+			}
+		}
+		else
+		{
+			int masa = FZ_COMBINE(sp[n1], ma);
+			masa = 255-masa;
+			masa = FZ_EXPAND(masa);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_COMBINE2(sp[k], ma, dp[k], masa);
+		}
+		dp += n1;
+		sp += n;
 	}
 }
 
@@ -576,6 +640,22 @@ fz_paint_span_N_with_alpha(byte * restrict dp, byte * restrict sp, int n, int w,
 	}
 }
 
+static inline void
+fz_paint_span_N_with_alpha_noda(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
+{
+	int n1 = n - 1;
+	alpha = FZ_EXPAND(alpha);
+	while (w--)
+	{
+		int masa = FZ_COMBINE(sp[n1], alpha);
+		int k;
+		for (k = 0; k < n1; k++)
+			dp[k] = FZ_BLEND(sp[k], dp[k], masa);
+		dp += n1;
+		sp += n;
+	}
+}
+
 /* Blend source over destination */
 
 static inline void
@@ -685,150 +765,1130 @@ fz_paint_span_N(byte * restrict dp, byte * restrict sp, int n, int w)
 	}
 }
 
-void
-fz_paint_span(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
+static inline void
+fz_paint_span_N_noda(byte * restrict dp, byte * restrict sp, int n, int w)
 {
-	if (alpha == 255)
+	int n1 = n - 1;
+	while (w--)
 	{
-		switch (n)
+		int k;
+		int t = FZ_EXPAND(sp[n1]);
+		if (t == 0)
 		{
-		case 1: fz_paint_span_1(dp, sp, w); break;
-		case 2: fz_paint_span_2(dp, sp, w); break;
-		case 4: fz_paint_span_4(dp, sp, w); break;
-		default: fz_paint_span_N(dp, sp, n, w); break;
 		}
-	}
-	else if (alpha > 0)
-	{
-		switch (n)
+		else if (t == 256)
 		{
-		case 2: fz_paint_span_2_with_alpha(dp, sp, w, alpha); break;
-		case 4: fz_paint_span_4_with_alpha(dp, sp, w, alpha); break;
-		default: fz_paint_span_N_with_alpha(dp, sp, n, w, alpha); break;
+			for (k = 0; k < n1; k++)
+				dp[k] = sp[k];
 		}
+		else
+		{
+			t = 256 - t;
+			for (k = 0; k < n1; k++)
+				dp[k] = sp[k] + FZ_COMBINE(dp[k], t);
+		}
+		dp += n1;
+		sp += n;
 	}
 }
 
-/*
- * Pixmap blending functions
- */
+/* The scalar painters for 4 component destinations, or for 3 component
+ * destinations without alpha. The SIMD painters below fall back to
+ * these for the pixels left over at the end of a span. */
 
-void
-fz_paint_pixmap_with_bbox(fz_pixmap *dst, fz_pixmap *src, int alpha, fz_irect bbox)
+static inline void
+fz_paint_span_with_color_4_or_3(byte * restrict dp, int da, byte * restrict mp, int w, byte *color)
 {
-	unsigned char *sp, *dp;
-	int x, y, w, h, n;
-	fz_irect bbox2;
+	if (da)
+		fz_paint_span_with_color_4(dp, mp, w, color);
+	else
+		fz_paint_span_with_color_N_noda(dp, mp, 3, w, color);
+}
 
-	assert(dst->n == src->n);
+static inline void
+fz_paint_span_with_mask_4_or_3(byte * restrict dp, int da, byte * restrict sp, byte * restrict mp, int w)
+{
+	if (da)
+		fz_paint_span_with_mask_4(dp, sp, mp, w);
+	else
+		fz_paint_span_with_mask_N_noda(dp, sp, mp, 4, w);
+}
 
-	fz_pixmap_bbox_no_ctx(dst, &bbox2);
-	fz_intersect_irect(&bbox, &bbox2);
-	fz_pixmap_bbox_no_ctx(src, &bbox2);
-	fz_intersect_irect(&bbox, &bbox2);
+static inline void
+fz_paint_span_4_or_3_with_alpha(byte * restrict dp, int da, byte * restrict sp, int w, int alpha)
+{
+	if (da)
+		fz_paint_span_4_with_alpha(dp, sp, w, alpha);
+	else
+		fz_paint_span_N_with_alpha_noda(dp, sp, 4, w, alpha);
+}
 
-	x = bbox.x0;
-	y = bbox.y0;
-	w = bbox.x1 - bbox.x0;
-	h = bbox.y1 - bbox.y0;
-	if ((w | h) == 0)
-		return;
+static inline void
+fz_paint_span_4_or_3(byte * restrict dp, int da, byte * restrict sp, int w)
+{
+	if (da)
+		fz_paint_span_4(dp, sp, w);
+	else
+		fz_paint_span_N_noda(dp, sp, 4, w);
+}
 
-	n = src->n;
-	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
-	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+/*
+	x86 SIMD versions of the span painters for 4 component pixels, and
+	for 1 and 3 component destinations without alpha.
+
+	These give exactly the same results as the scalar versions above.
+	Everything is done with 16 bit arithmetic, 4 pixels at a time for
+	SSE2, or 8 for AVX2. To stay within 16 bits FZ_BLEND(s, d, a) is
+	rewritten as (s * a + d * (256 - a)) >> 8, which is the same value.
+	Left over pixels at the end of a span are done by the scalar code.
+
+	The 4 component painters take da. Without it the destination pixels
+	have 3 components, which are loaded with a zero alpha. The color
+	equations do not depend on the destination alpha, so the color lanes
+	get the same results, and the alpha lanes are not stored. Gray
+	destinations without alpha have SSE2 painters of their own, which
+	do 8 pixels at a time.
+*/
 
-	while (h--)
+#ifdef FZ_SSE2
+
+/* Copy the alpha of each pixel to all of its components. */
+#define SSE2_ALPHA(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16((x), 0xFF), 0xFF)
+
+/* Load 4 mask values, FZ_EXPAND them, and spread each across the 4
+ * components of its pixel. */
+static inline void
+sse2_load_mask(byte *mp, int sa, __m128i *lo, __m128i *hi)
+{
+	__m128i ma;
+	int m;
+
+	memcpy(&m, mp, 4);
+	ma = _mm_unpacklo_epi8(_mm_cvtsi32_si128(m), _mm_setzero_si128());
+	ma = _mm_add_epi16(ma, _mm_srli_epi16(ma, 7));
+	if (sa != 256)
+		ma = _mm_srli_epi16(_mm_mullo_epi16(ma, _mm_set1_epi16(sa)), 8);
+	ma = _mm_unpacklo_epi16(ma, ma);
+	*lo = _mm_unpacklo_epi32(ma, ma);
+	*hi = _mm_unpackhi_epi32(ma, ma);
+}
+
+/* Load 4 destination pixels, 2 in each register, and store them. */
+static inline void
+sse2_load_dst(byte *dp, int da, __m128i *lo, __m128i *hi)
+{
+	if (da)
 	{
-		fz_paint_span(dp, sp, n, w, alpha);
-		sp += src->w * n;
-		dp += dst->w * n;
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		*lo = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+		*hi = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+	}
+	else
+	{
+		*lo = sse2_load_rgb2(dp);
+		*hi = sse2_load_rgb2(dp + 6);
 	}
 }
 
-void
-fz_paint_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha)
+static inline void
+sse2_store_dst(byte *dp, int da, __m128i lo, __m128i hi)
 {
-	unsigned char *sp, *dp;
-	fz_irect bbox;
-	fz_irect bbox2;
-	int x, y, w, h, n;
+	if (da)
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	else
+	{
+		sse2_store_rgb2(dp, lo);
+		sse2_store_rgb2(dp + 6, hi);
+	}
+}
 
-	assert(dst->n == src->n);
+static inline __m128i
+sse2_blend(__m128i s, __m128i d, __m128i a)
+{
+	__m128i na = _mm_sub_epi16(_mm_set1_epi16(256), a);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, na)), 8);
+}
 
-	fz_pixmap_bbox_no_ctx(dst, &bbox);
-	fz_pixmap_bbox_no_ctx(src, &bbox2);
-	fz_intersect_irect(&bbox, &bbox2);
+static void
+fz_paint_span_with_color_4_sse2(byte * restrict dp, int da, byte * restrict mp, int w, byte *color)
+{
+	__m128i c, lo, hi, dlo, dhi;
+	int sa = FZ_EXPAND(color[3]);
+	int dn = 3 + da;
+	int m;
 
-	x = bbox.x0;
-	y = bbox.y0;
-	w = bbox.x1 - bbox.x0;
-	h = bbox.y1 - bbox.y0;
-	if ((w | h) == 0)
+	if (sa == 0)
 		return;
+	c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	for (; w >= 4; w -= 4, dp += 4 * dn, mp += 4)
+	{
+		memcpy(&m, mp, 4);
+		if (m == 0)
+			continue;
+		if (m == -1 && sa == 256)
+		{
+			sse2_store_dst(dp, da, c, c);
+			continue;
+		}
+		sse2_load_mask(mp, sa, &lo, &hi);
+		sse2_load_dst(dp, da, &dlo, &dhi);
+		sse2_store_dst(dp, da, sse2_blend(c, dlo, lo), sse2_blend(c, dhi, hi));
+	}
+	fz_paint_span_with_color_4_or_3(dp, da, mp, w, color);
+}
 
-	n = src->n;
-	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
-	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+static inline __m128i
+sse2_mask_over(__m128i s, __m128i d, __m128i ma)
+{
+	__m128i k255 = _mm_set1_epi16(255);
+	__m128i masa = _mm_srli_epi16(_mm_mullo_epi16(SSE2_ALPHA(s), ma), 8);
+	masa = _mm_sub_epi16(k255, masa);
+	masa = _mm_add_epi16(masa, _mm_srli_epi16(masa, 7));
+	s = _mm_srli_epi16(_mm_mullo_epi16(s, ma), 8);
+	d = _mm_srli_epi16(_mm_mullo_epi16(d, masa), 8);
+	return _mm_and_si128(_mm_add_epi16(s, d), k255);
+}
 
-	while (h--)
+static void
+fz_paint_span_with_mask_4_sse2(byte * restrict dp, int da, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo, hi, dlo, dhi, s;
+	int dn = 3 + da;
+	int m;
+
+	for (; w >= 4; w -= 4, dp += 4 * dn, sp += 16, mp += 4)
 	{
-		fz_paint_span(dp, sp, n, w, alpha);
-		sp += src->w * n;
-		dp += dst->w * n;
+		memcpy(&m, mp, 4);
+		if (m == 0)
+			continue;
+		sse2_load_mask(mp, 256, &lo, &hi);
+		s = _mm_loadu_si128((__m128i *)sp);
+		sse2_load_dst(dp, da, &dlo, &dhi);
+		lo = sse2_mask_over(_mm_unpacklo_epi8(s, zero), dlo, lo);
+		hi = sse2_mask_over(_mm_unpackhi_epi8(s, zero), dhi, hi);
+		sse2_store_dst(dp, da, lo, hi);
 	}
+	fz_paint_span_with_mask_4_or_3(dp, da, sp, mp, w);
 }
 
-void
-fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk)
+static inline __m128i
+sse2_alpha_over(__m128i s, __m128i d, __m128i alpha)
 {
-	unsigned char *sp, *dp, *mp;
-	fz_irect bbox, bbox2;
-	int x, y, w, h, n;
+	__m128i masa = _mm_srli_epi16(_mm_mullo_epi16(SSE2_ALPHA(s), alpha), 8);
+	return sse2_blend(s, d, masa);
+}
 
-	assert(dst->n == src->n);
-	assert(msk->n == 1);
+static void
+fz_paint_span_4_with_alpha_sse2(byte * restrict dp, int da, byte * restrict sp, int w, int alpha)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(FZ_EXPAND(alpha));
+	__m128i lo, hi, s;
+	int dn = 3 + da;
 
-	fz_pixmap_bbox_no_ctx(dst, &bbox);
-	fz_pixmap_bbox_no_ctx(src, &bbox2);
-	fz_intersect_irect(&bbox, &bbox2);
-	fz_pixmap_bbox_no_ctx(msk, &bbox2);
-	fz_intersect_irect(&bbox, &bbox2);
+	for (; w >= 4; w -= 4, dp += 4 * dn, sp += 16)
+	{
+		s = _mm_loadu_si128((__m128i *)sp);
+		sse2_load_dst(dp, da, &lo, &hi);
+		lo = sse2_alpha_over(_mm_unpacklo_epi8(s, zero), lo, a);
+		hi = sse2_alpha_over(_mm_unpackhi_epi8(s, zero), hi, a);
+		sse2_store_dst(dp, da, lo, hi);
+	}
+	fz_paint_span_4_or_3_with_alpha(dp, da, sp, w, alpha);
+}
 
-	x = bbox.x0;
-	y = bbox.y0;
-	w = bbox.x1 - bbox.x0;
-	h = bbox.y1 - bbox.y0;
-	if ((w | h) == 0)
-		return;
+static inline __m128i
+sse2_over(__m128i s, __m128i d)
+{
+	__m128i a = SSE2_ALPHA(s);
+	__m128i t = _mm_sub_epi16(_mm_set1_epi16(256), _mm_add_epi16(a, _mm_srli_epi16(a, 7)));
+	__m128i r = _mm_and_si128(_mm_add_epi16(s, _mm_srli_epi16(_mm_mullo_epi16(d, t), 8)), _mm_set1_epi16(255));
+	/* Fully transparent source pixels leave the destination untouched */
+	__m128i z = _mm_cmpeq_epi16(a, _mm_setzero_si128());
+	return _mm_or_si128(_mm_and_si128(z, d), _mm_andnot_si128(z, r));
+}
 
-	n = src->n;
-	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
-	mp = msk->samples + (unsigned int)(((y - msk->y) * msk->w + (x - msk->x)) * msk->n);
-	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+static void
+fz_paint_span_4_sse2(byte * restrict dp, int da, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi8(-1);
+	__m128i lo, hi, s;
+	int dn = 3 + da;
 
-	while (h--)
+	for (; w >= 4; w -= 4, dp += 4 * dn, sp += 16)
 	{
-		fz_paint_span_with_mask(dp, sp, mp, n, w);
-		sp += src->w * n;
-		dp += dst->w * n;
-		mp += msk->w;
+		s = _mm_loadu_si128((__m128i *)sp);
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) & 0x8888) == 0x8888)
+			continue;
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(s, ones)) & 0x8888) == 0x8888)
+		{
+			if (da)
+				_mm_storeu_si128((__m128i *)dp, s);
+			else
+				sse2_store_dst(dp, da, _mm_unpacklo_epi8(s, zero), _mm_unpackhi_epi8(s, zero));
+			continue;
+		}
+		sse2_load_dst(dp, da, &lo, &hi);
+		lo = sse2_over(_mm_unpacklo_epi8(s, zero), lo);
+		hi = sse2_over(_mm_unpackhi_epi8(s, zero), hi);
+		sse2_store_dst(dp, da, lo, hi);
 	}
+	fz_paint_span_4_or_3(dp, da, sp, w);
+}
+
+/* Gray destinations without alpha, 8 pixels at a time. Gray and alpha
+ * sources are split into a register of grays and one of alphas. */
+
+static inline __m128i
+sse2_load8(byte *p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)p), _mm_setzero_si128());
 }
 
 static inline void
-fz_paint_glyph_mask(int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+sse2_store8(byte *p, __m128i x)
 {
-	while (h--)
+	_mm_storel_epi64((__m128i *)p, _mm_packus_epi16(x, x));
+}
+
+static inline void
+sse2_load_ga8(byte *sp, __m128i *g, __m128i *a)
+{
+	__m128i s = _mm_loadu_si128((__m128i *)sp);
+	*g = _mm_and_si128(s, _mm_set1_epi16(255));
+	*a = _mm_srli_epi16(s, 8);
+}
+
+static void
+fz_paint_solid_color_1_noda_sse2(byte * restrict dp, int w, byte *color)
+{
+	__m128i c = _mm_set1_epi16(color[0]);
+	__m128i a;
+	int sa = FZ_EXPAND(color[1]);
+
+	if (sa == 0)
+		return;
+	if (sa == 256)
 	{
-		int skip_xx, ww, len, extend;
-		unsigned char *runp;
-		unsigned char *ddp = dp;
-		int offset = ((int *)(glyph->data))[skip_y++];
-		if (offset >= 0)
-		{
-			int eol = 0;
-			runp = &glyph->data[offset];
+		memset(dp, color[0], w);
+		return;
+	}
+	a = _mm_set1_epi16(sa);
+	for (; w >= 8; w -= 8, dp += 8)
+		sse2_store8(dp, sse2_blend(c, sse2_load8(dp), a));
+	fz_paint_solid_color_N_noda(dp, 1, w, color);
+}
+
+static void
+fz_paint_solid_color_3_noda_sse2(byte * restrict dp, int w, byte *color)
+{
+	__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 0, color[0], color[1], color[2], 0);
+	__m128i a, lo, hi;
+	int sa = FZ_EXPAND(color[3]);
+
+	if (sa == 0)
+		return;
+	a = _mm_set1_epi16(sa);
+	for (; w >= 4; w -= 4, dp += 12)
+	{
+		if (sa == 256)
+		{
+			sse2_store_dst(dp, 0, c, c);
+			continue;
+		}
+		sse2_load_dst(dp, 0, &lo, &hi);
+		sse2_store_dst(dp, 0, sse2_blend(c, lo, a), sse2_blend(c, hi, a));
+	}
+	fz_paint_solid_color_N_noda(dp, 3, w, color);
+}
+
+static void
+fz_paint_span_with_color_1_noda_sse2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	__m128i c = _mm_set1_epi16(color[0]);
+	__m128i ma;
+	int sa = FZ_EXPAND(color[1]);
+	uint64_t m;
+
+	if (sa == 0)
+		return;
+	for (; w >= 8; w -= 8, dp += 8, mp += 8)
+	{
+		memcpy(&m, mp, 8);
+		if (m == 0)
+			continue;
+		ma = sse2_load8(mp);
+		ma = _mm_add_epi16(ma, _mm_srli_epi16(ma, 7));
+		if (sa != 256)
+			ma = _mm_srli_epi16(_mm_mullo_epi16(ma, _mm_set1_epi16(sa)), 8);
+		sse2_store8(dp, sse2_blend(c, sse2_load8(dp), ma));
+	}
+	fz_paint_span_with_color_N_noda(dp, mp, 1, w, color);
+}
+
+static void
+fz_paint_span_with_mask_1_noda_sse2(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m128i k255 = _mm_set1_epi16(255);
+	__m128i g, a, ma, masa, d;
+	uint64_t m;
+
+	for (; w >= 8; w -= 8, dp += 8, sp += 16, mp += 8)
+	{
+		memcpy(&m, mp, 8);
+		if (m == 0)
+			continue;
+		ma = sse2_load8(mp);
+		ma = _mm_add_epi16(ma, _mm_srli_epi16(ma, 7));
+		sse2_load_ga8(sp, &g, &a);
+		masa = _mm_sub_epi16(k255, _mm_srli_epi16(_mm_mullo_epi16(a, ma), 8));
+		masa = _mm_add_epi16(masa, _mm_srli_epi16(masa, 7));
+		g = _mm_srli_epi16(_mm_mullo_epi16(g, ma), 8);
+		d = _mm_srli_epi16(_mm_mullo_epi16(sse2_load8(dp), masa), 8);
+		sse2_store8(dp, _mm_and_si128(_mm_add_epi16(g, d), k255));
+	}
+	fz_paint_span_with_mask_N_noda(dp, sp, mp, 2, w);
+}
+
+static void
+fz_paint_span_1_with_alpha_noda_sse2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m128i va = _mm_set1_epi16(FZ_EXPAND(alpha));
+	__m128i g, a;
+
+	for (; w >= 8; w -= 8, dp += 8, sp += 16)
+	{
+		sse2_load_ga8(sp, &g, &a);
+		a = _mm_srli_epi16(_mm_mullo_epi16(a, va), 8);
+		sse2_store8(dp, sse2_blend(g, sse2_load8(dp), a));
+	}
+	fz_paint_span_N_with_alpha_noda(dp, sp, 2, w, alpha);
+}
+
+static void
+fz_paint_span_1_noda_sse2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i g, a, d, t, r, z;
+
+	for (; w >= 8; w -= 8, dp += 8, sp += 16)
+	{
+		sse2_load_ga8(sp, &g, &a);
+		z = _mm_cmpeq_epi16(a, zero);
+		if (_mm_movemask_epi8(z) == 0xFFFF)
+			continue;
+		d = sse2_load8(dp);
+		t = _mm_sub_epi16(_mm_set1_epi16(256), _mm_add_epi16(a, _mm_srli_epi16(a, 7)));
+		r = _mm_and_si128(_mm_add_epi16(g, _mm_srli_epi16(_mm_mullo_epi16(d, t), 8)), _mm_set1_epi16(255));
+		/* Fully transparent source pixels leave the destination untouched */
+		sse2_store8(dp, _mm_or_si128(_mm_and_si128(z, d), _mm_andnot_si128(z, r)));
+	}
+	fz_paint_span_N_noda(dp, sp, 2, w);
+}
+
+#endif /* FZ_SSE2 */
+
+#ifdef FZ_AVX2
+
+/* As above, but each 256 bit register holds 4 pixels. We load 4 pixels
+ * at a time with _mm256_cvtepu8_epi16, and pack 8 at a time, which
+ * leaves the 64 bit quarters in the order 0, 2, 1, 3. */
+
+#define AVX2_ALPHA(x) _mm256_shufflehi_epi16(_mm256_shufflelo_epi16((x), 0xFF), 0xFF)
+#define AVX2_LOAD4(p) _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)(p)))
+#define AVX2_PACK8(lo, hi) _mm256_permute4x64_epi64(_mm256_packus_epi16((lo), (hi)), 0xD8)
+
+static inline void FZ_TARGET_AVX2
+avx2_load_mask(byte *mp, int sa, __m256i *lo, __m256i *hi)
+{
+	__m128i ma = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)mp));
+	__m256i mm;
+
+	ma = _mm_add_epi16(ma, _mm_srli_epi16(ma, 7));
+	if (sa != 256)
+		ma = _mm_srli_epi16(_mm_mullo_epi16(ma, _mm_set1_epi16(sa)), 8);
+	mm = _mm256_broadcastsi128_si256(ma);
+	*lo = _mm256_shuffle_epi8(mm, _mm256_setr_epi8(
+		0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 2, 3, 2, 3, 2, 3,
+		4, 5, 4, 5, 4, 5, 4, 5, 6, 7, 6, 7, 6, 7, 6, 7));
+	*hi = _mm256_shuffle_epi8(mm, _mm256_setr_epi8(
+		8, 9, 8, 9, 8, 9, 8, 9, 10, 11, 10, 11, 10, 11, 10, 11,
+		12, 13, 12, 13, 12, 13, 12, 13, 14, 15, 14, 15, 14, 15, 14, 15));
+}
+
+/* Load 8 destination pixels, 4 in each register, and store them.
+ * Pixels without alpha are spread out to 4 bytes, and packed back
+ * into 3, with byte shuffles. */
+static inline void FZ_TARGET_AVX2
+avx2_load_dst(byte *dp, int da, __m256i *lo, __m256i *hi)
+{
+	if (da)
+	{
+		*lo = AVX2_LOAD4(dp);
+		*hi = AVX2_LOAD4(dp + 16);
+	}
+	else
+	{
+		__m128i a = _mm_loadu_si128((__m128i *)dp);
+		__m128i b = _mm_loadu_si128((__m128i *)(dp + 8));
+		a = _mm_shuffle_epi8(a, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+		b = _mm_shuffle_epi8(b, _mm_setr_epi8(4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1));
+		*lo = _mm256_cvtepu8_epi16(a);
+		*hi = _mm256_cvtepu8_epi16(b);
+	}
+}
+
+static inline void FZ_TARGET_AVX2
+avx2_store_dst(byte *dp, int da, __m256i lo, __m256i hi)
+{
+	__m256i r = AVX2_PACK8(lo, hi);
+	__m128i a, b;
+	int t;
+
+	if (da)
+	{
+		_mm256_storeu_si256((__m256i *)dp, r);
+		return;
+	}
+
+	/* Pack each half into its first 12 bytes, and write the first half
+	 * whole, as the second overwrites the 4 bytes after it. */
+	r = _mm256_shuffle_epi8(r, _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+	a = _mm256_castsi256_si128(r);
+	b = _mm256_extracti128_si256(r, 1);
+	_mm_storeu_si128((__m128i *)dp, a);
+	_mm_storel_epi64((__m128i *)(dp + 12), b);
+	t = _mm_cvtsi128_si32(_mm_srli_si128(b, 8));
+	memcpy(dp + 20, &t, 4);
+}
+
+static inline __m256i FZ_TARGET_AVX2
+avx2_blend(__m256i s, __m256i d, __m256i a)
+{
+	__m256i na = _mm256_sub_epi16(_mm256_set1_epi16(256), a);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, na)), 8);
+}
+
+static void FZ_TARGET_AVX2
+fz_paint_span_with_color_4_avx2(byte * restrict dp, int da, byte * restrict mp, int w, byte *color)
+{
+	__m256i c, lo, hi, dlo, dhi;
+	int sa = FZ_EXPAND(color[3]);
+	int dn = 3 + da;
+	uint64_t m;
+
+	if (sa == 0)
+		return;
+	c = _mm256_setr_epi16(
+		color[0], color[1], color[2], 255, color[0], color[1], color[2], 255,
+		color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	for (; w >= 8; w -= 8, dp += 8 * dn, mp += 8)
+	{
+		memcpy(&m, mp, 8);
+		if (m == 0)
+			continue;
+		if (m == ~(uint64_t)0 && sa == 256)
+		{
+			avx2_store_dst(dp, da, c, c);
+			continue;
+		}
+		avx2_load_mask(mp, sa, &lo, &hi);
+		avx2_load_dst(dp, da, &dlo, &dhi);
+		avx2_store_dst(dp, da, avx2_blend(c, dlo, lo), avx2_blend(c, dhi, hi));
+	}
+	fz_paint_span_with_color_4_or_3(dp, da, mp, w, color);
+}
+
+static inline __m256i FZ_TARGET_AVX2
+avx2_mask_over(__m256i s, __m256i d, __m256i ma)
+{
+	__m256i k255 = _mm256_set1_epi16(255);
+	__m256i masa = _mm256_srli_epi16(_mm256_mullo_epi16(AVX2_ALPHA(s), ma), 8);
+	masa = _mm256_sub_epi16(k255, masa);
+	masa = _mm256_add_epi16(masa, _mm256_srli_epi16(masa, 7));
+	s = _mm256_srli_epi16(_mm256_mullo_epi16(s, ma), 8);
+	d = _mm256_srli_epi16(_mm256_mullo_epi16(d, masa), 8);
+	return _mm256_and_si256(_mm256_add_epi16(s, d), k255);
+}
+
+static void FZ_TARGET_AVX2
+fz_paint_span_with_mask_4_avx2(byte * restrict dp, int da, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m256i lo, hi, dlo, dhi;
+	int dn = 3 + da;
+	uint64_t m;
+
+	for (; w >= 8; w -= 8, dp += 8 * dn, sp += 32, mp += 8)
+	{
+		memcpy(&m, mp, 8);
+		if (m == 0)
+			continue;
+		avx2_load_mask(mp, 256, &lo, &hi);
+		avx2_load_dst(dp, da, &dlo, &dhi);
+		lo = avx2_mask_over(AVX2_LOAD4(sp), dlo, lo);
+		hi = avx2_mask_over(AVX2_LOAD4(sp + 16), dhi, hi);
+		avx2_store_dst(dp, da, lo, hi);
+	}
+	fz_paint_span_with_mask_4_or_3(dp, da, sp, mp, w);
+}
+
+static inline __m256i FZ_TARGET_AVX2
+avx2_alpha_over(__m256i s, __m256i d, __m256i alpha)
+{
+	__m256i masa = _mm256_srli_epi16(_mm256_mullo_epi16(AVX2_ALPHA(s), alpha), 8);
+	return avx2_blend(s, d, masa);
+}
+
+static void FZ_TARGET_AVX2
+fz_paint_span_4_with_alpha_avx2(byte * restrict dp, int da, byte * restrict sp, int w, int alpha)
+{
+	__m256i a = _mm256_set1_epi16(FZ_EXPAND(alpha));
+	__m256i lo, hi;
+	int dn = 3 + da;
+
+	for (; w >= 8; w -= 8, dp += 8 * dn, sp += 32)
+	{
+		avx2_load_dst(dp, da, &lo, &hi);
+		lo = avx2_alpha_over(AVX2_LOAD4(sp), lo, a);
+		hi = avx2_alpha_over(AVX2_LOAD4(sp + 16), hi, a);
+		avx2_store_dst(dp, da, lo, hi);
+	}
+	fz_paint_span_4_or_3_with_alpha(dp, da, sp, w, alpha);
+}
+
+static inline __m256i FZ_TARGET_AVX2
+avx2_over(__m256i s, __m256i d)
+{
+	__m256i a = AVX2_ALPHA(s);
+	__m256i t = _mm256_sub_epi16(_mm256_set1_epi16(256), _mm256_add_epi16(a, _mm256_srli_epi16(a, 7)));
+	__m256i r = _mm256_and_si256(_mm256_add_epi16(s, _mm256_srli_epi16(_mm256_mullo_epi16(d, t), 8)), _mm256_set1_epi16(255));
+	__m256i z = _mm256_cmpeq_epi16(a, _mm256_setzero_si256());
+	return _mm256_blendv_epi8(r, d, z);
+}
+
+static void FZ_TARGET_AVX2
+fz_paint_span_4_avx2(byte * restrict dp, int da, byte * restrict sp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i ones = _mm256_set1_epi8(-1);
+	__m256i s, lo, hi;
+	int dn = 3 + da;
+
+	for (; w >= 8; w -= 8, dp += 8 * dn, sp += 32)
+	{
+		s = _mm256_loadu_si256((__m256i *)sp);
+		if (((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) & 0x88888888) == 0x88888888)
+			continue;
+		if (((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, ones)) & 0x88888888) == 0x88888888)
+		{
+			if (da)
+				_mm256_storeu_si256((__m256i *)dp, s);
+			else
+				avx2_store_dst(dp, da, AVX2_LOAD4(sp), AVX2_LOAD4(sp + 16));
+			continue;
+		}
+		avx2_load_dst(dp, da, &lo, &hi);
+		lo = avx2_over(AVX2_LOAD4(sp), lo);
+		hi = avx2_over(AVX2_LOAD4(sp + 16), hi);
+		avx2_store_dst(dp, da, lo, hi);
+	}
+	fz_paint_span_4_or_3(dp, da, sp, w);
+}
+
+#endif /* FZ_AVX2 */
+
+#if defined(FZ_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+static int
+cpu_has_avx2(void)
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
+	__cpuid(info, 1);
+	/* AVX, and the OS saves the YMM registers */
+	if ((info[2] & (3<<27)) != (3<<27) || (_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+}
+#elif defined(FZ_AVX2)
+static int
+cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+int
+fz_simd_level(void)
+{
+	/* Worked out on first use. Threads may race to do so, but they
+	 * all store the same value, and atomically. */
+	static int level = -1;
+	int l = fz_refs_load(&level);
+
+	if (l < 0)
+	{
+		l = FZ_SIMD_NONE;
+#ifdef FZ_SSE2
+		l = FZ_SIMD_SSE2;
+#endif
+#ifdef FZ_AVX2
+		if (cpu_has_avx2())
+			l = FZ_SIMD_AVX2;
+#endif
+		fz_refs_store(&level, l);
+	}
+	return l;
+}
+
+static void
+paint_span_with_color_4(byte * restrict dp, int da, byte * restrict mp, int w, byte *color)
+{
+#ifdef FZ_AVX2
+	if (w >= 8 && fz_simd_level() >= FZ_SIMD_AVX2)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_color_4_avx2", dp, w * (3 + da),
+			fz_paint_span_with_color_4_avx2(dp, da, mp, w, color),
+			fz_paint_span_with_color_4_or_3(dp, da, mp, w, color));
+		return;
+	}
+#endif
+#ifdef FZ_SSE2
+	if (w >= 4)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_color_4_sse2", dp, w * (3 + da),
+			fz_paint_span_with_color_4_sse2(dp, da, mp, w, color),
+			fz_paint_span_with_color_4_or_3(dp, da, mp, w, color));
+		return;
+	}
+#endif
+	fz_paint_span_with_color_4_or_3(dp, da, mp, w, color);
+}
+
+static void
+paint_span_with_mask_4(byte * restrict dp, int da, byte * restrict sp, byte * restrict mp, int w)
+{
+#ifdef FZ_AVX2
+	if (w >= 8 && fz_simd_level() >= FZ_SIMD_AVX2)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_mask_4_avx2", dp, w * (3 + da),
+			fz_paint_span_with_mask_4_avx2(dp, da, sp, mp, w),
+			fz_paint_span_with_mask_4_or_3(dp, da, sp, mp, w));
+		return;
+	}
+#endif
+#ifdef FZ_SSE2
+	if (w >= 4)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_mask_4_sse2", dp, w * (3 + da),
+			fz_paint_span_with_mask_4_sse2(dp, da, sp, mp, w),
+			fz_paint_span_with_mask_4_or_3(dp, da, sp, mp, w));
+		return;
+	}
+#endif
+	fz_paint_span_with_mask_4_or_3(dp, da, sp, mp, w);
+}
+
+static void
+paint_span_4_with_alpha(byte * restrict dp, int da, byte * restrict sp, int w, int alpha)
+{
+#ifdef FZ_AVX2
+	if (w >= 8 && fz_simd_level() >= FZ_SIMD_AVX2)
+	{
+		FZ_SIMD_CALL("fz_paint_span_4_with_alpha_avx2", dp, w * (3 + da),
+			fz_paint_span_4_with_alpha_avx2(dp, da, sp, w, alpha),
+			fz_paint_span_4_or_3_with_alpha(dp, da, sp, w, alpha));
+		return;
+	}
+#endif
+#ifdef FZ_SSE2
+	if (w >= 4)
+	{
+		FZ_SIMD_CALL("fz_paint_span_4_with_alpha_sse2", dp, w * (3 + da),
+			fz_paint_span_4_with_alpha_sse2(dp, da, sp, w, alpha),
+			fz_paint_span_4_or_3_with_alpha(dp, da, sp, w, alpha));
+		return;
+	}
+#endif
+	fz_paint_span_4_or_3_with_alpha(dp, da, sp, w, alpha);
+}
+
+static void
+paint_span_4(byte * restrict dp, int da, byte * restrict sp, int w)
+{
+#ifdef FZ_AVX2
+	if (w >= 8 && fz_simd_level() >= FZ_SIMD_AVX2)
+	{
+		FZ_SIMD_CALL("fz_paint_span_4_avx2", dp, w * (3 + da),
+			fz_paint_span_4_avx2(dp, da, sp, w),
+			fz_paint_span_4_or_3(dp, da, sp, w));
+		return;
+	}
+#endif
+#ifdef FZ_SSE2
+	if (w >= 4)
+	{
+		FZ_SIMD_CALL("fz_paint_span_4_sse2", dp, w * (3 + da),
+			fz_paint_span_4_sse2(dp, da, sp, w),
+			fz_paint_span_4_or_3(dp, da, sp, w));
+		return;
+	}
+#endif
+	fz_paint_span_4_or_3(dp, da, sp, w);
+}
+
+static void
+paint_solid_color_1_noda(byte * restrict dp, int w, byte *color)
+{
+#ifdef FZ_SSE2
+	if (w >= 8)
+	{
+		FZ_SIMD_CALL("fz_paint_solid_color_1_noda_sse2", dp, w,
+			fz_paint_solid_color_1_noda_sse2(dp, w, color),
+			fz_paint_solid_color_N_noda(dp, 1, w, color));
+		return;
+	}
+#endif
+	fz_paint_solid_color_N_noda(dp, 1, w, color);
+}
+
+static void
+paint_solid_color_3_noda(byte * restrict dp, int w, byte *color)
+{
+#ifdef FZ_SSE2
+	if (w >= 4)
+	{
+		FZ_SIMD_CALL("fz_paint_solid_color_3_noda_sse2", dp, w * 3,
+			fz_paint_solid_color_3_noda_sse2(dp, w, color),
+			fz_paint_solid_color_N_noda(dp, 3, w, color));
+		return;
+	}
+#endif
+	fz_paint_solid_color_N_noda(dp, 3, w, color);
+}
+
+static void
+paint_span_with_color_1_noda(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+#ifdef FZ_SSE2
+	if (w >= 8)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_color_1_noda_sse2", dp, w,
+			fz_paint_span_with_color_1_noda_sse2(dp, mp, w, color),
+			fz_paint_span_with_color_N_noda(dp, mp, 1, w, color));
+		return;
+	}
+#endif
+	fz_paint_span_with_color_N_noda(dp, mp, 1, w, color);
+}
+
+static void
+paint_span_with_mask_1_noda(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+#ifdef FZ_SSE2
+	if (w >= 8)
+	{
+		FZ_SIMD_CALL("fz_paint_span_with_mask_1_noda_sse2", dp, w,
+			fz_paint_span_with_mask_1_noda_sse2(dp, sp, mp, w),
+			fz_paint_span_with_mask_N_noda(dp, sp, mp, 2, w));
+		return;
+	}
+#endif
+	fz_paint_span_with_mask_N_noda(dp, sp, mp, 2, w);
+}
+
+static void
+paint_span_1_with_alpha_noda(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+#ifdef FZ_SSE2
+	if (w >= 8)
+	{
+		FZ_SIMD_CALL("fz_paint_span_1_with_alpha_noda_sse2", dp, w,
+			fz_paint_span_1_with_alpha_noda_sse2(dp, sp, w, alpha),
+			fz_paint_span_N_with_alpha_noda(dp, sp, 2, w, alpha));
+		return;
+	}
+#endif
+	fz_paint_span_N_with_alpha_noda(dp, sp, 2, w, alpha);
+}
+
+static void
+paint_span_1_noda(byte * restrict dp, byte * restrict sp, int w)
+{
+#ifdef FZ_SSE2
+	if (w >= 8)
+	{
+		FZ_SIMD_CALL("fz_paint_span_1_noda_sse2", dp, w,
+			fz_paint_span_1_noda_sse2(dp, sp, w),
+			fz_paint_span_N_noda(dp, sp, 2, w));
+		return;
+	}
+#endif
+	fz_paint_span_N_noda(dp, sp, 2, w);
+}
+
+void
+fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color, int da)
+{
+	if (!da)
+	{
+		switch (n)
+		{
+		case 1: paint_solid_color_1_noda(dp, w, color); break;
+		case 3: paint_solid_color_3_noda(dp, w, color); break;
+		default: fz_paint_solid_color_N_noda(dp, n, w, color); break;
+		}
+		return;
+	}
+	switch (n)
+	{
+	case 2: fz_paint_solid_color_2(dp, w, color); break;
+	case 4: fz_paint_solid_color_4(dp, w, color); break;
+	default: fz_paint_solid_color_N(dp, n, w, color); break;
+	}
+}
+
+void
+fz_paint_span_with_color(byte * restrict dp, byte * restrict mp, int n, int w, byte *color, int da)
+{
+	if (!da)
+	{
+		switch (n)
+		{
+		case 1: paint_span_with_color_1_noda(dp, mp, w, color); break;
+		case 3: paint_span_with_color_4(dp, 0, mp, w, color); break;
+		default: fz_paint_span_with_color_N_noda(dp, mp, n, w, color); break;
+		}
+		return;
+	}
+	switch (n)
+	{
+	case 2: fz_paint_span_with_color_2(dp, mp, w, color); break;
+	case 4: paint_span_with_color_4(dp, 1, mp, w, color); break;
+	default: fz_paint_span_with_color_N(dp, mp, n, w, color); break;
+	}
+}
+
+static void
+fz_paint_span_with_mask(byte * restrict dp, int da, byte * restrict sp, byte * restrict mp, int n, int w)
+{
+	if (!da)
+	{
+		switch (n)
+		{
+		case 2: paint_span_with_mask_1_noda(dp, sp, mp, w); break;
+		case 4: paint_span_with_mask_4(dp, 0, sp, mp, w); break;
+		default: fz_paint_span_with_mask_N_noda(dp, sp, mp, n, w); break;
+		}
+		return;
+	}
+	switch (n)
+	{
+	case 2: fz_paint_span_with_mask_2(dp, sp, mp, w); break;
+	case 4: paint_span_with_mask_4(dp, 1, sp, mp, w); break;
+	default: fz_paint_span_with_mask_N(dp, sp, mp, n, w); break;
+	}
+}
+
+void
+fz_paint_span(byte * restrict dp, int da, byte * restrict sp, int n, int w, int alpha)
+{
+	if (!da)
+	{
+		if (alpha == 255)
+		{
+			switch (n)
+			{
+			case 2: paint_span_1_noda(dp, sp, w); break;
+			case 4: paint_span_4(dp, 0, sp, w); break;
+			default: fz_paint_span_N_noda(dp, sp, n, w); break;
+			}
+		}
+		else if (alpha > 0)
+		{
+			switch (n)
+			{
+			case 2: paint_span_1_with_alpha_noda(dp, sp, w, alpha); break;
+			case 4: paint_span_4_with_alpha(dp, 0, sp, w, alpha); break;
+			default: fz_paint_span_N_with_alpha_noda(dp, sp, n, w, alpha); break;
+			}
+		}
+		return;
+	}
+	if (alpha == 255)
+	{
+		switch (n)
+		{
+		case 1: fz_paint_span_1(dp, sp, w); break;
+		case 2: fz_paint_span_2(dp, sp, w); break;
+		case 4: paint_span_4(dp, 1, sp, w); break;
+		default: fz_paint_span_N(dp, sp, n, w); break;
+		}
+	}
+	else if (alpha > 0)
+	{
+		switch (n)
+		{
+		case 2: fz_paint_span_2_with_alpha(dp, sp, w, alpha); break;
+		case 4: paint_span_4_with_alpha(dp, 1, sp, w, alpha); break;
+		default: fz_paint_span_N_with_alpha(dp, sp, n, w, alpha); break;
+		}
+	}
+}
+
+void
+fz_add_span_alpha(byte * restrict dp, const byte * restrict sp, int n, int w)
+{
+	int k;
+	while (w--)
+	{
+		for (k = 0; k < n; k++)
+			*dp++ = *sp++;
+		*dp++ = 255;
+	}
+}
+
+void
+fz_drop_span_alpha(byte * restrict dp, const byte * restrict sp, int n, int w)
+{
+	int k;
+	while (w--)
+	{
+		for (k = 0; k < n; k++)
+			*dp++ = *sp++;
+		sp++;
+	}
+}
+
+/*
+ * Pixmap blending functions
+ */
+
+void
+fz_paint_pixmap_with_bbox(fz_pixmap *dst, fz_pixmap *src, int alpha, fz_irect bbox)
+{
+	unsigned char *sp, *dp;
+	int x, y, w, h, n;
+	fz_irect bbox2;
+
+	assert(dst->n - dst->alpha == src->n - src->alpha && src->alpha);
+
+	fz_pixmap_bbox_no_ctx(dst, &bbox2);
+	fz_intersect_irect(&bbox, &bbox2);
+	fz_pixmap_bbox_no_ctx(src, &bbox2);
+	fz_intersect_irect(&bbox, &bbox2);
+
+	x = bbox.x0;
+	y = bbox.y0;
+	w = bbox.x1 - bbox.x0;
+	h = bbox.y1 - bbox.y0;
+	if ((w | h) == 0)
+		return;
+
+	n = src->n;
+	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
+	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+
+	while (h--)
+	{
+		fz_paint_span(dp, dst->alpha, sp, n, w, alpha);
+		sp += src->w * n;
+		dp += dst->w * dst->n;
+	}
+}
+
+void
+fz_paint_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha)
+{
+	unsigned char *sp, *dp;
+	fz_irect bbox;
+	fz_irect bbox2;
+	int x, y, w, h, n;
+
+	assert(dst->n - dst->alpha == src->n - src->alpha && src->alpha);
+
+	fz_pixmap_bbox_no_ctx(dst, &bbox);
+	fz_pixmap_bbox_no_ctx(src, &bbox2);
+	fz_intersect_irect(&bbox, &bbox2);
+
+	x = bbox.x0;
+	y = bbox.y0;
+	w = bbox.x1 - bbox.x0;
+	h = bbox.y1 - bbox.y0;
+	if ((w | h) == 0)
+		return;
+
+	n = src->n;
+	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
+	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+
+	while (h--)
+	{
+		fz_paint_span(dp, dst->alpha, sp, n, w, alpha);
+		sp += src->w * n;
+		dp += dst->w * dst->n;
+	}
+}
+
+void
+fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk)
+{
+	unsigned char *sp, *dp, *mp;
+	fz_irect bbox, bbox2;
+	int x, y, w, h, n;
+
+	assert(dst->n - dst->alpha == src->n - src->alpha && src->alpha);
+	assert(msk->n == 1);
+
+	fz_pixmap_bbox_no_ctx(dst, &bbox);
+	fz_pixmap_bbox_no_ctx(src, &bbox2);
+	fz_intersect_irect(&bbox, &bbox2);
+	fz_pixmap_bbox_no_ctx(msk, &bbox2);
+	fz_intersect_irect(&bbox, &bbox2);
+
+	x = bbox.x0;
+	y = bbox.y0;
+	w = bbox.x1 - bbox.x0;
+	h = bbox.y1 - bbox.y0;
+	if ((w | h) == 0)
+		return;
+
+	n = src->n;
+	sp = src->samples + (unsigned int)(((y - src->y) * src->w + (x - src->x)) * src->n);
+	mp = msk->samples + (unsigned int)(((y - msk->y) * msk->w + (x - msk->x)) * msk->n);
+	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
+
+	while (h--)
+	{
+		fz_paint_span_with_mask(dp, dst->alpha, sp, mp, n, w);
+		sp += src->w * n;
+		dp += dst->w * dst->n;
+		mp += msk->w;
+	}
+}
+
+static inline void
+fz_paint_glyph_mask(int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+{
+	while (h--)
+	{
+		int skip_xx, ww, len, extend;
+		unsigned char *runp;
+		unsigned char *ddp = dp;
+		int offset = ((int *)(glyph->data))[skip_y++];
+		if (offset >= 0)
+		{
+			int eol = 0;
+			runp = &glyph->data[offset];
 			extend = 0;
 			ww = w;
 			skip_xx = skip_x;
@@ -946,9 +2006,10 @@ intermediate_run:
 }
 
 static inline void
-fz_paint_glyph_alpha_N(unsigned char *colorbv, int n, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+fz_paint_glyph_alpha_N(unsigned char *colorbv, int n, int da, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
 {
-	int sa = FZ_EXPAND(colorbv[n-1]);
+	int n1 = n - da;
+	int sa = FZ_EXPAND(colorbv[n1]);
 	while (h--)
 	{
 		int skip_xx, ww, len, extend;
@@ -1043,9 +2104,12 @@ solid_run:
 							*ddp = FZ_BLEND(colorbv[k++], *ddp, sa);
 							ddp++;
 						}
-						while (k != n-1);
-						*ddp = FZ_BLEND(0xFF, *ddp, sa);
-						ddp++;
+						while (k != n1);
+						if (da)
+						{
+							*ddp = FZ_BLEND(0xFF, *ddp, sa);
+							ddp++;
+						}
 					}
 					while (--len);
 					break;
@@ -1067,9 +2131,12 @@ intermediate_run:
 							*ddp = FZ_BLEND(colorbv[k++], *ddp, a);
 							ddp++;
 						}
-						while (k != n-1);
-						*ddp = FZ_BLEND(0xFF, *ddp, a);
-						ddp++;
+						while (k != n1);
+						if (da)
+						{
+							*ddp = FZ_BLEND(0xFF, *ddp, a);
+							ddp++;
+						}
 					}
 					while (--len);
 					break;
@@ -1083,8 +2150,9 @@ intermediate_run:
 }
 
 static inline void
-fz_paint_glyph_solid_N(unsigned char *colorbv, int n, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+fz_paint_glyph_solid_N(unsigned char *colorbv, int n, int da, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
 {
+	int n1 = n - da;
 	while (h--)
 	{
 		int skip_xx, ww, len, extend;
@@ -1200,9 +2268,12 @@ intermediate_run:
 							*ddp = FZ_BLEND(colorbv[k++], *ddp, a);
 							ddp++;
 						}
-						while (k != n-1);
-						*ddp = FZ_BLEND(0xFF, *ddp, a);
-						ddp++;
+						while (k != n1);
+						if (da)
+						{
+							*ddp = FZ_BLEND(0xFF, *ddp, a);
+							ddp++;
+						}
 					}
 					while (--len);
 					break;
@@ -1216,36 +2287,72 @@ intermediate_run:
 }
 
 static inline void
-fz_paint_glyph_alpha(unsigned char *colorbv, int n, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+fz_paint_glyph_alpha(unsigned char *colorbv, int n, int da, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
 {
-	switch (n)
+	if (da)
 	{
-	case 4:
-		fz_paint_glyph_alpha_N(colorbv, 4, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
-	case 2:
-		fz_paint_glyph_alpha_N(colorbv, 2, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
-	default:
-		fz_paint_glyph_alpha_N(colorbv, n, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
+		switch (n)
+		{
+		case 4:
+			fz_paint_glyph_alpha_N(colorbv, 4, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		case 2:
+			fz_paint_glyph_alpha_N(colorbv, 2, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		default:
+			fz_paint_glyph_alpha_N(colorbv, n, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		}
+	}
+	else
+	{
+		switch (n)
+		{
+		case 3:
+			fz_paint_glyph_alpha_N(colorbv, 3, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		case 1:
+			fz_paint_glyph_alpha_N(colorbv, 1, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		default:
+			fz_paint_glyph_alpha_N(colorbv, n, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		}
 	}
 }
 
 static inline void
-fz_paint_glyph_solid(unsigned char *colorbv, int n, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
+fz_paint_glyph_solid(unsigned char *colorbv, int n, int da, int span, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
 {
-	switch (n)
+	if (da)
 	{
-	case 4:
-		fz_paint_glyph_solid_N(colorbv, 4, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
-	case 2:
-		fz_paint_glyph_solid_N(colorbv, 2, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
-	default:
-		fz_paint_glyph_solid_N(colorbv, n, span, dp, glyph, w, h, skip_x, skip_y);
-		break;
+		switch (n)
+		{
+		case 4:
+			fz_paint_glyph_solid_N(colorbv, 4, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		case 2:
+			fz_paint_glyph_solid_N(colorbv, 2, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		default:
+			fz_paint_glyph_solid_N(colorbv, n, 1, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		}
+	}
+	else
+	{
+		switch (n)
+		{
+		case 3:
+			fz_paint_glyph_solid_N(colorbv, 3, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		case 1:
+			fz_paint_glyph_solid_N(colorbv, 1, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		default:
+			fz_paint_glyph_solid_N(colorbv, n, 0, span, dp, glyph, w, h, skip_x, skip_y);
+			break;
+		}
 	}
 }
 
@@ -1254,10 +2361,11 @@ fz_paint_glyph(unsigned char *colorbv, fz_pixmap *dst, unsigned char *dp, fz_gly
 {
 	if (dst->colorspace)
 	{
-		if (colorbv[dst->n-1] == 255)
-			fz_paint_glyph_solid(colorbv, dst->n, dst->w * dst->n, dp, glyph, w, h, skip_x, skip_y);
-		else if (colorbv[dst->n-1] != 0)
-			fz_paint_glyph_alpha(colorbv, dst->n, dst->w * dst->n, dp, glyph, w, h, skip_x, skip_y);
+		int a = colorbv[dst->n - dst->alpha];
+		if (a == 255)
+			fz_paint_glyph_solid(colorbv, dst->n, dst->alpha, dst->w * dst->n, dp, glyph, w, h, skip_x, skip_y);
+		else if (a != 0)
+			fz_paint_glyph_alpha(colorbv, dst->n, dst->alpha, dst->w * dst->n, dp, glyph, w, h, skip_x, skip_y);
 	}
 	else
 		fz_paint_glyph_mask(dst->w, dp, glyph, w, h, skip_x, skip_y);
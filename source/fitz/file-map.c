@@ -0,0 +1,144 @@
+#include "mupdf/fitz.h"
+
+/* Map files into memory where the platform lets us, and read them in
+ * where it does not. Isolated into a file that can be modified on a
+ * per-platform basis if required. */
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#define HAVE_FILE_MAPPING
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_FILE_MAPPING
+#endif
+
+struct fz_file_mapping_s
+{
+	void *addr;
+	size_t len;
+	fz_buffer *buffer;
+};
+
+#ifdef HAVE_FILE_MAPPING
+
+#if defined(_WIN32) || defined(_WIN64)
+
+static void *
+map_file(fz_context *ctx, const char *filename, size_t *len)
+{
+	char *s = (char*)filename;
+	wchar_t *wname, *d;
+	HANDLE file, mapping;
+	LARGE_INTEGER size;
+	void *addr = NULL;
+	int c;
+
+	d = wname = fz_malloc(ctx, (strlen(filename)+1) * sizeof(wchar_t));
+	while (*s) {
+		s += fz_chartorune(&c, s);
+		*d++ = c;
+	}
+	*d = 0;
+	file = CreateFileW(wname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	fz_free(ctx, wname);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= SIZE_MAX)
+	{
+		mapping = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (mapping)
+		{
+			addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			*len = (size_t)size.QuadPart;
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	return addr;
+}
+
+static void
+unmap_file(void *addr, size_t len)
+{
+	UnmapViewOfFile(addr);
+}
+
+#else
+
+static void *
+map_file(fz_context *ctx, const char *filename, size_t *len)
+{
+	struct stat info;
+	void *addr = NULL;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && (unsigned long long)info.st_size <= SIZE_MAX)
+	{
+		addr = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED)
+			addr = NULL;
+		else
+			*len = (size_t)info.st_size;
+	}
+	close(fd);
+	return addr;
+}
+
+static void
+unmap_file(void *addr, size_t len)
+{
+	munmap(addr, len);
+}
+
+#endif
+
+#endif
+
+fz_file_mapping *
+fz_map_file(fz_context *ctx, const char *filename, unsigned char **data, size_t *len)
+{
+	fz_file_mapping *map = fz_malloc_struct(ctx, fz_file_mapping);
+
+#ifdef HAVE_FILE_MAPPING
+	map->addr = map_file(ctx, filename, &map->len);
+	if (map->addr)
+	{
+		*data = map->addr;
+		*len = map->len;
+		return map;
+	}
+#endif
+
+	/* Empty files, and those that cannot be mapped, are read in */
+	fz_try(ctx)
+		map->buffer = fz_read_file(ctx, filename);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, map);
+		fz_rethrow(ctx);
+	}
+	*data = map->buffer->data;
+	*len = map->buffer->len;
+	return map;
+}
+
+void
+fz_unmap_file(fz_context *ctx, fz_file_mapping *map)
+{
+	if (!map)
+		return;
+#ifdef HAVE_FILE_MAPPING
+	if (map->addr)
+		unmap_file(map->addr, map->len);
+#endif
+	fz_drop_buffer(ctx, map->buffer);
+	fz_free(ctx, map);
+}
@@ -406,6 +406,29 @@ fz_new_font_from_buffer(fz_context *ctx, const char *name, fz_buffer *buffer, in
 	return font;
 }
 
+fz_buffer *
+fz_font_data(fz_context *ctx, fz_font *font, int *index)
+{
+	FT_Face face = font->ft_face;
+	fz_buffer *buf;
+
+	if (!face)
+		return NULL;
+
+	*index = face->face_index;
+	if (font->ft_buffer)
+		return fz_keep_buffer(ctx, font->ft_buffer);
+	if (font->ft_filepath)
+		return fz_read_file(ctx, font->ft_filepath);
+	if (face->stream && face->stream->base)
+	{
+		buf = fz_new_buffer(ctx, face->stream->size);
+		fz_write_buffer(ctx, buf, face->stream->base, face->stream->size);
+		return buf;
+	}
+	fz_throw(ctx, FZ_ERROR_GENERIC, "cannot get data for font '%s'", font->name);
+}
+
 static fz_matrix *
 fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm)
 {
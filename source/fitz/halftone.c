@@ -137,7 +137,7 @@ static void make_ht_line(unsigned char *buf, fz_halftone *ht, int x, int y, int
 }
 
 /* Inner mono thresholding code */
-static void do_threshold_1(unsigned char *ht_line, unsigned char *pixmap, unsigned char *out, int w)
+static void do_threshold_1(unsigned char *ht_line, unsigned char *pixmap, unsigned char *out, int w, int n)
 {
 	int bit = 0x80;
 	int h = 0;
@@ -146,7 +146,7 @@ static void do_threshold_1(unsigned char *ht_line, unsigned char *pixmap, unsign
 	{
 		if (*pixmap < *ht_line++)
 			h |= bit;
-		pixmap += 2; /* Skip the alpha */
+		pixmap += n; /* Skip the alpha, if any */
 		bit >>= 1;
 		if (bit == 0)
 		{
@@ -171,9 +171,9 @@ fz_bitmap *fz_new_bitmap_from_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halfton
 	if (!pix)
 		return NULL;
 
-	assert(pix->n == 2); /* Mono + Alpha */
+	assert(pix->n - pix->alpha == 1); /* Mono, with or without alpha */
 
-	n = pix->n-1; /* Remove alpha */
+	n = 1;
 	if (ht == NULL)
 	{
 		ht = fz_default_halftone(ctx, n);
@@ -192,7 +192,7 @@ fz_bitmap *fz_new_bitmap_from_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halfton
 	while (h--)
 	{
 		make_ht_line(ht_line, ht, x, y++, w);
-		do_threshold_1(ht_line, p, o, w);
+		do_threshold_1(ht_line, p, o, w, pix->n);
 		o += ostride;
 		p += pstride;
 	}
@@ -1,5 +1,11 @@
 #include "mupdf/fitz.h"
 
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
 #define SANE_DPI 72.0f
 
 fz_pixmap *
@@ -78,7 +84,9 @@ static fz_store_type fz_image_store_type =
 	fz_keep_image_key,
 	fz_drop_image_key,
 	fz_cmp_image_key,
-	fz_print_image
+	fz_print_image,
+	NULL,
+	"fz_image"
 };
 
 static void
@@ -292,6 +300,28 @@ standard_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h, int *l
 	return tile;
 }
 
+/* Decode costs are measured against a monotonic wall clock in
+ * microseconds, as clock() counts the time used by every thread in the
+ * process, not just the one doing the decode. */
+static double
+decode_clock(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+#endif
+}
+
 fz_pixmap *
 fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 {
@@ -299,6 +329,8 @@ fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 	int l2factor, l2factor_remaining;
 	fz_image_key key;
 	fz_image_key *keyp;
+	double start;
+	unsigned int cost;
 
 	/* 'Simple' images created direct from pixmaps will have no buffer
 	 * of compressed data. We cannot do any better than just returning
@@ -341,6 +373,7 @@ fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 	/* We'll have to decode the image; request the correct amount of
 	 * downscaling. */
 	l2factor_remaining = l2factor;
+	start = decode_clock();
 	tile = image->get_pixmap(ctx, image, w, h, &l2factor_remaining);
 
 	/* l2factor_remaining is updated to the amount of subscaling left to do */
@@ -349,6 +382,7 @@ fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 	{
 		fz_subsample_pixmap(ctx, tile, l2factor_remaining);
 	}
+	cost = (unsigned int)(decode_clock() - start);
 
 	/* Now we try to cache the pixmap. Any failure here will just result
 	 * in us not caching. */
@@ -361,7 +395,7 @@ fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 		keyp->refs = 1;
 		keyp->image = fz_keep_image(ctx, image);
 		keyp->l2factor = l2factor;
-		existing_tile = fz_store_item(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type);
+		existing_tile = fz_store_item_with_cost(ctx, keyp, tile, fz_pixmap_size(ctx, tile), &fz_image_store_type, cost);
 		if (existing_tile)
 		{
 			/* We already have a tile. This must have been produced by a
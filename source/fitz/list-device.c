@@ -2,6 +2,9 @@
 
 typedef struct fz_display_node_s fz_display_node;
 typedef struct fz_list_device_s fz_list_device;
+typedef struct fz_display_span_s fz_display_span;
+typedef struct fz_display_index_s fz_display_index;
+typedef struct fz_list_file_s fz_list_file;
 
 #define STACK_SIZE 96
 
@@ -118,6 +121,48 @@ struct fz_display_list_s
 	fz_rect mediabox;
 	int max;
 	int len;
+	fz_display_index *index;
+	fz_list_file *file;
+};
+
+/* The spatial index splits the list into spans: single nodes at the
+ * top level, or whole clip/mask/group/tile blocks from the node that
+ * opens them to the node that closes them. A block whose first node
+ * is culled is skipped entirely on replay, so the rect of that node
+ * bounds the span. Each span records the unpacked state before its
+ * first node so that replay can start from it directly.
+ *
+ * Spans are entered into a uniform grid over their bounds. Spans that
+ * can never be culled, or that would cover much of the grid, are kept
+ * in a separate list that is always replayed.
+ */
+struct fz_display_span_s
+{
+	int start;
+	int end;
+	fz_rect bbox;
+
+	fz_rect rect;
+	fz_path *path;
+	fz_stroke_state *stroke;
+	fz_colorspace *colorspace;
+	int color;
+	float alpha;
+	fz_matrix ctm;
+};
+
+struct fz_display_index_s
+{
+	int len;
+	fz_display_span *spans;
+	int colors_len;
+	float *colors;
+	fz_rect bounds;
+	int gw, gh;
+	int *cell_start;
+	int *cell_spans;
+	int always_len;
+	int *always;
 };
 
 struct fz_list_device_s
@@ -147,6 +192,8 @@ enum { ISOLATED = 1, KNOCKOUT = 2 };
 #define SIZE_IN_NODES(t) \
 	((t + sizeof(fz_display_node) - 1) / sizeof(fz_display_node))
 
+static void fz_drop_display_index(fz_context *ctx, fz_display_index *index);
+
 static void
 fz_append_display_node(
 	fz_context *ctx,
@@ -182,6 +229,13 @@ fz_append_display_node(
 	fz_rect local_rect;
 	int path_size = 0;
 
+	/* Any index no longer covers the whole list */
+	if (list->index)
+	{
+		fz_drop_display_index(ctx, list->index);
+		list->index = NULL;
+	}
+
 	switch (cmd)
 	{
 	case FZ_CMD_CLIP_PATH:
@@ -1074,9 +1128,19 @@ fz_list_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const
 	}
 }
 
-static void
-fz_list_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color)
+typedef struct fz_list_mask_data_s fz_list_mask_data;
+
+struct fz_list_mask_data_s
+{
+	int id;
+};
+
+static int
+fz_list_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
 {
+	fz_list_mask_data mask;
+
+	mask.id = ctm ? id : 0;
 	fz_append_display_node(
 		ctx,
 		dev,
@@ -1087,10 +1151,11 @@ fz_list_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int lum
 		color,
 		colorspace,
 		NULL, /* alpha */
-		NULL, /* ctm */
+		ctm,
 		NULL, /* stroke */
-		NULL, /* private_data */
-		0); /* private_data_len */
+		&mask, /* private_data */
+		sizeof(mask)); /* private_data_len */
+	return 0;
 }
 
 static void
@@ -1257,6 +1322,9 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 {
 	fz_list_device *dev;
 
+	if (list->file)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot add to a display list loaded from a file");
+
 	dev = fz_new_device(ctx, sizeof(fz_list_device));
 
 	dev->super.begin_page = fz_list_begin_page;
@@ -1305,6 +1373,8 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 	return &dev->super;
 }
 
+static void fz_drop_list_file(fz_context *ctx, fz_list_file *file);
+
 static void
 fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 {
@@ -1394,7 +1464,11 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 
 		node = next;
 	}
-	fz_free(ctx, list->list);
+	fz_drop_display_index(ctx, list->index);
+	if (list->file)
+		fz_drop_list_file(ctx, list->file);
+	else
+		fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
 
@@ -1407,6 +1481,8 @@ fz_new_display_list(fz_context *ctx)
 	list->mediabox = fz_empty_rect;
 	list->max = 0;
 	list->len = 0;
+	list->index = NULL;
+	list->file = NULL;
 	return list;
 }
 
@@ -1429,15 +1505,65 @@ fz_bound_display_list(fz_context *ctx, fz_display_list *list, fz_rect *bounds)
 	return bounds;
 }
 
-void
-fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+static void
+fz_drop_display_index(fz_context *ctx, fz_display_index *index)
 {
-	fz_display_node *node;
-	fz_display_node *node_end;
-	fz_display_node *next_node;
-	int clipped = 0;
-	int tiled = 0;
-	int progress = 0;
+	if (index == NULL)
+		return;
+	fz_free(ctx, index->spans);
+	fz_free(ctx, index->colors);
+	fz_free(ctx, index->cell_start);
+	fz_free(ctx, index->cell_spans);
+	fz_free(ctx, index->always);
+	fz_free(ctx, index);
+}
+
+static int
+fz_display_span_always(fz_display_command cmd, const fz_rect *bbox)
+{
+	switch (cmd)
+	{
+	case FZ_CMD_BEGIN_PAGE:
+	case FZ_CMD_END_PAGE:
+	case FZ_CMD_BEGIN_TILE:
+	case FZ_CMD_END_TILE:
+	case FZ_CMD_RENDER_FLAGS:
+		return 1;
+	case FZ_CMD_POP_CLIP:
+	case FZ_CMD_END_GROUP:
+	case FZ_CMD_END_MASK:
+		/* Unbalanced; these are replayed even when culled */
+		return 1;
+	default:
+		return fz_is_infinite_rect(bbox);
+	}
+}
+
+static void
+fz_display_cell_range(fz_display_index *index, const fz_rect *r, int *x0, int *y0, int *x1, int *y1)
+{
+	float w = index->bounds.x1 - index->bounds.x0;
+	float h = index->bounds.y1 - index->bounds.y0;
+	float sx = w > 0 ? index->gw / w : 0;
+	float sy = h > 0 ? index->gh / h : 0;
+
+	*x0 = fz_clampi((int)floorf((r->x0 - index->bounds.x0) * sx), 0, index->gw - 1);
+	*x1 = fz_clampi((int)floorf((r->x1 - index->bounds.x0) * sx), 0, index->gw - 1);
+	*y0 = fz_clampi((int)floorf((r->y0 - index->bounds.y0) * sy), 0, index->gh - 1);
+	*y1 = fz_clampi((int)floorf((r->y1 - index->bounds.y0) * sy), 0, index->gh - 1);
+}
+
+static void
+fz_build_display_index(fz_context *ctx, fz_display_list *list, fz_display_index *index)
+{
+	fz_display_node *node = list->list;
+	fz_display_node *node_end = list->list + list->len;
+	int spans_max = 0;
+	int colors_max = 0;
+	int color_dirty = 1;
+	int depth = 0;
+	int i, n, g, nfinite, ncells, x, y, x0, y0, x1, y1;
+	unsigned char *kind;
 
 	/* Current graphics state as unpacked from list */
 	fz_path *path = NULL;
@@ -1447,38 +1573,41 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 	float color[FZ_MAX_COLORS] = { 0 };
 	fz_colorspace *colorspace = fz_device_gray(ctx);
 	fz_rect rect = { 0 };
+	fz_display_span *span = NULL;
 
-	/* Transformed versions of graphic state entries */
-	fz_rect trans_rect;
-	fz_matrix trans_ctm;
-	int tile_skip_depth = 0;
-
-	fz_var(colorspace);
-
-	if (!scissor)
-		scissor = &fz_infinite_rect;
-
-	if (cookie)
-	{
-		cookie->progress_max = list->len;
-		cookie->progress = 0;
-	}
-
-	node = list->list;
-	node_end = &list->list[list->len];
-	for (; node != node_end ; node = next_node)
+	while (node != node_end)
 	{
-		int empty;
 		fz_display_node n = *node;
+		fz_display_node *next = node + n.size;
+		int first = (depth == 0);
 
-		next_node = node + n.size;
-
-		/* Check the cookie for aborting */
-		if (cookie)
+		if (first)
 		{
-			if (cookie->abort)
-				break;
-			cookie->progress = progress++;
+			if (index->len == spans_max)
+			{
+				spans_max = spans_max ? spans_max * 2 : 256;
+				index->spans = fz_resize_array(ctx, index->spans, spans_max, sizeof(fz_display_span));
+			}
+			if (color_dirty)
+			{
+				if (index->colors_len + colorspace->n > colors_max)
+				{
+					colors_max = fz_maxi(colors_max * 2, 256);
+					index->colors = fz_resize_array(ctx, index->colors, colors_max, sizeof(float));
+				}
+				memcpy(index->colors + index->colors_len, color, colorspace->n * sizeof(float));
+				index->colors_len += colorspace->n;
+				color_dirty = 0;
+			}
+			span = &index->spans[index->len++];
+			span->start = node - list->list;
+			span->rect = rect;
+			span->path = path;
+			span->stroke = stroke;
+			span->colorspace = colorspace;
+			span->color = index->colors_len - colorspace->n;
+			span->alpha = alpha;
+			span->ctm = ctm;
 		}
 
 		node++;
@@ -1489,15 +1618,13 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 		}
 		if (n.cs)
 		{
-			int i;
-
-			fz_drop_colorspace(ctx, colorspace);
+			color_dirty = 1;
+			memset(color, 0, sizeof color);
 			switch (n.cs)
 			{
 			default:
 			case CS_GRAY_0:
 				colorspace = fz_device_gray(ctx);
-				color[0] = 0.0f;
 				break;
 			case CS_GRAY_1:
 				colorspace = fz_device_gray(ctx);
@@ -1505,46 +1632,33 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 				break;
 			case CS_RGB_0:
 				colorspace = fz_device_rgb(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
 				break;
 			case CS_RGB_1:
 				colorspace = fz_device_rgb(ctx);
-				color[0] = 1.0f;
-				color[1] = 1.0f;
-				color[2] = 1.0f;
+				color[0] = color[1] = color[2] = 1.0f;
 				break;
 			case CS_CMYK_0:
 				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 0.0f;
 				break;
 			case CS_CMYK_1:
 				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
 				color[3] = 1.0f;
 				break;
 			case CS_OTHER_0:
-				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
+				colorspace = *(fz_colorspace **)node;
 				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
-				for (i = 0; i < colorspace->n; i++)
-					color[i] = 0.0f;
 				break;
 			}
 		}
 		if (n.color)
 		{
+			color_dirty = 1;
 			memcpy(color, (float *)node, colorspace->n * sizeof(float));
 			node += SIZE_IN_NODES(colorspace->n * sizeof(float));
 		}
 		if (n.alpha)
 		{
-			switch(n.alpha)
+			switch (n.alpha)
 			{
 			default:
 			case ALPHA_0:
@@ -1583,180 +1697,3444 @@ fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, cons
 		}
 		if (n.stroke)
 		{
-			fz_drop_stroke_state(ctx, stroke);
-			stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
+			stroke = *(fz_stroke_state **)node;
 			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
 		}
 		if (n.path)
 		{
-			fz_drop_path(ctx, path);
-			path = fz_keep_path(ctx, (fz_path *)node);
+			path = (fz_path *)node;
 			node += SIZE_IN_NODES(fz_packed_path_size(path));
 		}
 
-		if (tile_skip_depth > 0)
+		/* The first node of a span is what replay culls on */
+		if (first)
+			span->bbox = fz_display_span_always(n.cmd, &rect) ? fz_infinite_rect : rect;
+
+		switch (n.cmd)
 		{
-			if (n.cmd == FZ_CMD_BEGIN_TILE)
-				tile_skip_depth++;
-			else if (n.cmd == FZ_CMD_END_TILE)
-				tile_skip_depth--;
-			if (tile_skip_depth > 0)
-				continue;
+		case FZ_CMD_CLIP_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+		case FZ_CMD_BEGIN_MASK:
+		case FZ_CMD_BEGIN_GROUP:
+		case FZ_CMD_BEGIN_TILE:
+			depth++;
+			break;
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+		case FZ_CMD_END_TILE:
+			if (depth > 0)
+				depth--;
+			break;
+		default:
+			break;
 		}
 
-		trans_rect = rect;
-		fz_transform_rect(&trans_rect, top_ctm);
-
-		/* cull objects to draw using a quick visibility test */
+		node = next;
+		if (depth == 0)
+			span->end = node - list->list;
+	}
+	if (span && depth > 0)
+		span->end = list->len;
 
-		if (tiled ||
-			n.cmd == FZ_CMD_BEGIN_TILE || n.cmd == FZ_CMD_END_TILE ||
-			n.cmd == FZ_CMD_BEGIN_PAGE || n.cmd == FZ_CMD_END_PAGE ||
-			n.cmd == FZ_CMD_RENDER_FLAGS)
+	/* Divide the spans between the grid and the always list */
+	n = index->len;
+	kind = fz_malloc(ctx, n);
+	fz_try(ctx)
+	{
+		nfinite = 0;
+		index->bounds = fz_empty_rect;
+		for (i = 0; i < n; i++)
 		{
-			empty = 0;
+			fz_rect *r = &index->spans[i].bbox;
+			if (fz_is_infinite_rect(r))
+				kind[i] = 1;
+			else if (fz_is_empty_rect(r))
+				kind[i] = 0;
+			else
+			{
+				kind[i] = 2;
+				fz_union_rect(&index->bounds, r);
+				nfinite++;
+			}
 		}
-		else
+
+		/* Aim for a handful of spans per cell */
+		g = fz_clampi((int)sqrtf(nfinite / 8.0f), 1, 64);
+		index->gw = index->gh = g;
+		ncells = g * g;
+		index->cell_start = fz_calloc(ctx, ncells + 1, sizeof(int));
+
+		for (i = 0; i < n; i++)
 		{
-			fz_rect irect = trans_rect;
-			fz_intersect_rect(&irect, scissor);
-			empty = fz_is_empty_rect(&irect);
+			if (kind[i] != 2)
+				continue;
+			fz_display_cell_range(index, &index->spans[i].bbox, &x0, &y0, &x1, &y1);
+			if (ncells > 16 && (x1 - x0 + 1) * (y1 - y0 + 1) > ncells / 4)
+			{
+				kind[i] = 1;
+				continue;
+			}
+			for (y = y0; y <= y1; y++)
+				for (x = x0; x <= x1; x++)
+					index->cell_start[y * g + x + 1]++;
 		}
+		for (i = 0; i < ncells; i++)
+			index->cell_start[i + 1] += index->cell_start[i];
+		index->cell_spans = fz_malloc_array(ctx, fz_maxi(index->cell_start[ncells], 1), sizeof(int));
 
-		if (clipped || empty)
+		for (i = 0; i < n; i++)
+			if (kind[i] == 1)
+				index->always_len++;
+		index->always = fz_malloc_array(ctx, fz_maxi(index->always_len, 1), sizeof(int));
+		index->always_len = 0;
+
+		/* Fill in order so that each cell lists its spans in
+		 * list order; cell_start is advanced as we go and then
+		 * shifted back. */
+		for (i = 0; i < n; i++)
 		{
-			switch (n.cmd)
+			if (kind[i] == 1)
+				index->always[index->always_len++] = i;
+			else if (kind[i] == 2)
 			{
-			case FZ_CMD_CLIP_PATH:
-			case FZ_CMD_CLIP_STROKE_PATH:
-			case FZ_CMD_CLIP_TEXT:
-			case FZ_CMD_CLIP_STROKE_TEXT:
-			case FZ_CMD_CLIP_IMAGE_MASK:
-			case FZ_CMD_BEGIN_MASK:
-			case FZ_CMD_BEGIN_GROUP:
-				clipped++;
-				continue;
-			case FZ_CMD_POP_CLIP:
-			case FZ_CMD_END_GROUP:
-				if (!clipped)
-					goto visible;
-				clipped--;
-				continue;
-			case FZ_CMD_END_MASK:
-				if (!clipped)
-					goto visible;
-				continue;
-			default:
-				continue;
+				fz_display_cell_range(index, &index->spans[i].bbox, &x0, &y0, &x1, &y1);
+				for (y = y0; y <= y1; y++)
+					for (x = x0; x <= x1; x++)
+						index->cell_spans[index->cell_start[y * g + x]++] = i;
 			}
 		}
+		for (i = ncells; i > 0; i--)
+			index->cell_start[i] = index->cell_start[i - 1];
+		index->cell_start[0] = 0;
+	}
+	fz_always(ctx)
+		fz_free(ctx, kind);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
 
-visible:
-		fz_concat(&trans_ctm, &ctm, top_ctm);
+void
+fz_index_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_index *index;
 
-		fz_try(ctx)
+	if (list->index)
+		return;
+
+	index = fz_malloc_struct(ctx, fz_display_index);
+	fz_try(ctx)
+		fz_build_display_index(ctx, list, index);
+	fz_catch(ctx)
+	{
+		fz_drop_display_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+	list->index = index;
+}
+
+/* Mark the spans that may be visible through area (given in the
+ * coordinate space of the list) in a bitmap. */
+static unsigned int *
+fz_mark_display_spans(fz_context *ctx, fz_display_index *index, const fz_rect *area)
+{
+	unsigned int *marks = fz_calloc(ctx, (index->len + 31) / 32 + 1, sizeof(unsigned int));
+	int i, j, x, y, x0, y0, x1, y1;
+
+	for (i = 0; i < index->always_len; i++)
+		marks[index->always[i] >> 5] |= 1u << (index->always[i] & 31);
+
+	if (fz_is_empty_rect(&index->bounds) ||
+		area->x1 < index->bounds.x0 || area->x0 > index->bounds.x1 ||
+		area->y1 < index->bounds.y0 || area->y0 > index->bounds.y1)
+		return marks;
+
+	fz_display_cell_range(index, area, &x0, &y0, &x1, &y1);
+	for (y = y0; y <= y1; y++)
+	{
+		for (x = x0; x <= x1; x++)
 		{
-			switch (n.cmd)
+			int c = y * index->gw + x;
+			for (j = index->cell_start[c]; j < index->cell_start[c + 1]; j++)
 			{
-			case FZ_CMD_BEGIN_PAGE:
-				fz_begin_page(ctx, dev, &trans_rect, &trans_ctm);
-				break;
-			case FZ_CMD_END_PAGE:
-				fz_end_page(ctx, dev);
-				break;
-			case FZ_CMD_FILL_PATH:
-				fz_fill_path(ctx, dev, path, n.flags, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_STROKE_PATH:
-				fz_stroke_path(ctx, dev, path, stroke, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_CLIP_PATH:
-				fz_clip_path(ctx, dev, path, &trans_rect, n.flags, &trans_ctm);
-				break;
-			case FZ_CMD_CLIP_STROKE_PATH:
-				fz_clip_stroke_path(ctx, dev, path, &trans_rect, stroke, &trans_ctm);
-				break;
-			case FZ_CMD_FILL_TEXT:
-				fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_STROKE_TEXT:
-				fz_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_CLIP_TEXT:
-				fz_clip_text(ctx, dev, *(fz_text **)node, &trans_ctm);
-				break;
-			case FZ_CMD_CLIP_STROKE_TEXT:
-				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm);
-				break;
-			case FZ_CMD_IGNORE_TEXT:
-				fz_ignore_text(ctx, dev, *(fz_text **)node, &trans_ctm);
-				break;
-			case FZ_CMD_FILL_SHADE:
-				if ((dev->hints & FZ_IGNORE_SHADE) == 0)
-					fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, alpha);
+				fz_display_span *span = &index->spans[index->cell_spans[j]];
+				if (span->bbox.x1 >= area->x0 && span->bbox.x0 <= area->x1 &&
+					span->bbox.y1 >= area->y0 && span->bbox.y0 <= area->y1)
+					marks[index->cell_spans[j] >> 5] |= 1u << (index->cell_spans[j] & 31);
+			}
+		}
+	}
+
+	return marks;
+}
+
+static int
+fz_next_display_span(fz_display_index *index, unsigned int *marks, int i)
+{
+	while (i < index->len)
+	{
+		unsigned int m = marks[i >> 5] >> (i & 31);
+		if (m == 0)
+		{
+			i = (i | 31) + 1;
+			continue;
+		}
+		while ((m & 1) == 0)
+			m >>= 1, i++;
+		return i;
+	}
+	return index->len;
+}
+
+/* As fz_run_display_list, but also stops when *abort is set, if abort
+ * is not NULL. Bands drawn in parallel each have a cookie of their own,
+ * and watch the caller's abort flag through this. */
+static void
+run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie, const int *abort)
+{
+	fz_display_node *node;
+	fz_display_node *node_end;
+	fz_display_node *next_node;
+	int clipped = 0;
+	int tiled = 0;
+	int progress = 0;
+
+	/* Current graphics state as unpacked from list */
+	fz_path *path = NULL;
+	float alpha = 1.0f;
+	fz_matrix ctm = fz_identity;
+	fz_stroke_state *stroke = NULL;
+	float color[FZ_MAX_COLORS] = { 0 };
+	fz_colorspace *colorspace = fz_device_gray(ctx);
+	fz_rect rect = { 0 };
+
+	/* Transformed versions of graphic state entries */
+	fz_rect trans_rect;
+	fz_matrix trans_ctm;
+	int tile_skip_depth = 0;
+	int mask_skip_depth = 0;
+
+	/* Spans of an indexed list that may be visible */
+	fz_display_index *index = list->index;
+	unsigned int *marks = NULL;
+	int span = -1;
+	int span_end = 0;
+
+	fz_var(colorspace);
+
+	if (!scissor)
+		scissor = &fz_infinite_rect;
+
+	/* The index is only consulted for transforms that keep rects
+	 * axis aligned, so that culling on it in the coordinates of the
+	 * list matches culling the transformed rects. */
+	if (index && !fz_is_infinite_rect(scissor) &&
+		((top_ctm->b == 0 && top_ctm->c == 0) || (top_ctm->a == 0 && top_ctm->d == 0)))
+	{
+		fz_matrix inv;
+		fz_rect area = *scissor;
+
+		if (!fz_try_invert_matrix(&inv, top_ctm))
+		{
+			area.x0 -= 1;
+			area.y0 -= 1;
+			area.x1 += 1;
+			area.y1 += 1;
+			fz_transform_rect(&area, &inv);
+			marks = fz_mark_display_spans(ctx, index, &area);
+		}
+	}
+
+	if (cookie)
+	{
+		cookie->progress_max = list->len;
+		cookie->progress = 0;
+	}
+
+	node = list->list;
+	node_end = &list->list[list->len];
+	for (; node != node_end ; node = next_node)
+	{
+		int empty;
+		fz_display_node n;
+
+		/* Skip to the next span that may be visible, picking up the
+		 * state recorded for it if we have passed over others. */
+		if (marks && node - list->list == span_end)
+		{
+			int i = fz_next_display_span(index, marks, span + 1);
+			fz_display_span *s;
+
+			if (i == index->len)
 				break;
-			case FZ_CMD_FILL_IMAGE:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, alpha);
+			s = &index->spans[i];
+			if (s->start != span_end)
+			{
+				fz_drop_path(ctx, path);
+				path = fz_keep_path(ctx, s->path);
+				fz_drop_stroke_state(ctx, stroke);
+				stroke = fz_keep_stroke_state(ctx, s->stroke);
+				fz_drop_colorspace(ctx, colorspace);
+				colorspace = fz_keep_colorspace(ctx, s->colorspace);
+				memcpy(color, index->colors + s->color, colorspace->n * sizeof(float));
+				alpha = s->alpha;
+				ctm = s->ctm;
+				rect = s->rect;
+				node = list->list + s->start;
+			}
+			span = i;
+			span_end = s->end;
+		}
+
+		n = *node;
+		next_node = node + n.size;
+
+		/* Check the cookie for aborting */
+		if (cookie)
+		{
+			if (cookie->abort || (abort && *abort))
 				break;
-			case FZ_CMD_FILL_IMAGE_MASK:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, colorspace, color, alpha);
+			cookie->progress = progress++;
+		}
+
+		node++;
+		if (n.rect)
+		{
+			rect = *(fz_rect *)node;
+			node += SIZE_IN_NODES(sizeof(fz_rect));
+		}
+		if (n.cs)
+		{
+			int i;
+
+			fz_drop_colorspace(ctx, colorspace);
+			switch (n.cs)
+			{
+			default:
+			case CS_GRAY_0:
+				colorspace = fz_device_gray(ctx);
+				color[0] = 0.0f;
 				break;
-			case FZ_CMD_CLIP_IMAGE_MASK:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_clip_image_mask(ctx, dev, *(fz_image **)node, &trans_rect, &trans_ctm);
+			case CS_GRAY_1:
+				colorspace = fz_device_gray(ctx);
+				color[0] = 1.0f;
 				break;
-			case FZ_CMD_POP_CLIP:
-				fz_pop_clip(ctx, dev);
+			case CS_RGB_0:
+				colorspace = fz_device_rgb(ctx);
+				color[0] = 0.0f;
+				color[1] = 0.0f;
+				color[2] = 0.0f;
 				break;
-			case FZ_CMD_BEGIN_MASK:
-				fz_begin_mask(ctx, dev, &trans_rect, n.flags, colorspace, color);
+			case CS_RGB_1:
+				colorspace = fz_device_rgb(ctx);
+				color[0] = 1.0f;
+				color[1] = 1.0f;
+				color[2] = 1.0f;
 				break;
-			case FZ_CMD_END_MASK:
-				fz_end_mask(ctx, dev);
+			case CS_CMYK_0:
+				colorspace = fz_device_cmyk(ctx);
+				color[0] = 0.0f;
+				color[1] = 0.0f;
+				color[2] = 0.0f;
+				color[3] = 0.0f;
 				break;
-			case FZ_CMD_BEGIN_GROUP:
-				fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), alpha);
+			case CS_CMYK_1:
+				colorspace = fz_device_cmyk(ctx);
+				color[0] = 0.0f;
+				color[1] = 0.0f;
+				color[2] = 0.0f;
+				color[3] = 1.0f;
 				break;
-			case FZ_CMD_END_GROUP:
-				fz_end_group(ctx, dev);
+			case CS_OTHER_0:
+				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
+				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+				for (i = 0; i < colorspace->n; i++)
+					color[i] = 0.0f;
 				break;
-			case FZ_CMD_BEGIN_TILE:
+			}
+		}
+		if (n.color)
+		{
+			memcpy(color, (float *)node, colorspace->n * sizeof(float));
+			node += SIZE_IN_NODES(colorspace->n * sizeof(float));
+		}
+		if (n.alpha)
+		{
+			switch(n.alpha)
 			{
-				int cached;
-				fz_list_tile_data *data = (fz_list_tile_data *)node;
-				fz_rect tile_rect;
-				tiled++;
-				tile_rect = data->view;
-				cached = fz_begin_tile_id(ctx, dev, &rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
-				if (cached)
-					tile_skip_depth = 1;
+			default:
+			case ALPHA_0:
+				alpha = 0.0f;
 				break;
-			}
-			case FZ_CMD_END_TILE:
-				tiled--;
-				fz_end_tile(ctx, dev);
+			case ALPHA_1:
+				alpha = 1.0f;
 				break;
-			case FZ_CMD_RENDER_FLAGS:
-				if (n.flags == 0)
-					fz_render_flags(ctx, dev, 0, FZ_DEVFLAG_GRIDFIT_AS_TILED);
-				else if (n.flags == 1)
-					fz_render_flags(ctx, dev, FZ_DEVFLAG_GRIDFIT_AS_TILED, 0);
+			case ALPHA_PRESENT:
+				alpha = *(float *)node;
+				node += SIZE_IN_NODES(sizeof(float));
 				break;
 			}
 		}
-		fz_catch(ctx)
+		if (n.ctm != 0)
 		{
-			/* Swallow the error */
-			if (cookie)
-				cookie->errors++;
-			if (fz_caught(ctx) == FZ_ERROR_ABORT)
-				break;
-			fz_warn(ctx, "Ignoring error during interpretation");
+			float *packed_ctm = (float *)node;
+			if (n.ctm & CTM_CHANGE_AD)
+			{
+				ctm.a = *packed_ctm++;
+				ctm.d = *packed_ctm++;
+				node += SIZE_IN_NODES(2*sizeof(float));
+			}
+			if (n.ctm & CTM_CHANGE_BC)
+			{
+				ctm.b = *packed_ctm++;
+				ctm.c = *packed_ctm++;
+				node += SIZE_IN_NODES(2*sizeof(float));
+			}
+			if (n.ctm & CTM_CHANGE_EF)
+			{
+				ctm.e = *packed_ctm++;
+				ctm.f = *packed_ctm;
+				node += SIZE_IN_NODES(2*sizeof(float));
+			}
 		}
-	}
-	fz_drop_colorspace(ctx, colorspace);
-	fz_drop_stroke_state(ctx, stroke);
-	fz_drop_path(ctx, path);
+		if (n.stroke)
+		{
+			fz_drop_stroke_state(ctx, stroke);
+			stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
+			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+		if (n.path)
+		{
+			fz_drop_path(ctx, path);
+			path = fz_keep_path(ctx, (fz_path *)node);
+			node += SIZE_IN_NODES(fz_packed_path_size(path));
+		}
+
+		if (tile_skip_depth > 0)
+		{
+			if (n.cmd == FZ_CMD_BEGIN_TILE)
+				tile_skip_depth++;
+			else if (n.cmd == FZ_CMD_END_TILE)
+				tile_skip_depth--;
+			if (tile_skip_depth > 0)
+				continue;
+		}
+
+		if (mask_skip_depth > 0)
+		{
+			if (n.cmd == FZ_CMD_BEGIN_MASK)
+				mask_skip_depth++;
+			else if (n.cmd == FZ_CMD_END_MASK)
+				mask_skip_depth--;
+			if (mask_skip_depth > 0)
+				continue;
+		}
+
+		trans_rect = rect;
+		fz_transform_rect(&trans_rect, top_ctm);
+
+		/* cull objects to draw using a quick visibility test */
+
+		if (tiled ||
+			n.cmd == FZ_CMD_BEGIN_TILE || n.cmd == FZ_CMD_END_TILE ||
+			n.cmd == FZ_CMD_BEGIN_PAGE || n.cmd == FZ_CMD_END_PAGE ||
+			n.cmd == FZ_CMD_RENDER_FLAGS)
+		{
+			empty = 0;
+		}
+		else
+		{
+			fz_rect irect = trans_rect;
+			fz_intersect_rect(&irect, scissor);
+			empty = fz_is_empty_rect(&irect);
+		}
+
+		if (clipped || empty)
+		{
+			switch (n.cmd)
+			{
+			case FZ_CMD_CLIP_PATH:
+			case FZ_CMD_CLIP_STROKE_PATH:
+			case FZ_CMD_CLIP_TEXT:
+			case FZ_CMD_CLIP_STROKE_TEXT:
+			case FZ_CMD_CLIP_IMAGE_MASK:
+			case FZ_CMD_BEGIN_MASK:
+			case FZ_CMD_BEGIN_GROUP:
+				clipped++;
+				continue;
+			case FZ_CMD_POP_CLIP:
+			case FZ_CMD_END_GROUP:
+				if (!clipped)
+					goto visible;
+				clipped--;
+				continue;
+			case FZ_CMD_END_MASK:
+				if (!clipped)
+					goto visible;
+				continue;
+			default:
+				continue;
+			}
+		}
+
+visible:
+		fz_concat(&trans_ctm, &ctm, top_ctm);
+
+		fz_try(ctx)
+		{
+			switch (n.cmd)
+			{
+			case FZ_CMD_BEGIN_PAGE:
+				fz_begin_page(ctx, dev, &trans_rect, &trans_ctm);
+				break;
+			case FZ_CMD_END_PAGE:
+				fz_end_page(ctx, dev);
+				break;
+			case FZ_CMD_FILL_PATH:
+				fz_fill_path(ctx, dev, path, n.flags, &trans_ctm, colorspace, color, alpha);
+				break;
+			case FZ_CMD_STROKE_PATH:
+				fz_stroke_path(ctx, dev, path, stroke, &trans_ctm, colorspace, color, alpha);
+				break;
+			case FZ_CMD_CLIP_PATH:
+				fz_clip_path(ctx, dev, path, &trans_rect, n.flags, &trans_ctm);
+				break;
+			case FZ_CMD_CLIP_STROKE_PATH:
+				fz_clip_stroke_path(ctx, dev, path, &trans_rect, stroke, &trans_ctm);
+				break;
+			case FZ_CMD_FILL_TEXT:
+				fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, colorspace, color, alpha);
+				break;
+			case FZ_CMD_STROKE_TEXT:
+				fz_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, colorspace, color, alpha);
+				break;
+			case FZ_CMD_CLIP_TEXT:
+				fz_clip_text(ctx, dev, *(fz_text **)node, &trans_ctm);
+				break;
+			case FZ_CMD_CLIP_STROKE_TEXT:
+				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm);
+				break;
+			case FZ_CMD_IGNORE_TEXT:
+				fz_ignore_text(ctx, dev, *(fz_text **)node, &trans_ctm);
+				break;
+			case FZ_CMD_FILL_SHADE:
+				if ((dev->hints & FZ_IGNORE_SHADE) == 0)
+					fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, alpha);
+				break;
+			case FZ_CMD_FILL_IMAGE:
+				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+					fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, alpha);
+				break;
+			case FZ_CMD_FILL_IMAGE_MASK:
+				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+					fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, colorspace, color, alpha);
+				break;
+			case FZ_CMD_CLIP_IMAGE_MASK:
+				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+					fz_clip_image_mask(ctx, dev, *(fz_image **)node, &trans_rect, &trans_ctm);
+				break;
+			case FZ_CMD_POP_CLIP:
+				fz_pop_clip(ctx, dev);
+				break;
+			case FZ_CMD_BEGIN_MASK:
+			{
+				fz_list_mask_data *data = (fz_list_mask_data *)node;
+				if (fz_begin_mask_id(ctx, dev, &trans_rect, n.flags, colorspace, color, &trans_ctm, data->id))
+					mask_skip_depth = 1;
+				break;
+			}
+			case FZ_CMD_END_MASK:
+				fz_end_mask(ctx, dev);
+				break;
+			case FZ_CMD_BEGIN_GROUP:
+				fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), alpha);
+				break;
+			case FZ_CMD_END_GROUP:
+				fz_end_group(ctx, dev);
+				break;
+			case FZ_CMD_BEGIN_TILE:
+			{
+				int cached;
+				fz_list_tile_data *data = (fz_list_tile_data *)node;
+				fz_rect tile_rect;
+				tiled++;
+				tile_rect = data->view;
+				cached = fz_begin_tile_id(ctx, dev, &rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
+				if (cached)
+					tile_skip_depth = 1;
+				break;
+			}
+			case FZ_CMD_END_TILE:
+				tiled--;
+				fz_end_tile(ctx, dev);
+				break;
+			case FZ_CMD_RENDER_FLAGS:
+				if (n.flags == 0)
+					fz_render_flags(ctx, dev, 0, FZ_DEVFLAG_GRIDFIT_AS_TILED);
+				else if (n.flags == 1)
+					fz_render_flags(ctx, dev, FZ_DEVFLAG_GRIDFIT_AS_TILED, 0);
+				break;
+			}
+		}
+		fz_catch(ctx)
+		{
+			/* Swallow the error */
+			if (cookie)
+				cookie->errors++;
+			if (fz_caught(ctx) == FZ_ERROR_ABORT)
+				break;
+			fz_warn(ctx, "Ignoring error during interpretation");
+		}
+	}
+	fz_free(ctx, marks);
+	fz_drop_colorspace(ctx, colorspace);
+	fz_drop_stroke_state(ctx, stroke);
+	fz_drop_path(ctx, path);
+}
+
+void
+fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+{
+	run_display_list(ctx, list, dev, top_ctm, scissor, cookie, NULL);
+}
+
+typedef struct
+{
+	fz_context *ctx;
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *dest;
+	int hints;
+	int band_height;
+	fz_cookie *cookie;
+	int hits, misses;
+	size_t peak;
+} fz_band_job;
+
+static void
+fz_render_display_list_band(fz_context *ctx, void *arg, int i)
+{
+	fz_band_job *job = (fz_band_job *)arg;
+	fz_pixmap *dest = job->dest;
+	fz_pixmap *band = NULL;
+	fz_device *dev = NULL;
+	fz_cookie cookie = { 0 };
+	int hits = 0, misses = 0;
+	size_t peak = 0;
+	fz_irect bbox;
+	fz_rect area;
+
+	fz_var(band);
+	fz_var(dev);
+	fz_var(hits);
+	fz_var(misses);
+	fz_var(peak);
+
+	bbox.x0 = dest->x;
+	bbox.x1 = dest->x + dest->w;
+	bbox.y0 = dest->y + i * job->band_height;
+	bbox.y1 = fz_mini(bbox.y0 + job->band_height, dest->y + dest->h);
+	if (bbox.y1 <= bbox.y0)
+		return;
+
+	fz_try(ctx)
+	{
+		/* Each band draws into its own pixmap header over the
+		 * rows of dest, so no band can touch another's pixels.
+		 * The header must match dest in alpha, and so in n and
+		 * the length of a row. */
+		band = fz_new_pixmap_with_bbox_alpha_and_data(ctx, dest->colorspace, &bbox, dest->alpha,
+			dest->samples + (size_t)(bbox.y0 - dest->y) * dest->w * dest->n);
+		band->interpolate = dest->interpolate;
+		band->xres = dest->xres;
+		band->yres = dest->yres;
+
+		fz_rect_from_irect(&area, &bbox);
+		area.y0 -= 1;
+		area.y1 += 1;
+
+		if (job->cookie)
+			cookie.incomplete_ok = job->cookie->incomplete_ok;
+
+		dev = fz_new_draw_device_for_band(ctx, band, fz_pixmap_bbox(ctx, dest, &bbox));
+		fz_enable_device_hints(ctx, dev, job->hints);
+		run_display_list(ctx, job->list, dev, &job->ctm, &area, &cookie, job->cookie ? &job->cookie->abort : NULL);
+		/* Devices dropped on the caller's context count themselves;
+		 * those on clones are added to it once all bands are done. */
+		if (ctx != job->ctx)
+			fz_draw_device_pool_stats(ctx, dev, &hits, &misses, &peak);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, band);
+
+		/* Bands may run at once, so add up their peaks. */
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		job->hits += hits;
+		job->misses += misses;
+		job->peak += peak;
+		if (job->cookie)
+		{
+			job->cookie->progress += cookie.progress;
+			job->cookie->errors += cookie.errors;
+			job->cookie->incomplete |= cookie.incomplete;
+		}
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+void
+fz_render_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *pix, int hints, int nthreads, fz_cookie *cookie)
+{
+	fz_band_job job;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > pix->h)
+		nthreads = fz_maxi(pix->h, 1);
+
+	job.ctx = ctx;
+	job.list = list;
+	job.ctm = *ctm;
+	job.dest = pix;
+	job.hints = hints;
+	job.band_height = (pix->h + nthreads - 1) / nthreads;
+	job.cookie = cookie;
+	job.hits = 0;
+	job.misses = 0;
+	job.peak = 0;
+
+	if (cookie)
+	{
+		cookie->progress_max = list->len * nthreads;
+		cookie->progress = 0;
+	}
+
+	fz_try(ctx)
+	{
+		fz_run_jobs(ctx, nthreads, fz_render_display_list_band, &job);
+	}
+	fz_always(ctx)
+	{
+		fz_add_draw_pool_stats(ctx, job.hits, job.misses, job.peak);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/*
+ * Display list optimisation.
+ *
+ * The list is run twice through devices of our own. The first pass
+ * records what each call draws or clips to, and from that we decide
+ * which calls to drop, which text to merge and which clips to merge.
+ * The second pass sees exactly the same calls, and passes on those we
+ * keep to a list device that builds the new node stream.
+ */
+
+typedef struct fz_optimize_record_s fz_optimize_record;
+typedef struct fz_optimize_device_s fz_optimize_device;
+
+struct fz_optimize_record_s
+{
+	unsigned char cmd;
+	unsigned char keep;
+	unsigned char protect; /* inside a tile or mask definition */
+	unsigned char rect_clip; /* clip to an axis aligned rectangle */
+	unsigned char occluder; /* opaque axis aligned rectangle fill */
+	unsigned char similar; /* text that could be merged with the call before */
+	unsigned char merged; /* clip that has absorbed the one inside it */
+	int match; /* for blocks, the index of the call at the other end */
+	int kept; /* for blocks, the number of calls in them that we keep */
+	fz_rect bbox; /* what is drawn, or for blocks the area clipped to */
+	fz_rect content; /* for blocks, the union of what is drawn inside */
+};
+
+#define OPTIMIZE_OCCLUDERS 8
+
+struct fz_optimize_device_s
+{
+	fz_device super;
+
+	/* The calls seen so far */
+	fz_optimize_record *rec;
+	int len, max;
+
+	/* The blocks we are in, and the area they clip to */
+	int top, stack_max;
+	int *stack;
+	fz_rect *scissor;
+	int protect;
+	int knockout;
+
+	/* The last text filled, to check for text that can be merged */
+	fz_font *text_font;
+	fz_colorspace *text_colorspace;
+	float text_color[FZ_MAX_COLORS];
+	float text_alpha;
+	fz_matrix text_ctm;
+
+	/* For the second pass */
+	fz_device *target;
+	int pos;
+	fz_text *text;
+};
+
+/* Axis aligned rectangles, as the device will see them */
+
+typedef struct
+{
+	int len;
+	fz_point p[5];
+} rect_path_arg;
+
+static void
+rect_path_moveto(fz_context *ctx, void *arg_, float x, float y)
+{
+	rect_path_arg *arg = (rect_path_arg *)arg_;
+	if (arg->len == 0)
+	{
+		arg->p[0].x = x;
+		arg->p[0].y = y;
+		arg->len = 1;
+	}
+	else
+		arg->len = 6;
+}
+
+static void
+rect_path_lineto(fz_context *ctx, void *arg_, float x, float y)
+{
+	rect_path_arg *arg = (rect_path_arg *)arg_;
+	if (arg->len >= 1 && arg->len < 5)
+	{
+		arg->p[arg->len].x = x;
+		arg->p[arg->len].y = y;
+		arg->len++;
+	}
+	else
+		arg->len = 6;
+}
+
+static void
+rect_path_curveto(fz_context *ctx, void *arg_, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	((rect_path_arg *)arg_)->len = 6;
+}
+
+static void
+rect_path_close(fz_context *ctx, void *arg_)
+{
+}
+
+static const fz_path_processor rect_path_proc =
+{
+	rect_path_moveto,
+	rect_path_lineto,
+	rect_path_curveto,
+	rect_path_close,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+/* Is the path a single axis aligned rectangle once transformed? */
+static int
+fz_is_rect_path(fz_context *ctx, fz_path *path, const fz_matrix *ctm, fz_rect *r)
+{
+	rect_path_arg arg;
+	fz_point *p = arg.p;
+	int i;
+
+	arg.len = 0;
+	fz_process_path(ctx, &rect_path_proc, &arg, path);
+	if (arg.len == 5 && p[4].x == p[0].x && p[4].y == p[0].y)
+		arg.len = 4;
+	if (arg.len != 4)
+		return 0;
+
+	for (i = 0; i < 4; i++)
+		fz_transform_point(&p[i], ctm);
+	if (!(p[0].x == p[1].x && p[1].y == p[2].y && p[2].x == p[3].x && p[3].y == p[0].y) &&
+		!(p[0].y == p[1].y && p[1].x == p[2].x && p[2].y == p[3].y && p[3].x == p[0].x))
+		return 0;
+
+	r->x0 = fz_min(p[0].x, p[2].x);
+	r->x1 = fz_max(p[0].x, p[2].x);
+	r->y0 = fz_min(p[0].y, p[2].y);
+	r->y1 = fz_max(p[0].y, p[2].y);
+	return 1;
+}
+
+static int
+fz_contains_rect(const fz_rect *outer, const fz_rect *inner)
+{
+	return inner->x0 >= outer->x0 && inner->x1 <= outer->x1 && inner->y0 >= outer->y0 && inner->y1 <= outer->y1;
+}
+
+/* First pass: record the calls */
+
+static fz_optimize_record *
+optimize_record(fz_context *ctx, fz_optimize_device *dev, int cmd, const fz_rect *bbox)
+{
+	fz_optimize_record *rec;
+
+	if (dev->len == dev->max)
+	{
+		int new_max = dev->max ? dev->max * 2 : 256;
+		dev->rec = fz_resize_array(ctx, dev->rec, new_max, sizeof(fz_optimize_record));
+		dev->max = new_max;
+	}
+	rec = &dev->rec[dev->len++];
+	memset(rec, 0, sizeof *rec);
+	rec->cmd = cmd;
+	rec->keep = 1;
+	rec->protect = dev->protect > 0;
+	rec->match = -1;
+	rec->bbox = bbox ? *bbox : fz_infinite_rect;
+	rec->content = fz_empty_rect;
+	dev->text_font = NULL;
+	return rec;
+}
+
+/* Something is drawn: drop it if nothing of it can be seen */
+static fz_optimize_record *
+optimize_content(fz_context *ctx, fz_optimize_device *dev, int cmd, const fz_rect *bbox, float alpha)
+{
+	fz_optimize_record *rec = optimize_record(ctx, dev, cmd, bbox);
+	fz_rect visible = *bbox;
+
+	if (dev->top > 0)
+		fz_intersect_rect(&visible, &dev->scissor[dev->top - 1]);
+	if (!rec->protect && (fz_is_empty_rect(&visible) || (alpha == 0 && dev->knockout == 0)))
+	{
+		rec->keep = 0;
+		return rec;
+	}
+	if (dev->top > 0)
+	{
+		fz_optimize_record *parent = &dev->rec[dev->stack[dev->top - 1]];
+		parent->kept++;
+		fz_union_rect(&parent->content, &visible);
+	}
+	return rec;
+}
+
+static void
+optimize_push(fz_context *ctx, fz_optimize_device *dev, int cmd, const fz_rect *area)
+{
+	fz_optimize_record *rec = optimize_record(ctx, dev, cmd, area);
+
+	if (dev->top == dev->stack_max)
+	{
+		int new_max = dev->stack_max ? dev->stack_max * 2 : 32;
+		dev->stack = fz_resize_array(ctx, dev->stack, new_max, sizeof(int));
+		dev->scissor = fz_resize_array(ctx, dev->scissor, new_max, sizeof(fz_rect));
+		dev->stack_max = new_max;
+	}
+	dev->scissor[dev->top] = rec->bbox;
+	if (dev->top > 0)
+		fz_intersect_rect(&dev->scissor[dev->top], &dev->scissor[dev->top - 1]);
+	dev->stack[dev->top++] = dev->len - 1;
+}
+
+static void
+optimize_pop(fz_context *ctx, fz_optimize_device *dev, int cmd)
+{
+	fz_optimize_record *rec, *open;
+	int i;
+
+	if (dev->top == 0)
+	{
+		optimize_record(ctx, dev, cmd, NULL);
+		return;
+	}
+	i = dev->stack[--dev->top];
+	rec = optimize_record(ctx, dev, cmd, NULL);
+	open = &dev->rec[i];
+	open->match = dev->len - 1;
+	rec->match = i;
+
+	/* Blocks with nothing left in them go; otherwise they count as
+	 * content of the block they are in. */
+	if (open->kept == 0 && !open->protect && open->cmd != FZ_CMD_BEGIN_TILE)
+	{
+		int k;
+		for (k = i; k < dev->len; k++)
+			dev->rec[k].keep = 0;
+	}
+	else if (dev->top > 0)
+	{
+		fz_optimize_record *parent = &dev->rec[dev->stack[dev->top - 1]];
+		fz_rect area = open->content;
+		if (open->cmd == FZ_CMD_BEGIN_TILE)
+			area = fz_infinite_rect;
+		fz_intersect_rect(&area, &open->bbox);
+		parent->kept++;
+		fz_union_rect(&parent->content, &area);
+	}
+}
+
+static void
+optimize_clip_path(fz_context *ctx, fz_device *dev_, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+	int is_rect;
+
+	fz_bound_path(ctx, path, NULL, ctm, &bbox);
+	if (rect)
+		fz_intersect_rect(&bbox, rect);
+	is_rect = fz_is_rect_path(ctx, path, ctm, &bbox);
+	if (is_rect && rect)
+		fz_intersect_rect(&bbox, rect);
+	optimize_push(ctx, dev, FZ_CMD_CLIP_PATH, &bbox);
+	dev->rec[dev->len - 1].rect_clip = is_rect;
+}
+
+static void
+optimize_clip_stroke_path(fz_context *ctx, fz_device *dev_, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_path(ctx, path, stroke, ctm, &bbox);
+	if (rect)
+		fz_intersect_rect(&bbox, rect);
+	optimize_push(ctx, dev, FZ_CMD_CLIP_STROKE_PATH, &bbox);
+}
+
+static void
+optimize_clip_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_text(ctx, text, NULL, ctm, &bbox);
+	optimize_push(ctx, dev, FZ_CMD_CLIP_TEXT, &bbox);
+}
+
+static void
+optimize_clip_stroke_text(fz_context *ctx, fz_device *dev_, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_text(ctx, text, stroke, ctm, &bbox);
+	optimize_push(ctx, dev, FZ_CMD_CLIP_STROKE_TEXT, &bbox);
+}
+
+static void
+optimize_clip_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_rect *rect, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox = fz_unit_rect;
+
+	fz_transform_rect(&bbox, ctm);
+	if (rect)
+		fz_intersect_rect(&bbox, rect);
+	optimize_push(ctx, dev, FZ_CMD_CLIP_IMAGE_MASK, &bbox);
+}
+
+static void
+optimize_pop_clip(fz_context *ctx, fz_device *dev_)
+{
+	optimize_pop(ctx, (fz_optimize_device *)dev_, FZ_CMD_POP_CLIP);
+}
+
+static int
+optimize_begin_mask(fz_context *ctx, fz_device *dev_, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	/* Masks with a backdrop can let through what lies outside their
+	 * area, so a mask does not clip what it applies to. What makes
+	 * up the mask is left alone. */
+	optimize_push(ctx, dev, FZ_CMD_BEGIN_MASK, &fz_infinite_rect);
+	dev->protect++;
+	return 0;
+}
+
+static void
+optimize_end_mask(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	dev->protect--;
+	optimize_record(ctx, dev, FZ_CMD_END_MASK, NULL);
+}
+
+static void
+optimize_begin_group(fz_context *ctx, fz_device *dev_, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	/* Groups are drawn into a pixmap of their area, so they clip */
+	optimize_push(ctx, dev, FZ_CMD_BEGIN_GROUP, rect);
+	if (knockout)
+	{
+		dev->knockout++;
+		dev->rec[dev->len - 1].occluder = 1;
+	}
+}
+
+static void
+optimize_end_group(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	if (dev->top > 0 && dev->rec[dev->stack[dev->top - 1]].occluder)
+		dev->knockout--;
+	optimize_pop(ctx, dev, FZ_CMD_END_GROUP);
+}
+
+static int
+optimize_begin_tile(fz_context *ctx, fz_device *dev_, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	/* Tile contents are in the space of the tile, and left alone */
+	optimize_push(ctx, dev, FZ_CMD_BEGIN_TILE, &fz_infinite_rect);
+	dev->protect++;
+	return 0;
+}
+
+static void
+optimize_end_tile(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	dev->protect--;
+	optimize_pop(ctx, dev, FZ_CMD_END_TILE);
+}
+
+static void
+optimize_fill_path(fz_context *ctx, fz_device *dev_, fz_path *path, int even_odd, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_optimize_record *rec;
+	fz_rect bbox;
+	int is_rect = fz_is_rect_path(ctx, path, ctm, &bbox);
+
+	if (!is_rect)
+		fz_bound_path(ctx, path, NULL, ctm, &bbox);
+	rec = optimize_content(ctx, dev, FZ_CMD_FILL_PATH, &bbox, alpha);
+
+	/* Only a fill outside of any clip or group is sure to hide
+	 * everything beneath it. */
+	rec->occluder = is_rect && alpha == 1 && dev->top == 0 && rec->keep;
+}
+
+static void
+optimize_stroke_path(fz_context *ctx, fz_device *dev_, fz_path *path, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_path(ctx, path, stroke, ctm, &bbox);
+	optimize_content(ctx, dev, FZ_CMD_STROKE_PATH, &bbox, alpha);
+}
+
+static fz_font *
+fz_text_font(fz_text *text)
+{
+	fz_text_span *span;
+	fz_font *font = text->head ? text->head->font : NULL;
+
+	for (span = text->head; span; span = span->next)
+		if (span->font != font)
+			return NULL;
+	return font;
+}
+
+static void
+optimize_fill_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_font *font = fz_text_font(text);
+	int similar;
+	fz_rect bbox;
+
+	similar = font && font == dev->text_font && colorspace == dev->text_colorspace &&
+		alpha == dev->text_alpha && !memcmp(ctm, &dev->text_ctm, sizeof *ctm) &&
+		!memcmp(color, dev->text_color, colorspace->n * sizeof(float));
+
+	fz_bound_text(ctx, text, NULL, ctm, &bbox);
+	optimize_content(ctx, dev, FZ_CMD_FILL_TEXT, &bbox, alpha)->similar = similar;
+
+	dev->text_font = font;
+	dev->text_colorspace = colorspace;
+	memcpy(dev->text_color, color, colorspace->n * sizeof(float));
+	dev->text_alpha = alpha;
+	dev->text_ctm = *ctm;
+}
+
+static void
+optimize_stroke_text(fz_context *ctx, fz_device *dev_, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_text(ctx, text, stroke, ctm, &bbox);
+	optimize_content(ctx, dev, FZ_CMD_STROKE_TEXT, &bbox, alpha);
+}
+
+static void
+optimize_ignore_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	/* Invisible text is only there to be found, so keep it */
+	optimize_content(ctx, dev, FZ_CMD_IGNORE_TEXT, &fz_infinite_rect, 1);
+}
+
+static void
+optimize_fill_shade(fz_context *ctx, fz_device *dev_, fz_shade *shade, const fz_matrix *ctm, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox;
+
+	fz_bound_shade(ctx, shade, ctm, &bbox);
+	optimize_content(ctx, dev, FZ_CMD_FILL_SHADE, &bbox, alpha);
+}
+
+static void
+optimize_fill_image(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_matrix *ctm, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox = fz_unit_rect;
+
+	fz_transform_rect(&bbox, ctm);
+	optimize_content(ctx, dev, FZ_CMD_FILL_IMAGE, &bbox, alpha);
+}
+
+static void
+optimize_fill_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_rect bbox = fz_unit_rect;
+
+	fz_transform_rect(&bbox, ctm);
+	optimize_content(ctx, dev, FZ_CMD_FILL_IMAGE_MASK, &bbox, alpha);
+}
+
+static void
+optimize_begin_page(fz_context *ctx, fz_device *dev_, const fz_rect *rect, const fz_matrix *ctm)
+{
+	optimize_record(ctx, (fz_optimize_device *)dev_, FZ_CMD_BEGIN_PAGE, NULL);
+}
+
+static void
+optimize_end_page(fz_context *ctx, fz_device *dev_)
+{
+	optimize_record(ctx, (fz_optimize_device *)dev_, FZ_CMD_END_PAGE, NULL);
+}
+
+static void
+optimize_render_flags(fz_context *ctx, fz_device *dev_, int set, int clear)
+{
+	optimize_record(ctx, (fz_optimize_device *)dev_, FZ_CMD_RENDER_FLAGS, NULL);
+}
+
+static void
+drop_optimize_device(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+
+	fz_free(ctx, dev->rec);
+	fz_free(ctx, dev->stack);
+	fz_free(ctx, dev->scissor);
+	fz_drop_text(ctx, dev->text);
+}
+
+/* Decide what to keep once we have seen everything */
+
+/* Remove what later opaque rectangles hide. Only calls and blocks
+ * outside of any other block are considered, and only a handful of
+ * the largest rectangles are remembered as we work back through them. */
+static void
+optimize_occlusion(fz_context *ctx, fz_optimize_device *dev)
+{
+	fz_rect occluders[OPTIMIZE_OCCLUDERS];
+	int count = 0;
+	int i, k, end;
+
+	for (end = dev->len; end > 0; end = i)
+	{
+		fz_optimize_record *rec;
+		fz_rect area;
+
+		/* Find the start of the call or block that ends here */
+		i = end - 1;
+		rec = &dev->rec[i];
+		if (rec->match >= 0 && rec->match < i)
+			i = rec->match;
+		rec = &dev->rec[i];
+		if (!rec->keep)
+			continue;
+
+		switch (rec->cmd)
+		{
+		case FZ_CMD_BEGIN_PAGE:
+		case FZ_CMD_END_PAGE:
+		case FZ_CMD_RENDER_FLAGS:
+		case FZ_CMD_IGNORE_TEXT:
+		case FZ_CMD_BEGIN_TILE:
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+		case FZ_CMD_END_TILE:
+		case FZ_CMD_END_MASK:
+			continue;
+		}
+
+		area = rec->bbox;
+		if (rec->match > i)
+		{
+			fz_intersect_rect(&area, &rec->content);
+			if (rec->cmd == FZ_CMD_BEGIN_MASK)
+				area = rec->content;
+		}
+
+		for (k = 0; k < count; k++)
+		{
+			if (fz_contains_rect(&occluders[k], &area))
+			{
+				int last = rec->match > i ? rec->match : i;
+				int j;
+				for (j = i; j <= last; j++)
+					dev->rec[j].keep = 0;
+				break;
+			}
+		}
+		if (k < count || !rec->occluder || rec->cmd != FZ_CMD_FILL_PATH)
+			continue;
+
+		/* Remember the rectangle, in place of the smallest one if
+		 * we have too many already. */
+		if (count < OPTIMIZE_OCCLUDERS)
+			occluders[count++] = rec->bbox;
+		else
+		{
+			float size = (rec->bbox.x1 - rec->bbox.x0) * (rec->bbox.y1 - rec->bbox.y0);
+			int smallest = 0;
+			float smallest_size = FLT_MAX;
+			for (k = 0; k < count; k++)
+			{
+				float s = (occluders[k].x1 - occluders[k].x0) * (occluders[k].y1 - occluders[k].y0);
+				if (s < smallest_size)
+				{
+					smallest = k;
+					smallest_size = s;
+				}
+			}
+			if (size > smallest_size)
+				occluders[smallest] = rec->bbox;
+		}
+	}
+}
+
+/* Merge rectangular clips whose only content is another rectangular
+ * clip. The blocks end in order, so by the time we get to a block the
+ * ones inside it have already been merged. */
+static void
+optimize_clips(fz_context *ctx, fz_optimize_device *dev)
+{
+	int i, k;
+
+	for (i = 0; i < dev->len; i++)
+	{
+		fz_optimize_record *close = &dev->rec[i];
+		fz_optimize_record *open, *only = NULL;
+		int count = 0;
+
+		if (close->cmd != FZ_CMD_POP_CLIP || !close->keep || close->match < 0)
+			continue;
+		open = &dev->rec[close->match];
+		if (open->cmd != FZ_CMD_CLIP_PATH || !open->rect_clip)
+			continue;
+
+		for (k = close->match + 1; k < i && count < 2; k++)
+		{
+			if (!dev->rec[k].keep)
+				continue;
+			only = &dev->rec[k];
+			count++;
+			if (only->match > k)
+				k = only->match;
+		}
+		if (count != 1 || only->cmd != FZ_CMD_CLIP_PATH || !only->rect_clip)
+			continue;
+
+		fz_intersect_rect(&open->bbox, &only->bbox);
+		open->merged = 1;
+		only->keep = 0;
+		dev->rec[only->match].keep = 0;
+	}
+}
+
+/* Second pass: pass on what we keep */
+
+static fz_optimize_record *
+optimize_next(fz_context *ctx, fz_optimize_device *dev)
+{
+	if (dev->pos >= dev->len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "display list changed while optimizing");
+	return &dev->rec[dev->pos++];
+}
+
+static void
+rewrite_begin_page(fz_context *ctx, fz_device *dev_, const fz_rect *rect, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_begin_page(ctx, dev->target, rect, ctm);
+}
+
+static void
+rewrite_end_page(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_end_page(ctx, dev->target);
+}
+
+static void
+rewrite_fill_path(fz_context *ctx, fz_device *dev_, fz_path *path, int even_odd, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_fill_path(ctx, dev->target, path, even_odd, ctm, colorspace, color, alpha);
+}
+
+static void
+rewrite_stroke_path(fz_context *ctx, fz_device *dev_, fz_path *path, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_stroke_path(ctx, dev->target, path, stroke, ctm, colorspace, color, alpha);
+}
+
+static void
+rewrite_clip_path(fz_context *ctx, fz_device *dev_, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_optimize_record *rec = optimize_next(ctx, dev);
+	fz_path *merged;
+
+	if (!rec->keep)
+		return;
+	if (!rec->merged)
+	{
+		fz_clip_path(ctx, dev->target, path, rect, even_odd, ctm);
+		return;
+	}
+
+	merged = fz_new_path(ctx);
+	fz_try(ctx)
+	{
+		fz_rectto(ctx, merged, rec->bbox.x0, rec->bbox.y0, rec->bbox.x1, rec->bbox.y1);
+		fz_clip_path(ctx, dev->target, merged, &rec->bbox, 0, &fz_identity);
+	}
+	fz_always(ctx)
+		fz_drop_path(ctx, merged);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+rewrite_clip_stroke_path(fz_context *ctx, fz_device *dev_, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_clip_stroke_path(ctx, dev->target, path, rect, stroke, ctm);
+}
+
+static void
+fz_append_text(fz_context *ctx, fz_text *dst, fz_text *src)
+{
+	fz_text_span *span;
+	fz_matrix trm;
+	int i;
+
+	for (span = src->head; span; span = span->next)
+	{
+		trm = span->trm;
+		for (i = 0; i < span->len; i++)
+		{
+			trm.e = span->items[i].x;
+			trm.f = span->items[i].y;
+			fz_add_text(ctx, dst, span->font, span->wmode, &trm, span->items[i].gid, span->items[i].ucs);
+		}
+	}
+}
+
+static void
+rewrite_fill_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	fz_optimize_record *rec = optimize_next(ctx, dev);
+	int join_next;
+
+	if (!rec->keep)
+		return;
+
+	/* Collect runs of similar text, and fill them as one */
+	join_next = dev->pos < dev->len && dev->rec[dev->pos].keep && dev->rec[dev->pos].similar;
+	if (!dev->text && !join_next)
+	{
+		fz_fill_text(ctx, dev->target, text, ctm, colorspace, color, alpha);
+		return;
+	}
+	if (!dev->text)
+		dev->text = fz_new_text(ctx);
+	fz_append_text(ctx, dev->text, text);
+	if (!join_next)
+	{
+		fz_text *merged = dev->text;
+		dev->text = NULL;
+		fz_try(ctx)
+			fz_fill_text(ctx, dev->target, merged, ctm, colorspace, color, alpha);
+		fz_always(ctx)
+			fz_drop_text(ctx, merged);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+}
+
+static void
+rewrite_stroke_text(fz_context *ctx, fz_device *dev_, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_stroke_text(ctx, dev->target, text, stroke, ctm, colorspace, color, alpha);
+}
+
+static void
+rewrite_clip_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_clip_text(ctx, dev->target, text, ctm);
+}
+
+static void
+rewrite_clip_stroke_text(fz_context *ctx, fz_device *dev_, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_clip_stroke_text(ctx, dev->target, text, stroke, ctm);
+}
+
+static void
+rewrite_ignore_text(fz_context *ctx, fz_device *dev_, fz_text *text, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_ignore_text(ctx, dev->target, text, ctm);
+}
+
+static void
+rewrite_fill_shade(fz_context *ctx, fz_device *dev_, fz_shade *shade, const fz_matrix *ctm, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_fill_shade(ctx, dev->target, shade, ctm, alpha);
+}
+
+static void
+rewrite_fill_image(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_matrix *ctm, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_fill_image(ctx, dev->target, image, ctm, alpha);
+}
+
+static void
+rewrite_fill_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_fill_image_mask(ctx, dev->target, image, ctm, colorspace, color, alpha);
+}
+
+static void
+rewrite_clip_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image, const fz_rect *rect, const fz_matrix *ctm)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_clip_image_mask(ctx, dev->target, image, rect, ctm);
+}
+
+static void
+rewrite_pop_clip(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_pop_clip(ctx, dev->target);
+}
+
+static int
+rewrite_begin_mask(fz_context *ctx, fz_device *dev_, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_begin_mask_id(ctx, dev->target, rect, luminosity, colorspace, color, ctm, id);
+	return 0;
+}
+
+static void
+rewrite_end_mask(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_end_mask(ctx, dev->target);
+}
+
+static void
+rewrite_begin_group(fz_context *ctx, fz_device *dev_, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_begin_group(ctx, dev->target, rect, isolated, knockout, blendmode, alpha);
+}
+
+static void
+rewrite_end_group(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_end_group(ctx, dev->target);
+}
+
+static int
+rewrite_begin_tile(fz_context *ctx, fz_device *dev_, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_begin_tile_id(ctx, dev->target, area, view, xstep, ystep, ctm, id);
+	return 0;
+}
+
+static void
+rewrite_end_tile(fz_context *ctx, fz_device *dev_)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_end_tile(ctx, dev->target);
+}
+
+static void
+rewrite_render_flags(fz_context *ctx, fz_device *dev_, int set, int clear)
+{
+	fz_optimize_device *dev = (fz_optimize_device *)dev_;
+	if (optimize_next(ctx, dev)->keep)
+		fz_render_flags(ctx, dev->target, set, clear);
+}
+
+static fz_optimize_device *
+fz_new_optimize_device(fz_context *ctx)
+{
+	fz_optimize_device *dev = fz_new_device(ctx, sizeof(fz_optimize_device));
+
+	dev->super.begin_page = optimize_begin_page;
+	dev->super.end_page = optimize_end_page;
+
+	dev->super.fill_path = optimize_fill_path;
+	dev->super.stroke_path = optimize_stroke_path;
+	dev->super.clip_path = optimize_clip_path;
+	dev->super.clip_stroke_path = optimize_clip_stroke_path;
+
+	dev->super.fill_text = optimize_fill_text;
+	dev->super.stroke_text = optimize_stroke_text;
+	dev->super.clip_text = optimize_clip_text;
+	dev->super.clip_stroke_text = optimize_clip_stroke_text;
+	dev->super.ignore_text = optimize_ignore_text;
+
+	dev->super.fill_shade = optimize_fill_shade;
+	dev->super.fill_image = optimize_fill_image;
+	dev->super.fill_image_mask = optimize_fill_image_mask;
+	dev->super.clip_image_mask = optimize_clip_image_mask;
+
+	dev->super.pop_clip = optimize_pop_clip;
+
+	dev->super.begin_mask = optimize_begin_mask;
+	dev->super.end_mask = optimize_end_mask;
+	dev->super.begin_group = optimize_begin_group;
+	dev->super.end_group = optimize_end_group;
+
+	dev->super.begin_tile = optimize_begin_tile;
+	dev->super.end_tile = optimize_end_tile;
+
+	dev->super.render_flags = optimize_render_flags;
+
+	dev->super.drop_imp = drop_optimize_device;
+
+	return dev;
+}
+
+static void
+fz_rewrite_with_optimize_device(fz_optimize_device *dev, fz_device *target)
+{
+	dev->super.begin_page = rewrite_begin_page;
+	dev->super.end_page = rewrite_end_page;
+
+	dev->super.fill_path = rewrite_fill_path;
+	dev->super.stroke_path = rewrite_stroke_path;
+	dev->super.clip_path = rewrite_clip_path;
+	dev->super.clip_stroke_path = rewrite_clip_stroke_path;
+
+	dev->super.fill_text = rewrite_fill_text;
+	dev->super.stroke_text = rewrite_stroke_text;
+	dev->super.clip_text = rewrite_clip_text;
+	dev->super.clip_stroke_text = rewrite_clip_stroke_text;
+	dev->super.ignore_text = rewrite_ignore_text;
+
+	dev->super.fill_shade = rewrite_fill_shade;
+	dev->super.fill_image = rewrite_fill_image;
+	dev->super.fill_image_mask = rewrite_fill_image_mask;
+	dev->super.clip_image_mask = rewrite_clip_image_mask;
+
+	dev->super.pop_clip = rewrite_pop_clip;
+
+	dev->super.begin_mask = rewrite_begin_mask;
+	dev->super.end_mask = rewrite_end_mask;
+	dev->super.begin_group = rewrite_begin_group;
+	dev->super.end_group = rewrite_end_group;
+
+	dev->super.begin_tile = rewrite_begin_tile;
+	dev->super.end_tile = rewrite_end_tile;
+
+	dev->super.render_flags = rewrite_render_flags;
+
+	dev->target = target;
+	dev->pos = 0;
+}
+
+void
+fz_optimize_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_optimize_device *dev = NULL;
+	fz_device *writer = NULL;
+	fz_display_list *out = NULL;
+	fz_cookie cookie = { 0 };
+	fz_display_node *nodes;
+	fz_list_file *file;
+	int len, max;
+
+	fz_var(dev);
+	fz_var(writer);
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		dev = fz_new_optimize_device(ctx);
+		fz_run_display_list(ctx, list, &dev->super, &fz_identity, NULL, &cookie);
+		if (cookie.errors)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot analyse display list");
+
+		optimize_occlusion(ctx, dev);
+		optimize_clips(ctx, dev);
+
+		out = fz_new_display_list(ctx);
+		writer = fz_new_list_device(ctx, out);
+		fz_rewrite_with_optimize_device(dev, writer);
+		fz_run_display_list(ctx, list, &dev->super, &fz_identity, NULL, &cookie);
+		if (cookie.errors || dev->pos != dev->len)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot rewrite display list");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, writer);
+		if (dev)
+			fz_drop_device(ctx, &dev->super);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, out);
+		fz_rethrow_message(ctx, "cannot optimize display list");
+	}
+
+	/* Swap the new nodes in, and let the old ones go with the
+	 * temporary list. */
+	nodes = list->list;
+	len = list->len;
+	max = list->max;
+	file = list->file;
+	list->list = out->list;
+	list->len = out->len;
+	list->max = out->max;
+	list->file = NULL;
+	out->list = nodes;
+	out->len = len;
+	out->max = max;
+	out->file = file;
+	fz_drop_display_index(ctx, list->index);
+	list->index = NULL;
+	fz_drop_display_list(ctx, out);
+}
+
+/*
+ * Display list files.
+ *
+ * A display list is saved as the node stream it is held in memory as,
+ * with every pointer the nodes hold (to colorspaces, stroke states,
+ * text, shades and images) replaced by a 1 based index into a table of
+ * resources stored alongside. Fonts, the display lists of type 3
+ * glyphs, and the data of paths too long to be packed flat are stored
+ * as resources in their own right. Resources only refer to those that
+ * come before them in the table; the list itself is the last one.
+ *
+ * Node streams are aligned so that the lists loaded from a file can
+ * use the nodes in place in the file as mapped by fz_map_file, with
+ * the indexes patched back into pointers. Only the pages of the mapping
+ * that are patched are copied. Everything is stored in native
+ * byte order, so files can only be loaded by builds with the same byte
+ * order, pointer size and node layout as the one that saved them.
+ */
+
+#define LIST_FILE_MAGIC "MuDL"
+#define LIST_FILE_VERSION 4
+#define LIST_FILE_ALIGN 8
+
+enum
+{
+	RES_COLORSPACE = 1,
+	RES_STROKE,
+	RES_TEXT,
+	RES_SHADE,
+	RES_IMAGE,
+	RES_FONT,
+	RES_LIST,
+	RES_PATH
+};
+
+enum
+{
+	CS_FILE_DEVICE,
+	CS_FILE_INDEXED,
+	CS_FILE_SEPARATION
+};
+
+/* The tint functions of Separation and DeviceN colorspaces are saved
+ * as samples on a regular grid over the unit cube of their inputs, and
+ * loaded as functions that interpolate between the samples. The grid
+ * is as fine as TINT_MAX_SAMPLES points allow, and no finer than
+ * TINT_MAX_GRID along each input. As every point of the cube is worked
+ * out from the corners of its grid cell, colorspaces with more than
+ * TINT_MAX_INPUTS components are not saved. */
+#define TINT_MAX_SAMPLES 65536
+#define TINT_MAX_GRID 1025
+#define TINT_MAX_INPUTS 8
+
+static int
+tint_grid(int m)
+{
+	int g, i, size;
+
+	for (g = 2; g < TINT_MAX_GRID; g++)
+	{
+		for (size = 1, i = 0; i < m; i++)
+			size *= g + 1;
+		if (size > TINT_MAX_SAMPLES)
+			break;
+	}
+	return g;
+}
+
+typedef struct fz_list_file_header_s fz_list_file_header;
+typedef struct fz_list_file_entry_s fz_list_file_entry;
+
+struct fz_list_file_header_s
+{
+	char magic[4];
+	int version;
+	int byte_order;
+	int pointer_size;
+	int node_size;
+	int resources;
+	int table;
+	int list;
+};
+
+struct fz_list_file_entry_s
+{
+	int type;
+	int offset;
+	int len;
+};
+
+struct fz_list_file_s
+{
+	int refs;
+	unsigned char *data;
+	size_t len;
+	fz_file_mapping *map;
+};
+
+typedef void *(fz_list_ref_fn)(fz_context *ctx, void *arg, int type, void *slot);
+
+/* Call fn for every resource that the nodes of a list refer to. For
+ * paths, slot is the packed path itself; for everything else it is
+ * where the pointer to the resource is kept. fn returns the resource,
+ * so that we can find the number of components of a colorspace. */
+static void
+fz_walk_display_refs(fz_context *ctx, fz_display_node *node, int len, fz_list_ref_fn *fn, void *arg)
+{
+	fz_display_node *node_end = node + len;
+	int cs_n = 1;
+	int have_path = 0;
+	int have_stroke = 0;
+	int depth = 0;
+
+	while (node < node_end)
+	{
+		fz_display_node n = *node;
+		fz_display_node *next = node + n.size;
+		fz_colorspace *cs;
+
+		if (n.size == 0 || next > node_end || n.cmd > FZ_CMD_RENDER_FLAGS)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+		have_path |= n.path;
+		have_stroke |= n.stroke;
+
+		node++;
+		if (n.rect)
+			node += SIZE_IN_NODES(sizeof(fz_rect));
+		switch (n.cs)
+		{
+		default:
+		case CS_UNCHANGED:
+			break;
+		case CS_GRAY_0:
+		case CS_GRAY_1:
+			cs_n = 1;
+			break;
+		case CS_RGB_0:
+		case CS_RGB_1:
+			cs_n = 3;
+			break;
+		case CS_CMYK_0:
+		case CS_CMYK_1:
+			cs_n = 4;
+			break;
+		case CS_OTHER_0:
+			if (node + SIZE_IN_NODES(sizeof(fz_colorspace *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			cs = fn(ctx, arg, RES_COLORSPACE, node);
+			cs_n = cs->n;
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			break;
+		}
+		if (n.color)
+			node += SIZE_IN_NODES(cs_n * sizeof(float));
+		if (n.alpha == ALPHA_PRESENT)
+			node += SIZE_IN_NODES(sizeof(float));
+		if (n.ctm & CTM_CHANGE_AD)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_BC)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.ctm & CTM_CHANGE_EF)
+			node += SIZE_IN_NODES(2*sizeof(float));
+		if (n.stroke)
+		{
+			if (node + SIZE_IN_NODES(sizeof(fz_stroke_state *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			fn(ctx, arg, RES_STROKE, node);
+			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+		}
+		if (n.path)
+		{
+			if (node + SIZE_IN_NODES(sizeof(fz_path *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			fn(ctx, arg, RES_PATH, node);
+			node += SIZE_IN_NODES(fz_packed_path_size((fz_path *)node));
+		}
+		if (node > next)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+		switch (n.cmd)
+		{
+		case FZ_CMD_FILL_PATH:
+			if (!have_path)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		case FZ_CMD_STROKE_PATH:
+			if (!have_path || !have_stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		case FZ_CMD_CLIP_PATH:
+			if (!have_path)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			depth++;
+			break;
+		case FZ_CMD_CLIP_STROKE_PATH:
+			if (!have_path || !have_stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			depth++;
+			break;
+		case FZ_CMD_FILL_TEXT:
+		case FZ_CMD_STROKE_TEXT:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_IGNORE_TEXT:
+			if (node + SIZE_IN_NODES(sizeof(fz_text *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			if ((n.cmd == FZ_CMD_STROKE_TEXT || n.cmd == FZ_CMD_CLIP_STROKE_TEXT) && !have_stroke)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			if (n.cmd == FZ_CMD_CLIP_TEXT || n.cmd == FZ_CMD_CLIP_STROKE_TEXT)
+				depth++;
+			fn(ctx, arg, RES_TEXT, node);
+			break;
+		case FZ_CMD_FILL_SHADE:
+			if (node + SIZE_IN_NODES(sizeof(fz_shade *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			fn(ctx, arg, RES_SHADE, node);
+			break;
+		case FZ_CMD_FILL_IMAGE:
+		case FZ_CMD_FILL_IMAGE_MASK:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+			if (node + SIZE_IN_NODES(sizeof(fz_image *)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			if (n.cmd == FZ_CMD_CLIP_IMAGE_MASK)
+				depth++;
+			fn(ctx, arg, RES_IMAGE, node);
+			break;
+		case FZ_CMD_BEGIN_MASK:
+			if (node + SIZE_IN_NODES(sizeof(fz_list_mask_data)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			/* Mask ids only mean something to the process that
+			 * made them, so never let them into or out of a file. */
+			((fz_list_mask_data *)node)->id = 0;
+			depth++;
+			break;
+		case FZ_CMD_BEGIN_GROUP:
+			depth++;
+			break;
+		case FZ_CMD_BEGIN_TILE:
+			if (node + SIZE_IN_NODES(sizeof(fz_list_tile_data)) > next)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			depth++;
+			break;
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+		case FZ_CMD_END_TILE:
+			if (--depth < 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+			break;
+		}
+
+		node = next;
+	}
+}
+
+static fz_list_file *
+fz_keep_list_file(fz_context *ctx, fz_list_file *file)
+{
+	return fz_keep_imp(ctx, file, &file->refs);
+}
+
+static void
+fz_drop_list_file(fz_context *ctx, fz_list_file *file)
+{
+	if (!fz_drop_imp(ctx, file, &file->refs))
+		return;
+	fz_unmap_file(ctx, file->map);
+	fz_free(ctx, file);
+}
+
+/* Saving */
+
+typedef struct fz_list_saver_s fz_list_saver;
+
+struct fz_list_saver_s
+{
+	fz_buffer *out;
+	fz_hash_table *ids;
+	int len, max;
+	fz_list_file_entry *table;
+	int start;
+	int busy_len;
+	void *busy[16];
+	int paths_len, paths_max;
+	int *paths;
+};
+
+static void
+put_int(fz_context *ctx, fz_buffer *out, int v)
+{
+	fz_write_buffer(ctx, out, &v, sizeof v);
+}
+
+static void
+put_float(fz_context *ctx, fz_buffer *out, float v)
+{
+	fz_write_buffer(ctx, out, &v, sizeof v);
+}
+
+static void
+put_data(fz_context *ctx, fz_buffer *out, const void *data, int len)
+{
+	put_int(ctx, out, len);
+	fz_write_buffer(ctx, out, data, len);
+}
+
+static void
+put_align(fz_context *ctx, fz_buffer *out)
+{
+	static const char zeros[LIST_FILE_ALIGN] = { 0 };
+	if (out->len % LIST_FILE_ALIGN)
+		fz_write_buffer(ctx, out, zeros, LIST_FILE_ALIGN - out->len % LIST_FILE_ALIGN);
+}
+
+static int save_resource(fz_context *ctx, fz_list_saver *saver, int type, void *obj);
+
+/* Called by each of the functions below once everything the resource
+ * refers to has been saved, and before any of its own data is written,
+ * so that the data of different resources is never interleaved. */
+static void
+begin_resource(fz_context *ctx, fz_list_saver *saver)
+{
+	put_align(ctx, saver->out);
+	saver->start = saver->out->len;
+}
+
+static int
+save_ref(fz_context *ctx, fz_list_saver *saver, int type, void *obj)
+{
+	return obj ? save_resource(ctx, saver, type, obj) + 1 : 0;
+}
+
+static void *
+save_node_ref(fz_context *ctx, void *arg, int type, void *slot)
+{
+	fz_list_saver *saver = (fz_list_saver *)arg;
+	void *obj = *(void **)slot;
+	int cmd_len, coord_len;
+	const uint8_t *cmds;
+	const float *coords;
+
+	if (type != RES_PATH)
+	{
+		*(intptr_t *)slot = save_ref(ctx, saver, type, obj);
+		return obj;
+	}
+
+	/* Flat paths are saved in place; for open ones we save the data
+	 * they point to, and note the resource in the list's path table. */
+	if (fz_packed_path_data(ctx, slot, &cmd_len, &cmds, &coord_len, &coords))
+	{
+		int ref = save_ref(ctx, saver, RES_PATH, slot);
+		if (saver->paths_len == saver->paths_max)
+		{
+			int new_max = saver->paths_max ? saver->paths_max * 2 : 16;
+			saver->paths = fz_resize_array(ctx, saver->paths, new_max, sizeof(int));
+			saver->paths_max = new_max;
+		}
+		saver->paths[saver->paths_len++] = ref;
+		memset((char *)slot + 2, 0, fz_packed_path_size(slot) - 2);
+	}
+	else
+		fz_repack_path(ctx, slot, 0, cmd_len, cmds, coord_len, coords);
+	return NULL;
+}
+
+static void
+save_list(fz_context *ctx, fz_list_saver *saver, fz_display_list *list)
+{
+	fz_display_node *nodes;
+	int *paths = saver->paths;
+	int paths_len = saver->paths_len;
+	int paths_max = saver->paths_max;
+
+	nodes = fz_malloc_array(ctx, fz_maxi(list->len, 1), sizeof(fz_display_node));
+	saver->paths = NULL;
+	saver->paths_len = saver->paths_max = 0;
+	fz_try(ctx)
+	{
+		memcpy(nodes, list->list, list->len * sizeof(fz_display_node));
+		fz_walk_display_refs(ctx, nodes, list->len, save_node_ref, saver);
+
+		begin_resource(ctx, saver);
+		put_float(ctx, saver->out, list->mediabox.x0);
+		put_float(ctx, saver->out, list->mediabox.y0);
+		put_float(ctx, saver->out, list->mediabox.x1);
+		put_float(ctx, saver->out, list->mediabox.y1);
+		put_int(ctx, saver->out, list->len);
+		put_data(ctx, saver->out, saver->paths, saver->paths_len * sizeof(int));
+		put_align(ctx, saver->out);
+		fz_write_buffer(ctx, saver->out, nodes, list->len * sizeof(fz_display_node));
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, nodes);
+		fz_free(ctx, saver->paths);
+		saver->paths = paths;
+		saver->paths_len = paths_len;
+		saver->paths_max = paths_max;
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static fz_colorspace *
+device_colorspace(fz_context *ctx, int i)
+{
+	switch (i)
+	{
+	case 0: return fz_device_gray(ctx);
+	case 1: return fz_device_rgb(ctx);
+	case 2: return fz_device_bgr(ctx);
+	case 3: return fz_device_cmyk(ctx);
+	}
+	return NULL;
+}
+
+static int
+device_colorspace_index(fz_context *ctx, fz_colorspace *cs)
+{
+	int i;
+	for (i = 0; i < 4; i++)
+		if (device_colorspace(ctx, i) == cs)
+			return i;
+	return -1;
+}
+
+static void
+save_tint(fz_context *ctx, fz_list_saver *saver, fz_function *tint, int m, int n)
+{
+	float in[FZ_MAX_COLORS];
+	float *samples;
+	int grid = tint_grid(m);
+	int count, i, j, k;
+
+	for (count = 1, i = 0; i < m; i++)
+		count *= grid;
+	samples = fz_malloc_array(ctx, count, n * sizeof(float));
+	fz_try(ctx)
+	{
+		/* The first input varies the slowest */
+		for (j = 0; j < count; j++)
+		{
+			for (i = m - 1, k = j; i >= 0; i--, k /= grid)
+				in[i] = (float)(k % grid) / (grid - 1);
+			fz_eval_function(ctx, tint, in, m, samples + j * n, n);
+		}
+		put_int(ctx, saver->out, grid);
+		put_data(ctx, saver->out, samples, count * n * sizeof(float));
+	}
+	fz_always(ctx)
+		fz_free(ctx, samples);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+save_colorspace(fz_context *ctx, fz_list_saver *saver, fz_colorspace *cs)
+{
+	unsigned char *lookup;
+	fz_colorspace *base;
+	fz_function *tint;
+	int high, ref;
+
+	int device = device_colorspace_index(ctx, cs);
+
+	if (device >= 0)
+	{
+		begin_resource(ctx, saver);
+		put_int(ctx, saver->out, CS_FILE_DEVICE);
+		put_int(ctx, saver->out, device);
+	}
+	else if ((base = fz_indexed_colorspace_lookup(ctx, cs, &high, &lookup)) != NULL)
+	{
+		ref = save_ref(ctx, saver, RES_COLORSPACE, base);
+		begin_resource(ctx, saver);
+		put_int(ctx, saver->out, CS_FILE_INDEXED);
+		put_int(ctx, saver->out, ref);
+		put_int(ctx, saver->out, high);
+		put_data(ctx, saver->out, lookup, base->n * (high + 1));
+	}
+	else if ((base = fz_separation_colorspace_tint(ctx, cs, &tint)) != NULL)
+	{
+		if (cs->n > TINT_MAX_INPUTS)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save %s colorspace of %d components", cs->name, cs->n);
+		ref = save_ref(ctx, saver, RES_COLORSPACE, base);
+		begin_resource(ctx, saver);
+		put_int(ctx, saver->out, CS_FILE_SEPARATION);
+		put_int(ctx, saver->out, ref);
+		put_int(ctx, saver->out, cs->n);
+		save_tint(ctx, saver, tint, cs->n, base->n);
+	}
+	else
+	{
+		/* Other colorspaces convert through callbacks that we cannot
+		 * save, and sampling them would change how the list draws. */
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save colorspace '%s'", cs->name);
+	}
+}
+
+static void
+save_stroke(fz_context *ctx, fz_list_saver *saver, fz_stroke_state *stroke)
+{
+	begin_resource(ctx, saver);
+	put_int(ctx, saver->out, stroke->start_cap);
+	put_int(ctx, saver->out, stroke->dash_cap);
+	put_int(ctx, saver->out, stroke->end_cap);
+	put_int(ctx, saver->out, stroke->linejoin);
+	put_float(ctx, saver->out, stroke->linewidth);
+	put_float(ctx, saver->out, stroke->miterlimit);
+	put_float(ctx, saver->out, stroke->dash_phase);
+	put_data(ctx, saver->out, stroke->dash_list, stroke->dash_len * sizeof(float));
+}
+
+static void
+save_text(fz_context *ctx, fz_list_saver *saver, fz_text *text)
+{
+	fz_text_span *span;
+	int count = 0;
+	int *fonts;
+	int i;
+
+	for (span = text->head; span; span = span->next)
+		count++;
+
+	fonts = fz_malloc_array(ctx, fz_maxi(count, 1), sizeof(int));
+	fz_try(ctx)
+	{
+		for (i = 0, span = text->head; span; span = span->next, i++)
+			fonts[i] = save_ref(ctx, saver, RES_FONT, span->font);
+
+		begin_resource(ctx, saver);
+		put_int(ctx, saver->out, count);
+		for (i = 0, span = text->head; span; span = span->next, i++)
+		{
+			put_int(ctx, saver->out, fonts[i]);
+			put_float(ctx, saver->out, span->trm.a);
+			put_float(ctx, saver->out, span->trm.b);
+			put_float(ctx, saver->out, span->trm.c);
+			put_float(ctx, saver->out, span->trm.d);
+			put_int(ctx, saver->out, span->wmode);
+			put_data(ctx, saver->out, span->items, span->len * sizeof(fz_text_item));
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, fonts);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+save_compressed_buffer(fz_context *ctx, fz_list_saver *saver, fz_compressed_buffer *buffer)
+{
+	fz_write_buffer(ctx, saver->out, &buffer->params, sizeof buffer->params);
+	put_data(ctx, saver->out, buffer->buffer->data, buffer->buffer->len);
+}
+
+static void
+save_shade(fz_context *ctx, fz_list_saver *saver, fz_shade *shade)
+{
+	int ref = save_ref(ctx, saver, RES_COLORSPACE, shade->colorspace);
+	int n = shade->colorspace ? shade->colorspace->n : 1;
+	int i;
+
+	begin_resource(ctx, saver);
+	put_int(ctx, saver->out, ref);
+	fz_write_buffer(ctx, saver->out, &shade->bbox, sizeof shade->bbox);
+	fz_write_buffer(ctx, saver->out, &shade->matrix, sizeof shade->matrix);
+	put_int(ctx, saver->out, shade->use_background);
+	fz_write_buffer(ctx, saver->out, shade->background, n * sizeof(float));
+	put_int(ctx, saver->out, shade->use_function);
+	if (shade->use_function)
+		for (i = 0; i < 256; i++)
+			fz_write_buffer(ctx, saver->out, shade->function[i], (n + 1) * sizeof(float));
+	put_int(ctx, saver->out, shade->type);
+	fz_write_buffer(ctx, saver->out, &shade->u, sizeof shade->u);
+	if (shade->type == FZ_FUNCTION_BASED)
+		put_data(ctx, saver->out, shade->u.f.fn_vals, (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n * sizeof(float));
+	put_int(ctx, saver->out, shade->buffer != NULL);
+	if (shade->buffer)
+		save_compressed_buffer(ctx, saver, shade->buffer);
+}
+
+static void
+save_image(fz_context *ctx, fz_list_saver *saver, fz_image *image)
+{
+	fz_pixmap *pix = NULL;
+	int type = image->buffer ? image->buffer->params.type : FZ_IMAGE_UNKNOWN;
+	int compressed = image->get_pixmap && image->buffer && type != FZ_IMAGE_UNKNOWN && type != FZ_IMAGE_JPX && type != FZ_IMAGE_JBIG2;
+	int cs, pix_cs, mask;
+
+	fz_var(pix);
+
+	fz_try(ctx)
+	{
+		/* Images that we cannot save as they came are saved decoded */
+		if (!compressed)
+			pix = fz_new_pixmap_from_image(ctx, image, image->w, image->h);
+
+		cs = save_ref(ctx, saver, RES_COLORSPACE, image->colorspace);
+		pix_cs = pix ? save_ref(ctx, saver, RES_COLORSPACE, pix->colorspace) : 0;
+		mask = save_ref(ctx, saver, RES_IMAGE, image->mask);
+
+		begin_resource(ctx, saver);
+		put_int(ctx, saver->out, compressed);
+		put_int(ctx, saver->out, cs);
+		put_int(ctx, saver->out, mask);
+		put_int(ctx, saver->out, image->w);
+		put_int(ctx, saver->out, image->h);
+		put_int(ctx, saver->out, image->n);
+		put_int(ctx, saver->out, image->bpc);
+		put_int(ctx, saver->out, image->imagemask);
+		put_int(ctx, saver->out, image->interpolate);
+		put_int(ctx, saver->out, image->usecolorkey);
+		put_int(ctx, saver->out, image->xres);
+		put_int(ctx, saver->out, image->yres);
+		put_int(ctx, saver->out, image->invert_cmyk_jpeg);
+		fz_write_buffer(ctx, saver->out, image->colorkey, sizeof image->colorkey);
+		fz_write_buffer(ctx, saver->out, image->decode, sizeof image->decode);
+		if (compressed)
+			save_compressed_buffer(ctx, saver, image->buffer);
+		else
+		{
+			put_int(ctx, saver->out, pix_cs);
+			put_int(ctx, saver->out, pix->w);
+			put_int(ctx, saver->out, pix->h);
+			put_int(ctx, saver->out, pix->n);
+			put_data(ctx, saver->out, pix->samples, pix->w * pix->h * pix->n);
+		}
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+save_font(fz_context *ctx, fz_list_saver *saver, fz_font *font)
+{
+	fz_buffer *data = NULL;
+	int lists[256];
+	int i, index = 0;
+
+	fz_var(data);
+
+	fz_try(ctx)
+	{
+		if (font->t3lists)
+		{
+			for (i = 0; i < 256; i++)
+				lists[i] = save_ref(ctx, saver, RES_LIST, font->t3lists[i]);
+		}
+		else
+			data = fz_font_data(ctx, font, &index);
+
+		begin_resource(ctx, saver);
+		fz_write_buffer(ctx, saver->out, font->name, sizeof font->name);
+		fz_write_buffer(ctx, saver->out, &font->bbox, sizeof font->bbox);
+		put_int(ctx, saver->out, font->use_glyph_bbox);
+		put_int(ctx, saver->out, font->t3lists != NULL);
+		if (font->t3lists)
+		{
+			fz_write_buffer(ctx, saver->out, &font->t3matrix, sizeof font->t3matrix);
+			fz_write_buffer(ctx, saver->out, font->t3widths, 256 * sizeof(float));
+			fz_write_buffer(ctx, saver->out, font->t3flags, 256 * sizeof(unsigned short));
+			fz_write_buffer(ctx, saver->out, lists, sizeof lists);
+			put_data(ctx, saver->out, font->bbox_table, font->bbox_count * sizeof(fz_rect));
+		}
+		else
+		{
+			put_int(ctx, saver->out, index);
+			put_int(ctx, saver->out, font->ft_substitute);
+			put_int(ctx, saver->out, font->ft_stretch);
+			put_int(ctx, saver->out, font->ft_bold);
+			put_int(ctx, saver->out, font->ft_italic);
+			put_int(ctx, saver->out, font->ft_hint);
+			put_int(ctx, saver->out, font->width_default);
+			put_data(ctx, saver->out, font->width_table, font->width_count * sizeof(short));
+			put_data(ctx, saver->out, data->data, data->len);
+		}
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, data);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+save_path(fz_context *ctx, fz_list_saver *saver, fz_path *path)
+{
+	int cmd_len, coord_len;
+	const uint8_t *cmds;
+	const float *coords;
+
+	fz_packed_path_data(ctx, path, &cmd_len, &cmds, &coord_len, &coords);
+	begin_resource(ctx, saver);
+	put_data(ctx, saver->out, coords, coord_len * sizeof(float));
+	put_data(ctx, saver->out, cmds, cmd_len);
+}
+
+/* Save a resource (and anything it refers to) if we have not already,
+ * and return its index. */
+static int
+save_resource(fz_context *ctx, fz_list_saver *saver, int type, void *obj)
+{
+	fz_list_file_entry *entry;
+	void *id;
+	int i, offset;
+
+	id = fz_hash_find(ctx, saver->ids, &obj);
+	if (id)
+		return (int)(intptr_t)id - 1;
+
+	for (i = 0; i < saver->busy_len; i++)
+		if (saver->busy[i] == obj)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save display list that refers to itself");
+	if (saver->busy_len == nelem(saver->busy))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "display list resources nested too deeply");
+	saver->busy[saver->busy_len++] = obj;
+
+	fz_try(ctx)
+	{
+		switch (type)
+		{
+		case RES_COLORSPACE:
+			save_colorspace(ctx, saver, obj);
+			break;
+		case RES_STROKE:
+			save_stroke(ctx, saver, obj);
+			break;
+		case RES_TEXT:
+			save_text(ctx, saver, obj);
+			break;
+		case RES_SHADE:
+			save_shade(ctx, saver, obj);
+			break;
+		case RES_IMAGE:
+			save_image(ctx, saver, obj);
+			break;
+		case RES_FONT:
+			save_font(ctx, saver, obj);
+			break;
+		case RES_LIST:
+			save_list(ctx, saver, obj);
+			break;
+		case RES_PATH:
+			save_path(ctx, saver, obj);
+			break;
+		}
+		offset = saver->start;
+	}
+	fz_always(ctx)
+		saver->busy_len--;
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	if (saver->len == saver->max)
+	{
+		int new_max = saver->max ? saver->max * 2 : 64;
+		saver->table = fz_resize_array(ctx, saver->table, new_max, sizeof(fz_list_file_entry));
+		saver->max = new_max;
+	}
+	entry = &saver->table[saver->len];
+	entry->type = type;
+	entry->offset = offset;
+	entry->len = saver->out->len - offset;
+	fz_hash_insert(ctx, saver->ids, &obj, (void *)(intptr_t)(saver->len + 1));
+	return saver->len++;
+}
+
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_list_saver saver = { 0 };
+	fz_list_file_header header;
+	fz_output *out = NULL;
+	int list_id;
+
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		saver.out = fz_new_buffer(ctx, 1024);
+		saver.ids = fz_new_hash_table(ctx, 256, sizeof(void *), -1);
+
+		/* The header is filled in once we know where the table is */
+		fz_write_buffer(ctx, saver.out, &header, sizeof header);
+		list_id = save_resource(ctx, &saver, RES_LIST, list);
+		put_align(ctx, saver.out);
+
+		memcpy(header.magic, LIST_FILE_MAGIC, 4);
+		header.version = LIST_FILE_VERSION;
+		header.byte_order = 0x01020304;
+		header.pointer_size = sizeof(void *);
+		header.node_size = sizeof(fz_display_node);
+		header.resources = saver.len;
+		header.table = saver.out->len;
+		header.list = list_id;
+		memcpy(saver.out->data, &header, sizeof header);
+		fz_write_buffer(ctx, saver.out, saver.table, saver.len * sizeof(fz_list_file_entry));
+
+		out = fz_new_output_with_path(ctx, filename, 0);
+		fz_write(ctx, out, saver.out->data, saver.out->len);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_hash(ctx, saver.ids);
+		fz_drop_buffer(ctx, saver.out);
+		fz_free(ctx, saver.table);
+		fz_free(ctx, saver.paths);
+	}
+	fz_catch(ctx)
+		fz_rethrow_message(ctx, "cannot save display list to '%s'", filename);
+}
+
+/* Loading */
+
+typedef struct fz_list_loader_s fz_list_loader;
+
+struct fz_list_loader_s
+{
+	fz_list_file *file;
+	fz_list_file_entry *table;
+	int count;
+	void **objs;
+	int pos, end;
+	int *paths;
+	int paths_len, next_path;
+};
+
+static void
+get_bytes(fz_context *ctx, fz_list_loader *loader, void *data, int len)
+{
+	if (len < 0 || len > loader->end - loader->pos)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list resource");
+	memcpy(data, loader->file->data + loader->pos, len);
+	loader->pos += len;
+}
+
+static int
+get_int(fz_context *ctx, fz_list_loader *loader)
+{
+	int v;
+	get_bytes(ctx, loader, &v, sizeof v);
+	return v;
+}
+
+static float
+get_float(fz_context *ctx, fz_list_loader *loader)
+{
+	float v;
+	get_bytes(ctx, loader, &v, sizeof v);
+	return v;
+}
+
+/* Returns a pointer into the file, which is not necessarily aligned
+ * for anything but bytes. */
+static unsigned char *
+get_data(fz_context *ctx, fz_list_loader *loader, int size, int *count)
+{
+	unsigned char *data;
+	int len = get_int(ctx, loader);
+	if (len < 0 || len > loader->end - loader->pos || len % size)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list resource");
+	data = loader->file->data + loader->pos;
+	loader->pos += len;
+	*count = len / size;
+	return data;
+}
+
+static void
+get_align(fz_context *ctx, fz_list_loader *loader)
+{
+	loader->pos += (LIST_FILE_ALIGN - loader->pos % LIST_FILE_ALIGN) % LIST_FILE_ALIGN;
+	if (loader->pos > loader->end)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list resource");
+}
+
+/* Resources may only refer to those loaded before them */
+static void *
+get_ref_imp(fz_context *ctx, fz_list_loader *loader, int ref, int type, int current)
+{
+	if (ref == 0)
+		return NULL;
+	if (ref < 0 || ref > current || loader->table[ref - 1].type != type)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bad display list resource reference");
+	return loader->objs[ref - 1];
+}
+
+static void *
+get_ref(fz_context *ctx, fz_list_loader *loader, int type, int current)
+{
+	return get_ref_imp(ctx, loader, get_int(ctx, loader), type, current);
+}
+
+static void
+drop_resource(fz_context *ctx, int type, void *obj)
+{
+	if (!obj)
+		return;
+	switch (type)
+	{
+	case RES_COLORSPACE: fz_drop_colorspace(ctx, obj); break;
+	case RES_STROKE: fz_drop_stroke_state(ctx, obj); break;
+	case RES_TEXT: fz_drop_text(ctx, obj); break;
+	case RES_SHADE: fz_drop_shade(ctx, obj); break;
+	case RES_IMAGE: fz_drop_image(ctx, obj); break;
+	case RES_FONT: fz_drop_font(ctx, obj); break;
+	case RES_LIST: fz_drop_display_list(ctx, obj); break;
+	}
+}
+
+typedef struct
+{
+	fz_function super;
+	int grid;
+	float *samples;
+} tint_table;
+
+static void
+eval_tint_table(fz_context *ctx, fz_function *func_, const float *in, float *out)
+{
+	tint_table *func = (tint_table *)func_;
+	int m = func->super.m;
+	int n = func->super.n;
+	int g = func->grid;
+	int cell[FZ_MAX_COLORS];
+	float frac[FZ_MAX_COLORS];
+	int corner, ofs, i, k;
+	float x, w;
+
+	for (i = 0; i < m; i++)
+	{
+		x = fz_clamp(in[i], 0, 1) * (g - 1);
+		cell[i] = fz_mini((int)x, g - 2);
+		frac[i] = x - cell[i];
+	}
+
+	for (k = 0; k < n; k++)
+		out[k] = 0;
+
+	/* Weigh the samples at the corners of the cell */
+	for (corner = 0; corner < (1 << m); corner++)
+	{
+		w = 1;
+		ofs = 0;
+		for (i = 0; i < m; i++)
+		{
+			int up = (corner >> i) & 1;
+			w *= up ? frac[i] : 1 - frac[i];
+			ofs = ofs * g + cell[i] + up;
+		}
+		if (w == 0)
+			continue;
+		for (k = 0; k < n; k++)
+			out[k] += w * func->samples[ofs * n + k];
+	}
+}
+
+static void
+drop_tint_table_imp(fz_context *ctx, fz_storable *func_)
+{
+	tint_table *func = (tint_table *)func_;
+	fz_free(ctx, func->samples);
+	fz_free(ctx, func);
+}
+
+static fz_function *
+load_tint(fz_context *ctx, fz_list_loader *loader, int m, int n)
+{
+	tint_table *func;
+	unsigned char *data;
+	int grid = get_int(ctx, loader);
+	int count, len, i;
+
+	if (grid < 2 || grid > TINT_MAX_GRID)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bad tint function");
+	for (count = n, i = 0; i < m; i++)
+	{
+		if (count > TINT_MAX_SAMPLES * FZ_MAX_COLORS / grid)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad tint function");
+		count *= grid;
+	}
+	data = get_data(ctx, loader, sizeof(float), &len);
+	if (len != count)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bad tint function");
+
+	func = fz_malloc_struct(ctx, tint_table);
+	FZ_INIT_STORABLE(&func->super, 1, drop_tint_table_imp);
+	func->super.size = sizeof(*func) + count * sizeof(float);
+	func->super.m = m;
+	func->super.n = n;
+	func->super.evaluate = eval_tint_table;
+	func->grid = grid;
+	fz_try(ctx)
+	{
+		func->samples = fz_malloc_array(ctx, count, sizeof(float));
+		memcpy(func->samples, data, count * sizeof(float));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, func);
+		fz_rethrow(ctx);
+	}
+	return &func->super;
+}
+
+static fz_colorspace *
+load_colorspace(fz_context *ctx, fz_list_loader *loader, int current)
+{
+	fz_colorspace *cs = NULL;
+	unsigned char *lookup = NULL;
+	int kind = get_int(ctx, loader);
+
+	fz_var(cs);
+	fz_var(lookup);
+
+	if (kind == CS_FILE_DEVICE)
+	{
+		cs = device_colorspace(ctx, get_int(ctx, loader));
+		if (!cs)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unknown device colorspace");
+		return fz_keep_colorspace(ctx, cs);
+	}
+
+	if (kind == CS_FILE_INDEXED)
+	{
+		fz_colorspace *base = get_ref(ctx, loader, RES_COLORSPACE, current);
+		int high = get_int(ctx, loader);
+		int len;
+		unsigned char *data = get_data(ctx, loader, 1, &len);
+
+		if (!base || high < 0 || high > 255 || len != base->n * (high + 1))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad indexed colorspace");
+		lookup = fz_malloc(ctx, len);
+		memcpy(lookup, data, len);
+		fz_try(ctx)
+			cs = fz_new_indexed_colorspace(ctx, fz_keep_colorspace(ctx, base), high, lookup);
+		fz_catch(ctx)
+		{
+			fz_drop_colorspace(ctx, base);
+			fz_free(ctx, lookup);
+			fz_rethrow(ctx);
+		}
+		return cs;
+	}
+
+	if (kind == CS_FILE_SEPARATION)
+	{
+		fz_colorspace *base = get_ref(ctx, loader, RES_COLORSPACE, current);
+		int n = get_int(ctx, loader);
+		fz_function *tint;
+
+		if (!base || n < 1 || n > TINT_MAX_INPUTS)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad separation colorspace");
+		tint = load_tint(ctx, loader, n, base->n);
+		fz_try(ctx)
+			cs = fz_new_separation_colorspace(ctx, n, fz_keep_colorspace(ctx, base), tint);
+		fz_catch(ctx)
+		{
+			fz_drop_colorspace(ctx, base);
+			fz_drop_function(ctx, tint);
+			fz_rethrow(ctx);
+		}
+		return cs;
+	}
+
+	fz_throw(ctx, FZ_ERROR_GENERIC, "bad colorspace");
+	return NULL;
+}
+
+static fz_stroke_state *
+load_stroke(fz_context *ctx, fz_list_loader *loader)
+{
+	fz_stroke_state *stroke;
+	int start_cap = get_int(ctx, loader);
+	int dash_cap = get_int(ctx, loader);
+	int end_cap = get_int(ctx, loader);
+	int linejoin = get_int(ctx, loader);
+	float linewidth = get_float(ctx, loader);
+	float miterlimit = get_float(ctx, loader);
+	float dash_phase = get_float(ctx, loader);
+	int dash_len;
+	unsigned char *dashes = get_data(ctx, loader, sizeof(float), &dash_len);
+
+	if (start_cap < FZ_LINECAP_BUTT || start_cap > FZ_LINECAP_TRIANGLE ||
+		dash_cap < FZ_LINECAP_BUTT || dash_cap > FZ_LINECAP_TRIANGLE ||
+		end_cap < FZ_LINECAP_BUTT || end_cap > FZ_LINECAP_TRIANGLE ||
+		linejoin < FZ_LINEJOIN_MITER || linejoin > FZ_LINEJOIN_MITER_XPS)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bad stroke state");
+
+	stroke = fz_new_stroke_state_with_dash_len(ctx, dash_len);
+	stroke->start_cap = start_cap;
+	stroke->dash_cap = dash_cap;
+	stroke->end_cap = end_cap;
+	stroke->linejoin = linejoin;
+	stroke->linewidth = linewidth;
+	stroke->miterlimit = miterlimit;
+	stroke->dash_phase = dash_phase;
+	stroke->dash_len = dash_len;
+	memcpy(stroke->dash_list, dashes, dash_len * sizeof(float));
+	return stroke;
+}
+
+static fz_text *
+load_text(fz_context *ctx, fz_list_loader *loader, int current)
+{
+	fz_text *text = fz_new_text(ctx);
+
+	fz_try(ctx)
+	{
+		int count = get_int(ctx, loader);
+		int i, k;
+
+		for (i = 0; i < count; i++)
+		{
+			fz_font *font = get_ref(ctx, loader, RES_FONT, current);
+			fz_matrix trm;
+			int wmode, len;
+			unsigned char *items;
+
+			trm.a = get_float(ctx, loader);
+			trm.b = get_float(ctx, loader);
+			trm.c = get_float(ctx, loader);
+			trm.d = get_float(ctx, loader);
+			wmode = get_int(ctx, loader);
+			items = get_data(ctx, loader, sizeof(fz_text_item), &len);
+			if (!font)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "text span without font");
+			for (k = 0; k < len; k++)
+			{
+				fz_text_item item;
+				memcpy(&item, items + k * sizeof item, sizeof item);
+				trm.e = item.x;
+				trm.f = item.y;
+				fz_add_text(ctx, text, font, wmode, &trm, item.gid, item.ucs);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static fz_compressed_buffer *
+load_compressed_buffer(fz_context *ctx, fz_list_loader *loader)
+{
+	fz_compressed_buffer *bc;
+	fz_compression_params params;
+	unsigned char *data;
+	int len;
+
+	get_bytes(ctx, loader, &params, sizeof params);
+	data = get_data(ctx, loader, 1, &len);
+	bc = fz_malloc_struct(ctx, fz_compressed_buffer);
+	bc->params = params;
+	fz_try(ctx)
+	{
+		bc->buffer = fz_new_buffer(ctx, len);
+		fz_write_buffer(ctx, bc->buffer, data, len);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_compressed_buffer(ctx, bc);
+		fz_rethrow(ctx);
+	}
+	return bc;
+}
+
+static fz_shade *
+load_shade(fz_context *ctx, fz_list_loader *loader, int current)
+{
+	fz_shade *shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+
+	fz_try(ctx)
+	{
+		fz_colorspace *cs = get_ref(ctx, loader, RES_COLORSPACE, current);
+		int n = cs ? cs->n : 1;
+		int i;
+
+		/* Nothing that the shade owns is set until the last moment,
+		 * so that it can be dropped at any point. */
+		shade->type = FZ_LINEAR;
+		shade->colorspace = fz_keep_colorspace(ctx, cs);
+		get_bytes(ctx, loader, &shade->bbox, sizeof shade->bbox);
+		get_bytes(ctx, loader, &shade->matrix, sizeof shade->matrix);
+		shade->use_background = get_int(ctx, loader);
+		get_bytes(ctx, loader, shade->background, n * sizeof(float));
+		shade->use_function = get_int(ctx, loader);
+		if (shade->use_function)
+			for (i = 0; i < 256; i++)
+				get_bytes(ctx, loader, shade->function[i], (n + 1) * sizeof(float));
+		i = get_int(ctx, loader);
+		get_bytes(ctx, loader, &shade->u, sizeof shade->u);
+		if (i == FZ_FUNCTION_BASED)
+		{
+			int len;
+			unsigned char *vals = get_data(ctx, loader, sizeof(float), &len);
+			if (shade->u.f.xdivs < 0 || shade->u.f.ydivs < 0 || len != (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "bad function based shading");
+			shade->u.f.fn_vals = NULL;
+			shade->type = i;
+			shade->u.f.fn_vals = fz_malloc_array(ctx, len, sizeof(float));
+			memcpy(shade->u.f.fn_vals, vals, len * sizeof(float));
+		}
+		else if (i < FZ_FUNCTION_BASED || i > FZ_MESH_TYPE7)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad shading type");
+		else
+			shade->type = i;
+		if (get_int(ctx, loader))
+			shade->buffer = load_compressed_buffer(ctx, loader);
+		if (shade->type >= FZ_MESH_TYPE4 && (!shade->buffer ||
+			shade->u.m.bpflag < 1 || shade->u.m.bpflag > 32 ||
+			shade->u.m.bpcoord < 1 || shade->u.m.bpcoord > 32 ||
+			shade->u.m.bpcomp < 1 || shade->u.m.bpcomp > 32 ||
+			(shade->type == FZ_MESH_TYPE5 && shade->u.m.vprow < 2)))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad mesh shading");
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	return shade;
+}
+
+static fz_image *
+load_image(fz_context *ctx, fz_list_loader *loader, int current)
+{
+	fz_image *image = NULL;
+	fz_colorspace *cs = NULL;
+	fz_image *mask = NULL;
+	fz_pixmap *pix = NULL;
+	fz_compressed_buffer *bc = NULL;
+	int compressed, w, h, n, bpc, imagemask, interpolate, usecolorkey, xres, yres, invert_cmyk_jpeg;
+	int colorkey[FZ_MAX_COLORS * 2];
+	float decode[FZ_MAX_COLORS * 2];
+
+	fz_var(image);
+	fz_var(cs);
+	fz_var(mask);
+	fz_var(pix);
+	fz_var(bc);
+
+	compressed = get_int(ctx, loader);
+	cs = get_ref(ctx, loader, RES_COLORSPACE, current);
+	mask = get_ref(ctx, loader, RES_IMAGE, current);
+	w = get_int(ctx, loader);
+	h = get_int(ctx, loader);
+	n = get_int(ctx, loader);
+	bpc = get_int(ctx, loader);
+	imagemask = get_int(ctx, loader);
+	interpolate = get_int(ctx, loader);
+	usecolorkey = get_int(ctx, loader);
+	xres = get_int(ctx, loader);
+	yres = get_int(ctx, loader);
+	invert_cmyk_jpeg = get_int(ctx, loader);
+	get_bytes(ctx, loader, colorkey, sizeof colorkey);
+	get_bytes(ctx, loader, decode, sizeof decode);
+
+	fz_keep_colorspace(ctx, cs);
+	fz_keep_image(ctx, mask);
+	fz_try(ctx)
+	{
+		if (compressed)
+		{
+			if (w <= 0 || h <= 0 || bpc < 1 || bpc > 16 || n != (cs ? cs->n : 1))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "bad image");
+			bc = load_compressed_buffer(ctx, loader);
+			/* fz_new_image takes the buffer whether it succeeds or
+			 * not, and the colorspace and mask if it succeeds. */
+			image = fz_new_image(ctx, w, h, bpc, cs, xres, yres, interpolate, imagemask, decode, usecolorkey ? colorkey : NULL, bc, mask);
+			cs = NULL;
+			mask = NULL;
+			image->invert_cmyk_jpeg = invert_cmyk_jpeg;
+		}
+		else
+		{
+			fz_colorspace *pix_cs = get_ref(ctx, loader, RES_COLORSPACE, current);
+			int pw = get_int(ctx, loader);
+			int ph = get_int(ctx, loader);
+			int pn = get_int(ctx, loader);
+			int len;
+			unsigned char *samples = get_data(ctx, loader, 1, &len);
+
+			if (pw <= 0 || ph <= 0 || pn != (pix_cs ? pix_cs->n + 1 : 1) || len / pw / ph != pn || len % (pw * ph))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "bad image");
+			pix = fz_new_pixmap(ctx, pix_cs, pw, ph);
+			memcpy(pix->samples, samples, len);
+			pix->xres = xres;
+			pix->yres = yres;
+			pix->interpolate = interpolate;
+			image = fz_new_image_from_pixmap(ctx, pix, mask);
+			mask = NULL;
+			image->imagemask = imagemask;
+			image->interpolate = interpolate;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_colorspace(ctx, cs);
+		fz_drop_image(ctx, mask);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+static fz_font *
+load_font(fz_context *ctx, fz_list_loader *loader, int current)
+{
+	fz_font *font = NULL;
+	fz_buffer *buf = NULL;
+	char name[32];
+	fz_rect bbox;
+	int use_glyph_bbox, type3, i, len;
+	unsigned char *data;
+
+	fz_var(font);
+	fz_var(buf);
+
+	get_bytes(ctx, loader, name, sizeof name);
+	name[sizeof name - 1] = 0;
+	get_bytes(ctx, loader, &bbox, sizeof bbox);
+	use_glyph_bbox = get_int(ctx, loader);
+	type3 = get_int(ctx, loader);
+
+	fz_try(ctx)
+	{
+		if (type3)
+		{
+			fz_matrix matrix;
+			int lists[256];
+
+			/* The glyph procedures are not needed, as we have
+			 * the display lists they made. */
+			get_bytes(ctx, loader, &matrix, sizeof matrix);
+			font = fz_new_type3_font(ctx, name, &matrix);
+			get_bytes(ctx, loader, font->t3widths, 256 * sizeof(float));
+			get_bytes(ctx, loader, font->t3flags, 256 * sizeof(unsigned short));
+			get_bytes(ctx, loader, lists, sizeof lists);
+			for (i = 0; i < 256; i++)
+				font->t3lists[i] = fz_keep_display_list(ctx, get_ref_imp(ctx, loader, lists[i], RES_LIST, current));
+			data = get_data(ctx, loader, sizeof(fz_rect), &len);
+			if (len == font->bbox_count)
+				memcpy(font->bbox_table, data, len * sizeof(fz_rect));
+		}
+		else
+		{
+			int index = get_int(ctx, loader);
+			int substitute = get_int(ctx, loader);
+			int stretch = get_int(ctx, loader);
+			int bold = get_int(ctx, loader);
+			int italic = get_int(ctx, loader);
+			int hint = get_int(ctx, loader);
+			int width_default = get_int(ctx, loader);
+			unsigned char *widths = get_data(ctx, loader, sizeof(short), &len);
+
+			data = get_data(ctx, loader, 1, &i);
+			buf = fz_new_buffer(ctx, i);
+			fz_write_buffer(ctx, buf, data, i);
+			font = fz_new_font_from_buffer(ctx, name, buf, index, use_glyph_bbox);
+			font->ft_substitute = substitute;
+			font->ft_stretch = stretch;
+			font->ft_bold = bold;
+			font->ft_italic = italic;
+			font->ft_hint = hint;
+			font->width_default = width_default;
+			if (len)
+			{
+				font->width_table = fz_malloc_array(ctx, len, sizeof(short));
+				font->width_count = len;
+				memcpy(font->width_table, widths, len * sizeof(short));
+			}
+		}
+		font->bbox = bbox;
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+	{
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+	return font;
+}
+
+static void *
+check_node_ref(fz_context *ctx, void *arg, int type, void *slot)
+{
+	fz_list_loader *loader = (fz_list_loader *)arg;
+	int cmd_len, coord_len;
+	const uint8_t *cmds;
+	const float *coords;
+	intptr_t ref;
+
+	if (type != RES_PATH)
+	{
+		ref = *(intptr_t *)slot;
+		if (ref <= 0 || ref > loader->count)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "bad display list resource reference");
+		return get_ref_imp(ctx, loader, (int)ref, type, loader->count);
+	}
+
+	/* Reset the reference count, and the pointers open paths hold */
+	if (!fz_packed_path_data(ctx, slot, &cmd_len, &cmds, &coord_len, &coords))
+	{
+		fz_repack_path(ctx, slot, 0, cmd_len, cmds, coord_len, coords);
+		return NULL;
+	}
+	fz_repack_path(ctx, slot, 1, 0, NULL, 0, NULL);
+
+	/* Open paths take their data from the next path resource */
+	if (loader->next_path >= loader->paths_len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "missing display list path");
+	ref = loader->paths[loader->next_path++];
+	if (ref <= 0 || ref > loader->count || loader->table[ref - 1].type != RES_PATH)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "bad display list path reference");
+	return NULL;
+}
+
+static void *
+unpack_node_path(fz_context *ctx, void *arg, int type, void *slot)
+{
+	fz_list_loader *loader = (fz_list_loader *)arg;
+	fz_list_file_entry *entry;
+	int cmd_len, coord_len;
+	unsigned char *cmds, *coords;
+
+	if (type != RES_PATH)
+		return type == RES_COLORSPACE ? loader->objs[*(intptr_t *)slot - 1] : NULL;
+	if (!fz_packed_path_data(ctx, slot, &cmd_len, (const uint8_t **)&cmds, &coord_len, (const float **)&coords))
+		return NULL;
+
+	entry = &loader->table[loader->paths[loader->next_path++] - 1];
+	loader->pos = entry->offset;
+	loader->end = entry->offset + entry->len;
+	coords = get_data(ctx, loader, sizeof(float), &coord_len);
+	cmds = get_data(ctx, loader, 1, &cmd_len);
+	fz_repack_path(ctx, slot, 1, cmd_len, cmds, coord_len, (float *)coords);
+	return NULL;
+}
+
+static void *
+drop_node_path(fz_context *ctx, void *arg, int type, void *slot)
+{
+	fz_list_loader *loader = (fz_list_loader *)arg;
+
+	if (type == RES_PATH)
+		fz_drop_path(ctx, slot);
+	return type == RES_COLORSPACE ? loader->objs[*(intptr_t *)slot - 1] : NULL;
+}
+
+static void *
+patch_node_ref(fz_context *ctx, void *arg, int type, void *slot)
+{
+	fz_list_loader *loader = (fz_list_loader *)arg;
+	void *obj;
+
+	if (type == RES_PATH)
+		return NULL;
+	obj = loader->objs[*(intptr_t *)slot - 1];
+	switch (type)
+	{
+	case RES_COLORSPACE: fz_keep_colorspace(ctx, obj); break;
+	case RES_STROKE: fz_keep_stroke_state(ctx, obj); break;
+	case RES_TEXT: fz_keep_text(ctx, obj); break;
+	case RES_SHADE: fz_keep_shade(ctx, obj); break;
+	case RES_IMAGE: fz_keep_image(ctx, obj); break;
+	}
+	*(void **)slot = obj;
+	return obj;
+}
+
+static fz_display_list *
+load_list(fz_context *ctx, fz_list_loader *loader)
+{
+	fz_display_list *list = NULL;
+	fz_display_node *nodes;
+	fz_rect mediabox;
+	int len, paths_len;
+	unsigned char *paths;
+
+	fz_var(list);
+
+	mediabox.x0 = get_float(ctx, loader);
+	mediabox.y0 = get_float(ctx, loader);
+	mediabox.x1 = get_float(ctx, loader);
+	mediabox.y1 = get_float(ctx, loader);
+	len = get_int(ctx, loader);
+	paths = get_data(ctx, loader, sizeof(int), &paths_len);
+	get_align(ctx, loader);
+	if (len < 0 || len > (loader->end - loader->pos) / (int)sizeof(fz_display_node))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list resource");
+	nodes = (fz_display_node *)(loader->file->data + loader->pos);
+
+	/* Make sure the nodes are sound before we change anything, then
+	 * unpack the paths that need it. References are only turned into
+	 * pointers once nothing can go wrong, as until then the nodes
+	 * cannot be dropped as a list. */
+	loader->paths = fz_malloc_array(ctx, fz_maxi(paths_len, 1), sizeof(int));
+	memcpy(loader->paths, paths, paths_len * sizeof(int));
+	loader->paths_len = paths_len;
+	fz_try(ctx)
+	{
+		loader->next_path = 0;
+		fz_walk_display_refs(ctx, nodes, len, check_node_ref, loader);
+		fz_try(ctx)
+		{
+			loader->next_path = 0;
+			fz_walk_display_refs(ctx, nodes, len, unpack_node_path, loader);
+			list = fz_new_display_list(ctx);
+			list->file = fz_keep_list_file(ctx, loader->file);
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_display_list(ctx, list);
+			fz_walk_display_refs(ctx, nodes, len, drop_node_path, loader);
+			fz_rethrow(ctx);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, loader->paths);
+		loader->paths = NULL;
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	fz_walk_display_refs(ctx, nodes, len, patch_node_ref, loader);
+	list->list = nodes;
+	list->len = list->max = len;
+	list->mediabox = mediabox;
+	return list;
+}
+
+static void
+load_resource(fz_context *ctx, fz_list_loader *loader, int i)
+{
+	fz_list_file_entry *entry = &loader->table[i];
+
+	loader->pos = entry->offset;
+	loader->end = entry->offset + entry->len;
+	switch (entry->type)
+	{
+	case RES_COLORSPACE:
+		loader->objs[i] = load_colorspace(ctx, loader, i);
+		break;
+	case RES_STROKE:
+		loader->objs[i] = load_stroke(ctx, loader);
+		break;
+	case RES_TEXT:
+		loader->objs[i] = load_text(ctx, loader, i);
+		break;
+	case RES_SHADE:
+		loader->objs[i] = load_shade(ctx, loader, i);
+		break;
+	case RES_IMAGE:
+		loader->objs[i] = load_image(ctx, loader, i);
+		break;
+	case RES_FONT:
+		loader->objs[i] = load_font(ctx, loader, i);
+		break;
+	case RES_LIST:
+		/* The resource count is what lets nodes refer to any
+		 * resource before the list itself. */
+		loader->count = i;
+		loader->objs[i] = load_list(ctx, loader);
+		break;
+	case RES_PATH:
+		break;
+	default:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown display list resource type %d", entry->type);
+	}
+}
+
+static fz_list_file *
+fz_open_list_file(fz_context *ctx, const char *filename)
+{
+	fz_list_file *file = fz_malloc_struct(ctx, fz_list_file);
+	file->refs = 1;
+
+	fz_try(ctx)
+	{
+		file->map = fz_map_file(ctx, filename, &file->data, &file->len);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_list_file(ctx, file);
+		fz_rethrow(ctx);
+	}
+	return file;
+}
+
+fz_display_list *
+fz_load_display_list(fz_context *ctx, const char *filename)
+{
+	fz_list_loader loader = { 0 };
+	fz_list_file_header header;
+	fz_display_list *list = NULL;
+	int i;
+
+	fz_var(list);
+
+	fz_try(ctx)
+	{
+		loader.file = fz_open_list_file(ctx, filename);
+		if (loader.file->len < sizeof header)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not a display list file");
+		memcpy(&header, loader.file->data, sizeof header);
+		if (memcmp(header.magic, LIST_FILE_MAGIC, 4))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not a display list file");
+		if (header.version != LIST_FILE_VERSION)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unsupported display list file version %d", header.version);
+		if (header.byte_order != 0x01020304 || header.pointer_size != sizeof(void *) || header.node_size != sizeof(fz_display_node))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "display list file was saved by an incompatible build");
+		if (header.resources <= 0 || header.table < (int)sizeof header || header.table % LIST_FILE_ALIGN ||
+			(size_t)header.table + (size_t)header.resources * sizeof(fz_list_file_entry) > loader.file->len ||
+			header.list < 0 || header.list >= header.resources)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+		loader.table = (fz_list_file_entry *)(loader.file->data + header.table);
+		for (i = 0; i < header.resources; i++)
+		{
+			fz_list_file_entry *entry = &loader.table[i];
+			if (entry->offset < (int)sizeof header || entry->len < 0 || entry->offset % LIST_FILE_ALIGN || entry->offset > header.table - entry->len)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+		}
+		if (loader.table[header.list].type != RES_LIST)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list file");
+
+		loader.objs = fz_malloc_array(ctx, header.resources, sizeof(void *));
+		memset(loader.objs, 0, header.resources * sizeof(void *));
+		for (i = 0; i <= header.list; i++)
+			load_resource(ctx, &loader, i);
+		list = fz_keep_display_list(ctx, loader.objs[header.list]);
+	}
+	fz_always(ctx)
+	{
+		if (loader.objs)
+			for (i = 0; i < header.resources; i++)
+				drop_resource(ctx, loader.table[i].type, loader.objs[i]);
+		fz_free(ctx, loader.objs);
+		if (loader.file)
+			fz_drop_list_file(ctx, loader.file);
+	}
+	fz_catch(ctx)
+		fz_rethrow_message(ctx, "cannot load display list from '%s'", filename);
+
+	return list;
 }
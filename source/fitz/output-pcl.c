@@ -405,7 +405,7 @@ fz_write_pixmap_as_pcl(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap,
 	if (!out || !pixmap)
 		return;
 
-	if (pixmap->n != 1 && pixmap->n != 2 && pixmap->n != 4)
+	if (pixmap->n - pixmap->alpha > 1 && pixmap->n - pixmap->alpha != 3)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or rgb to write as pcl");
 
 	pcl_header(ctx, out, pcl, 1, pixmap->xres);
@@ -85,7 +85,7 @@ fz_keep_path(fz_context *ctx, fz_path *path)
 {
 	if (path == NULL)
 		return NULL;
-	if (path->refs == 1 && path->packed == FZ_PATH_UNPACKED)
+	if (fz_refs_load8(&path->refs) == 1 && path->packed == FZ_PATH_UNPACKED)
 		fz_trim_path(ctx, path);
 	return fz_keep_imp8(ctx, path, &path->refs);
 }
@@ -126,14 +126,100 @@ int fz_packed_path_size(const fz_path *path)
 	}
 }
 
+int
+fz_packed_path_data(fz_context *ctx, const fz_path *path, int *cmd_len, const uint8_t **cmds, int *coord_len, const float **coords)
+{
+	switch (path->packed)
+	{
+	case FZ_PATH_PACKED_OPEN:
+		*cmd_len = path->cmd_len;
+		*cmds = path->cmds;
+		*coord_len = path->coord_len;
+		*coords = path->coords;
+		return 1;
+	case FZ_PATH_PACKED_FLAT:
+	{
+		fz_packed_path *pack = (fz_packed_path *)path;
+		*cmd_len = pack->cmd_len;
+		*coord_len = pack->coord_len;
+		*coords = (float *)&pack[1];
+		*cmds = (uint8_t *)&(*coords)[pack->coord_len];
+		return 0;
+	}
+	default:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "path is not packed");
+	}
+}
+
+void
+fz_repack_path(fz_context *ctx, fz_path *pack, int open, int cmd_len, const uint8_t *cmds, int coord_len, const float *coords)
+{
+	if (!open)
+	{
+		fz_packed_path *flat = (fz_packed_path *)pack;
+		uint8_t *ptr = (uint8_t *)&flat[1];
+
+		if (cmd_len > 255 || coord_len > 255)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "path too long to pack flat");
+		flat->refs = 1;
+		flat->packed = FZ_PATH_PACKED_FLAT;
+		flat->cmd_len = cmd_len;
+		flat->coord_len = coord_len;
+		memmove(ptr, coords, sizeof(float) * coord_len);
+		ptr += sizeof(float) * coord_len;
+		memmove(ptr, cmds, sizeof(uint8_t) * cmd_len);
+		return;
+	}
+
+	pack->refs = 1;
+	pack->packed = FZ_PATH_PACKED_OPEN;
+	pack->current.x = 0;
+	pack->current.y = 0;
+	pack->begin.x = 0;
+	pack->begin.y = 0;
+	pack->cmd_len = pack->cmd_cap = 0;
+	pack->coord_len = pack->coord_cap = 0;
+	pack->cmds = NULL;
+	pack->coords = NULL;
+	pack->coords = fz_malloc_array(ctx, coord_len, sizeof(float));
+	fz_try(ctx)
+	{
+		pack->cmds = fz_malloc_array(ctx, cmd_len, sizeof(uint8_t));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, pack->coords);
+		pack->coords = NULL;
+		fz_rethrow(ctx);
+	}
+	memcpy(pack->coords, coords, sizeof(float) * coord_len);
+	memcpy(pack->cmds, cmds, sizeof(uint8_t) * cmd_len);
+	pack->coord_cap = pack->coord_len = coord_len;
+	pack->cmd_cap = pack->cmd_len = cmd_len;
+}
+
 int
 fz_pack_path(fz_context *ctx, uint8_t *pack_, int max, const fz_path *path)
 {
 	uint8_t *ptr;
 	int size;
 
+	/* Copy packed paths (from a display list being replayed into
+	 * another, say) as they are. */
 	if (path->packed)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't repack a packed path");
+	{
+		int cmd_len, coord_len, open;
+		const uint8_t *cmds;
+		const float *coords;
+
+		open = fz_packed_path_data(ctx, path, &cmd_len, &cmds, &coord_len, &coords);
+		size = fz_packed_path_size(path);
+		if (size > max)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "Can't pack a path that small!");
+		if (pack_ != NULL)
+			fz_repack_path(ctx, (fz_path *)pack_, open, cmd_len, cmds, coord_len, coords);
+		return size;
+	}
 
 	size = sizeof(fz_packed_path) + sizeof(float) * path->coord_len + sizeof(uint8_t) * path->cmd_len;
 
@@ -195,7 +281,7 @@ fz_pack_path(fz_context *ctx, uint8_t *pack_, int max, const fz_path *path)
 static void
 push_cmd(fz_context *ctx, fz_path *path, int cmd)
 {
-	if (path->refs != 1)
+	if (fz_refs_load8(&path->refs) != 1)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot modify shared paths");
 
 	if (path->cmd_len + 1 >= path->cmd_cap)
@@ -1428,7 +1514,7 @@ fz_keep_stroke_state(fz_context *ctx, fz_stroke_state *stroke)
 		return NULL;
 
 	/* -2 is the magic number we use when we have stroke states stored on the stack */
-	if (stroke->refs == -2)
+	if (fz_refs_load(&stroke->refs) == -2)
 		return fz_clone_stroke_state(ctx, stroke);
 
 	return fz_keep_imp(ctx, stroke, &stroke->refs);
@@ -1485,12 +1571,11 @@ fz_clone_stroke_state(fz_context *ctx, fz_stroke_state *stroke)
 fz_stroke_state *
 fz_unshare_stroke_state_with_dash_len(fz_context *ctx, fz_stroke_state *shared, int len)
 {
-	int single, unsize, shsize, shlen, drop;
+	int single, unsize, shsize, shlen;
 	fz_stroke_state *unshared;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	single = (shared->refs == 1);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	/* If we hold the only reference, nobody else can change the count. */
+	single = (fz_refs_load(&shared->refs) == 1);
 
 	shlen = shared->dash_len - nelem(shared->dash_list);
 	if (shlen < 0)
@@ -1507,11 +1592,7 @@ fz_unshare_stroke_state_with_dash_len(fz_context *ctx, fz_stroke_state *shared,
 	memcpy(unshared, shared, (shsize > unsize ? unsize : shsize));
 	unshared->refs = 1;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	drop = (shared->refs > 0 ? --shared->refs == 0 : 0);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	if (drop)
-		fz_free(ctx, shared);
+	fz_drop_stroke_state(ctx, shared);
 	return unshared;
 }
 
@@ -24,8 +24,8 @@ fz_drop_pixmap_imp(fz_context *ctx, fz_storable *pix_)
 	fz_free(ctx, pix);
 }
 
-fz_pixmap *
-fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h, unsigned char *samples)
+static fz_pixmap *
+new_pixmap(fz_context *ctx, fz_colorspace *colorspace, int w, int h, int alpha, unsigned char *samples)
 {
 	fz_pixmap *pix;
 
@@ -43,11 +43,13 @@ fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h
 	pix->yres = 96;
 	pix->colorspace = NULL;
 	pix->n = 1;
+	pix->alpha = 1;
 
 	if (colorspace)
 	{
 		pix->colorspace = fz_keep_colorspace(ctx, colorspace);
-		pix->n = 1 + colorspace->n;
+		pix->alpha = !!alpha;
+		pix->n = colorspace->n + pix->alpha;
 	}
 
 	pix->samples = samples;
@@ -76,10 +78,22 @@ fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h
 	return pix;
 }
 
+fz_pixmap *
+fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h, unsigned char *samples)
+{
+	return new_pixmap(ctx, colorspace, w, h, 1, samples);
+}
+
 fz_pixmap *
 fz_new_pixmap(fz_context *ctx, fz_colorspace *colorspace, int w, int h)
 {
-	return fz_new_pixmap_with_data(ctx, colorspace, w, h, NULL);
+	return new_pixmap(ctx, colorspace, w, h, 1, NULL);
+}
+
+fz_pixmap *
+fz_new_pixmap_with_alpha(fz_context *ctx, fz_colorspace *colorspace, int w, int h, int alpha)
+{
+	return new_pixmap(ctx, colorspace, w, h, alpha, NULL);
 }
 
 fz_pixmap *
@@ -92,6 +106,16 @@ fz_new_pixmap_with_bbox(fz_context *ctx, fz_colorspace *colorspace, const fz_ire
 	return pixmap;
 }
 
+fz_pixmap *
+fz_new_pixmap_with_bbox_and_alpha(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *r, int alpha)
+{
+	fz_pixmap *pixmap;
+	pixmap = fz_new_pixmap_with_alpha(ctx, colorspace, r->x1 - r->x0, r->y1 - r->y0, alpha);
+	pixmap->x = r->x0;
+	pixmap->y = r->y0;
+	return pixmap;
+}
+
 fz_pixmap *
 fz_new_pixmap_with_bbox_and_data(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *r, unsigned char *samples)
 {
@@ -101,6 +125,15 @@ fz_new_pixmap_with_bbox_and_data(fz_context *ctx, fz_colorspace *colorspace, con
 	return pixmap;
 }
 
+fz_pixmap *
+fz_new_pixmap_with_bbox_alpha_and_data(fz_context *ctx, fz_colorspace *colorspace, const fz_irect *r, int alpha, unsigned char *samples)
+{
+	fz_pixmap *pixmap = new_pixmap(ctx, colorspace, r->x1 - r->x0, r->y1 - r->y0, alpha, samples);
+	pixmap->x = r->x0;
+	pixmap->y = r->y0;
+	return pixmap;
+}
+
 fz_irect *
 fz_pixmap_bbox(fz_context *ctx, fz_pixmap *pix, fz_irect *bbox)
 {
@@ -157,15 +190,16 @@ fz_clear_pixmap_with_value(fz_context *ctx, fz_pixmap *pix, int value)
 				*s++ = 0;
 				*s++ = 0;
 				*s++ = value;
-				*s++ = 255;
+				if (pix->alpha)
+					*s++ = 255;
 			}
 		}
 		return;
 	}
 
-	if (value == 255)
+	if (value == 255 || !pix->alpha)
 	{
-		memset(pix->samples, 255, (unsigned int)(pix->w * pix->h * pix->n));
+		memset(pix->samples, value, (unsigned int)(pix->w * pix->h * pix->n));
 	}
 	else
 	{
@@ -204,7 +238,7 @@ fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, const fz_i
 	destspan = dest->w * dest->n;
 	destp = dest->samples + (unsigned int)(destspan * (local_b.y0 - dest->y) + dest->n * (local_b.x0 - dest->x));
 
-	if (src->n == dest->n)
+	if (src->n == dest->n && src->alpha == dest->alpha)
 	{
 		w *= src->n;
 		do
@@ -215,7 +249,28 @@ fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, const fz_i
 		}
 		while (--y);
 	}
-	else if (src->n == 2 && dest->n == 4)
+	else if (src->n - src->alpha == dest->n - dest->alpha)
+	{
+		/* Copy, adding an opaque alpha or dropping the alpha */
+		int k, n = src->n - src->alpha;
+		srcspan -= w*src->n;
+		destspan -= w*dest->n;
+		do
+		{
+			for (x = w; x > 0; x--)
+			{
+				for (k = 0; k < n; k++)
+					*destp++ = *srcp++;
+				if (dest->alpha)
+					*destp++ = 255;
+				srcp += src->alpha;
+			}
+			srcp += srcspan;
+			destp += destspan;
+		}
+		while (--y);
+	}
+	else if (src->n == 2 && dest->n == 4 && src->alpha && dest->alpha)
 	{
 		/* Copy, and convert from grey+alpha to rgb+alpha */
 		srcspan -= w*2;
@@ -236,7 +291,7 @@ fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, const fz_i
 		}
 		while (--y);
 	}
-	else if (src->n == 4 && dest->n == 2)
+	else if (src->n == 4 && dest->n == 2 && src->alpha && dest->alpha)
 	{
 		/* Copy, and convert from rgb+alpha to grey+alpha */
 		srcspan -= w*4;
@@ -261,8 +316,8 @@ fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, const fz_i
 	{
 		/* FIXME: Crap conversion */
 		int z;
-		int sn = src->n-1;
-		int dn = dest->n-1;
+		int sn = src->n - src->alpha;
+		int dn = dest->n - dest->alpha;
 
 		srcspan -= w*src->n;
 		destspan -= w*dest->n;
@@ -276,7 +331,9 @@ fz_copy_pixmap_rect(fz_context *ctx, fz_pixmap *dest, fz_pixmap *src, const fz_i
 				v = (v * dn + (sn>>1)) / sn;
 				for (z = dn; z > 0; z--)
 					*destp++ = (unsigned char)v;
-				*destp++ = *srcp++;
+				if (dest->alpha)
+					*destp++ = src->alpha ? *srcp : 255;
+				srcp += src->alpha;
 			}
 			srcp += srcspan;
 			destp += destspan;
@@ -315,7 +372,8 @@ fz_clear_pixmap_rect_with_value(fz_context *ctx, fz_pixmap *dest, int value, con
 				*s++ = 0;
 				*s++ = 0;
 				*s++ = value;
-				*s++ = 255;
+				if (dest->alpha)
+					*s++ = 255;
 			}
 			destp += destspan;
 		}
@@ -323,11 +381,11 @@ fz_clear_pixmap_rect_with_value(fz_context *ctx, fz_pixmap *dest, int value, con
 		return;
 	}
 
-	if (value == 255)
+	if (value == 255 || !dest->alpha)
 	{
 		do
 		{
-			memset(destp, 255, (unsigned int)(w * dest->n));
+			memset(destp, value, (unsigned int)(w * dest->n));
 			destp += destspan;
 		}
 		while (--y);
@@ -356,6 +414,9 @@ fz_premultiply_pixmap(fz_context *ctx, fz_pixmap *pix)
 	unsigned char a;
 	int k, x, y;
 
+	if (!pix->alpha)
+		return;
+
 	for (y = 0; y < pix->h; y++)
 	{
 		for (x = 0; x < pix->w; x++)
@@ -375,6 +436,9 @@ fz_unmultiply_pixmap(fz_context *ctx, fz_pixmap *pix)
 	int a, inva;
 	int k, x, y;
 
+	if (!pix->alpha)
+		return;
+
 	for (y = 0; y < pix->h; y++)
 	{
 		for (x = 0; x < pix->w; x++)
@@ -435,7 +499,7 @@ fz_tint_pixmap(fz_context *ctx, fz_pixmap *pix, int r, int g, int b)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "can only tint RGB, BGR and Gray pixmaps");
 	}
 
-	if (pix->n == 4)
+	if (pix->n - pix->alpha == 3)
 	{
 		for (x = 0; x < pix->w; x++)
 		{
@@ -444,18 +508,18 @@ fz_tint_pixmap(fz_context *ctx, fz_pixmap *pix, int r, int g, int b)
 				s[0] = fz_mul255(s[0], r);
 				s[1] = fz_mul255(s[1], g);
 				s[2] = fz_mul255(s[2], b);
-				s += 4;
+				s += pix->n;
 			}
 		}
 	}
-	else if (pix->n == 2)
+	else if (pix->n - pix->alpha == 1)
 	{
 		for (x = 0; x < pix->w; x++)
 		{
 			for (y = 0; y < pix->h; y++)
 			{
 				*s = fz_mul255(*s, g);
-				s += 2;
+				s += pix->n;
 			}
 		}
 	}
@@ -471,7 +535,7 @@ fz_invert_pixmap(fz_context *ctx, fz_pixmap *pix)
 	{
 		for (x = 0; x < pix->w; x++)
 		{
-			for (k = 0; k < pix->n - 1; k++)
+			for (k = 0; k < pix->n - pix->alpha; k++)
 				s[k] = 255 - s[k];
 			s += pix->n;
 		}
@@ -493,9 +557,9 @@ void fz_invert_pixmap_rect(fz_context *ctx, fz_pixmap *image, const fz_irect *re
 		p = image->samples + (unsigned int)((y * image->w + x0) * image->n);
 		for (x = x0; x < x1; x++)
 		{
-			for (n = image->n; n > 1; n--, p++)
+			for (n = image->n - image->alpha; n > 0; n--, p++)
 				*p = 255 - *p;
-			p++;
+			p += image->alpha;
 		}
 	}
 }
@@ -514,7 +578,7 @@ fz_gamma_pixmap(fz_context *ctx, fz_pixmap *pix, float gamma)
 	{
 		for (x = 0; x < pix->w; x++)
 		{
-			for (k = 0; k < pix->n - 1; k++)
+			for (k = 0; k < pix->n - pix->alpha; k++)
 				s[k] = gamma_map[s[k]];
 			s += pix->n;
 		}
@@ -526,21 +590,25 @@ fz_gamma_pixmap(fz_context *ctx, fz_pixmap *pix, float gamma)
  */
 
 void
-fz_write_pnm_header(fz_context *ctx, fz_output *out, int w, int h, int n)
+fz_write_pnm_header(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha)
 {
-	if (n != 1 && n != 2 && n != 4)
+	/* Masks are written as greyscale */
+	if (n == 1)
+		alpha = 0;
+	n -= alpha;
+	if (n != 1 && n != 3)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or rgb to write as pnm");
 
-	if (n == 1 || n == 2)
+	if (n == 1)
 		fz_printf(ctx, out, "P5\n");
-	if (n == 4)
+	if (n == 3)
 		fz_printf(ctx, out, "P6\n");
 	fz_printf(ctx, out, "%d %d\n", w, h);
 	fz_printf(ctx, out, "255\n");
 }
 
 void
-fz_write_pnm_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *p)
+fz_write_pnm_band(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int band, int bandheight, unsigned char *p)
 {
 	int len;
 	int start = band * bandheight;
@@ -552,6 +620,12 @@ fz_write_pnm_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band
 
 	len = w * end;
 
+	if (!alpha || n == 1)
+	{
+		fz_write(ctx, out, p, len * n);
+		return;
+	}
+
 	switch (n)
 	{
 	case 1:
@@ -578,16 +652,16 @@ fz_write_pnm_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band
 void
 fz_write_pixmap_as_pnm(fz_context *ctx, fz_output *out, fz_pixmap *pixmap)
 {
-	fz_write_pnm_header(ctx, out, pixmap->w, pixmap->h, pixmap->n);
-	fz_write_pnm_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples);
+	fz_write_pnm_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha);
+	fz_write_pnm_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples);
 }
 
 void
 fz_save_pixmap_as_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename)
 {
 	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
-	fz_write_pnm_header(ctx, out, pixmap->w, pixmap->h, pixmap->n);
-	fz_write_pnm_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples);
+	fz_write_pnm_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha);
+	fz_write_pnm_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples);
 	fz_drop_output(ctx, out);
 }
 
@@ -596,11 +670,11 @@ fz_save_pixmap_as_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename)
  */
 
 void
-fz_write_pam_header(fz_context *ctx, fz_output *out, int w, int h, int n, int savealpha)
+fz_write_pam_header(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int savealpha)
 {
-	int sn = n;
+	int sn = n + !alpha;
 	int dn = n;
-	if (!savealpha && dn > 1)
+	if (alpha && !savealpha && dn > 1)
 		dn--;
 
 	fz_printf(ctx, out, "P7\n");
@@ -618,14 +692,14 @@ fz_write_pam_header(fz_context *ctx, fz_output *out, int w, int h, int n, int sa
 }
 
 void
-fz_write_pam_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *sp, int savealpha)
+fz_write_pam_band(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int band, int bandheight, unsigned char *sp, int savealpha)
 {
 	int y, x, k;
 	int start = band * bandheight;
 	int end = start + bandheight;
 	int sn = n;
 	int dn = n;
-	if (!savealpha && dn > 1)
+	if (alpha && !savealpha && dn > 1)
 		dn--;
 
 	if (end > h)
@@ -647,16 +721,16 @@ fz_write_pam_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band
 void
 fz_write_pixmap_as_pam(fz_context *ctx, fz_output *out, fz_pixmap *pixmap, int savealpha)
 {
-	fz_write_pam_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, savealpha);
-	fz_write_pam_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha);
+	fz_write_pam_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, savealpha);
+	fz_write_pam_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples, savealpha);
 }
 
 void
 fz_save_pixmap_as_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
 {
 	fz_output *out = fz_new_output_with_path(ctx, filename, 0);
-	fz_write_pam_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, savealpha);
-	fz_write_pam_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha);
+	fz_write_pam_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, savealpha);
+	fz_write_pam_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples, savealpha);
 	fz_drop_output(ctx, out);
 }
 
@@ -696,8 +770,8 @@ fz_save_pixmap_as_png(fz_context *ctx, fz_pixmap *pixmap, const char *filename,
 
 	fz_try(ctx)
 	{
-		poc = fz_write_png_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, savealpha);
-		fz_write_png_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha, poc);
+		poc = fz_write_png_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, savealpha);
+		fz_write_png_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples, savealpha, poc);
 	}
 	fz_always(ctx)
 	{
@@ -718,11 +792,11 @@ fz_write_pixmap_as_png(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap,
 	if (!out)
 		return;
 
-	poc = fz_write_png_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, savealpha);
+	poc = fz_write_png_header(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, savealpha);
 
 	fz_try(ctx)
 	{
-		fz_write_png_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha, poc);
+		fz_write_png_band(ctx, out, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, 0, pixmap->h, pixmap->samples, savealpha, poc);
 	}
 	fz_always(ctx)
 	{
@@ -743,7 +817,7 @@ struct fz_png_output_context_s
 };
 
 fz_png_output_context *
-fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int savealpha)
+fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int savealpha)
 {
 	static const unsigned char pngsig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
 	unsigned char head[13];
@@ -753,12 +827,15 @@ fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int sa
 	if (!out)
 		return NULL;
 
-	if (n != 1 && n != 2 && n != 4)
+	/* Masks are written as greyscale */
+	if (n == 1)
+		alpha = 0;
+	if (n - alpha != 1 && n - alpha != 3)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or rgb to write as png");
 
 	poc = fz_malloc_struct(ctx, fz_png_output_context);
 
-	if (!savealpha && n > 1)
+	if (alpha && !savealpha)
 		n--;
 
 	switch (n)
@@ -785,7 +862,7 @@ fz_write_png_header(fz_context *ctx, fz_output *out, int w, int h, int n, int sa
 }
 
 void
-fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *sp, int savealpha, fz_png_output_context *poc)
+fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int alpha, int band, int bandheight, unsigned char *sp, int savealpha, fz_png_output_context *poc)
 {
 	unsigned char *dp;
 	int y, x, k, sn, dn, err, finalband;
@@ -793,7 +870,9 @@ fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band
 	if (!out || !sp || !poc)
 		return;
 
-	if (n != 1 && n != 2 && n != 4)
+	if (n == 1)
+		alpha = 0;
+	if (n - alpha != 1 && n - alpha != 3)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale or rgb to write as png");
 
 	band *= bandheight;
@@ -803,7 +882,7 @@ fz_write_png_band(fz_context *ctx, fz_output *out, int w, int h, int n, int band
 
 	sn = n;
 	dn = n;
-	if (!savealpha && dn > 1)
+	if (alpha && !savealpha)
 		dn--;
 
 	if (poc->udata == NULL)
@@ -981,10 +1060,13 @@ fz_save_pixmap_as_tga(fz_context *ctx, fz_pixmap *pixmap, const char *filename,
 	fz_output *out;
 	unsigned char head[18];
 	int n = pixmap->n;
-	int d = savealpha || n == 1 ? n : n - 1;
-	int is_bgr = pixmap->colorspace == fz_device_bgr(ctx);
+	int d, is_bgr = pixmap->colorspace == fz_device_bgr(ctx);
 	int k;
 
+	if (!pixmap->alpha)
+		savealpha = 0;
+	d = savealpha || n == 1 || !pixmap->alpha ? n : n - 1;
+
 	if (pixmap->colorspace && pixmap->colorspace != fz_device_gray(ctx) &&
 		pixmap->colorspace != fz_device_rgb(ctx) && pixmap->colorspace != fz_device_bgr(ctx))
 	{
@@ -994,7 +1076,7 @@ fz_save_pixmap_as_tga(fz_context *ctx, fz_pixmap *pixmap, const char *filename,
 	out = fz_new_output_with_path(ctx, filename, 0);
 
 	memset(head, 0, sizeof(head));
-	head[2] = n == 4 ? 10 : 11;
+	head[2] = n - pixmap->alpha == 3 ? 10 : 11;
 	head[12] = pixmap->w & 0xFF; head[13] = (pixmap->w >> 8) & 0xFF;
 	head[14] = pixmap->h & 0xFF; head[15] = (pixmap->h >> 8) & 0xFF;
 	head[16] = d * 8;
@@ -55,25 +55,34 @@ fz_char_and_box *fz_stext_char_at(fz_context *ctx, fz_char_and_box *cab, fz_stex
 	return cab;
 }
 
-static int charat(fz_context *ctx, fz_stext_page *page, int idx)
+enum
 {
-	fz_char_and_box cab;
-	return fz_stext_char_at(ctx, &cab, page, idx)->c;
-}
+	FZ_STEXT_INDEX_LINE_END = 1,
+	FZ_STEXT_INDEX_LAST_SPAN = 2
+};
 
-static fz_rect *bboxat(fz_context *ctx, fz_stext_page *page, int idx, fz_rect *bbox)
+typedef struct fz_stext_index_char_s
 {
-	fz_char_and_box cab;
-	/* FIXME: Nasty extra copy */
-	*bbox = fz_stext_char_at(ctx, &cab, page, idx)->bbox;
-	return bbox;
-}
+	int c;
+	int flags;
+	fz_rect bbox;
+} fz_stext_index_char;
 
-static int textlen(fz_context *ctx, fz_stext_page *page)
+struct fz_stext_index_s
 {
-	int len = 0;
-	int block_num;
+	int len;
+	fz_stext_index_char *chars;
+};
 
+fz_stext_index *
+fz_new_stext_index(fz_context *ctx, fz_stext_page *page)
+{
+	fz_stext_index *index;
+	fz_stext_index_char *ch;
+	int block_num, i, len;
+
+	/* Count the characters, plus one pseudo-newline per line */
+	len = 0;
 	for (block_num = 0; block_num < page->len; block_num++)
 	{
 		fz_stext_block *block;
@@ -86,30 +95,81 @@ static int textlen(fz_context *ctx, fz_stext_page *page)
 		for (line = block->lines; line < block->lines + block->len; line++)
 		{
 			for (span = line->first_span; span; span = span->next)
-			{
 				len += span->len;
+			len++;
+		}
+	}
+
+	index = fz_malloc_struct(ctx, fz_stext_index);
+	fz_try(ctx)
+		index->chars = fz_malloc_array(ctx, len, sizeof *index->chars);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, index);
+		fz_rethrow(ctx);
+	}
+	index->len = len;
+
+	ch = index->chars;
+	for (block_num = 0; block_num < page->len; block_num++)
+	{
+		fz_stext_block *block;
+		fz_stext_line *line;
+		fz_stext_span *span;
+
+		if (page->blocks[block_num].type != FZ_PAGE_BLOCK_TEXT)
+			continue;
+		block = page->blocks[block_num].u.text;
+		for (line = block->lines; line < block->lines + block->len; line++)
+		{
+			for (span = line->first_span; span; span = span->next)
+			{
+				for (i = 0; i < span->len; i++, ch++)
+				{
+					ch->c = span->text[i].c;
+					ch->flags = span == line->last_span ? FZ_STEXT_INDEX_LAST_SPAN : 0;
+					fz_stext_char_bbox(ctx, &ch->bbox, span, i);
+				}
 			}
-			len++; /* pseudo-newline */
+			ch->c = ' ';
+			ch->flags = FZ_STEXT_INDEX_LINE_END;
+			ch->bbox = fz_empty_rect;
+			ch++;
 		}
 	}
-	return len;
+
+	return index;
 }
 
-static int match(fz_context *ctx, fz_stext_page *page, const char *s, int n)
+void
+fz_drop_stext_index(fz_context *ctx, fz_stext_index *index)
+{
+	if (!index)
+		return;
+	fz_free(ctx, index->chars);
+	fz_free(ctx, index);
+}
+
+static inline int charat(fz_stext_index *index, int idx)
+{
+	return idx < index->len ? index->chars[idx].c : 0;
+}
+
+static int match(fz_stext_index *index, const char *s, int n)
 {
 	int orig = n;
 	int c;
 	while (*s)
 	{
 		s += fz_chartorune(&c, (char *)s);
-		if (iswhite(c) && iswhite(charat(ctx, page, n)))
+		if (iswhite(c) && iswhite(charat(index, n)))
 		{
 			const char *s_next;
 
 			/* Skip over whitespace in the document */
 			do
 				n++;
-			while (iswhite(charat(ctx, page, n)));
+			while (iswhite(charat(index, n)));
 
 			/* Skip over multiple whitespace in the search string */
 			while (s_next = s + fz_chartorune(&c, (char *)s), iswhite(c))
@@ -117,7 +177,7 @@ static int match(fz_context *ctx, fz_stext_page *page, const char *s, int n)
 		}
 		else
 		{
-			if (fz_tolower(c) != fz_tolower(charat(ctx, page, n)))
+			if (fz_tolower(c) != fz_tolower(charat(index, n)))
 				return 0;
 			n++;
 		}
@@ -126,36 +186,34 @@ static int match(fz_context *ctx, fz_stext_page *page, const char *s, int n)
 }
 
 int
-fz_search_stext_page(fz_context *ctx, fz_stext_page *text, const char *needle, fz_rect *hit_bbox, int hit_max)
+fz_search_stext_index(fz_context *ctx, fz_stext_index *index, const char *needle, fz_rect *hit_bbox, int hit_max)
 {
-	int pos, len, i, n, hit_count;
+	int pos, i, n, hit_count;
 
 	if (strlen(needle) == 0)
 		return 0;
 
 	hit_count = 0;
-	len = textlen(ctx, text);
-	for (pos = 0; pos < len; pos++)
+	for (pos = 0; pos < index->len; pos++)
 	{
-		n = match(ctx, text, needle, pos);
+		n = match(index, needle, pos);
 		if (n)
 		{
 			fz_rect linebox = fz_empty_rect;
 			for (i = 0; i < n; i++)
 			{
-				fz_rect charbox;
-				bboxat(ctx, text, pos + i, &charbox);
-				if (!fz_is_empty_rect(&charbox))
+				fz_rect *charbox = &index->chars[pos + i].bbox;
+				if (!fz_is_empty_rect(charbox))
 				{
-					if (charbox.y0 != linebox.y0 || fz_abs(charbox.x0 - linebox.x1) > 5)
+					if (charbox->y0 != linebox.y0 || fz_abs(charbox->x0 - linebox.x1) > 5)
 					{
 						if (!fz_is_empty_rect(&linebox) && hit_count < hit_max)
 							hit_bbox[hit_count++] = linebox;
-						linebox = charbox;
+						linebox = *charbox;
 					}
 					else
 					{
-						fz_union_rect(&linebox, &charbox);
+						fz_union_rect(&linebox, charbox);
 					}
 				}
 			}
@@ -168,63 +226,88 @@ fz_search_stext_page(fz_context *ctx, fz_stext_page *text, const char *needle, f
 }
 
 int
-fz_highlight_selection(fz_context *ctx, fz_stext_page *page, fz_rect rect, fz_rect *hit_bbox, int hit_max)
+fz_search_stext_page(fz_context *ctx, fz_stext_page *text, const char *needle, fz_rect *hit_bbox, int hit_max)
+{
+	fz_stext_index *index;
+	int hit_count = 0;
+
+	if (strlen(needle) == 0)
+		return 0;
+
+	index = fz_new_stext_index(ctx, text);
+	fz_try(ctx)
+		hit_count = fz_search_stext_index(ctx, index, needle, hit_bbox, hit_max);
+	fz_always(ctx)
+		fz_drop_stext_index(ctx, index);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return hit_count;
+}
+
+int
+fz_highlight_stext_index(fz_context *ctx, fz_stext_index *index, fz_rect rect, fz_rect *hit_bbox, int hit_max)
 {
-	fz_rect linebox, charbox;
-	fz_stext_block *block;
-	fz_stext_line *line;
-	fz_stext_span *span;
-	int i, block_num, hit_count;
+	fz_rect linebox = fz_empty_rect;
+	fz_stext_index_char *ch, *end;
+	int hit_count = 0;
 
 	float x0 = rect.x0;
 	float x1 = rect.x1;
 	float y0 = rect.y0;
 	float y1 = rect.y1;
 
-	hit_count = 0;
-
-	for (block_num = 0; block_num < page->len; block_num++)
+	for (ch = index->chars, end = ch + index->len; ch < end; ch++)
 	{
-		if (page->blocks[block_num].type != FZ_PAGE_BLOCK_TEXT)
-			continue;
-		block = page->blocks[block_num].u.text;
-		for (line = block->lines; line < block->lines + block->len; line++)
+		fz_rect *charbox = &ch->bbox;
+
+		if (ch->flags & FZ_STEXT_INDEX_LINE_END)
 		{
+			if (!fz_is_empty_rect(&linebox) && hit_count < hit_max)
+				hit_bbox[hit_count++] = linebox;
 			linebox = fz_empty_rect;
-			for (span = line->first_span; span; span = span->next)
+		}
+		else if (charbox->x1 >= x0 && charbox->x0 <= x1 && charbox->y1 >= y0 && charbox->y0 <= y1)
+		{
+			if (charbox->y0 != linebox.y0 || fz_abs(charbox->x0 - linebox.x1) > 5)
 			{
-				for (i = 0; i < span->len; i++)
-				{
-					fz_stext_char_bbox(ctx, &charbox, span, i);
-					if (charbox.x1 >= x0 && charbox.x0 <= x1 && charbox.y1 >= y0 && charbox.y0 <= y1)
-					{
-						if (charbox.y0 != linebox.y0 || fz_abs(charbox.x0 - linebox.x1) > 5)
-						{
-							if (!fz_is_empty_rect(&linebox) && hit_count < hit_max)
-								hit_bbox[hit_count++] = linebox;
-							linebox = charbox;
-						}
-						else
-						{
-							fz_union_rect(&linebox, &charbox);
-						}
-					}
-				}
+				if (!fz_is_empty_rect(&linebox) && hit_count < hit_max)
+					hit_bbox[hit_count++] = linebox;
+				linebox = *charbox;
+			}
+			else
+			{
+				fz_union_rect(&linebox, charbox);
 			}
-			if (!fz_is_empty_rect(&linebox) && hit_count < hit_max)
-				hit_bbox[hit_count++] = linebox;
 		}
 	}
 
 	return hit_count;
 }
 
+int
+fz_highlight_selection(fz_context *ctx, fz_stext_page *page, fz_rect rect, fz_rect *hit_bbox, int hit_max)
+{
+	fz_stext_index *index;
+	int hit_count = 0;
+
+	index = fz_new_stext_index(ctx, page);
+	fz_try(ctx)
+		hit_count = fz_highlight_stext_index(ctx, index, rect, hit_bbox, hit_max);
+	fz_always(ctx)
+		fz_drop_stext_index(ctx, index);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return hit_count;
+}
+
 char *
-fz_copy_selection(fz_context *ctx, fz_stext_page *page, fz_rect rect)
+fz_copy_stext_index(fz_context *ctx, fz_stext_index *index, fz_rect rect)
 {
 	fz_buffer *buffer;
-	fz_rect hitbox;
-	int c, i, block_num, seen = 0;
+	fz_stext_index_char *ch, *end;
+	int c, seen = 0, newline = 0;
 	char *s;
 
 	float x0 = rect.x0;
@@ -234,47 +317,62 @@ fz_copy_selection(fz_context *ctx, fz_stext_page *page, fz_rect rect)
 
 	buffer = fz_new_buffer(ctx, 1024);
 
-	for (block_num = 0; block_num < page->len; block_num++)
+	fz_try(ctx)
 	{
-		fz_stext_block *block;
-		fz_stext_line *line;
-		fz_stext_span *span;
-
-		if (page->blocks[block_num].type != FZ_PAGE_BLOCK_TEXT)
-			continue;
-		block = page->blocks[block_num].u.text;
-		for (line = block->lines; line < block->lines + block->len; line++)
+		for (ch = index->chars, end = ch + index->len; ch < end; ch++)
 		{
-			for (span = line->first_span; span; span = span->next)
-			{
-				if (seen)
-				{
-					fz_write_buffer_byte(ctx, buffer, '\n');
-				}
+			fz_rect *hitbox = &ch->bbox;
 
+			/* Lines end with a newline if their last span had
+			 * selected text and more text follows. */
+			if (ch->flags & FZ_STEXT_INDEX_LINE_END)
+			{
+				newline |= seen;
 				seen = 0;
-
-				for (i = 0; i < span->len; i++)
-				{
-					fz_stext_char_bbox(ctx, &hitbox, span, i);
-					c = span->text[i].c;
-					if (c < 32)
-						c = '?';
-					if (hitbox.x1 >= x0 && hitbox.x0 <= x1 && hitbox.y1 >= y0 && hitbox.y0 <= y1)
-					{
-						fz_write_buffer_rune(ctx, buffer, c);
-						seen = 1;
-					}
-				}
-
-				seen = (seen && span == line->last_span);
+				continue;
+			}
+			if (newline)
+			{
+				fz_write_buffer_byte(ctx, buffer, '\n');
+				newline = 0;
+			}
+			if (hitbox->x1 >= x0 && hitbox->x0 <= x1 && hitbox->y1 >= y0 && hitbox->y0 <= y1)
+			{
+				c = ch->c;
+				if (c < 32)
+					c = '?';
+				fz_write_buffer_rune(ctx, buffer, c);
+				if (ch->flags & FZ_STEXT_INDEX_LAST_SPAN)
+					seen = 1;
 			}
 		}
-	}
 
-	fz_write_buffer_byte(ctx, buffer, 0);
+		fz_write_buffer_byte(ctx, buffer, 0);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buffer);
+		fz_rethrow(ctx);
+	}
 
 	s = (char*)buffer->data;
 	fz_free(ctx, buffer);
 	return s;
 }
+
+char *
+fz_copy_selection(fz_context *ctx, fz_stext_page *page, fz_rect rect)
+{
+	fz_stext_index *index;
+	char *s = NULL;
+
+	index = fz_new_stext_index(ctx, page);
+	fz_try(ctx)
+		s = fz_copy_stext_index(ctx, index, rect);
+	fz_always(ctx)
+		fz_drop_stext_index(ctx, index);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return s;
+}
@@ -9,10 +9,25 @@ struct fz_item_s
 	unsigned int size;
 	fz_item *next;
 	fz_item *prev;
+	fz_item *index_next;
+	fz_item *index_prev;
+	unsigned int index_hash;
+	unsigned int cost;
+	double priority;
+	fz_store_stats *stats;
 	fz_store *store;
 	fz_store_type *type;
 };
 
+#define INITIAL_INDEX_LEN 256 /* Must be a power of 2 */
+
+/* How many of the least recently used items we consider when choosing
+ * which one to evict. */
+#define EVICT_WINDOW 16
+
+/* How many different store types we keep statistics for. */
+#define MAX_STATS 32
+
 struct fz_store_s
 {
 	int refs;
@@ -26,9 +41,29 @@ struct fz_store_s
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
 
+	/* Everything else lives in a second, chained, hash table, indexed
+	 * on the item type and drop function, and on the key hash for
+	 * types that supply one. Matches are confirmed with cmp_key. */
+	fz_item **index;
+	int index_len;
+	int index_count;
+
 	/* We keep track of the size of the store, and keep it below max. */
 	unsigned int max;
 	unsigned int size;
+
+	/* Eviction priorities are relative to this, which rises as items
+	 * are evicted, so that unused items eventually age out whatever
+	 * their cost. */
+	double age;
+
+	/* The total cost and size of all the items stored with a known
+	 * cost, from which items of unknown cost take their priority. */
+	double known_cost;
+	double known_size;
+
+	fz_store_stats stats[MAX_STATS];
+	int num_stats;
 };
 
 void
@@ -39,12 +74,17 @@ fz_new_store_context(fz_context *ctx, unsigned int max)
 	fz_try(ctx)
 	{
 		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC);
+		store->index = fz_calloc(ctx, INITIAL_INDEX_LEN, sizeof(fz_item *));
 	}
 	fz_catch(ctx)
 	{
+		if (store->hash)
+			fz_drop_hash(ctx, store->hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
+	store->index_len = INITIAL_INDEX_LEN;
+	store->index_count = 0;
 	store->refs = 1;
 	store->head = NULL;
 	store->tail = NULL;
@@ -73,6 +113,182 @@ fz_drop_storable(fz_context *ctx, fz_storable *s)
 		s->drop(ctx, s);
 }
 
+static unsigned int
+index_hash(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *type)
+{
+	unsigned int h = (unsigned int)(intptr_t)type ^ ((unsigned int)(intptr_t)drop * 31);
+
+	if (type->hash_key)
+		h ^= type->hash_key(ctx, key) * 0x9e3779b1;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+/* The store lock is held when these two are called. */
+static void
+index_insert(fz_store *store, fz_item *item)
+{
+	fz_item **head = &store->index[item->index_hash & (store->index_len - 1)];
+
+	item->index_prev = NULL;
+	item->index_next = *head;
+	if (item->index_next)
+		item->index_next->index_prev = item;
+	*head = item;
+	store->index_count++;
+}
+
+static void
+index_remove(fz_store *store, fz_item *item)
+{
+	if (item->index_next)
+		item->index_next->index_prev = item->index_prev;
+	if (item->index_prev)
+		item->index_prev->index_next = item->index_next;
+	else
+		store->index[item->index_hash & (store->index_len - 1)] = item->index_next;
+	store->index_count--;
+}
+
+/* Called without the store lock held, as we need to allocate. */
+static void
+grow_index(fz_context *ctx, fz_store *store)
+{
+	fz_item **index, **old;
+	fz_item *item;
+	int len, i;
+
+	len = store->index_len;
+	index = fz_calloc_no_throw(ctx, len * 2, sizeof(fz_item *));
+	if (index == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (store->index_len != len)
+	{
+		/* Someone else beat us to it */
+		old = index;
+	}
+	else
+	{
+		old = store->index;
+		store->index = index;
+		store->index_len = len * 2;
+		store->index_count = 0;
+		for (i = 0; i < len; i++)
+		{
+			while ((item = old[i]) != NULL)
+			{
+				old[i] = item->index_next;
+				index_insert(store, item);
+			}
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_free(ctx, old);
+}
+
+/*
+	Items are evicted in the style of the GreedyDual-Size algorithm:
+	each is given a priority of the cost of recreating it per byte of
+	store that it uses, on top of the current age of the store. The
+	age rises to the priority of each item evicted to make space.
+
+	Items of unknown cost (0) are neither cheap nor expensive: when
+	choosing a victim they are taken to cost the current average per
+	byte of the items whose cost is known, or 0 if there are none.
+
+	Rather than keep a priority queue, we choose the item with the
+	lowest priority from amongst the least recently used few that are
+	evictable. Ties go to the least recently used, so when no costs
+	are known this is plain LRU.
+*/
+static void
+set_priority(fz_store *store, fz_item *item)
+{
+	item->priority = store->age;
+	if (item->cost != 0)
+		item->priority += (double)item->cost / (item->size > 0 ? item->size : 1);
+}
+
+static double
+get_priority(fz_store *store, fz_item *item)
+{
+	if (item->cost == 0 && store->known_size > 0)
+		return item->priority + store->known_cost / store->known_size;
+	return item->priority;
+}
+
+/* Items of known cost count towards the average while they are stored */
+static void
+add_known_cost(fz_store *store, fz_item *item)
+{
+	if (item->cost != 0)
+	{
+		store->known_cost += item->cost;
+		store->known_size += item->size > 0 ? item->size : 1;
+	}
+}
+
+static void
+remove_known_cost(fz_store *store, fz_item *item)
+{
+	if (item->cost != 0)
+	{
+		store->known_cost -= item->cost;
+		store->known_size -= item->size > 0 ? item->size : 1;
+	}
+}
+
+static fz_item *
+choose_victim(fz_store *store)
+{
+	fz_item *item, *victim = NULL;
+	double priority, victim_priority = 0;
+	int n = 0;
+
+	for (item = store->tail; item && n < EVICT_WINDOW; item = item->prev)
+	{
+		if (fz_refs_load(&item->val->refs) != 1)
+			continue;
+		priority = get_priority(store, item);
+		if (victim == NULL || priority < victim_priority)
+		{
+			victim = item;
+			victim_priority = priority;
+		}
+		n++;
+	}
+
+	if (victim)
+	{
+		if (store->age < victim_priority)
+			store->age = victim_priority;
+		if (victim->stats)
+			victim->stats->evictions++;
+	}
+
+	return victim;
+}
+
+static fz_store_stats *
+find_stats(fz_store *store, fz_store_type *type)
+{
+	int i;
+
+	for (i = 0; i < store->num_stats; i++)
+		if (store->stats[i].type == type)
+			return &store->stats[i];
+	if (i == MAX_STATS)
+		return NULL;
+	store->stats[i].type = type;
+	store->num_stats++;
+	return &store->stats[i];
+}
+
 static void
 evict(fz_context *ctx, fz_item *item)
 {
@@ -80,6 +296,12 @@ evict(fz_context *ctx, fz_item *item)
 	int drop;
 
 	store->size -= item->size;
+	remove_known_cost(store, item);
+	if (item->stats)
+	{
+		item->stats->items--;
+		item->stats->bytes -= item->size;
+	}
 	/* Unlink from the linked list */
 	if (item->next)
 		item->next->prev = item->prev;
@@ -90,14 +312,15 @@ evict(fz_context *ctx, fz_item *item)
 	else
 		store->head = item->next;
 	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
+	drop = (fz_refs_load(&item->val->refs) > 0 && fz_refs_dec(&item->val->refs) == 0);
+	/* Remove from the hash table, or the index */
 	{
 		fz_store_hash hash = { NULL };
 		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
+		if (item->type->make_hash_key && item->type->make_hash_key(ctx, &hash, item->key))
 			fz_hash_remove(ctx, store->hash, &hash);
+		else
+			index_remove(store, item);
 	}
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (drop)
@@ -111,7 +334,7 @@ evict(fz_context *ctx, fz_item *item)
 static int
 ensure_space(fz_context *ctx, unsigned int tofree)
 {
-	fz_item *item, *prev;
+	fz_item *item;
 	unsigned int count;
 	fz_store *store = ctx->store;
 
@@ -122,7 +345,7 @@ ensure_space(fz_context *ctx, unsigned int tofree)
 	count = 0;
 	for (item = store->tail; item; item = item->prev)
 	{
-		if (item->val->refs == 1)
+		if (fz_refs_load(&item->val->refs) == 1)
 		{
 			count += item->size;
 			if (count >= tofree)
@@ -136,35 +359,13 @@ ensure_space(fz_context *ctx, unsigned int tofree)
 		return 0;
 	}
 
-	/* Actually free the items */
+	/* Actually free the items. Evict has to drop the lock, so we
+	 * choose afresh each time round. */
 	count = 0;
-	for (item = store->tail; item; item = prev)
+	while (count < tofree && (item = choose_victim(store)) != NULL)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
-
-			if (count >= tofree)
-				return count;
-		}
+		count += item->size;
+		evict(ctx, item); /* Drops then retakes lock */
 	}
 
 	return count;
@@ -196,7 +397,13 @@ touch(fz_store *store, fz_item *item)
 }
 
 void *
-fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_store_type *type)
+fz_store_item(fz_context *ctx, void *key, void *val, unsigned int itemsize, fz_store_type *type)
+{
+	return fz_store_item_with_cost(ctx, key, val, itemsize, type, 0);
+}
+
+void *
+fz_store_item_with_cost(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_store_type *type, unsigned int cost)
 {
 	fz_item *item = NULL;
 	unsigned int size;
@@ -235,6 +442,12 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 		hash.drop = val->drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	if (!use_hash)
+	{
+		item->index_hash = index_hash(ctx, val->drop, key, type);
+		if (store->index_count >= store->index_len)
+			grow_index(ctx, store);
+	}
 
 	type->keep_key(ctx, key);
 	fz_lock(ctx, FZ_LOCK_ALLOC);
@@ -249,6 +462,8 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 	item->next = item;
 	item->prev = item;
 	item->type = type;
+	item->cost = cost;
+	item->stats = find_stats(store, type);
 
 	/* If we can index it fast, put it into the hash table. This serves
 	 * to check whether we have one there already. */
@@ -275,8 +490,8 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
 			touch(store, existing);
-			if (existing->val->refs > 0)
-				existing->val->refs++;
+			if (fz_refs_load(&existing->val->refs) > 0)
+				(void)fz_refs_inc(&existing->val->refs);
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
@@ -284,8 +499,8 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 		}
 	}
 	/* Now bump the ref */
-	if (val->refs > 0)
-		val->refs++;
+	if (fz_refs_load(&val->refs) > 0)
+		(void)fz_refs_inc(&val->refs);
 	/* If we haven't got an infinite store, check for space within it */
 	if (store->max != FZ_STORE_UNLIMITED)
 	{
@@ -312,17 +527,26 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 				fz_unlock(ctx, FZ_LOCK_ALLOC);
 				fz_free(ctx, item);
 				type->drop_key(ctx, key);
-				if (val->refs > 0)
-					val->refs--;
+				if (fz_refs_load(&val->refs) > 0)
+					(void)fz_refs_dec(&val->refs);
 				return NULL;
 			}
 			size -= saved;
 		}
 	}
 	store->size += itemsize;
+	if (item->stats)
+	{
+		item->stats->items++;
+		item->stats->bytes += itemsize;
+	}
+	add_known_cost(store, item);
 
-	/* Regardless of whether it's indexed, it goes into the linked list */
+	/* Regardless of whether it's hashed, it goes into the linked list */
+	set_priority(store, item);
 	touch(store, item);
+	if (!use_hash)
+		index_insert(store, item);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
@@ -333,8 +557,10 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_stats *stats;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	unsigned int h = 0;
 
 	if (!store)
 		return NULL;
@@ -347,6 +573,8 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	if (!use_hash)
+		h = index_hash(ctx, drop, key, type);
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	if (use_hash)
@@ -356,10 +584,10 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 	}
 	else
 	{
-		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		/* Others we find through the index */
+		for (item = store->index[h & (store->index_len - 1)]; item; item = item->index_next)
 		{
-			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+			if (item->index_hash == h && item->type == type && item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 		}
 	}
@@ -370,12 +598,18 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 		 * linked list does not get whipped out again due to the
 		 * store being full. */
 		touch(store, item);
+		set_priority(store, item);
+		if (item->stats)
+			item->stats->hits++;
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
+		if (fz_refs_load(&item->val->refs) > 0)
+			(void)fz_refs_inc(&item->val->refs);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return (void *)item->val;
 	}
+	stats = find_stats(store, type);
+	if (stats)
+		stats->misses++;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
@@ -389,12 +623,15 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 	int dodrop;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	unsigned int h = 0;
 
 	if (type->make_hash_key)
 	{
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	if (!use_hash)
+		h = index_hash(ctx, drop, key, type);
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	if (use_hash)
@@ -406,10 +643,12 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 	}
 	else
 	{
-		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
-			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
+		/* Others we find through the index */
+		for (item = store->index[h & (store->index_len - 1)]; item; item = item->index_next)
+			if (item->index_hash == h && item->type == type && item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
+		if (item)
+			index_remove(store, item);
 	}
 	if (item)
 	{
@@ -426,8 +665,15 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 				item->prev->next = item->next;
 			else
 				store->head = item->next;
+			store->size -= item->size;
+			remove_known_cost(store, item);
+			if (item->stats)
+			{
+				item->stats->items--;
+				item->stats->bytes -= item->size;
+			}
 		}
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
+		dodrop = (fz_refs_load(&item->val->refs) > 0 && fz_refs_dec(&item->val->refs) == 0);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		if (dodrop)
 			item->val->drop(ctx, item->val);
@@ -480,6 +726,7 @@ fz_drop_store_context(fz_context *ctx)
 
 	fz_empty_store(ctx);
 	fz_drop_hash(ctx, ctx->store->hash);
+	fz_free(ctx, ctx->store->index);
 	fz_free(ctx, ctx->store);
 	ctx->store = NULL;
 }
@@ -503,14 +750,14 @@ fz_print_store_locked(fz_context *ctx, fz_output *out)
 	{
 		next = item->next;
 		if (next)
-			next->val->refs++;
-		fz_printf(ctx, out, "store[*][refs=%d][size=%d] ", item->val->refs, item->size);
+			(void)fz_refs_inc(&next->val->refs);
+		fz_printf(ctx, out, "store[*][refs=%d][size=%d] ", fz_refs_load(&item->val->refs), item->size);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		item->type->print(ctx, out, item->key);
 		fz_printf(ctx, out, " = %p\n", item->val);
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (next)
-			next->val->refs--;
+			(void)fz_refs_dec(&next->val->refs);
 	}
 	fz_printf(ctx, out, "-- resource store hash contents --\n");
 	fz_print_hash_details(ctx, out, store->hash, print_item);
@@ -525,6 +772,42 @@ fz_print_store(fz_context *ctx, fz_output *out)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
+int
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats, int max)
+{
+	fz_store *store = ctx->store;
+	int n;
+
+	if (store == NULL)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	n = store->num_stats;
+	if (stats)
+		memcpy(stats, store->stats, (n < max ? n : max) * sizeof(*stats));
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return n;
+}
+
+void
+fz_print_store_stats(fz_context *ctx, fz_output *out)
+{
+	fz_store_stats stats[MAX_STATS];
+	int i, n;
+
+	n = fz_get_store_stats(ctx, stats, nelem(stats));
+	fz_printf(ctx, out, "-- resource store statistics --\n");
+	for (i = 0; i < n; i++)
+	{
+		fz_printf(ctx, out, "%s: items=%d bytes=%u hits=%d misses=%d evictions=%d\n",
+			stats[i].type->name ? stats[i].type->name : "unknown",
+			stats[i].items, stats[i].bytes,
+			stats[i].hits, stats[i].misses, stats[i].evictions);
+	}
+	fz_printf(ctx, out, "-- end --\n");
+}
+
 /* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
  * actually managing to scavenge lots of blocks back. */
 static int
@@ -532,25 +815,13 @@ scavenge(fz_context *ctx, unsigned int tofree)
 {
 	fz_store *store = ctx->store;
 	unsigned int count = 0;
-	fz_item *item, *prev;
+	fz_item *item;
 
 	/* Free the items */
-	for (item = store->tail; item; item = prev)
+	while (count < tofree && (item = choose_victim(store)) != NULL)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
-
-			if (count >= tofree)
-				break;
-
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
+		count += item->size;
+		evict(ctx, item); /* Drops then retakes lock */
 	}
 	/* Success is managing to evict any blocks */
 	return count != 0;
@@ -572,6 +843,10 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase)
 	fz_print_store_locked(ctx, stderr);
 	Memento_stats();
 #endif
+	/* Spare draw device buffers are the cheapest thing to give back. */
+	if (*phase == 0 && fz_scavenge_draw_pool(ctx))
+		return 1;
+
 	do
 	{
 		unsigned int tofree;
@@ -635,6 +910,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 #endif
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 
+	(void)fz_scavenge_draw_pool(ctx);
 	new_size = (unsigned int)(((uint64_t)store->size * percent) / 100);
 	if (store->size > new_size)
 		scavenge(ctx, store->size - new_size);
@@ -897,8 +897,8 @@ svg_dev_pop_clip(fz_context *ctx, fz_device *dev)
 	fz_printf(ctx, out, "</g>\n");
 }
 
-static void
-svg_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int luminosity, fz_colorspace *colorspace, float *color)
+static int
+svg_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
 {
 	svg_device *sdev = (svg_device*)dev;
 	fz_output *out;
@@ -909,6 +909,7 @@ svg_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int lum
 
 	if (dev->container_len > 0)
 		dev->container[dev->container_len-1].user = mask;
+	return 0;
 }
 
 static void
@@ -0,0 +1,683 @@
+#include "mupdf/fitz.h"
+
+/*
+	Index file layout. All values are 32-bit little-endian integers
+	(or IEEE floats stored as their bit patterns).
+
+	header (32 bytes):
+		magic "MUIX", version, page count, term count, posting count,
+		term table offset, posting table offset, string pool offset
+	term table (16 bytes per term, sorted by term bytes):
+		string offset, string length, first posting, posting count
+	posting table (32 bytes per posting, sorted by page and word):
+		page, word, line, char offset, x0, y0, x1, y1
+	string pool:
+		the folded UTF-8 bytes of each term
+
+	Terms are folded by mapping A-Z to a-z and U+2018 and U+2019 to an
+	ASCII apostrophe; every other character is kept as it is. Words
+	are split at spaces and punctuation and where the script changes,
+	and every ideograph, kana and Hangul character (and every character
+	of the other scripts written without spaces) is a term of its own,
+	so that a phrase in those scripts is found as a run of terms. This
+	is part of the format: a reader folds and splits its needles the
+	same way, so a change to fold_char or word_class needs a new
+	INDEX_VERSION.
+*/
+
+#define INDEX_MAGIC "MUIX"
+#define INDEX_VERSION 3
+#define HEADER_SIZE 32
+#define TERM_SIZE 16
+#define POSTING_SIZE 32
+
+struct fz_text_index_s
+{
+	fz_buffer *buf;
+	int page_count;
+	int term_count;
+	int posting_count;
+	const unsigned char *terms;
+	const unsigned char *postings;
+};
+
+typedef struct occurrence_s occurrence;
+
+struct occurrence_s
+{
+	int term, len;
+	const unsigned char *s;
+	int page, word, line, ofs;
+	fz_rect bbox;
+};
+
+typedef struct builder_s builder;
+
+struct builder_s
+{
+	fz_buffer *pool;
+	int len, cap;
+	occurrence *occ;
+};
+
+/* Fold characters that should match each other; applied to both
+ * the indexed text and the needle before splitting into words.
+ * See the format description above before changing it. */
+static inline int fold_char(int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	/* Typographic apostrophes and single quotes */
+	if (c == 0x2018 || c == 0x2019)
+		return '\'';
+	return c;
+}
+
+/* The classes of characters that words are made of. A word is a run
+ * of characters of one script; digits and combining marks go with any
+ * script. The characters of ALONE are each a word by themselves. */
+enum
+{
+	NOT_WORD,	/* spaces, punctuation and symbols */
+	COMMON,
+	ALONE,
+	LATIN,
+	GREEK,
+	CYRILLIC,
+	ARMENIAN,
+	HEBREW,
+	ARABIC,
+	OTHER
+};
+
+static int word_class(int c)
+{
+	if (c < 128)
+	{
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+			return LATIN;
+		if (c >= '0' && c <= '9')
+			return COMMON;
+		return NOT_WORD;
+	}
+
+	/* Latin-1 controls, spaces, punctuation and symbols, but not the
+	 * ordinal indicators and micro sign, which are letters */
+	if (c < 0xC0)
+		return (c == 0xAA || c == 0xB5 || c == 0xBA) ? LATIN : NOT_WORD;
+	if (c == 0xD7 || c == 0xF7)
+		return NOT_WORD;
+
+	if (c < 0x300)
+		return LATIN;
+	if (c < 0x370)
+		return COMMON;
+	if (c < 0x400)
+		return GREEK;
+	if (c < 0x530)
+		return CYRILLIC;
+	if (c < 0x590)
+		return ARMENIAN;
+	if (c < 0x600)
+		return HEBREW;
+	if (c < 0x700 || (c >= 0x750 && c <= 0x77F) || (c >= 0x8A0 && c <= 0x8FF))
+		return ARABIC;
+
+	/* Thai, Lao, Myanmar and Khmer, which do not put spaces between
+	 * words, and Hangul Jamo */
+	if ((c >= 0x0E00 && c <= 0x0EFF) || (c >= 0x1000 && c <= 0x109F) ||
+		(c >= 0x1100 && c <= 0x11FF) || (c >= 0x1780 && c <= 0x17FF))
+		return ALONE;
+
+	/* Combining marks */
+	if ((c >= 0x1AB0 && c <= 0x1AFF) || (c >= 0x1DC0 && c <= 0x1DFF) ||
+		(c >= 0x20D0 && c <= 0x20FF) || (c >= 0xFE20 && c <= 0xFE2F))
+		return COMMON;
+
+	if (c >= 0x1E00 && c <= 0x1EFF)
+		return LATIN;
+	if (c >= 0x1F00 && c <= 0x1FFF)
+		return GREEK;
+
+	/* General and supplemental punctuation: spaces, dashes, quotes,
+	 * ellipses, line and paragraph separators */
+	if ((c >= 0x2000 && c <= 0x206F) || (c >= 0x2E00 && c <= 0x2E7F))
+		return NOT_WORD;
+
+	/* CJK radicals, the iteration marks and ideographic numbers among
+	 * the CJK spaces, marks and brackets, kana, Bopomofo, Hangul and
+	 * the ideographs themselves */
+	if (c >= 0x2E80 && c <= 0x2FDF)
+		return ALONE;
+	if (c >= 0x3000 && c <= 0x303F)
+	{
+		if ((c >= 0x3005 && c <= 0x3007) || (c >= 0x3021 && c <= 0x3029) ||
+			(c >= 0x3031 && c <= 0x3035) || c == 0x303B || c == 0x303C)
+			return ALONE;
+		return NOT_WORD;
+	}
+	if ((c >= 0x3040 && c <= 0x31FF) || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0x4E00 && c <= 0x9FFF))
+		return ALONE;
+	if ((c >= 0xA960 && c <= 0xA97F) || (c >= 0xAC00 && c <= 0xD7FF) || (c >= 0xF900 && c <= 0xFAFF))
+		return ALONE;
+
+	/* Latin ligatures, and the Hebrew and Arabic presentation forms */
+	if (c >= 0xFB00 && c <= 0xFB06)
+		return LATIN;
+	if (c >= 0xFB1D && c <= 0xFB4F)
+		return HEBREW;
+	if ((c >= 0xFB50 && c <= 0xFDFF) || (c >= 0xFE70 && c <= 0xFEFC))
+		return ARABIC;
+
+	/* The fullwidth, small and vertical forms of punctuation */
+	if ((c >= 0xFE10 && c <= 0xFE19) || (c >= 0xFE30 && c <= 0xFE6F) || c == 0xFEFF)
+		return NOT_WORD;
+	if ((c >= 0xFF01 && c <= 0xFF0F) || (c >= 0xFF1A && c <= 0xFF20) ||
+		(c >= 0xFF3B && c <= 0xFF40) || (c >= 0xFF5B && c <= 0xFF65))
+		return NOT_WORD;
+
+	/* Fullwidth digits and letters, and halfwidth kana and Hangul */
+	if (c >= 0xFF10 && c <= 0xFF19)
+		return COMMON;
+	if (c >= 0xFF21 && c <= 0xFF5A)
+		return LATIN;
+	if (c >= 0xFF66 && c <= 0xFFDC)
+		return ALONE;
+
+	/* Supplementary ideographs */
+	if (c >= 0x20000 && c <= 0x3FFFF)
+		return ALONE;
+
+	return OTHER;
+}
+
+/* Whether a character of class cls continues a word whose characters
+ * so far are of class word. */
+static inline int continues_word(int word, int cls)
+{
+	if (word == ALONE || cls == ALONE)
+		return 0;
+	return word == cls || word == COMMON || cls == COMMON;
+}
+
+static int
+cmp_term(const unsigned char *a, int alen, const unsigned char *b, int blen)
+{
+	int d = memcmp(a, b, fz_mini(alen, blen));
+	if (d)
+		return d;
+	return alen - blen;
+}
+
+static int
+cmp_occurrence(const void *a_, const void *b_)
+{
+	const occurrence *a = a_;
+	const occurrence *b = b_;
+	int d = cmp_term(a->s, a->len, b->s, b->len);
+	if (d)
+		return d;
+	if (a->page != b->page)
+		return a->page - b->page;
+	return a->word - b->word;
+}
+
+static occurrence *
+new_occurrence(fz_context *ctx, builder *b)
+{
+	if (b->len == b->cap)
+	{
+		int newcap = b->cap ? b->cap * 2 : 1024;
+		b->occ = fz_resize_array(ctx, b->occ, newcap, sizeof *b->occ);
+		b->cap = newcap;
+	}
+	return &b->occ[b->len++];
+}
+
+static void
+index_page(fz_context *ctx, builder *b, fz_stext_page *text, int page_num)
+{
+	occurrence *occ;
+	fz_rect bbox;
+	int block_num, i, c, cls, occ_cls = NOT_WORD;
+	int ofs = 0, word = 0, line_num = 0;
+
+	for (block_num = 0; block_num < text->len; block_num++)
+	{
+		fz_stext_block *block;
+		fz_stext_line *line;
+		fz_stext_span *span;
+
+		if (text->blocks[block_num].type != FZ_PAGE_BLOCK_TEXT)
+			continue;
+		block = text->blocks[block_num].u.text;
+		for (line = block->lines; line < block->lines + block->len; line++)
+		{
+			occ = NULL;
+			for (span = line->first_span; span; span = span->next)
+			{
+				for (i = 0; i < span->len; i++, ofs++)
+				{
+					c = fold_char(span->text[i].c);
+					cls = word_class(c);
+					if (cls == NOT_WORD)
+					{
+						occ = NULL;
+						continue;
+					}
+					if (occ && !continues_word(occ_cls, cls))
+						occ = NULL;
+					if (!occ)
+					{
+						occ_cls = cls;
+						occ = new_occurrence(ctx, b);
+						occ->term = b->pool->len;
+						occ->len = 0;
+						occ->page = page_num;
+						occ->word = word++;
+						occ->line = line_num;
+						occ->ofs = ofs;
+						occ->bbox = fz_empty_rect;
+					}
+					else if (occ_cls == COMMON)
+						occ_cls = cls;
+					fz_write_buffer_rune(ctx, b->pool, c);
+					occ->len = b->pool->len - occ->term;
+					fz_union_rect(&occ->bbox, fz_stext_char_bbox(ctx, &bbox, span, i));
+				}
+			}
+			/* pseudo-newline */
+			ofs++;
+			line_num++;
+		}
+	}
+}
+
+static inline void
+write_float(fz_context *ctx, fz_output *out, float f)
+{
+	union { float f; int i; } u;
+	u.f = f;
+	fz_write_int32le(ctx, out, u.i);
+}
+
+static void
+write_index(fz_context *ctx, fz_output *out, builder *b, int page_count)
+{
+	int i, k, term_count, str_ofs;
+	int terms_ofs, postings_ofs, strings_ofs;
+
+	for (i = 0; i < b->len; i++)
+		b->occ[i].s = b->pool->data + b->occ[i].term;
+	/* occ is NULL when the document has no words */
+	if (b->len > 0)
+		qsort(b->occ, b->len, sizeof *b->occ, cmp_occurrence);
+
+	term_count = 0;
+	for (i = 0; i < b->len; i++)
+		if (i == 0 || cmp_term(b->occ[i-1].s, b->occ[i-1].len, b->occ[i].s, b->occ[i].len))
+			term_count++;
+
+	if (term_count > (INT_MAX - HEADER_SIZE) / TERM_SIZE ||
+		b->len > (INT_MAX - HEADER_SIZE - term_count * TERM_SIZE) / POSTING_SIZE ||
+		b->pool->len > INT_MAX - HEADER_SIZE - term_count * TERM_SIZE - b->len * POSTING_SIZE)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "text index too large");
+
+	terms_ofs = HEADER_SIZE;
+	postings_ofs = terms_ofs + term_count * TERM_SIZE;
+	strings_ofs = postings_ofs + b->len * POSTING_SIZE;
+
+	fz_write(ctx, out, INDEX_MAGIC, 4);
+	fz_write_int32le(ctx, out, INDEX_VERSION);
+	fz_write_int32le(ctx, out, page_count);
+	fz_write_int32le(ctx, out, term_count);
+	fz_write_int32le(ctx, out, b->len);
+	fz_write_int32le(ctx, out, terms_ofs);
+	fz_write_int32le(ctx, out, postings_ofs);
+	fz_write_int32le(ctx, out, strings_ofs);
+
+	str_ofs = strings_ofs;
+	for (i = 0; i < b->len; i = k)
+	{
+		for (k = i + 1; k < b->len; k++)
+			if (cmp_term(b->occ[i].s, b->occ[i].len, b->occ[k].s, b->occ[k].len))
+				break;
+		fz_write_int32le(ctx, out, str_ofs);
+		fz_write_int32le(ctx, out, b->occ[i].len);
+		fz_write_int32le(ctx, out, i);
+		fz_write_int32le(ctx, out, k - i);
+		str_ofs += b->occ[i].len;
+	}
+
+	for (i = 0; i < b->len; i++)
+	{
+		occurrence *occ = &b->occ[i];
+		fz_write_int32le(ctx, out, occ->page);
+		fz_write_int32le(ctx, out, occ->word);
+		fz_write_int32le(ctx, out, occ->line);
+		fz_write_int32le(ctx, out, occ->ofs);
+		write_float(ctx, out, occ->bbox.x0);
+		write_float(ctx, out, occ->bbox.y0);
+		write_float(ctx, out, occ->bbox.x1);
+		write_float(ctx, out, occ->bbox.y1);
+	}
+
+	for (i = 0; i < b->len; i = k)
+	{
+		for (k = i + 1; k < b->len; k++)
+			if (cmp_term(b->occ[i].s, b->occ[i].len, b->occ[k].s, b->occ[k].len))
+				break;
+		fz_write(ctx, out, b->occ[i].s, b->occ[i].len);
+	}
+}
+
+void
+fz_write_text_index(fz_context *ctx, fz_output *out, fz_document *doc)
+{
+	fz_stext_sheet *sheet = NULL;
+	fz_stext_page *text = NULL;
+	builder b = { 0 };
+	int i, page_count;
+
+	fz_var(sheet);
+	fz_var(text);
+
+	fz_try(ctx)
+	{
+		page_count = fz_count_pages(ctx, doc);
+		sheet = fz_new_stext_sheet(ctx);
+		b.pool = fz_new_buffer(ctx, 4096);
+
+		for (i = 0; i < page_count; i++)
+		{
+			fz_try(ctx)
+				text = fz_new_stext_page_from_page_number(ctx, doc, i, sheet);
+			fz_catch(ctx)
+			{
+				fz_warn(ctx, "cannot extract text from page %d", i + 1);
+				continue;
+			}
+			index_page(ctx, &b, text, i);
+			fz_drop_stext_page(ctx, text);
+			text = NULL;
+		}
+
+		write_index(ctx, out, &b, page_count);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stext_page(ctx, text);
+		fz_drop_stext_sheet(ctx, sheet);
+		fz_drop_buffer(ctx, b.pool);
+		fz_free(ctx, b.occ);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static inline int
+get32(const unsigned char *p)
+{
+	return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static inline float
+getfloat(const unsigned char *p)
+{
+	union { float f; int i; } u;
+	u.i = get32(p);
+	return u.f;
+}
+
+fz_text_index *
+fz_new_text_index_from_buffer(fz_context *ctx, fz_buffer *buf)
+{
+	fz_text_index *index;
+	const unsigned char *data = buf->data;
+	const unsigned char *term;
+	int len = buf->len;
+	int version, terms_ofs, postings_ofs, strings_ofs;
+	int page_count, term_count, posting_count;
+	int i, str_ofs, str_len, first, count;
+
+	if (len < HEADER_SIZE || memcmp(data, INDEX_MAGIC, 4))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not a text index");
+	version = get32(data + 4);
+	if (version != INDEX_VERSION)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unsupported text index version %d", version);
+
+	page_count = get32(data + 8);
+	term_count = get32(data + 12);
+	posting_count = get32(data + 16);
+	terms_ofs = get32(data + 20);
+	postings_ofs = get32(data + 24);
+	strings_ofs = get32(data + 28);
+
+	if (page_count < 0 || term_count < 0 || posting_count < 0 ||
+		terms_ofs < HEADER_SIZE || terms_ofs > len || term_count > (len - terms_ofs) / TERM_SIZE ||
+		postings_ofs < HEADER_SIZE || postings_ofs > len || posting_count > (len - postings_ofs) / POSTING_SIZE ||
+		strings_ofs < HEADER_SIZE || strings_ofs > len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt text index header");
+
+	for (i = 0; i < term_count; i++)
+	{
+		term = data + terms_ofs + i * TERM_SIZE;
+		str_ofs = get32(term);
+		str_len = get32(term + 4);
+		first = get32(term + 8);
+		count = get32(term + 12);
+		if (str_ofs < strings_ofs || str_len < 0 || str_ofs > len - str_len ||
+			first < 0 || count < 0 || first > posting_count - count)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt text index term %d", i);
+	}
+
+	index = fz_malloc_struct(ctx, fz_text_index);
+	index->buf = fz_keep_buffer(ctx, buf);
+	index->page_count = page_count;
+	index->term_count = term_count;
+	index->posting_count = posting_count;
+	index->terms = data + terms_ofs;
+	index->postings = data + postings_ofs;
+	return index;
+}
+
+fz_text_index *
+fz_open_text_index(fz_context *ctx, const char *filename)
+{
+	fz_text_index *index;
+	fz_buffer *buf;
+
+	buf = fz_read_file(ctx, filename);
+	fz_try(ctx)
+		index = fz_new_text_index_from_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return index;
+}
+
+void
+fz_drop_text_index(fz_context *ctx, fz_text_index *index)
+{
+	if (!index)
+		return;
+	fz_drop_buffer(ctx, index->buf);
+	fz_free(ctx, index);
+}
+
+int
+fz_count_text_index_pages(fz_context *ctx, fz_text_index *index)
+{
+	return index->page_count;
+}
+
+/* Return the index of the term in the term table, or -1 if it is absent */
+static int
+lookup_term(fz_text_index *index, const unsigned char *s, int len)
+{
+	int l = 0;
+	int r = index->term_count - 1;
+	while (l <= r)
+	{
+		int m = (l + r) >> 1;
+		const unsigned char *term = index->terms + m * TERM_SIZE;
+		int c = cmp_term(s, len, index->buf->data + get32(term), get32(term + 4));
+		if (c < 0)
+			r = m - 1;
+		else if (c > 0)
+			l = m + 1;
+		else
+			return m;
+	}
+	return -1;
+}
+
+/* Return the posting of term 't' for the word on the page, or NULL */
+static const unsigned char *
+lookup_posting(fz_text_index *index, int t, int page, int word)
+{
+	const unsigned char *term = index->terms + t * TERM_SIZE;
+	int l = get32(term + 8);
+	int r = l + get32(term + 12) - 1;
+	while (l <= r)
+	{
+		int m = (l + r) >> 1;
+		const unsigned char *p = index->postings + m * POSTING_SIZE;
+		int c = page - get32(p);
+		if (c == 0)
+			c = word - get32(p + 4);
+		if (c < 0)
+			r = m - 1;
+		else if (c > 0)
+			l = m + 1;
+		else
+			return p;
+	}
+	return NULL;
+}
+
+static inline void
+posting_bbox(fz_rect *bbox, const unsigned char *p)
+{
+	bbox->x0 = getfloat(p + 16);
+	bbox->y0 = getfloat(p + 20);
+	bbox->x1 = getfloat(p + 24);
+	bbox->y1 = getfloat(p + 28);
+}
+
+int
+fz_search_text_index(fz_context *ctx, fz_text_index *index, const char *needle, fz_text_index_hit *hits, int hit_max)
+{
+	fz_buffer *words;
+	int *starts = NULL;
+	int *terms = NULL;
+	int n, i, k, c, cls, hit_count, word;
+	const char *s;
+
+	if (hit_max <= 0)
+		return 0;
+
+	words = fz_new_buffer(ctx, strlen(needle) + 1);
+	fz_var(starts);
+	fz_var(terms);
+
+	fz_try(ctx)
+	{
+		/* Split the needle into folded words, as when indexing */
+		starts = fz_malloc_array(ctx, strlen(needle) + 2, sizeof *starts);
+		n = 0;
+		word = NOT_WORD;
+		for (s = needle; *s; )
+		{
+			s += fz_chartorune(&c, (char *)s);
+			c = fold_char(c);
+			cls = word_class(c);
+			if (cls != NOT_WORD)
+			{
+				if (word == NOT_WORD || !continues_word(word, cls))
+				{
+					starts[n++] = words->len;
+					word = cls;
+				}
+				else if (word == COMMON)
+					word = cls;
+				fz_write_buffer_rune(ctx, words, c);
+			}
+			else
+				word = NOT_WORD;
+		}
+		starts[n] = words->len;
+
+		terms = fz_malloc_array(ctx, n + 1, sizeof *terms);
+		for (k = 0; k < n; k++)
+		{
+			terms[k] = lookup_term(index, words->data + starts[k], starts[k + 1] - starts[k]);
+			if (terms[k] < 0)
+				break;
+		}
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, words);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, starts);
+		fz_free(ctx, terms);
+		fz_rethrow(ctx);
+	}
+
+	hit_count = 0;
+	if (n > 0 && k == n)
+	{
+		const unsigned char *term = index->terms + terms[0] * TERM_SIZE;
+		int first = get32(term + 8);
+		int count = get32(term + 12);
+
+		for (i = first; i < first + count && hit_count < hit_max; i++)
+		{
+			const unsigned char *p = index->postings + i * POSTING_SIZE;
+			int page = get32(p);
+			int word = get32(p + 4);
+			int ofs = get32(p + 12);
+			int line;
+			fz_rect bbox, r;
+
+			for (k = 1; k < n; k++)
+				if (!lookup_posting(index, terms[k], page, word + k))
+					break;
+			if (k < n)
+				continue;
+
+			/* Merge the word boxes of the match into one box per line */
+			line = get32(p + 8);
+			posting_bbox(&bbox, p);
+			for (k = 1; k < n && hit_count < hit_max; k++)
+			{
+				const unsigned char *q = lookup_posting(index, terms[k], page, word + k);
+				posting_bbox(&r, q);
+				if (get32(q + 8) != line)
+				{
+					hits[hit_count].page = page;
+					hits[hit_count].ofs = ofs;
+					hits[hit_count].bbox = bbox;
+					hit_count++;
+					line = get32(q + 8);
+					bbox = r;
+				}
+				else
+					fz_union_rect(&bbox, &r);
+			}
+			if (hit_count < hit_max)
+			{
+				hits[hit_count].page = page;
+				hits[hit_count].ofs = ofs;
+				hits[hit_count].bbox = bbox;
+				hit_count++;
+			}
+		}
+	}
+
+	fz_free(ctx, starts);
+	fz_free(ctx, terms);
+	return hit_count;
+}
@@ -80,7 +80,7 @@ fz_add_text(fz_context *ctx, fz_text *text, fz_font *font, int wmode, const fz_m
 {
 	fz_text_span *span;
 
-	if (text->refs != 1)
+	if (fz_refs_load(&text->refs) != 1)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot modify shared text objects");
 
 	span = fz_add_text_span(ctx, text, font, wmode, trm);
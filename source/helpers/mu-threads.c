@@ -0,0 +1,375 @@
+#include "mupdf/helpers/mu-threads.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(MU_THREADS_WINDOWS)
+
+/* Windows threads */
+
+int
+mu_create_semaphore(mu_semaphore *sem)
+{
+	sem->handle = CreateSemaphore(NULL, 0, 1000, NULL);
+	return (sem->handle == NULL);
+}
+
+void
+mu_destroy_semaphore(mu_semaphore *sem)
+{
+	if (sem->handle == NULL)
+		return;
+	/* We can't sensibly handle this failing */
+	(void)CloseHandle(sem->handle);
+}
+
+int
+mu_trigger_semaphore(mu_semaphore *sem)
+{
+	if (sem->handle == NULL)
+		return 0;
+	/* We can't sensibly handle this failing */
+	return !ReleaseSemaphore(sem->handle, 1, NULL);
+}
+
+int
+mu_wait_semaphore(mu_semaphore *sem)
+{
+	if (sem->handle == NULL)
+		return 0;
+	/* Zero on success, as with the pthreads version */
+	return WaitForSingleObject(sem->handle, INFINITE) != WAIT_OBJECT_0;
+}
+
+static DWORD WINAPI
+thread_starter(LPVOID arg)
+{
+	mu_thread *th = (mu_thread *)arg;
+
+	th->fn(th->arg);
+
+	return 0;
+}
+
+int
+mu_create_thread(mu_thread *th, mu_thread_fn *fn, void *arg)
+{
+	th->fn = fn;
+	th->arg = arg;
+	th->handle = CreateThread(NULL, 0, thread_starter, th, 0, NULL);
+
+	return (th->handle == NULL);
+}
+
+void
+mu_destroy_thread(mu_thread *th)
+{
+	if (th->handle == NULL)
+		return;
+	/* We can't sensibly handle this failing */
+	(void)WaitForSingleObject(th->handle, INFINITE);
+	(void)CloseHandle(th->handle);
+	th->handle = NULL;
+}
+
+int
+mu_create_mutex(mu_mutex *mutex)
+{
+	InitializeCriticalSection(&mutex->mutex);
+	return 0; /* Magic function, never fails */
+}
+
+void
+mu_destroy_mutex(mu_mutex *mutex)
+{
+	const static CRITICAL_SECTION empty = { 0 };
+	if (memcmp(&mutex->mutex, &empty, sizeof(empty)) == 0)
+		return;
+	DeleteCriticalSection(&mutex->mutex);
+	mutex->mutex = empty;
+}
+
+void
+mu_lock_mutex(mu_mutex *mutex)
+{
+	EnterCriticalSection(&mutex->mutex);
+}
+
+void
+mu_unlock_mutex(mu_mutex *mutex)
+{
+	LeaveCriticalSection(&mutex->mutex);
+}
+
+int
+mu_num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+#elif defined(MU_THREADS_PTHREADS)
+
+/* PThreads */
+
+#include <unistd.h>
+
+int
+mu_create_semaphore(mu_semaphore *sem)
+{
+	int scode;
+
+	sem->count = 0;
+	scode = pthread_mutex_init(&sem->mutex, NULL);
+	if (scode == 0)
+	{
+		scode = pthread_cond_init(&sem->cond, NULL);
+		if (scode)
+			pthread_mutex_destroy(&sem->mutex);
+	}
+	if (scode)
+		memset(sem, 0, sizeof(*sem));
+	return scode;
+}
+
+void
+mu_destroy_semaphore(mu_semaphore *sem)
+{
+	const static mu_semaphore empty = { 0 };
+
+	if (memcmp(sem, &empty, sizeof(empty)) == 0)
+		return;
+	(void)pthread_cond_destroy(&sem->cond);
+	(void)pthread_mutex_destroy(&sem->mutex);
+	*sem = empty;
+}
+
+int
+mu_wait_semaphore(mu_semaphore *sem)
+{
+	int scode, scode2;
+
+	scode = pthread_mutex_lock(&sem->mutex);
+	if (scode)
+		return scode;
+	while (sem->count == 0)
+	{
+		scode = pthread_cond_wait(&sem->cond, &sem->mutex);
+		if (scode)
+			break;
+	}
+	if (scode == 0)
+		sem->count--;
+	scode2 = pthread_mutex_unlock(&sem->mutex);
+	if (scode == 0)
+		scode = scode2;
+	return scode;
+}
+
+int
+mu_trigger_semaphore(mu_semaphore *sem)
+{
+	int scode, scode2;
+
+	scode = pthread_mutex_lock(&sem->mutex);
+	if (scode)
+		return scode;
+	sem->count++;
+	scode = pthread_cond_signal(&sem->cond);
+	scode2 = pthread_mutex_unlock(&sem->mutex);
+	if (scode == 0)
+		scode = scode2;
+	return scode;
+}
+
+static void *
+thread_starter(void *arg)
+{
+	mu_thread *th = (mu_thread *)arg;
+
+	th->fn(th->arg);
+
+	return NULL;
+}
+
+int
+mu_create_thread(mu_thread *th, mu_thread_fn *fn, void *arg)
+{
+	th->fn = fn;
+	th->arg = arg;
+	return pthread_create(&th->thread, NULL, thread_starter, th);
+}
+
+void
+mu_destroy_thread(mu_thread *th)
+{
+	const static mu_thread empty; /* static objects are always initialized to zero */
+
+	if (memcmp(th, &empty, sizeof(empty)) == 0)
+		return;
+
+	(void)pthread_join(th->thread, NULL);
+	*th = empty;
+}
+
+int
+mu_create_mutex(mu_mutex *mutex)
+{
+	return pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void
+mu_destroy_mutex(mu_mutex *mutex)
+{
+	const static mu_mutex empty; /* static objects are always initialized to zero */
+
+	if (memcmp(mutex, &empty, sizeof(empty)) == 0)
+		return;
+	(void)pthread_mutex_destroy(&mutex->mutex);
+	*mutex = empty;
+}
+
+void
+mu_lock_mutex(mu_mutex *mutex)
+{
+	(void)pthread_mutex_lock(&mutex->mutex);
+}
+
+void
+mu_unlock_mutex(mu_mutex *mutex)
+{
+	(void)pthread_mutex_unlock(&mutex->mutex);
+}
+
+int
+mu_num_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return (int)n;
+#endif
+	return 1;
+}
+
+#else
+
+/* No threading */
+
+int
+mu_create_semaphore(mu_semaphore *sem)
+{
+	return 1;
+}
+
+void
+mu_destroy_semaphore(mu_semaphore *sem)
+{
+}
+
+int
+mu_trigger_semaphore(mu_semaphore *sem)
+{
+	return 1;
+}
+
+int
+mu_wait_semaphore(mu_semaphore *sem)
+{
+	return 1;
+}
+
+int
+mu_create_thread(mu_thread *th, mu_thread_fn *fn, void *arg)
+{
+	return 1;
+}
+
+void
+mu_destroy_thread(mu_thread *th)
+{
+}
+
+int
+mu_create_mutex(mu_mutex *mutex)
+{
+	return 1;
+}
+
+void
+mu_destroy_mutex(mu_mutex *mutex)
+{
+}
+
+void
+mu_lock_mutex(mu_mutex *mutex)
+{
+}
+
+void
+mu_unlock_mutex(mu_mutex *mutex)
+{
+}
+
+int
+mu_num_cpus(void)
+{
+	return 1;
+}
+
+#endif
+
+/* Portable on top of the above */
+
+typedef struct
+{
+	mu_thread thread;
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int i;
+	int started;
+} mu_job;
+
+static void
+mu_job_starter(void *arg)
+{
+	mu_job *job = (mu_job *)arg;
+	job->fn(job->arg, job->i);
+}
+
+void
+mu_run_jobs(void *user, int count, void (*fn)(void *arg, int i), void *arg)
+{
+	mu_job *jobs;
+	int i;
+
+	jobs = count > 1 ? calloc(count, sizeof *jobs) : NULL;
+	if (jobs == NULL)
+	{
+		for (i = 0; i < count; i++)
+			fn(arg, i);
+		return;
+	}
+
+	/* Run the first job on this thread while the others run on theirs. */
+	for (i = 1; i < count; i++)
+	{
+		jobs[i].fn = fn;
+		jobs[i].arg = arg;
+		jobs[i].i = i;
+		jobs[i].started = !mu_create_thread(&jobs[i].thread, mu_job_starter, &jobs[i]);
+	}
+
+	fn(arg, 0);
+
+	for (i = 1; i < count; i++)
+	{
+		if (jobs[i].started)
+			mu_destroy_thread(&jobs[i].thread);
+		else
+			fn(arg, i);
+	}
+
+	free(jobs);
+}
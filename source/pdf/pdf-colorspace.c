@@ -88,35 +88,10 @@ static fz_colorspace *fz_device_lab = &k_device_lab;
 
 /* Separation and DeviceN */
 
-struct separation
-{
-	fz_colorspace *base;
-	fz_function *tint;
-};
-
-static void
-separation_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *color, float *rgb)
-{
-	struct separation *sep = cs->data;
-	float alt[FZ_MAX_COLORS];
-	fz_eval_function(ctx, sep->tint, color, cs->n, alt, sep->base->n);
-	sep->base->to_rgb(ctx, sep->base, alt, rgb);
-}
-
-static void
-free_separation(fz_context *ctx, fz_colorspace *cs)
-{
-	struct separation *sep = cs->data;
-	fz_drop_colorspace(ctx, sep->base);
-	fz_drop_function(ctx, sep->tint);
-	fz_free(ctx, sep);
-}
-
 static fz_colorspace *
 load_separation(fz_context *ctx, pdf_document *doc, pdf_obj *array)
 {
 	fz_colorspace *cs;
-	struct separation *sep = NULL;
 	pdf_obj *nameobj = pdf_array_get(ctx, array, 1);
 	pdf_obj *baseobj = pdf_array_get(ctx, array, 2);
 	pdf_obj *tintobj = pdf_array_get(ctx, array, 3);
@@ -125,7 +100,6 @@ load_separation(fz_context *ctx, pdf_document *doc, pdf_obj *array)
 	int n;
 
 	fz_var(tint);
-	fz_var(sep);
 
 	if (pdf_is_array(ctx, nameobj))
 		n = pdf_array_len(ctx, nameobj);
@@ -143,21 +117,12 @@ load_separation(fz_context *ctx, pdf_document *doc, pdf_obj *array)
 		/* RJW: fz_drop_colorspace(ctx, base);
 		 * "cannot load tint function (%d %d R)", pdf_to_num(ctx, tintobj), pdf_to_gen(ctx, tintobj) */
 
-		sep = fz_malloc_struct(ctx, struct separation);
-		sep->base = base;
-		sep->tint = tint;
-
-		cs = fz_new_colorspace(ctx, n == 1 ? "Separation" : "DeviceN", n);
-		cs->to_rgb = separation_to_rgb;
-		cs->free_data = free_separation;
-		cs->data = sep;
-		cs->size += sizeof(struct separation) + (base ? base->size : 0) + fz_function_size(ctx, tint);
+		cs = fz_new_separation_colorspace(ctx, n, base, tint);
 	}
 	fz_catch(ctx)
 	{
 		fz_drop_colorspace(ctx, base);
 		fz_drop_function(ctx, tint);
-		fz_free(ctx, sep);
 		fz_rethrow(ctx);
 	}
 
@@ -167,7 +132,8 @@ load_separation(fz_context *ctx, pdf_document *doc, pdf_obj *array)
 int
 pdf_is_tint_colorspace(fz_context *ctx, fz_colorspace *cs)
 {
-	return cs && cs->to_rgb == separation_to_rgb;
+	fz_function *tint;
+	return fz_separation_colorspace_tint(ctx, cs, &tint) != NULL;
 }
 
 /* Indexed */
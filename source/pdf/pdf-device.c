@@ -1104,8 +1104,8 @@ pdf_dev_pop_clip(fz_context *ctx, fz_device *dev)
 	pdf_dev_pop(ctx, pdev);
 }
 
-static void
-pdf_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int luminosity, fz_colorspace *colorspace, float *color)
+static int
+pdf_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int luminosity, fz_colorspace *colorspace, float *color, const fz_matrix *ctm, int id)
 {
 	pdf_device *pdev = (pdf_device*)dev;
 	pdf_document *doc = pdev->doc;
@@ -1166,6 +1166,7 @@ pdf_dev_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *bbox, int lum
 	/* Now, everything we get until the end_mask needs to go into a
 	 * new buffer, which will be the stream contents for the form. */
 	pdf_dev_push_new_buf(ctx, pdev, fz_new_buffer(ctx, 1024), NULL, form_ref);
+	return 0;
 }
 
 static void
@@ -811,7 +811,9 @@ static fz_store_type hail_mary_store_type =
 	hail_mary_keep_key,
 	hail_mary_drop_key,
 	hail_mary_cmp_key,
-	hail_mary_print_key
+	hail_mary_print_key,
+	NULL,
+	"hail_mary"
 };
 
 pdf_font_desc *
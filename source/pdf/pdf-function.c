@@ -1,6 +1,7 @@
 #include "mupdf/pdf.h"
 
 typedef struct psobj_s psobj;
+typedef struct psinst_s psinst;
 
 enum
 {
@@ -46,6 +47,13 @@ struct pdf_function_s
 		struct {
 			psobj *code;
 			int cap;
+			psinst *inst; /* compiled program */
+			int len;
+			psobj *regs; /* initial registers */
+			int nregs;
+			int out[FZ_FN_MAXN];
+			float *lut; /* sampled function */
+			int lut_size;
 		} p;
 	} u;
 };
@@ -285,7 +293,7 @@ ps_roll(ps_stack *st, int n, int j)
 static void
 ps_index(ps_stack *st, int n)
 {
-	if (!ps_overflow(st, 1) && !ps_underflow(st, n))
+	if (!ps_overflow(st, 1) && !ps_underflow(st, n + 1))
 	{
 		st->stack[st->sp] = st->stack[st->sp - n - 1];
 		st->sp++;
@@ -468,7 +476,9 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_IDIV:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				if (i2 == -1)
+					ps_push_int(st, (int)(0U - (unsigned int)i1));
+				else if (i2 != 0)
 					ps_push_int(st, i1 / i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -519,7 +529,9 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_MOD:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				if (i2 == -1)
+					ps_push_int(st, 0);
+				else if (i2 != 0)
 					ps_push_int(st, i1 % i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -832,56 +844,662 @@ parse_code(fz_context *ctx, pdf_function *func, fz_stream *stream, int *codeptr,
 	}
 }
 
+/*
+ * Calculator functions are compiled when they are loaded, so that
+ * evaluating them does not have to interpret the program every time.
+ *
+ * The program is run once symbolically, with a stack of registers in
+ * place of values. Stack shuffling (dup, exch, copy, index, roll and
+ * pop) then happens at compile time, as does any operation whose
+ * operands are all constants. What is left is a list of instructions
+ * working on a small register file, each of whose types is known in
+ * advance. Programs whose behaviour depends on more than that (stack
+ * depths that depend on the inputs, type errors, underflow and so on)
+ * are left to the interpreter.
+ *
+ * Functions of one or two inputs are then sampled into a table, which
+ * is used in place of the program if linear interpolation between the
+ * samples comes close enough to the function everywhere we look.
+ */
+
+enum
+{
+	PSC_MOV, PSC_JUMP, PSC_JUMP_FALSE,
+	PSC_ADD_I, PSC_SUB_I, PSC_MUL_I,
+	PSC_ADD_R, PSC_SUB_R, PSC_MUL_R, PSC_DIV_R, PSC_NEG_R, PSC_ABS_R,
+	PSC_LT_R, PSC_LE_R, PSC_GT_R, PSC_GE_R, PSC_EQ_R, PSC_NE_R,
+	PSC_AND_B, PSC_OR_B, PSC_NOT_B,
+	PSC_OP1, PSC_OP2
+};
+
+#define PSC_MAX_REGS 512
+#define PSC_MAX_CODE 16384
+#define PSC_STACK 100
+
+#define PSC_LUT_SIZE_1 256
+#define PSC_LUT_SIZE_2 32
+#define PSC_LUT_TOLERANCE (1 / 512.0f)
+
+struct psinst_s
+{
+	unsigned char op;
+	unsigned char psop;
+	unsigned short dst, a, b;
+};
+
+typedef struct ps_compiler_s ps_compiler;
+
+struct ps_compiler_s
+{
+	psobj *code;
+	psinst *inst;
+	int len, cap;
+	psobj *regs;
+	unsigned char *konst;
+	int nregs;
+};
+
+static inline float ps_fix_real(float x)
+{
+	/* As ps_push_real */
+	if (isnan(x))
+		return 1.0;
+	return fz_clamp(x, -FLT_MAX, FLT_MAX);
+}
+
+/* Run a single operator through the interpreter */
 static void
-load_postscript_func(fz_context *ctx, pdf_document *doc, pdf_function *func, pdf_obj *dict, int num, int gen)
+ps_run_op(fz_context *ctx, int op, int argc, const psobj *argv, psobj *result)
 {
-	fz_stream *stream = NULL;
-	int codeptr;
-	pdf_lexbuf buf;
-	pdf_token tok;
-	int locked = 0;
+	psobj code[2];
+	ps_stack st;
+	int i;
 
-	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
+	code[0].type = PS_OPERATOR;
+	code[0].u.op = op;
+	code[1].type = PS_OPERATOR;
+	code[1].u.op = PS_OP_RETURN;
+	st.sp = 0;
+	for (i = 0; i < argc; i++)
+		st.stack[st.sp++] = argv[i];
+	ps_run(ctx, code, &st, 0);
+	*result = st.stack[0];
+}
 
-	fz_var(stream);
-	fz_var(locked);
+static int
+psc_new_reg(fz_context *ctx, ps_compiler *c, int type)
+{
+	if (c->nregs == PSC_MAX_REGS)
+		return -1;
+	c->regs[c->nregs].type = type;
+	c->regs[c->nregs].u.i = 0;
+	c->konst[c->nregs] = 0;
+	return c->nregs++;
+}
 
-	fz_try(ctx)
+static int
+psc_new_const(fz_context *ctx, ps_compiler *c, const psobj *value)
+{
+	int r = psc_new_reg(ctx, c, value->type);
+	if (r >= 0)
 	{
-		stream = pdf_open_stream(ctx, doc, num, gen);
+		c->regs[r] = *value;
+		c->konst[r] = 1;
+	}
+	return r;
+}
 
-		tok = pdf_lex(ctx, stream, &buf);
-		if (tok != PDF_TOK_OPEN_BRACE)
+static int
+psc_emit(fz_context *ctx, ps_compiler *c, int op, int psop, int dst, int a, int b)
+{
+	psinst *inst;
+
+	if (c->len == PSC_MAX_CODE)
+		return -1;
+	if (c->len == c->cap)
+	{
+		int new_cap = c->cap ? c->cap * 2 : 64;
+		c->inst = fz_resize_array(ctx, c->inst, new_cap, sizeof(psinst));
+		c->cap = new_cap;
+	}
+	inst = &c->inst[c->len];
+	inst->op = op;
+	inst->psop = psop;
+	inst->dst = dst;
+	inst->a = a;
+	inst->b = b;
+	return c->len++;
+}
+
+static int
+psc_arity(int op)
+{
+	switch (op)
+	{
+	case PS_OP_ABS: case PS_OP_NEG: case PS_OP_ROUND: case PS_OP_TRUNCATE:
+	case PS_OP_CEILING: case PS_OP_FLOOR: case PS_OP_COS: case PS_OP_SIN:
+	case PS_OP_SQRT: case PS_OP_LN: case PS_OP_LOG: case PS_OP_CVR:
+	case PS_OP_CVI: case PS_OP_NOT:
+		return 1;
+	}
+	return 2;
+}
+
+/* The type an operator leaves on the stack given the types of its
+ * operands, or -1 if the interpreter would do something odd with them. */
+static int
+psc_result_type(int op, int t1, int t2)
+{
+	int num1 = (t1 == PS_INT || t1 == PS_REAL);
+	int num2 = (t2 == PS_INT || t2 == PS_REAL);
+
+	switch (op)
+	{
+	case PS_OP_ABS: case PS_OP_NEG:
+		return num1 ? t1 : -1;
+	case PS_OP_ROUND: case PS_OP_TRUNCATE:
+		return num1 ? t1 : -1;
+	case PS_OP_CEILING: case PS_OP_FLOOR: case PS_OP_COS: case PS_OP_SIN:
+	case PS_OP_SQRT: case PS_OP_LN: case PS_OP_LOG: case PS_OP_CVR:
+		return num1 ? PS_REAL : -1;
+	case PS_OP_CVI:
+		return num1 ? PS_INT : -1;
+	case PS_OP_NOT:
+		return t1 == PS_BOOL ? PS_BOOL : num1 ? PS_INT : -1;
+	case PS_OP_ADD: case PS_OP_SUB: case PS_OP_MUL:
+		if (!num1 || !num2)
+			return -1;
+		return t1 == PS_INT && t2 == PS_INT ? PS_INT : PS_REAL;
+	case PS_OP_DIV: case PS_OP_ATAN: case PS_OP_EXP:
+		return num1 && num2 ? PS_REAL : -1;
+	case PS_OP_IDIV: case PS_OP_MOD: case PS_OP_BITSHIFT:
+		return num1 && num2 ? PS_INT : -1;
+	case PS_OP_AND: case PS_OP_OR: case PS_OP_XOR:
+		if (t1 == PS_BOOL && t2 == PS_BOOL)
+			return PS_BOOL;
+		return t1 == PS_INT && t2 == PS_INT ? PS_INT : -1;
+	case PS_OP_EQ: case PS_OP_NE:
+		if (t1 == PS_BOOL && t2 == PS_BOOL)
+			return PS_BOOL;
+		return num1 && num2 ? PS_BOOL : -1;
+	case PS_OP_GE: case PS_OP_GT: case PS_OP_LE: case PS_OP_LT:
+		return num1 && num2 ? PS_BOOL : -1;
+	}
+	return -1;
+}
+
+/* A register holding the operand as a real, for the real valued
+ * instructions. Only constants can be converted at compile time. */
+static int
+psc_real_operand(fz_context *ctx, ps_compiler *c, int r)
+{
+	psobj value;
+
+	if (c->regs[r].type == PS_REAL)
+		return r;
+	if (!c->konst[r])
+		return -1;
+	value.type = PS_REAL;
+	value.u.f = c->regs[r].u.i;
+	return psc_new_const(ctx, c, &value);
+}
+
+static int
+psc_specialize(int op, int type)
+{
+	if (type == PS_INT)
+	{
+		switch (op)
 		{
-			fz_throw(ctx, FZ_ERROR_GENERIC, "stream is not a calculator function");
+		case PS_OP_ADD: return PSC_ADD_I;
+		case PS_OP_SUB: return PSC_SUB_I;
+		case PS_OP_MUL: return PSC_MUL_I;
+		}
+	}
+	else if (type == PS_REAL)
+	{
+		switch (op)
+		{
+		case PS_OP_ADD: return PSC_ADD_R;
+		case PS_OP_SUB: return PSC_SUB_R;
+		case PS_OP_MUL: return PSC_MUL_R;
+		case PS_OP_DIV: return PSC_DIV_R;
+		case PS_OP_NEG: return PSC_NEG_R;
+		case PS_OP_ABS: return PSC_ABS_R;
+		case PS_OP_LT: return PSC_LT_R;
+		case PS_OP_LE: return PSC_LE_R;
+		case PS_OP_GT: return PSC_GT_R;
+		case PS_OP_GE: return PSC_GE_R;
+		case PS_OP_EQ: return PSC_EQ_R;
+		case PS_OP_NE: return PSC_NE_R;
+		}
+	}
+	else if (type == PS_BOOL)
+	{
+		switch (op)
+		{
+		case PS_OP_AND: return PSC_AND_B;
+		case PS_OP_OR: return PSC_OR_B;
+		case PS_OP_NOT: return PSC_NOT_B;
 		}
+	}
+	return -1;
+}
 
-		func->u.p.code = NULL;
-		func->u.p.cap = 0;
+static int
+psc_operator(fz_context *ctx, ps_compiler *c, int op, int *stack, int *sp)
+{
+	int argc = psc_arity(op);
+	int t1, t2, type, r, spec, a, b, ra, rb;
+	psobj argv[2], value;
+
+	if (*sp < argc)
+		return 0;
+	t1 = c->regs[stack[*sp - argc]].type;
+	t2 = argc == 2 ? c->regs[stack[*sp - 1]].type : -1;
+	type = psc_result_type(op, t1, t2);
+	if (type < 0)
+		return 0;
+
+	a = stack[*sp - argc];
+	b = argc == 2 ? stack[*sp - 1] : 0;
+	*sp -= argc;
+
+	/* Constant folding */
+	if (c->konst[a] && (argc == 1 || c->konst[b]))
+	{
+		argv[0] = c->regs[a];
+		argv[1] = c->regs[b];
+		ps_run_op(ctx, op, argc, argv, &value);
+		if (value.type != type)
+			return 0;
+		r = psc_new_const(ctx, c, &value);
+		if (r < 0)
+			return 0;
+		stack[(*sp)++] = r;
+		return 1;
+	}
 
-		codeptr = 0;
-		parse_code(ctx, func, stream, &codeptr, &buf);
+	/* Round and truncate leave integers alone */
+	if ((op == PS_OP_ROUND || op == PS_OP_TRUNCATE) && type == PS_INT)
+	{
+		stack[(*sp)++] = a;
+		return 1;
+	}
+
+	/* Pick a specialized instruction if there is one for the types
+	 * involved, or leave it to the interpreter. */
+	spec = psc_specialize(op, t1 == PS_BOOL ? PS_BOOL : type == PS_INT ? PS_INT : PS_REAL);
+	if (spec >= PSC_ADD_R && spec <= PSC_NE_R)
+	{
+		ra = psc_real_operand(ctx, c, a);
+		rb = argc == 2 ? psc_real_operand(ctx, c, b) : 0;
+		if (ra < 0 || rb < 0)
+			spec = -1;
+		else
+		{
+			a = ra;
+			b = rb;
+		}
+	}
+
+	r = psc_new_reg(ctx, c, type);
+	if (r < 0)
+		return 0;
+	if (spec < 0)
+		spec = argc == 1 ? PSC_OP1 : PSC_OP2;
+	if (psc_emit(ctx, c, spec, op, r, a, b) < 0)
+		return 0;
+	stack[(*sp)++] = r;
+	return 1;
+}
+
+/* Get a constant integer operand, as ps_pop_int would */
+static int
+psc_pop_int(ps_compiler *c, int *stack, int *sp, int *value)
+{
+	psobj *obj;
+
+	if (*sp < 1 || !c->konst[stack[*sp - 1]])
+		return 0;
+	obj = &c->regs[stack[--*sp]];
+	if (obj->type == PS_INT)
+		*value = obj->u.i;
+	else if (obj->type == PS_REAL)
+		*value = obj->u.f;
+	else
+		return 0;
+	return 1;
+}
+
+static int psc_block(fz_context *ctx, ps_compiler *c, int pc, int *stack, int *sp);
+
+static int
+psc_branch(fz_context *ctx, ps_compiler *c, int cond, int then_pc, int else_pc, int *stack, int *sp)
+{
+	int then_stack[PSC_STACK], else_stack[PSC_STACK];
+	int then_sp = *sp, else_sp = *sp;
+	int jump_else, jump_fix, jump_end, i;
+
+	memcpy(then_stack, stack, *sp * sizeof(int));
+	memcpy(else_stack, stack, *sp * sizeof(int));
+
+	jump_else = psc_emit(ctx, c, PSC_JUMP_FALSE, 0, 0, cond, 0);
+	if (jump_else < 0 || !psc_block(ctx, c, then_pc, then_stack, &then_sp))
+		return 0;
+	jump_fix = psc_emit(ctx, c, PSC_JUMP, 0, 0, 0, 0);
+	if (jump_fix < 0)
+		return 0;
+	c->inst[jump_else].b = c->len;
+	if (else_pc >= 0 && !psc_block(ctx, c, else_pc, else_stack, &else_sp))
+		return 0;
+
+	/* Both ways must leave the same kinds of things on the stack.
+	 * Where they leave them in different registers, move them into
+	 * a register of their own on both paths. */
+	if (then_sp != else_sp)
+		return 0;
+	for (i = 0; i < then_sp; i++)
+	{
+		int t = then_stack[i], e = else_stack[i];
+		if (t == e)
+			continue;
+		if (c->regs[t].type != c->regs[e].type)
+			return 0;
+		stack[i] = psc_new_reg(ctx, c, c->regs[t].type);
+		if (stack[i] < 0 || psc_emit(ctx, c, PSC_MOV, 0, stack[i], e, 0) < 0)
+			return 0;
+	}
+	jump_end = psc_emit(ctx, c, PSC_JUMP, 0, 0, 0, 0);
+	if (jump_end < 0)
+		return 0;
+	c->inst[jump_fix].a = c->len;
+	for (i = 0; i < then_sp; i++)
+	{
+		int t = then_stack[i], e = else_stack[i];
+		if (t == e)
+			stack[i] = t;
+		else if (psc_emit(ctx, c, PSC_MOV, 0, stack[i], t, 0) < 0)
+			return 0;
+	}
+	c->inst[jump_end].a = c->len;
+	*sp = then_sp;
+	return 1;
+}
+
+static int
+psc_block(fz_context *ctx, ps_compiler *c, int pc, int *stack, int *sp)
+{
+	psobj *code = c->code;
+	int i, n, j, r, cond;
+
+	while (1)
+	{
+		switch (code[pc].type)
+		{
+		case PS_INT:
+		case PS_REAL:
+			if (*sp + 1 >= PSC_STACK)
+				return 0;
+			r = psc_new_const(ctx, c, &code[pc++]);
+			if (r < 0)
+				return 0;
+			stack[(*sp)++] = r;
+			break;
+
+		case PS_OPERATOR:
+			switch (code[pc++].u.op)
+			{
+			case PS_OP_RETURN:
+				return 1;
+
+			case PS_OP_TRUE:
+			case PS_OP_FALSE:
+				if (*sp + 1 >= PSC_STACK)
+					return 0;
+				r = psc_new_reg(ctx, c, PS_BOOL);
+				if (r < 0)
+					return 0;
+				c->regs[r].u.b = code[pc - 1].u.op == PS_OP_TRUE;
+				c->konst[r] = 1;
+				stack[(*sp)++] = r;
+				break;
+
+			case PS_OP_DUP:
+				if (*sp >= 1)
+				{
+					if (*sp + 1 >= PSC_STACK)
+						return 0;
+					stack[*sp] = stack[*sp - 1];
+					++*sp;
+				}
+				break;
+
+			case PS_OP_POP:
+				if (*sp >= 1)
+					--*sp;
+				break;
+
+			case PS_OP_EXCH:
+				if (*sp >= 2)
+				{
+					r = stack[*sp - 1];
+					stack[*sp - 1] = stack[*sp - 2];
+					stack[*sp - 2] = r;
+				}
+				break;
+
+			case PS_OP_COPY:
+				if (!psc_pop_int(c, stack, sp, &n) || n < 0 || n > *sp || *sp + n >= PSC_STACK)
+					return 0;
+				memcpy(stack + *sp, stack + *sp - n, n * sizeof(int));
+				*sp += n;
+				break;
+
+			case PS_OP_INDEX:
+				if (!psc_pop_int(c, stack, sp, &n) || n < 0 || n + 1 > *sp || *sp + 1 >= PSC_STACK)
+					return 0;
+				stack[*sp] = stack[*sp - n - 1];
+				++*sp;
+				break;
+
+			case PS_OP_ROLL:
+				if (!psc_pop_int(c, stack, sp, &j) || !psc_pop_int(c, stack, sp, &n))
+					return 0;
+				if (n <= 0 || n > *sp || j == 0)
+					break;
+				j = j > 0 ? j % n : (n - (-j % n)) % n;
+				while (j--)
+				{
+					r = stack[*sp - 1];
+					for (i = *sp - 1; i > *sp - n; i--)
+						stack[i] = stack[i - 1];
+					stack[*sp - n] = r;
+				}
+				break;
+
+			case PS_OP_IF:
+			case PS_OP_IFELSE:
+				if (*sp < 1 || c->regs[stack[*sp - 1]].type != PS_BOOL)
+					return 0;
+				cond = stack[--*sp];
+				if (code[pc - 1].u.op == PS_OP_IF)
+					n = -1;
+				else
+					n = code[pc].u.block;
+				if (c->konst[cond])
+				{
+					if (c->regs[cond].u.b)
+						n = code[pc + 1].u.block;
+					if (n >= 0 && !psc_block(ctx, c, n, stack, sp))
+						return 0;
+				}
+				else if (!psc_branch(ctx, c, cond, code[pc + 1].u.block, n, stack, sp))
+					return 0;
+				pc = code[pc + 2].u.block;
+				break;
+
+			default:
+				if (!psc_operator(ctx, c, code[pc - 1].u.op, stack, sp))
+					return 0;
+				break;
+			}
+			break;
+
+		default:
+			/* Literal booleans stop the interpreter */
+			return 0;
+		}
+	}
+}
+
+static void
+compile_postscript_func(fz_context *ctx, pdf_function *func)
+{
+	ps_compiler c = { 0 };
+	int stack[PSC_STACK];
+	int sp = 0;
+	int i, ok = 0;
+
+	if (func->base.m >= PSC_STACK)
+		return;
+
+	c.code = func->u.p.code;
+	c.regs = fz_malloc_array(ctx, PSC_MAX_REGS, sizeof(psobj));
+	fz_try(ctx)
+	{
+		c.konst = fz_malloc(ctx, PSC_MAX_REGS);
+
+		/* The inputs come first */
+		for (i = 0; i < func->base.m; i++)
+			stack[sp++] = psc_new_reg(ctx, &c, PS_REAL);
+
+		if (psc_block(ctx, &c, 0, stack, &sp) && sp >= func->base.n)
+		{
+			ok = 1;
+			for (i = 0; i < func->base.n; i++)
+			{
+				int r = stack[sp - func->base.n + i];
+				if (c.regs[r].type != PS_INT && c.regs[r].type != PS_REAL)
+					ok = 0;
+				func->u.p.out[i] = r;
+			}
+		}
+
+		if (ok)
+		{
+			func->u.p.inst = c.inst;
+			func->u.p.len = c.len;
+			func->u.p.regs = fz_resize_array(ctx, c.regs, c.nregs, sizeof(psobj));
+			func->u.p.nregs = c.nregs;
+			func->base.size += c.cap * sizeof(psinst) + c.nregs * sizeof(psobj);
+			c.inst = NULL;
+			c.regs = NULL;
+		}
 	}
 	fz_always(ctx)
 	{
-		fz_drop_stream(ctx, stream);
-		pdf_lexbuf_fin(ctx, &buf);
+		fz_free(ctx, c.inst);
+		fz_free(ctx, c.regs);
+		fz_free(ctx, c.konst);
 	}
 	fz_catch(ctx)
 	{
-		fz_rethrow_message(ctx, "cannot parse calculator function (%d %d R)", num, gen);
+		fz_rethrow(ctx);
 	}
+}
 
-	func->base.size += func->u.p.cap * sizeof(psobj);
+static void
+ps_exec(fz_context *ctx, const psinst *code, int len, psobj *regs)
+{
+	const psinst *pc = code;
+	const psinst *end = code + len;
+
+	while (pc < end)
+	{
+		psobj *dst = &regs[pc->dst];
+		const psobj *a = &regs[pc->a];
+		const psobj *b = &regs[pc->b];
+
+		switch (pc->op)
+		{
+		case PSC_MOV: *dst = *a; break;
+		case PSC_JUMP: pc = code + pc->a; continue;
+		case PSC_JUMP_FALSE:
+			if (!a->u.b)
+			{
+				pc = code + pc->b;
+				continue;
+			}
+			break;
+
+		case PSC_ADD_I: dst->u.i = a->u.i + b->u.i; break;
+		case PSC_SUB_I: dst->u.i = a->u.i - b->u.i; break;
+		case PSC_MUL_I: dst->u.i = a->u.i * b->u.i; break;
+
+		case PSC_ADD_R: dst->u.f = ps_fix_real(a->u.f + b->u.f); break;
+		case PSC_SUB_R: dst->u.f = ps_fix_real(a->u.f - b->u.f); break;
+		case PSC_MUL_R: dst->u.f = ps_fix_real(a->u.f * b->u.f); break;
+		case PSC_DIV_R:
+			if (fabsf(b->u.f) >= FLT_EPSILON)
+				dst->u.f = ps_fix_real(a->u.f / b->u.f);
+			else
+				dst->u.f = DIV_BY_ZERO(a->u.f, b->u.f, -FLT_MAX, FLT_MAX);
+			break;
+		case PSC_NEG_R: dst->u.f = -a->u.f; break;
+		case PSC_ABS_R: dst->u.f = fabsf(a->u.f); break;
+
+		case PSC_LT_R: dst->u.b = a->u.f < b->u.f; break;
+		case PSC_LE_R: dst->u.b = a->u.f <= b->u.f; break;
+		case PSC_GT_R: dst->u.b = a->u.f > b->u.f; break;
+		case PSC_GE_R: dst->u.b = a->u.f >= b->u.f; break;
+		case PSC_EQ_R: dst->u.b = a->u.f == b->u.f; break;
+		case PSC_NE_R: dst->u.b = a->u.f != b->u.f; break;
+
+		case PSC_AND_B: dst->u.b = a->u.b && b->u.b; break;
+		case PSC_OR_B: dst->u.b = a->u.b || b->u.b; break;
+		case PSC_NOT_B: dst->u.b = !a->u.b; break;
+
+		case PSC_OP1: ps_run_op(ctx, pc->psop, 1, a, dst); break;
+		case PSC_OP2:
+		{
+			psobj argv[2];
+			argv[0] = *a;
+			argv[1] = *b;
+			ps_run_op(ctx, pc->psop, 2, argv, dst);
+			break;
+		}
+		}
+		pc++;
+	}
 }
 
 static void
-eval_postscript_func(fz_context *ctx, pdf_function *func, const float *in, float *out)
+eval_postscript_code(fz_context *ctx, pdf_function *func, const float *in, float *out)
 {
 	ps_stack st;
 	float x;
 	int i;
 
+	if (func->u.p.regs)
+	{
+		psobj regs[PSC_MAX_REGS];
+
+		memcpy(regs, func->u.p.regs, func->u.p.nregs * sizeof(psobj));
+		for (i = 0; i < func->base.m; i++)
+			regs[i].u.f = ps_fix_real(fz_clamp(in[i], func->domain[i][0], func->domain[i][1]));
+
+		ps_exec(ctx, func->u.p.inst, func->u.p.len, regs);
+
+		for (i = 0; i < func->base.n; i++)
+		{
+			psobj *r = &regs[func->u.p.out[i]];
+			x = r->type == PS_INT ? r->u.i : r->u.f;
+			out[i] = fz_clamp(x, func->range[i][0], func->range[i][1]);
+		}
+		return;
+	}
+
 	ps_init_stack(&st);
 
 	for (i = 0; i < func->base.m; i++)
@@ -899,6 +1517,165 @@ eval_postscript_func(fz_context *ctx, pdf_function *func, const float *in, float
 	}
 }
 
+static void
+eval_postscript_lut(pdf_function *func, const float *in, float *out)
+{
+	int size = func->u.p.lut_size;
+	int n = func->base.n;
+	float *lut = func->u.p.lut;
+	float t[2], f[2];
+	int i[2], k, d;
+
+	for (d = 0; d < func->base.m; d++)
+	{
+		float x = fz_clamp(in[d], func->domain[d][0], func->domain[d][1]);
+		t[d] = (x - func->domain[d][0]) * size / (func->domain[d][1] - func->domain[d][0]);
+		i[d] = fz_clampi((int)t[d], 0, size - 1);
+		f[d] = t[d] - i[d];
+	}
+
+	if (func->base.m == 1)
+	{
+		float *a = lut + i[0] * n;
+		for (k = 0; k < n; k++)
+			out[k] = a[k] + (a[k + n] - a[k]) * f[0];
+	}
+	else
+	{
+		float *a = lut + (i[1] * (size + 1) + i[0]) * n;
+		float *b = a + (size + 1) * n;
+		for (k = 0; k < n; k++)
+		{
+			float top = a[k] + (a[k + n] - a[k]) * f[0];
+			float bot = b[k] + (b[k + n] - b[k]) * f[0];
+			out[k] = top + (bot - top) * f[1];
+		}
+	}
+}
+
+/* Sample functions of one or two inputs into a table, and keep it if
+ * interpolating in it gets within tolerance of the function at the
+ * points between the samples that we try. */
+static void
+sample_postscript_func(fz_context *ctx, pdf_function *func)
+{
+	static const float probes[3][2] = { { 0.25f, 0.5f }, { 0.5f, 0.25f }, { 0.75f, 0.75f } };
+	int m = func->base.m;
+	int n = func->base.n;
+	int size = m == 1 ? PSC_LUT_SIZE_1 : PSC_LUT_SIZE_2;
+	int rows = m == 1 ? 1 : size + 1;
+	float in[2], exact[FZ_FN_MAXN], approx[FZ_FN_MAXN], tol[FZ_FN_MAXN];
+	float *lut;
+	int x, y, p, k;
+
+	if (m > 2)
+		return;
+	for (k = 0; k < m; k++)
+		if (!(func->domain[k][0] < func->domain[k][1]))
+			return;
+	for (k = 0; k < n; k++)
+		tol[k] = fabsf(func->range[k][1] - func->range[k][0]) * PSC_LUT_TOLERANCE;
+
+	lut = fz_malloc_array(ctx, (size + 1) * rows * n, sizeof(float));
+	for (y = 0; y < rows; y++)
+	{
+		for (x = 0; x <= size; x++)
+		{
+			in[0] = lerp(x, 0, size, func->domain[0][0], func->domain[0][1]);
+			if (m == 2)
+				in[1] = lerp(y, 0, size, func->domain[1][0], func->domain[1][1]);
+			eval_postscript_code(ctx, func, in, lut + (y * (size + 1) + x) * n);
+		}
+	}
+
+	func->u.p.lut = lut;
+	func->u.p.lut_size = size;
+	for (y = 0; y < rows; y++)
+	{
+		for (x = 0; x < size; x++)
+		{
+			for (p = 0; p < 3; p++)
+			{
+				in[0] = lerp(x + probes[p][0], 0, size, func->domain[0][0], func->domain[0][1]);
+				if (m == 2)
+				{
+					if (y == size)
+						break;
+					in[1] = lerp(y + probes[p][1], 0, size, func->domain[1][0], func->domain[1][1]);
+				}
+				eval_postscript_code(ctx, func, in, exact);
+				eval_postscript_lut(func, in, approx);
+				for (k = 0; k < n; k++)
+				{
+					if (fabsf(exact[k] - approx[k]) > tol[k])
+					{
+						func->u.p.lut = NULL;
+						fz_free(ctx, lut);
+						return;
+					}
+				}
+			}
+		}
+	}
+
+	func->base.size += (size + 1) * rows * n * sizeof(float);
+}
+
+static void
+eval_postscript_func(fz_context *ctx, pdf_function *func, const float *in, float *out)
+{
+	if (func->u.p.lut)
+		eval_postscript_lut(func, in, out);
+	else
+		eval_postscript_code(ctx, func, in, out);
+}
+
+static void
+load_postscript_func(fz_context *ctx, pdf_document *doc, pdf_function *func, pdf_obj *dict, int num, int gen)
+{
+	fz_stream *stream = NULL;
+	int codeptr;
+	pdf_lexbuf buf;
+	pdf_token tok;
+	int locked = 0;
+
+	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
+
+	fz_var(stream);
+	fz_var(locked);
+
+	fz_try(ctx)
+	{
+		stream = pdf_open_stream(ctx, doc, num, gen);
+
+		tok = pdf_lex(ctx, stream, &buf);
+		if (tok != PDF_TOK_OPEN_BRACE)
+		{
+			fz_throw(ctx, FZ_ERROR_GENERIC, "stream is not a calculator function");
+		}
+
+		func->u.p.code = NULL;
+		func->u.p.cap = 0;
+
+		codeptr = 0;
+		parse_code(ctx, func, stream, &codeptr, &buf);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stream);
+		pdf_lexbuf_fin(ctx, &buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow_message(ctx, "cannot parse calculator function (%d %d R)", num, gen);
+	}
+
+	func->base.size += func->u.p.cap * sizeof(psobj);
+
+	compile_postscript_func(ctx, func);
+	sample_postscript_func(ctx, func);
+}
+
 /*
  * Sample function
  */
@@ -1362,6 +2139,9 @@ pdf_drop_function_imp(fz_context *ctx, fz_storable *func_)
 		break;
 	case POSTSCRIPT:
 		fz_free(ctx, func->u.p.code);
+		fz_free(ctx, func->u.p.inst);
+		fz_free(ctx, func->u.p.regs);
+		fz_free(ctx, func->u.p.lut);
 		break;
 	}
 	fz_free(ctx, func);
@@ -103,6 +103,307 @@ struct softmask_save_s
 	fz_matrix ctm;
 };
 
+/*
+ * Find out whether a form draws the same whatever graphics state it
+ * is run in. This runs the contents through a processor that only
+ * notes which parts of the state have been set before they are used.
+ * Anything it cannot be sure of counts as inherited.
+ */
+
+enum
+{
+	DEP_FILL_CS = 1<<0,
+	DEP_FILL = 1<<1,
+	DEP_STROKE_CS = 1<<2,
+	DEP_STROKE = 1<<3,
+	DEP_LINE = 1<<4,
+	DEP_CAP = 1<<5,
+	DEP_JOIN = 1<<6,
+	DEP_MITER = 1<<7,
+	DEP_DASH = 1<<8,
+	DEP_FONT = 1<<9,
+	DEP_CHAR_SPACE = 1<<10,
+	DEP_WORD_SPACE = 1<<11,
+	DEP_SCALE = 1<<12,
+	DEP_LEADING = 1<<13,
+	DEP_RENDER = 1<<14,
+	DEP_RISE = 1<<15,
+
+	DEP_STROKING = DEP_STROKE | DEP_LINE | DEP_CAP | DEP_JOIN | DEP_MITER | DEP_DASH,
+	DEP_TEXT = DEP_FONT | DEP_CHAR_SPACE | DEP_WORD_SPACE | DEP_SCALE | DEP_RENDER | DEP_RISE,
+};
+
+#define DEP_STACK 32
+#define DEP_MAX_NESTING 8
+
+typedef struct pdf_dep_processor_s pdf_dep_processor;
+
+struct pdf_dep_processor_s
+{
+	pdf_processor super;
+	int set[DEP_STACK];
+	int top;
+	int render;
+	int nesting;
+	int inherits;
+};
+
+static void
+dep_set(pdf_dep_processor *p, int what)
+{
+	p->set[p->top] |= what;
+}
+
+static void
+dep_use(pdf_dep_processor *p, int what)
+{
+	if ((p->set[p->top] & what) != what)
+		p->inherits = 1;
+}
+
+static void dep_w(fz_context *ctx, pdf_processor *proc, float linewidth) { dep_set((pdf_dep_processor *)proc, DEP_LINE); }
+static void dep_j(fz_context *ctx, pdf_processor *proc, int linejoin) { dep_set((pdf_dep_processor *)proc, DEP_JOIN); }
+static void dep_J(fz_context *ctx, pdf_processor *proc, int linecap) { dep_set((pdf_dep_processor *)proc, DEP_CAP); }
+static void dep_M(fz_context *ctx, pdf_processor *proc, float miterlimit) { dep_set((pdf_dep_processor *)proc, DEP_MITER); }
+static void dep_d(fz_context *ctx, pdf_processor *proc, pdf_obj *array, float phase) { dep_set((pdf_dep_processor *)proc, DEP_DASH); }
+
+static void
+dep_q(fz_context *ctx, pdf_processor *proc)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	if (p->top + 1 == DEP_STACK)
+	{
+		/* Too deep to follow; give up. */
+		p->inherits = 1;
+		return;
+	}
+	p->set[p->top + 1] = p->set[p->top];
+	p->top++;
+}
+
+static void
+dep_Q(fz_context *ctx, pdf_processor *proc)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	if (p->top > 0)
+		p->top--;
+}
+
+static void dep_fill(fz_context *ctx, pdf_processor *proc) { dep_use((pdf_dep_processor *)proc, DEP_FILL); }
+static void dep_stroke(fz_context *ctx, pdf_processor *proc) { dep_use((pdf_dep_processor *)proc, DEP_STROKING); }
+static void dep_fill_stroke(fz_context *ctx, pdf_processor *proc) { dep_use((pdf_dep_processor *)proc, DEP_FILL | DEP_STROKING); }
+
+static void dep_Tc(fz_context *ctx, pdf_processor *proc, float charspace) { dep_set((pdf_dep_processor *)proc, DEP_CHAR_SPACE); }
+static void dep_Tw(fz_context *ctx, pdf_processor *proc, float wordspace) { dep_set((pdf_dep_processor *)proc, DEP_WORD_SPACE); }
+static void dep_Tz(fz_context *ctx, pdf_processor *proc, float scale) { dep_set((pdf_dep_processor *)proc, DEP_SCALE); }
+static void dep_TL(fz_context *ctx, pdf_processor *proc, float leading) { dep_set((pdf_dep_processor *)proc, DEP_LEADING); }
+static void dep_Tf(fz_context *ctx, pdf_processor *proc, const char *name, pdf_font_desc *font, float size) { dep_set((pdf_dep_processor *)proc, DEP_FONT); }
+static void dep_Ts(fz_context *ctx, pdf_processor *proc, float rise) { dep_set((pdf_dep_processor *)proc, DEP_RISE); }
+static void dep_TD(fz_context *ctx, pdf_processor *proc, float tx, float ty) { dep_set((pdf_dep_processor *)proc, DEP_LEADING); }
+static void dep_Tstar(fz_context *ctx, pdf_processor *proc) { dep_use((pdf_dep_processor *)proc, DEP_LEADING); }
+
+static void
+dep_Tr(fz_context *ctx, pdf_processor *proc, int render)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	dep_set(p, DEP_RENDER);
+	p->render = render;
+}
+
+static void
+dep_show(pdf_dep_processor *p)
+{
+	int need = DEP_TEXT | DEP_FILL;
+	if (p->render == 1 || p->render == 2 || p->render == 5 || p->render == 6)
+		need |= DEP_STROKING;
+	dep_use(p, need);
+}
+
+static void dep_TJ(fz_context *ctx, pdf_processor *proc, pdf_obj *array) { dep_show((pdf_dep_processor *)proc); }
+static void dep_Tj(fz_context *ctx, pdf_processor *proc, char *str, int len) { dep_show((pdf_dep_processor *)proc); }
+
+static void
+dep_squote(fz_context *ctx, pdf_processor *proc, char *str, int len)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	dep_use(p, DEP_LEADING);
+	dep_show(p);
+}
+
+static void
+dep_dquote(fz_context *ctx, pdf_processor *proc, float aw, float ac, char *str, int len)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	dep_set(p, DEP_WORD_SPACE | DEP_CHAR_SPACE);
+	dep_use(p, DEP_LEADING);
+	dep_show(p);
+}
+
+static void dep_CS(fz_context *ctx, pdf_processor *proc, const char *name, fz_colorspace *cs) { dep_set((pdf_dep_processor *)proc, DEP_STROKE_CS | DEP_STROKE); }
+static void dep_cs(fz_context *ctx, pdf_processor *proc, const char *name, fz_colorspace *cs) { dep_set((pdf_dep_processor *)proc, DEP_FILL_CS | DEP_FILL); }
+static void dep_SC_pattern(fz_context *ctx, pdf_processor *proc, const char *name, pdf_pattern *pat, int n, float *color) { dep_set((pdf_dep_processor *)proc, DEP_STROKE); }
+static void dep_sc_pattern(fz_context *ctx, pdf_processor *proc, const char *name, pdf_pattern *pat, int n, float *color) { dep_set((pdf_dep_processor *)proc, DEP_FILL); }
+static void dep_SC_shade(fz_context *ctx, pdf_processor *proc, const char *name, fz_shade *shade) { dep_set((pdf_dep_processor *)proc, DEP_STROKE); }
+static void dep_sc_shade(fz_context *ctx, pdf_processor *proc, const char *name, fz_shade *shade) { dep_set((pdf_dep_processor *)proc, DEP_FILL); }
+
+/* A colour without a colour space is read in the inherited one. */
+static void
+dep_SC_color(fz_context *ctx, pdf_processor *proc, int n, float *color)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	if (p->set[p->top] & DEP_STROKE_CS)
+		dep_set(p, DEP_STROKE);
+}
+
+static void
+dep_sc_color(fz_context *ctx, pdf_processor *proc, int n, float *color)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	if (p->set[p->top] & DEP_FILL_CS)
+		dep_set(p, DEP_FILL);
+}
+
+static void dep_G(fz_context *ctx, pdf_processor *proc, float g) { dep_set((pdf_dep_processor *)proc, DEP_STROKE_CS | DEP_STROKE); }
+static void dep_g(fz_context *ctx, pdf_processor *proc, float g) { dep_set((pdf_dep_processor *)proc, DEP_FILL_CS | DEP_FILL); }
+static void dep_RG(fz_context *ctx, pdf_processor *proc, float r, float g, float b) { dep_set((pdf_dep_processor *)proc, DEP_STROKE_CS | DEP_STROKE); }
+static void dep_rg(fz_context *ctx, pdf_processor *proc, float r, float g, float b) { dep_set((pdf_dep_processor *)proc, DEP_FILL_CS | DEP_FILL); }
+static void dep_K(fz_context *ctx, pdf_processor *proc, float c, float m, float y, float k) { dep_set((pdf_dep_processor *)proc, DEP_STROKE_CS | DEP_STROKE); }
+static void dep_k(fz_context *ctx, pdf_processor *proc, float c, float m, float y, float k) { dep_set((pdf_dep_processor *)proc, DEP_FILL_CS | DEP_FILL); }
+
+/* Image masks are painted in the fill colour. */
+static void
+dep_BI(fz_context *ctx, pdf_processor *proc, fz_image *image)
+{
+	if (image->imagemask)
+		dep_use((pdf_dep_processor *)proc, DEP_FILL);
+}
+
+static void
+dep_Do_image(fz_context *ctx, pdf_processor *proc, const char *name, fz_image *image)
+{
+	if (image->imagemask)
+		dep_use((pdf_dep_processor *)proc, DEP_FILL);
+}
+
+static void
+dep_Do_form(fz_context *ctx, pdf_processor *proc, const char *name, pdf_xobject *form, pdf_obj *page_resources)
+{
+	pdf_dep_processor *p = (pdf_dep_processor *)proc;
+	int top = p->top;
+
+	if (p->inherits)
+		return;
+	if (p->nesting == DEP_MAX_NESTING || pdf_mark_obj(ctx, form->me))
+	{
+		p->inherits = 1;
+		return;
+	}
+	p->nesting++;
+	dep_q(ctx, proc);
+	fz_try(ctx)
+	{
+		pdf_process_contents(ctx, proc, form->document, form->resources ? form->resources : page_resources, form->contents, NULL);
+	}
+	fz_always(ctx)
+	{
+		p->top = top;
+		p->nesting--;
+		pdf_unmark_obj(ctx, form->me);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static int
+pdf_xobject_inherits_state(fz_context *ctx, pdf_xobject *xobj)
+{
+	pdf_dep_processor *p = NULL;
+	int marked = 0;
+	int inherits = 1;
+
+	if (xobj->inherits_state >= 0)
+		return xobj->inherits_state;
+
+	fz_var(p);
+	fz_var(marked);
+
+	fz_try(ctx)
+	{
+		p = pdf_new_processor(ctx, sizeof *p);
+		p->super.op_w = dep_w;
+		p->super.op_j = dep_j;
+		p->super.op_J = dep_J;
+		p->super.op_M = dep_M;
+		p->super.op_d = dep_d;
+		p->super.op_q = dep_q;
+		p->super.op_Q = dep_Q;
+		p->super.op_S = dep_stroke;
+		p->super.op_s = dep_stroke;
+		p->super.op_F = dep_fill;
+		p->super.op_f = dep_fill;
+		p->super.op_fstar = dep_fill;
+		p->super.op_B = dep_fill_stroke;
+		p->super.op_Bstar = dep_fill_stroke;
+		p->super.op_b = dep_fill_stroke;
+		p->super.op_bstar = dep_fill_stroke;
+		p->super.op_Tc = dep_Tc;
+		p->super.op_Tw = dep_Tw;
+		p->super.op_Tz = dep_Tz;
+		p->super.op_TL = dep_TL;
+		p->super.op_Tf = dep_Tf;
+		p->super.op_Tr = dep_Tr;
+		p->super.op_Ts = dep_Ts;
+		p->super.op_TD = dep_TD;
+		p->super.op_Tstar = dep_Tstar;
+		p->super.op_TJ = dep_TJ;
+		p->super.op_Tj = dep_Tj;
+		p->super.op_squote = dep_squote;
+		p->super.op_dquote = dep_dquote;
+		p->super.op_CS = dep_CS;
+		p->super.op_cs = dep_cs;
+		p->super.op_SC_pattern = dep_SC_pattern;
+		p->super.op_sc_pattern = dep_sc_pattern;
+		p->super.op_SC_shade = dep_SC_shade;
+		p->super.op_sc_shade = dep_sc_shade;
+		p->super.op_SC_color = dep_SC_color;
+		p->super.op_sc_color = dep_sc_color;
+		p->super.op_G = dep_G;
+		p->super.op_g = dep_g;
+		p->super.op_RG = dep_RG;
+		p->super.op_rg = dep_rg;
+		p->super.op_K = dep_K;
+		p->super.op_k = dep_k;
+		p->super.op_BI = dep_BI;
+		p->super.op_Do_image = dep_Do_image;
+		p->super.op_Do_form = dep_Do_form;
+
+		if (!pdf_mark_obj(ctx, xobj->me))
+		{
+			marked = 1;
+			pdf_process_contents(ctx, &p->super, xobj->document, xobj->resources, xobj->contents, NULL);
+			inherits = p->inherits;
+		}
+	}
+	fz_always(ctx)
+	{
+		if (marked)
+			pdf_unmark_obj(ctx, xobj->me);
+		pdf_drop_processor(ctx, (pdf_processor *)p);
+	}
+	fz_catch(ctx)
+	{
+		/* Look again next time if the data was not there yet. */
+		if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+			return 1;
+		inherits = 1;
+	}
+
+	xobj->inherits_state = inherits;
+	return inherits;
+}
+
 static pdf_gstate *
 begin_softmask(fz_context *ctx, pdf_run_processor *pr, softmask_save *save)
 {
@@ -110,6 +411,7 @@ begin_softmask(fz_context *ctx, pdf_run_processor *pr, softmask_save *save)
 	pdf_xobject *softmask = gstate->softmask;
 	fz_rect mask_bbox;
 	fz_matrix save_tm, save_tlm, save_ctm;
+	int id;
 
 	save->softmask = softmask;
 	if (softmask == NULL)
@@ -133,18 +435,31 @@ begin_softmask(fz_context *ctx, pdf_run_processor *pr, softmask_save *save)
 	gstate->softmask_resources = NULL;
 	gstate->ctm = gstate->softmask_ctm;
 
-	fz_begin_mask(ctx, pr->dev, &mask_bbox, gstate->luminosity,
-			softmask->colorspace, gstate->softmask_bc);
-	fz_try(ctx)
-	{
-		pdf_run_xobject(ctx, pr, softmask, save->page_resources, &fz_identity);
-	}
-	fz_catch(ctx)
+	/* A mask that takes its resources from the page may draw
+	 * differently on every page, so only let the device reuse the
+	 * ones that carry their own. Nor can it reuse ones that draw
+	 * with the graphics state they are run in, which is not part
+	 * of the device's key, or that are composited with a blend
+	 * mode or alpha other than the defaults. */
+	id = 0;
+	if (softmask->resources && gstate->blendmode == 0 && gstate->fill.alpha == 1 &&
+			!pdf_xobject_inherits_state(ctx, softmask))
+		id = softmask->id;
+
+	if (!fz_begin_mask_id(ctx, pr->dev, &mask_bbox, gstate->luminosity,
+			softmask->colorspace, gstate->softmask_bc, &save->ctm, id))
 	{
-		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
-		/* FIXME: Ignore error - nasty, but if we throw from
-		 * here the clip stack would be messed up. */
-		/* TODO: pass cookie here to increase the cookie error count */
+		fz_try(ctx)
+		{
+			pdf_run_xobject(ctx, pr, softmask, save->page_resources, &fz_identity);
+		}
+		fz_catch(ctx)
+		{
+			fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+			/* FIXME: Ignore error - nasty, but if we throw from
+			 * here the clip stack would be messed up. */
+			/* TODO: pass cookie here to increase the cookie error count */
+		}
 	}
 
 	fz_end_mask(ctx, pr->dev);
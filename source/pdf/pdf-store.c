@@ -13,6 +13,63 @@ pdf_make_hash_key(fz_context *ctx, fz_store_hash *hash, void *key_)
 	return 1;
 }
 
+/* Hash direct objects on their contents, to match pdf_objcmp. Deeply
+ * nested parts are left out; that only makes collisions more likely. */
+static unsigned int
+pdf_hash_obj(fz_context *ctx, pdf_obj *obj, int depth)
+{
+	unsigned int h;
+	int i, n;
+
+	if (pdf_is_indirect(ctx, obj))
+		return pdf_to_num(ctx, obj) * 31 + pdf_to_gen(ctx, obj);
+	if (pdf_is_name(ctx, obj))
+	{
+		char *s = pdf_to_name(ctx, obj);
+		for (h = 5381; *s; s++)
+			h = h * 33 + (unsigned char)*s;
+		return h;
+	}
+	if (pdf_is_int(ctx, obj))
+		return pdf_to_int(ctx, obj) * 2654435761u;
+	if (pdf_is_real(ctx, obj))
+		return (int)(pdf_to_real(ctx, obj) * 1000) * 2246822519u;
+	if (pdf_is_string(ctx, obj))
+	{
+		char *s = pdf_to_str_buf(ctx, obj);
+		n = pdf_to_str_len(ctx, obj);
+		for (h = 5381, i = 0; i < n; i++)
+			h = h * 33 + (unsigned char)s[i];
+		return h;
+	}
+	if (depth == 0)
+		return 0;
+	if (pdf_is_array(ctx, obj))
+	{
+		n = pdf_array_len(ctx, obj);
+		for (h = n, i = 0; i < n; i++)
+			h = h * 31 + pdf_hash_obj(ctx, pdf_array_get(ctx, obj, i), depth - 1);
+		return h;
+	}
+	if (pdf_is_dict(ctx, obj))
+	{
+		n = pdf_dict_len(ctx, obj);
+		for (h = n, i = 0; i < n; i++)
+		{
+			h = h * 31 + pdf_hash_obj(ctx, pdf_dict_get_key(ctx, obj, i), 0);
+			h = h * 31 + pdf_hash_obj(ctx, pdf_dict_get_val(ctx, obj, i), depth - 1);
+		}
+		return h;
+	}
+	return pdf_is_bool(ctx, obj) ? 1 + pdf_to_bool(ctx, obj) : 0;
+}
+
+static unsigned int
+pdf_hash_key(fz_context *ctx, void *key)
+{
+	return pdf_hash_obj(ctx, (pdf_obj *)key, 3);
+}
+
 static void *
 pdf_keep_key(fz_context *ctx, void *key)
 {
@@ -48,7 +105,9 @@ static fz_store_type pdf_obj_store_type =
 	pdf_keep_key,
 	pdf_drop_key,
 	pdf_cmp_key,
-	pdf_print_key
+	pdf_print_key,
+	pdf_hash_key,
+	"pdf_obj"
 };
 
 void
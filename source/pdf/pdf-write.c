@@ -7,6 +7,7 @@
 /* #define DEBUG_WRITING */
 
 typedef struct pdf_write_state_s pdf_write_state;
+typedef struct deflated_stream_s deflated_stream;
 
 /*
 	As part of linearization, we need to keep a list of what objects are used
@@ -64,6 +65,16 @@ struct pdf_write_state_s
 	int *renumber_map;
 	int continue_on_error;
 	int *errors;
+	int do_threads;
+	int do_use_objstms;
+	/* Length of the per object arrays below */
+	int list_len;
+	/* Object stream each object is packed into, or 0; see packobjstms */
+	int *objstm_list;
+	int first_objstm;
+	/* Streams deflated ahead of the write pass, indexed by object number */
+	int deflated_len;
+	deflated_stream *deflated;
 	/* The following extras are required for linearization */
 	int *rev_renumber_map;
 	int *rev_gen_list;
@@ -598,20 +609,154 @@ static int markobj(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pd
  * Scan for and remove duplicate objects (slow)
  */
 
+/*
+ * Hash objects so that only objects with equal hashes need comparing.
+ * Objects that pdf_objcmp considers equal must hash equally.
+ */
+
+static inline unsigned int hashbytes(unsigned int h, const unsigned char *p, int n)
+{
+	while (n--)
+		h = (h ^ *p++) * 16777619;
+	return h;
+}
+
+static inline unsigned int hashint(unsigned int h, int x)
+{
+	unsigned char b[4];
+	b[0] = x;
+	b[1] = x >> 8;
+	b[2] = x >> 16;
+	b[3] = x >> 24;
+	return hashbytes(h, b, 4);
+}
+
+static unsigned int hashobj(fz_context *ctx, unsigned int h, pdf_obj *obj)
+{
+	int i, n;
+
+	if (!obj)
+		return hashint(h, 0);
+
+	/* Test for indirect first; the other tests resolve references */
+	if (pdf_is_indirect(ctx, obj))
+	{
+		h = hashint(h, 'R');
+		h = hashint(h, pdf_to_num(ctx, obj));
+		return hashint(h, pdf_to_gen(ctx, obj));
+	}
+	if (pdf_is_name(ctx, obj))
+	{
+		char *name = pdf_to_name(ctx, obj);
+		return hashbytes(hashint(h, '/'), (unsigned char *)name, strlen(name));
+	}
+	if (pdf_is_int(ctx, obj))
+		return hashint(hashint(h, 'i'), pdf_to_int(ctx, obj));
+	if (pdf_is_real(ctx, obj))
+	{
+		union { float f; int i; } u;
+		u.f = pdf_to_real(ctx, obj);
+		/* 0 and -0 compare equal, and so do NaNs */
+		if (u.f == 0 || u.f != u.f)
+			u.i = 0;
+		return hashint(hashint(h, 'f'), u.i);
+	}
+	if (pdf_is_string(ctx, obj))
+		return hashbytes(hashint(h, '('), (unsigned char *)pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+	if (pdf_is_array(ctx, obj))
+	{
+		n = pdf_array_len(ctx, obj);
+		h = hashint(hashint(h, '['), n);
+		for (i = 0; i < n; i++)
+			h = hashobj(ctx, h, pdf_array_get(ctx, obj, i));
+		return h;
+	}
+	if (pdf_is_dict(ctx, obj))
+	{
+		/* pdf_objcmp compares dictionary entries in order */
+		n = pdf_dict_len(ctx, obj);
+		h = hashint(hashint(h, '<'), n);
+		for (i = 0; i < n; i++)
+		{
+			h = hashobj(ctx, h, pdf_dict_get_key(ctx, obj, i));
+			h = hashobj(ctx, h, pdf_dict_get_val(ctx, obj, i));
+		}
+		return h;
+	}
+	if (pdf_is_bool(ctx, obj))
+		return hashint(hashint(h, 'b'), pdf_to_bool(ctx, obj));
+	return hashint(h, 'n');
+}
+
+typedef struct
+{
+	unsigned int hash;
+	int num;
+	int stream;
+} objhash;
+
+static int cmp_objhash(const void *a_, const void *b_)
+{
+	const objhash *a = a_;
+	const objhash *b = b_;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->num - b->num;
+}
+
+static int streams_equal(fz_context *ctx, pdf_document *doc, int num, int other)
+{
+	fz_buffer *sa = NULL;
+	fz_buffer *sb = NULL;
+	int equal = 0;
+
+	fz_var(sa);
+	fz_var(sb);
+
+	fz_try(ctx)
+	{
+		unsigned char *dataa, *datab;
+		int lena, lenb;
+		sa = pdf_load_raw_renumbered_stream(ctx, doc, num, 0, num, 0);
+		sb = pdf_load_raw_renumbered_stream(ctx, doc, other, 0, other, 0);
+		lena = fz_buffer_storage(ctx, sa, &dataa);
+		lenb = fz_buffer_storage(ctx, sb, &datab);
+		if (lena == lenb && memcmp(dataa, datab, lena) == 0)
+			equal = 1;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, sa);
+		fz_drop_buffer(ctx, sb);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return equal;
+}
+
 static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
 {
-	int num, other;
+	int num, other, newnum, stream, i, j, k, len;
 	int xref_len = pdf_xref_len(ctx, doc);
+	objhash *list;
+	fz_buffer *buf = NULL;
+	unsigned int h;
 
-	for (num = 1; num < xref_len; num++)
+	fz_var(buf);
+	fz_var(len);
+
+	list = fz_malloc_array(ctx, xref_len, sizeof *list);
+
+	fz_try(ctx)
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
+		/* Hash every object that may have a duplicate */
+		len = 0;
+		for (num = 1; num < xref_len; num++)
 		{
-			pdf_obj *a, *b;
-			int differ, newnum, streama, streamb;
-
-			if (num == other || !opts->use_list[num] || !opts->use_list[other])
+			if (!opts->use_list[num])
 				continue;
 
 			/*
@@ -622,74 +767,88 @@ static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_st
 			 */
 			fz_try(ctx)
 			{
-				streama = pdf_is_stream(ctx, doc, num, 0);
-				streamb = pdf_is_stream(ctx, doc, other, 0);
-				differ = streama || streamb;
-				if (streama && streamb && opts->do_garbage >= 4)
-					differ = 0;
+				stream = pdf_is_stream(ctx, doc, num, 0);
+				if (!stream || opts->do_garbage >= 4)
+				{
+					h = hashobj(ctx, 2166136261u, pdf_resolve_indirect(ctx, pdf_get_xref_entry(ctx, doc, num)->obj));
+					if (stream)
+					{
+						unsigned char *data;
+						int n;
+						buf = pdf_load_raw_renumbered_stream(ctx, doc, num, 0, num, 0);
+						n = fz_buffer_storage(ctx, buf, &data);
+						h = hashbytes(hashint(h, 's'), data, n);
+					}
+
+					list[len].hash = h;
+					list[len].num = num;
+					list[len].stream = stream;
+					len++;
+				}
+			}
+			fz_always(ctx)
+			{
+				fz_drop_buffer(ctx, buf);
+				buf = NULL;
 			}
 			fz_catch(ctx)
 			{
 				/* Assume different */
-				differ = 1;
 			}
-			if (differ)
-				continue;
-
-			a = pdf_get_xref_entry(ctx, doc, num)->obj;
-			b = pdf_get_xref_entry(ctx, doc, other)->obj;
+		}
 
-			a = pdf_resolve_indirect(ctx, a);
-			b = pdf_resolve_indirect(ctx, b);
+		qsort(list, len, sizeof *list, cmp_objhash);
 
-			if (pdf_objcmp(ctx, a, b))
-				continue;
+		/* Only compare an object to preceding objects with the same hash */
+		for (i = 0; i < len; i = k)
+		{
+			for (k = i + 1; k < len && list[k].hash == list[i].hash; k++)
+				;
 
-			if (streama && streamb)
+			for (j = i + 1; j < k; j++)
 			{
-				/* Check to see if streams match too. */
-				fz_buffer *sa = NULL;
-				fz_buffer *sb = NULL;
+				num = list[j].num;
+				for (other = i; other < j; other++)
+				{
+					pdf_obj *a, *b;
 
-				fz_var(sa);
-				fz_var(sb);
+					if (!opts->use_list[list[other].num] || list[other].stream != list[j].stream)
+						continue;
 
-				differ = 1;
-				fz_try(ctx)
-				{
-					unsigned char *dataa, *datab;
-					int lena, lenb;
-					sa = pdf_load_raw_renumbered_stream(ctx, doc, num, 0, num, 0);
-					sb = pdf_load_raw_renumbered_stream(ctx, doc, other, 0, other, 0);
-					lena = fz_buffer_storage(ctx, sa, &dataa);
-					lenb = fz_buffer_storage(ctx, sb, &datab);
-					if (lena == lenb && memcmp(dataa, datab, lena) == 0)
-						differ = 0;
-				}
-				fz_always(ctx)
-				{
-					fz_drop_buffer(ctx, sa);
-					fz_drop_buffer(ctx, sb);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow(ctx);
-				}
-				if (differ)
-					continue;
-			}
+					a = pdf_get_xref_entry(ctx, doc, num)->obj;
+					b = pdf_get_xref_entry(ctx, doc, list[other].num)->obj;
 
-			/* Keep the lowest numbered object */
-			newnum = fz_mini(num, other);
-			opts->renumber_map[num] = newnum;
-			opts->renumber_map[other] = newnum;
-			opts->rev_renumber_map[newnum] = num; /* Either will do */
-			opts->use_list[fz_maxi(num, other)] = 0;
+					a = pdf_resolve_indirect(ctx, a);
+					b = pdf_resolve_indirect(ctx, b);
 
-			/* One duplicate was found, do not look for another */
-			break;
+					if (pdf_objcmp(ctx, a, b))
+						continue;
+
+					/* Check to see if streams match too. */
+					if (list[j].stream && !streams_equal(ctx, doc, num, list[other].num))
+						continue;
+
+					/* Keep the lowest numbered object */
+					newnum = list[other].num;
+					opts->renumber_map[num] = newnum;
+					opts->renumber_map[newnum] = newnum;
+					opts->rev_renumber_map[newnum] = num; /* Either will do */
+					opts->use_list[num] = 0;
+
+					/* One duplicate was found, do not look for another */
+					break;
+				}
+			}
 		}
 	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, list);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /*
@@ -1589,6 +1748,37 @@ static fz_buffer *deflatebuf(fz_context *ctx, unsigned char *p, int n)
 	return buf;
 }
 
+/*
+ * Streams can be deflated ahead of the write pass (see deflatestreams
+ * and writeobjects_deflating). The write pass then picks up the deflated
+ * data in place of loading and deflating the stream itself, so the
+ * output is the same either way.
+ */
+
+struct deflated_stream_s
+{
+	fz_buffer *buf;
+	int truncated;
+};
+
+static fz_buffer *take_deflated_stream(fz_context *ctx, pdf_write_state *opts, int num, int *truncated)
+{
+	deflated_stream *ds;
+	fz_buffer *buf;
+
+	if (num <= 0 || num >= opts->deflated_len || !opts->deflated[num].buf)
+		return NULL;
+	ds = &opts->deflated[num];
+	if (truncated)
+		*truncated = ds->truncated;
+	/* Keep it for linearization, which writes every object twice */
+	if (opts->do_linear)
+		return fz_keep_buffer(ctx, ds->buf);
+	buf = ds->buf;
+	ds->buf = NULL;
+	return buf;
+}
+
 static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen)
 {
 	fz_buffer *buf, *tmp;
@@ -1596,8 +1786,12 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	pdf_obj *obj;
 	int orig_num = opts->rev_renumber_map[num];
 	int orig_gen = opts->rev_gen_list[num];
+	int deflated;
 
-	buf = pdf_load_raw_renumbered_stream(ctx, doc, num, gen, orig_num, orig_gen);
+	buf = take_deflated_stream(ctx, opts, num, NULL);
+	deflated = buf != NULL;
+	if (!deflated)
+		buf = pdf_load_raw_renumbered_stream(ctx, doc, num, gen, orig_num, orig_gen);
 
 	obj = pdf_copy_dict(ctx, obj_orig);
 
@@ -1605,9 +1799,12 @@ static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts
 	{
 		pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
 
-		tmp = deflatebuf(ctx, buf->data, buf->len);
-		fz_drop_buffer(ctx, buf);
-		buf = tmp;
+		if (!deflated)
+		{
+			tmp = deflatebuf(ctx, buf->data, buf->len);
+			fz_drop_buffer(ctx, buf);
+			buf = tmp;
+		}
 	}
 
 	if (opts->do_ascii && isbinarystream(buf))
@@ -1641,8 +1838,12 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 	int orig_num = opts->rev_renumber_map[num];
 	int orig_gen = opts->rev_gen_list[num];
 	int truncated = 0;
+	int deflated;
 
-	buf = pdf_load_renumbered_stream(ctx, doc, num, gen, orig_num, orig_gen, (opts->continue_on_error ? &truncated : NULL));
+	buf = take_deflated_stream(ctx, opts, num, &truncated);
+	deflated = buf != NULL;
+	if (!deflated)
+		buf = pdf_load_renumbered_stream(ctx, doc, num, gen, orig_num, orig_gen, (opts->continue_on_error ? &truncated : NULL));
 	if (truncated && opts->errors)
 		(*opts->errors)++;
 
@@ -1654,9 +1855,12 @@ static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *op
 	{
 		pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
 
-		tmp = deflatebuf(ctx, buf->data, buf->len);
-		fz_drop_buffer(ctx, buf);
-		buf = tmp;
+		if (!deflated)
+		{
+			tmp = deflatebuf(ctx, buf->data, buf->len);
+			fz_drop_buffer(ctx, buf);
+			buf = tmp;
+		}
 	}
 
 	if (opts->do_ascii && isbinarystream(buf))
@@ -1710,6 +1914,38 @@ static int filter_implies_image(fz_context *ctx, pdf_document *doc, pdf_obj *o)
 	return 0;
 }
 
+static int should_expand(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj)
+{
+	int dontexpand = 0;
+	if (opts->do_expand != 0 && opts->do_expand != PDF_EXPAND_ALL)
+	{
+		pdf_obj *o;
+
+		if ((o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_XObject)) &&
+			(o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_Image)))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
+		if (o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_Font))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_FontDescriptor))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (pdf_dict_get(ctx, obj, PDF_NAME_Length1) != NULL)
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (pdf_dict_get(ctx, obj, PDF_NAME_Length2) != NULL)
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (pdf_dict_get(ctx, obj, PDF_NAME_Length3) != NULL)
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_Type1C))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_CIDFontType0C))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
+		if (o = pdf_dict_get(ctx, obj, PDF_NAME_Filter), filter_implies_image(ctx, doc, o))
+			dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
+		if (pdf_dict_get(ctx, obj, PDF_NAME_Width) != NULL && pdf_dict_get(ctx, obj, PDF_NAME_Height) != NULL)
+			dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
+	}
+	return opts->do_expand && !dontexpand && !pdf_is_jpx_image(ctx, obj);
+}
+
 static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int gen, int skip_xrefs)
 {
 	pdf_xref_entry *entry;
@@ -1739,7 +1975,8 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 	if (pdf_is_dict(ctx, obj))
 	{
 		type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
-		if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm))
+		/* Object streams of our own are numbered from first_objstm */
+		if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm) && !(opts->objstm_list && num >= opts->first_objstm))
 		{
 			opts->use_list[num] = 0;
 			pdf_drop_obj(ctx, obj);
@@ -1768,36 +2005,10 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 	}
 	else
 	{
-		int dontexpand = 0;
-		if (opts->do_expand != 0 && opts->do_expand != PDF_EXPAND_ALL)
-		{
-			pdf_obj *o;
-
-			if ((o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_XObject)) &&
-				(o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_Image)))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
-			if (o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_Font))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (o = pdf_dict_get(ctx, obj, PDF_NAME_Type), pdf_name_eq(ctx, o, PDF_NAME_FontDescriptor))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (pdf_dict_get(ctx, obj, PDF_NAME_Length1) != NULL)
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (pdf_dict_get(ctx, obj, PDF_NAME_Length2) != NULL)
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (pdf_dict_get(ctx, obj, PDF_NAME_Length3) != NULL)
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_Type1C))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (o = pdf_dict_get(ctx, obj, PDF_NAME_Subtype), pdf_name_eq(ctx, o, PDF_NAME_CIDFontType0C))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_FONTS);
-			if (o = pdf_dict_get(ctx, obj, PDF_NAME_Filter), filter_implies_image(ctx, doc, o))
-				dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
-			if (pdf_dict_get(ctx, obj, PDF_NAME_Width) != NULL && pdf_dict_get(ctx, obj, PDF_NAME_Height) != NULL)
-				dontexpand = !(opts->do_expand & PDF_EXPAND_IMAGES);
-		}
 		fz_try(ctx)
 		{
-			if (opts->do_expand && !dontexpand && !pdf_is_jpx_image(ctx, obj))
+			/* Object streams of our own are left compressed */
+			if (should_expand(ctx, doc, opts, obj) && !(opts->objstm_list && num >= opts->first_objstm))
 				expandstream(ctx, doc, opts, obj, num, gen);
 			else
 				copystream(ctx, doc, opts, obj, num, gen);
@@ -1823,6 +2034,362 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 	pdf_drop_obj(ctx, obj);
 }
 
+/*
+ * Deflate streams in parallel ahead of the write pass.
+ *
+ * Loading streams touches the document, so it stays on this thread; only
+ * the compression itself is handed out to jobs with cloned contexts.
+ * Streams are taken in batches to bound the memory held by the
+ * uncompressed data. A plain write deflates a batch while the one before
+ * it is written (see writeobjects_deflating); linearization needs every
+ * stream twice, so it deflates them all first.
+ */
+
+#define DEFLATE_BATCH_COUNT 256
+#define DEFLATE_BATCH_SIZE (32 << 20)
+
+typedef struct
+{
+	int num;
+	int truncated;
+	fz_buffer *src;
+	fz_buffer *dst;
+} deflate_item;
+
+typedef struct
+{
+	int len;
+	int jobs;
+	deflate_item *items;
+} deflate_batch;
+
+static void deflate_job(fz_context *ctx, void *arg, int job)
+{
+	deflate_batch *batch = arg;
+	int i;
+
+	/* Each job takes every jobs'th item, so no two jobs share one */
+	for (i = job; i < batch->len; i += batch->jobs)
+	{
+		deflate_item *item = &batch->items[i];
+		fz_try(ctx)
+			item->dst = deflatebuf(ctx, item->src->data, item->src->len);
+		fz_catch(ctx)
+			item->dst = NULL; /* Leave it to the write pass */
+	}
+}
+
+static void keep_deflate_batch(fz_context *ctx, pdf_write_state *opts, deflate_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->len; i++)
+	{
+		deflate_item *item = &batch->items[i];
+		opts->deflated[item->num].buf = item->dst;
+		opts->deflated[item->num].truncated = item->truncated;
+		item->dst = NULL;
+		fz_drop_buffer(ctx, item->src);
+		item->src = NULL;
+	}
+	batch->len = 0;
+}
+
+static void drop_deflate_batch(fz_context *ctx, deflate_batch *batch)
+{
+	int i;
+
+	if (!batch->items)
+		return;
+	for (i = 0; i < DEFLATE_BATCH_COUNT; i++)
+	{
+		fz_drop_buffer(ctx, batch->items[i].src);
+		fz_drop_buffer(ctx, batch->items[i].dst);
+	}
+	fz_free(ctx, batch->items);
+}
+
+/* Load the data that writeobject would deflate, or return NULL */
+static fz_buffer *load_stream_to_deflate(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int *truncated)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+	fz_buffer *buf = NULL;
+	pdf_obj *obj, *type;
+	int gen;
+
+	fz_var(buf);
+
+	if (entry->type != 'n' && entry->type != 'o')
+		return NULL;
+
+	/* As in dowriteobject */
+	gen = (entry->type == 'o' || opts->do_garbage >= 2) ? 0 : entry->gen;
+
+	obj = pdf_load_object(ctx, doc, num, gen);
+	fz_try(ctx)
+	{
+		type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
+		if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm) || pdf_name_eq(ctx, type, PDF_NAME_XRef))
+			buf = NULL;
+		else if (!pdf_is_stream(ctx, doc, num, gen))
+			buf = NULL;
+		else if (entry->stm_ofs < 0 && entry->stm_buf == NULL)
+			buf = NULL;
+		else if (should_expand(ctx, doc, opts, obj))
+			buf = pdf_load_renumbered_stream(ctx, doc, num, gen,
+				opts->rev_renumber_map[num], opts->rev_gen_list[num],
+				(opts->continue_on_error ? truncated : NULL));
+		else if (!pdf_dict_get(ctx, obj, PDF_NAME_Filter))
+			buf = pdf_load_raw_renumbered_stream(ctx, doc, num, gen,
+				opts->rev_renumber_map[num], opts->rev_gen_list[num]);
+	}
+	fz_always(ctx)
+		pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return buf;
+}
+
+/* Load streams from num up to end until the batch is full. Returns where to go on from. */
+static int load_deflate_batch(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, deflate_batch *batch, int num, int end)
+{
+	fz_buffer *buf = NULL;
+	int size = 0;
+	int truncated;
+
+	fz_var(buf);
+
+	for (; num < end && batch->len < DEFLATE_BATCH_COUNT && size < DEFLATE_BATCH_SIZE; num++)
+	{
+		if (!opts->use_list[num])
+			continue;
+
+		truncated = 0;
+		fz_try(ctx)
+			buf = load_stream_to_deflate(ctx, doc, opts, num, &truncated);
+		fz_catch(ctx)
+			buf = NULL; /* Leave it to the write pass to report */
+		if (!buf)
+			continue;
+
+		batch->items[batch->len].num = num;
+		batch->items[batch->len].truncated = truncated;
+		batch->items[batch->len].src = buf;
+		batch->len++;
+		size += buf->len;
+	}
+
+	return num;
+}
+
+static void new_deflated_streams(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, deflate_batch *batch)
+{
+	if (!opts->deflated)
+	{
+		opts->deflated_len = pdf_xref_len(ctx, doc);
+		opts->deflated = fz_calloc(ctx, opts->deflated_len, sizeof *opts->deflated);
+	}
+	batch->items = fz_calloc(ctx, DEFLATE_BATCH_COUNT, sizeof *batch->items);
+}
+
+static void deflatestreams(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
+{
+	int xref_len = pdf_xref_len(ctx, doc);
+	deflate_batch batch = { 0 };
+	int num;
+
+	new_deflated_streams(ctx, doc, opts, &batch);
+
+	fz_try(ctx)
+	{
+		num = 1;
+		while (num < xref_len)
+		{
+			num = load_deflate_batch(ctx, doc, opts, &batch, num, xref_len);
+			batch.jobs = fz_mini(opts->do_threads, batch.len);
+			fz_run_jobs(ctx, batch.jobs, deflate_job, &batch);
+			keep_deflate_batch(ctx, opts, &batch);
+		}
+	}
+	fz_always(ctx)
+		drop_deflate_batch(ctx, &batch);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+ * Pack objects into object streams
+ */
+
+#define OBJSTM_MAX_OBJECTS 100
+
+static void expand_lists(fz_context *ctx, pdf_write_state *opts, int num)
+{
+	int i, len = num + 3;
+
+	if (len <= opts->list_len)
+		return;
+
+	opts->use_list = fz_resize_array(ctx, opts->use_list, len, sizeof(int));
+	opts->ofs_list = fz_resize_array(ctx, opts->ofs_list, len, sizeof(fz_off_t));
+	opts->gen_list = fz_resize_array(ctx, opts->gen_list, len, sizeof(int));
+	opts->renumber_map = fz_resize_array(ctx, opts->renumber_map, len, sizeof(int));
+	opts->rev_renumber_map = fz_resize_array(ctx, opts->rev_renumber_map, len, sizeof(int));
+	opts->rev_gen_list = fz_resize_array(ctx, opts->rev_gen_list, len, sizeof(int));
+	opts->objstm_list = fz_resize_array(ctx, opts->objstm_list, len, sizeof(int));
+
+	for (i = opts->list_len; i < len; i++)
+	{
+		opts->use_list[i] = 0;
+		opts->ofs_list[i] = 0;
+		opts->gen_list[i] = 0;
+		opts->renumber_map[i] = i;
+		opts->rev_renumber_map[i] = i;
+		opts->rev_gen_list[i] = 0;
+		opts->objstm_list[i] = 0;
+	}
+	opts->list_len = len;
+}
+
+/* Can the object be written into an object stream? */
+static int is_objstm_candidate(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+	pdf_obj *obj = NULL;
+	pdf_obj *type;
+	int candidate = 0;
+
+	if (!opts->use_list[num] || (entry->type != 'n' && entry->type != 'o'))
+		return 0;
+
+	/* Only objects that will be written with generation 0, as in dowriteobject */
+	if (entry->type == 'n' && entry->gen != 0 && opts->do_garbage < 2)
+		return 0;
+
+	fz_var(obj);
+
+	fz_try(ctx)
+	{
+		obj = pdf_load_object(ctx, doc, num, 0);
+		type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
+		if (!pdf_is_stream(ctx, doc, num, 0) &&
+			!pdf_name_eq(ctx, type, PDF_NAME_ObjStm) &&
+			!pdf_name_eq(ctx, type, PDF_NAME_XRef))
+			candidate = 1;
+	}
+	fz_always(ctx)
+		pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+	{
+		/* Leave it to writeobject to deal with */
+		candidate = 0;
+	}
+
+	return candidate;
+}
+
+static void packobjstm(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int *list, int count)
+{
+	fz_buffer *buf = NULL;
+	fz_buffer *objbuf = NULL;
+	fz_buffer *zbuf = NULL;
+	fz_output *out = NULL;
+	pdf_obj *dict = NULL;
+	pdf_obj *ref = NULL;
+	pdf_obj *obj;
+	int i, num;
+
+	fz_var(buf);
+	fz_var(objbuf);
+	fz_var(zbuf);
+	fz_var(out);
+	fz_var(dict);
+	fz_var(ref);
+
+	fz_try(ctx)
+	{
+		/* The stream is the object numbers and offsets, then the objects */
+		buf = fz_new_buffer(ctx, count * 12);
+		objbuf = fz_new_buffer(ctx, count * 64);
+		out = fz_new_output_with_buffer(ctx, objbuf);
+		for (i = 0; i < count; i++)
+		{
+			fz_buffer_printf(ctx, buf, "%d %d ", list[i], objbuf->len);
+			obj = pdf_load_object(ctx, doc, list[i], 0);
+			fz_try(ctx)
+				pdf_print_obj(ctx, out, obj, opts->do_tight);
+			fz_always(ctx)
+				pdf_drop_obj(ctx, obj);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+			fz_putc(ctx, out, '\n');
+		}
+		fz_drop_output(ctx, out);
+		out = NULL;
+
+		dict = pdf_new_dict(ctx, doc, 5);
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_Type, PDF_NAME_ObjStm);
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_N, pdf_new_int(ctx, doc, count));
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_First, pdf_new_int(ctx, doc, buf->len));
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+
+		fz_write_buffer(ctx, buf, objbuf->data, objbuf->len);
+		zbuf = deflatebuf(ctx, buf->data, buf->len);
+
+		num = pdf_create_object(ctx, doc);
+		pdf_update_object(ctx, doc, num, dict);
+		ref = pdf_new_indirect(ctx, doc, num, 0);
+		pdf_update_stream(ctx, doc, ref, zbuf, 1);
+
+		expand_lists(ctx, opts, num);
+		opts->use_list[num] = 1;
+
+		for (i = 0; i < count; i++)
+		{
+			opts->objstm_list[list[i]] = num;
+			opts->ofs_list[list[i]] = i;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, buf);
+		fz_drop_buffer(ctx, objbuf);
+		fz_drop_buffer(ctx, zbuf);
+		pdf_drop_obj(ctx, dict);
+		pdf_drop_obj(ctx, ref);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void packobjstms(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
+{
+	int xref_len = pdf_xref_len(ctx, doc);
+	int list[OBJSTM_MAX_OBJECTS];
+	int num, count = 0;
+
+	opts->objstm_list = fz_calloc(ctx, opts->list_len, sizeof(int));
+	opts->first_objstm = xref_len;
+
+	for (num = 1; num < xref_len; num++)
+	{
+		if (!is_objstm_candidate(ctx, doc, opts, num))
+			continue;
+		list[count++] = num;
+		if (count == OBJSTM_MAX_OBJECTS)
+		{
+			packobjstm(ctx, doc, opts, list, count);
+			count = 0;
+		}
+	}
+	if (count > 0)
+		packobjstm(ctx, doc, opts, list, count);
+}
+
 static void writexrefsubsect(fz_context *ctx, pdf_write_state *opts, int from, int to)
 {
 	int num;
@@ -1945,6 +2512,17 @@ static void writexrefstreamsubsect(fz_context *ctx, pdf_document *doc, pdf_write
 	pdf_array_push_drop(ctx, index, pdf_new_int(ctx, doc, to - from));
 	for (num = from; num < to; num++)
 	{
+		if (opts->objstm_list && opts->objstm_list[num])
+		{
+			/* Compressed object: object stream number and index */
+			fz_write_buffer_byte(ctx, fzbuf, 2);
+			fz_write_buffer_byte(ctx, fzbuf, opts->objstm_list[num]>>24);
+			fz_write_buffer_byte(ctx, fzbuf, opts->objstm_list[num]>>16);
+			fz_write_buffer_byte(ctx, fzbuf, opts->objstm_list[num]>>8);
+			fz_write_buffer_byte(ctx, fzbuf, opts->objstm_list[num]);
+			fz_write_buffer_byte(ctx, fzbuf, opts->ofs_list[num]);
+			continue;
+		}
 		fz_write_buffer_byte(ctx, fzbuf, opts->use_list[num] ? 1 : 0);
 		fz_write_buffer_byte(ctx, fzbuf, opts->ofs_list[num]>>24);
 		fz_write_buffer_byte(ctx, fzbuf, opts->ofs_list[num]>>16);
@@ -2105,6 +2683,10 @@ dowriteobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num
 	if (opts->do_garbage && !opts->use_list[num])
 		return;
 
+	/* Packed objects are written as part of their object stream */
+	if (opts->objstm_list && opts->objstm_list[num])
+		return;
+
 	if (entry->type == 'n' || entry->type == 'o')
 	{
 		if (pass > 0)
@@ -2119,6 +2701,67 @@ dowriteobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num
 		opts->use_list[num] = 0;
 }
 
+typedef struct
+{
+	pdf_document *doc;
+	pdf_write_state *opts;
+	int from, to, pass;
+	deflate_batch *batch;
+} write_window;
+
+static void write_window_job(fz_context *ctx, void *arg, int job)
+{
+	write_window *w = arg;
+	int num;
+
+	if (job > 0)
+		deflate_job(ctx, w->batch, job - 1);
+	else
+		for (num = w->from; num < w->to; num++)
+			dowriteobject(ctx, w->doc, w->opts, num, w->pass);
+}
+
+/*
+ * Write objects from up to end, deflating their streams one window
+ * ahead: jobs compress the next window while the first job writes the
+ * current one. Each deflated stream is dropped once it is written, so
+ * only two windows are held at a time.
+ */
+static void
+writeobjects_deflating(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int from, int end, int pass)
+{
+	deflate_batch batch = { 0 };
+	write_window w;
+	int next;
+
+	new_deflated_streams(ctx, doc, opts, &batch);
+
+	w.doc = doc;
+	w.opts = opts;
+	w.pass = pass;
+	w.batch = &batch;
+	w.from = from;
+	w.to = from;
+
+	fz_try(ctx)
+	{
+		while (w.from < end)
+		{
+			/* Only one thread may use the document, so load before the jobs start */
+			next = load_deflate_batch(ctx, doc, opts, &batch, w.to, end);
+			batch.jobs = fz_mini(fz_maxi(opts->do_threads - 1, 1), batch.len);
+			fz_run_jobs(ctx, 1 + batch.jobs, write_window_job, &w);
+			keep_deflate_batch(ctx, opts, &batch);
+			w.from = w.to;
+			w.to = next;
+		}
+	}
+	fz_always(ctx)
+		drop_deflate_batch(ctx, &batch);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 static void
 writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass)
 {
@@ -2127,7 +2770,9 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 
 	if (!opts->do_incremental)
 	{
-		fz_printf(ctx, opts->out, "%%PDF-%d.%d\n", doc->version / 10, doc->version % 10);
+		/* Object and cross reference streams need PDF 1.5 */
+		int version = opts->do_use_objstms ? fz_maxi(doc->version, 15) : doc->version;
+		fz_printf(ctx, opts->out, "%%PDF-%d.%d\n", version / 10, version % 10);
 		fz_puts(ctx, opts->out, "%%\316\274\341\277\246\n\n");
 	}
 
@@ -2143,8 +2788,11 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 		writexref(ctx, doc, opts, opts->start, pdf_xref_len(ctx, doc), 1, opts->main_xref_offset, 0);
 	}
 
-	for (num = opts->start+1; num < xref_len; num++)
-		dowriteobject(ctx, doc, opts, num, pass);
+	if (opts->do_deflate && opts->do_threads > 1 && !opts->do_incremental && !opts->do_linear)
+		writeobjects_deflating(ctx, doc, opts, opts->start+1, xref_len, pass);
+	else
+		for (num = opts->start+1; num < xref_len; num++)
+			dowriteobject(ctx, doc, opts, num, pass);
 	if (opts->do_linear && pass == 1)
 	{
 		fz_off_t offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
@@ -2645,6 +3293,9 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->rev_gen_list = fz_malloc_array(ctx, xref_len + 3, sizeof(int));
 	opts->continue_on_error = in_opts->continue_on_error;
 	opts->errors = in_opts->errors;
+	opts->do_threads = in_opts->do_threads;
+	opts->do_use_objstms = in_opts->do_use_objstms;
+	opts->list_len = xref_len + 3;
 
 	for (num = 0; num < xref_len; num++)
 	{
@@ -2659,12 +3310,18 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 /* Free the resources held by the dynamic write options */
 static void finalise_write_state(fz_context *ctx, pdf_write_state *opts)
 {
+	int num;
+
+	for (num = 0; num < opts->deflated_len; num++)
+		fz_drop_buffer(ctx, opts->deflated[num].buf);
+	fz_free(ctx, opts->deflated);
 	fz_free(ctx, opts->use_list);
 	fz_free(ctx, opts->ofs_list);
 	fz_free(ctx, opts->gen_list);
 	fz_free(ctx, opts->renumber_map);
 	fz_free(ctx, opts->rev_renumber_map);
 	fz_free(ctx, opts->rev_gen_list);
+	fz_free(ctx, opts->objstm_list);
 	pdf_drop_obj(ctx, opts->linear_l);
 	pdf_drop_obj(ctx, opts->linear_h0);
 	pdf_drop_obj(ctx, opts->linear_h1);
@@ -2697,6 +3354,8 @@ void pdf_save_document(fz_context *ctx, pdf_document *doc, char *filename, pdf_w
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with garbage collection");
 	if (in_opts->do_incremental && in_opts->do_linear)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with linearisation");
+	if (in_opts->do_use_objstms && (in_opts->do_incremental || in_opts->do_linear))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't use object streams with incremental writes or linearisation");
 
 	doc->freeze_updates = 1;
 
@@ -2767,6 +3426,17 @@ void pdf_save_document(fz_context *ctx, pdf_document *doc, char *filename, pdf_w
 		if (opts.do_linear)
 			linearize(ctx, doc, &opts);
 
+		/* Pack objects into object streams, which are new objects */
+		if (opts.do_use_objstms)
+		{
+			packobjstms(ctx, doc, &opts);
+			xref_len = pdf_xref_len(ctx, doc);
+		}
+
+		/* Deflate streams in parallel before writing them twice */
+		if (opts.do_deflate && opts.do_threads > 1 && opts.do_linear)
+			deflatestreams(ctx, doc, &opts);
+
 		if (opts.do_incremental)
 		{
 			int i;
@@ -2849,7 +3519,10 @@ void pdf_save_document(fz_context *ctx, pdf_document *doc, char *filename, pdf_w
 			else
 			{
 				opts.first_xref_offset = fz_tell_output(ctx, opts.out);
-				writexref(ctx, doc, &opts, 0, xref_len, 1, 0, opts.first_xref_offset);
+				if (opts.do_use_objstms)
+					writexrefstream(ctx, doc, &opts, 0, xref_len, 1, 0, opts.first_xref_offset);
+				else
+					writexref(ctx, doc, &opts, 0, xref_len, 1, 0, opts.first_xref_offset);
 			}
 
 			doc->xref_sections[0].end_ofs = fz_tell_output(ctx, opts.out);
@@ -52,6 +52,8 @@ pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 	form->colorspace = NULL;
 	form->me = NULL;
 	form->iteration = 0;
+	form->id = fz_gen_id(ctx);
+	form->inherits_state = -1;
 
 	/* Store item immediately, to avoid possible recursion if objects refer back to this one */
 	pdf_store_item(ctx, dict, form, pdf_xobject_size(form));
@@ -176,6 +178,8 @@ pdf_new_xobject(fz_context *ctx, pdf_document *doc, const fz_rect *bbox, const f
 		form->colorspace = NULL;
 		form->me = NULL;
 		form->iteration = 0;
+		form->id = fz_gen_id(ctx);
+		form->inherits_state = -1;
 
 		form->bbox = *bbox;
 
@@ -220,4 +224,6 @@ void pdf_update_xobject_contents(fz_context *ctx, pdf_document *doc, pdf_xobject
 {
 	pdf_update_stream(ctx, doc, form->contents, buffer, 0);
 	form->iteration ++;
+	form->id = fz_gen_id(ctx);
+	form->inherits_state = -1;
 }
@@ -5,6 +5,8 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h" /* for pdf output */
 
+#include "mupdf/helpers/mu-threads.h"
+
 #ifdef _MSC_VER
 #include <winsock2.h>
 #else
@@ -105,6 +107,8 @@ static const format_cs_table_t format_cs_table[] =
 };
 
 static char *output = NULL;
+static char *list_output = NULL;
+static int list_input = 0;
 static char *format = NULL;
 static int output_format = OUT_NONE;
 
@@ -132,12 +136,15 @@ static pdf_document *pdfout = NULL;
 
 static int ignore_errors = 0;
 static int uselist = 1;
+static int optimize = 0;
 static int alphabits = 8;
+static int rasterizer = FZ_RASTERIZER_EDGES;
 
 static int out_cs = CS_UNSET;
 static float gamma_value = 1;
 static int invert = 0;
 static int bandheight = 0;
+static int band_threads = 0;
 
 static int errored = 0;
 static int append = 0;
@@ -155,6 +162,58 @@ static struct {
 	char *maxfilename;
 } timing;
 
+/* Pixmap pool statistics for -s m */
+typedef struct
+{
+	int hits, misses;
+	size_t peak;
+} pool_stats;
+
+/*
+	With -T, the main thread interprets pages into display lists and
+	hands them round-robin to a pool of workers, each with a cloned
+	context, which rasterize and encode them. Because the workers are
+	used in strict rotation, finishing them in the same rotation
+	writes the output in page order.
+*/
+typedef struct worker_s
+{
+	mu_thread thread;
+	mu_semaphore start;
+	mu_semaphore stop;
+	fz_context *ctx;
+	int num;
+
+	/* The page in flight; list is NULL when the worker is idle. */
+	fz_display_list *list;
+	char *filename;
+	int pagenum;
+	int iscolor;
+	fz_matrix ctm;
+	fz_rect tbounds;
+	fz_irect ibounds;
+	fz_cookie cookie;
+
+	/* Results, owned by the main thread after the stop semaphore. */
+	fz_pixmap *pix;
+	fz_bitmap *bit;
+	fz_buffer *buf;
+	unsigned char digest[16];
+	int error;
+	int interptime;
+	int rendertime;
+	pool_stats pool;
+
+	/* Statistics for -s t */
+	int pages;
+	int total;
+} worker_t;
+
+static int num_workers = 0;
+static int dispatched = 0;
+static worker_t *workers = NULL;
+static mu_mutex mutexes[FZ_LOCK_MAX];
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -180,6 +239,8 @@ static void usage(void)
 		"\t-h -\theight (in pixels) (maximum height if -r is specified)\n"
 		"\t-f -\tfit width and/or height exactly; ignore original aspect ratio\n"
 		"\t-B -\tmaximum bandheight (pgm, ppm, pam, png output only)\n"
+		"\t-T -\tnumber of threads to use for rendering (raster output only)\n"
+		"\t-P -\tnumber of threads to draw each page with, in bands (raster output only)\n"
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
 		"\t-H -\tpage height for EPUB layout\n"
@@ -191,7 +252,11 @@ static void usage(void)
 		"\t-I\tinvert colors\n"
 		"\n"
 		"\t-A -\tnumber of bits of antialiasing (0 to 8)\n"
+		"\t-a -\tantialiasing scan converter (edges, cells)\n"
 		"\t-D\tdisable use of display list\n"
+		"\t-L -\tsave display list (%%d for page number)\n"
+		"\t-O\toptimize display list\n"
+		"\t-l\tinput files are display lists saved with -L\n"
 		"\t-i\tignore errors\n"
 		"\n"
 		"\tpages\tcomma separated list of page numbers and ranges\n"
@@ -240,13 +305,471 @@ static int has_percent_d(char *s)
 	return 0;
 }
 
+static int is_stream_format(int format)
+{
+	return format == OUT_PNG || format == OUT_PNM || format == OUT_PGM || format == OUT_PPM || format == OUT_PAM || format == OUT_PBM;
+}
+
+/* Pages made up of nothing but 1 bit images (scans and faxes) can be
+ * drawn straight onto a bitmap for mono output, skipping the contone
+ * pixmap and the halftoning. Returns NULL if the page needs the draw
+ * device. */
+static fz_bitmap *new_bitmap_from_list(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, const fz_rect *tbounds, const fz_irect *ibounds, fz_cookie *cookie)
+{
+	fz_bitmap *bit;
+	fz_device *dev = NULL;
+	fz_cookie trial = { 0 };
+	int unsupported = 1;
+
+	if (out_cs != CS_MONO || !list || invert || gamma_value != 1 || showmd5)
+		return NULL;
+
+	bit = fz_new_bitmap(ctx, ibounds->x1 - ibounds->x0, ibounds->y1 - ibounds->y0, 1, resolution, resolution);
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		fz_clear_bitmap(ctx, bit);
+		dev = fz_new_bitmap_device(ctx, bit, ibounds, &unsupported);
+		fz_run_display_list(ctx, list, dev, ctm, tbounds, &trial);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+		fz_rethrow(ctx);
+	}
+
+	if (unsupported)
+	{
+		fz_drop_bitmap(ctx, bit);
+		return NULL;
+	}
+
+	if (cookie)
+		cookie->errors += trial.errors;
+	return bit;
+}
+
+static void add_pool_counts(pool_stats *stats, int hits, int misses, size_t peak)
+{
+	stats->hits += hits;
+	stats->misses += misses;
+	if (peak > stats->peak)
+		stats->peak = peak;
+}
+
+static void add_pool_stats(fz_context *ctx, fz_device *dev, pool_stats *stats)
+{
+	int hits, misses;
+	size_t peak;
+
+	fz_draw_device_pool_stats(ctx, dev, &hits, &misses, &peak);
+	add_pool_counts(stats, hits, misses, peak);
+}
+
+static void print_pool_stats(pool_stats *stats)
+{
+	if (stats->hits || stats->misses)
+		printf("Pixmap Pool Hits: %d Misses: %d Peak: %lu bytes\n", stats->hits, stats->misses, (unsigned long)stats->peak);
+}
+
+/* Runs on the worker thread, using only the worker's own context. */
+static void render_worker_page(worker_t *me)
+{
+	fz_context *ctx = me->ctx;
+	int savealpha = (out_cs == CS_GRAY_ALPHA || out_cs == CS_RGB_ALPHA || out_cs == CS_CMYK_ALPHA);
+	fz_device *dev = NULL;
+	fz_output *out = NULL;
+	int start;
+
+	fz_var(dev);
+	fz_var(out);
+
+	if (showtime)
+		start = gettime();
+
+	fz_try(ctx)
+	{
+		me->bit = new_bitmap_from_list(ctx, me->list, &me->ctm, &me->tbounds, &me->ibounds, &me->cookie);
+		if (me->bit && output && output_format == OUT_PBM)
+		{
+			me->buf = fz_new_buffer(ctx, 1024);
+			out = fz_new_output_with_buffer(ctx, me->buf);
+			fz_write_bitmap_as_pbm(ctx, out, me->bit);
+		}
+
+		if (!me->bit)
+		{
+			me->pix = fz_new_pixmap_with_bbox_and_alpha(ctx, colorspace, &me->ibounds, savealpha);
+			fz_pixmap_set_resolution(me->pix, resolution);
+
+			if (savealpha)
+				fz_clear_pixmap(ctx, me->pix);
+			else
+				fz_clear_pixmap_with_value(ctx, me->pix, 255);
+
+			dev = fz_new_draw_device(ctx, me->pix);
+			if (alphabits == 0)
+				fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
+			fz_run_display_list(ctx, me->list, dev, &me->ctm, &me->tbounds, &me->cookie);
+			if (showmemory)
+				add_pool_stats(ctx, dev, &me->pool);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+
+			if (invert)
+				fz_invert_pixmap(ctx, me->pix);
+			if (gamma_value != 1)
+				fz_gamma_pixmap(ctx, me->pix, gamma_value);
+
+			if (savealpha)
+				fz_unmultiply_pixmap(ctx, me->pix);
+
+			if (showmd5)
+				fz_md5_pixmap(ctx, me->pix, me->digest);
+
+			if (output)
+			{
+				if (output_format == OUT_PBM || (out_cs == CS_MONO && (output_format == OUT_PWG || output_format == OUT_PCL)))
+					me->bit = fz_new_bitmap_from_pixmap(ctx, me->pix, NULL);
+
+				if (is_stream_format(output_format))
+				{
+					me->buf = fz_new_buffer(ctx, 1024);
+					out = fz_new_output_with_buffer(ctx, me->buf);
+					if (output_format == OUT_PGM || output_format == OUT_PPM || output_format == OUT_PNM)
+						fz_write_pixmap_as_pnm(ctx, out, me->pix);
+					else if (output_format == OUT_PAM)
+						fz_write_pixmap_as_pam(ctx, out, me->pix, savealpha);
+					else if (output_format == OUT_PNG)
+						fz_write_pixmap_as_png(ctx, out, me->pix, savealpha);
+					else if (output_format == OUT_PBM)
+						fz_write_bitmap_as_pbm(ctx, out, me->bit);
+				}
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_output(ctx, out);
+	}
+	fz_catch(ctx)
+	{
+		me->error = 1;
+	}
+
+	if (showtime)
+		me->rendertime = gettime() - start;
+}
+
+static void worker_thread(void *arg)
+{
+	worker_t *me = (worker_t *)arg;
+
+	for (;;)
+	{
+		mu_wait_semaphore(&me->start);
+		if (me->list == NULL)
+			break;
+		render_worker_page(me);
+		mu_trigger_semaphore(&me->stop);
+	}
+}
+
+static void drop_worker_results(fz_context *ctx, worker_t *w)
+{
+	fz_drop_display_list(ctx, w->list);
+	w->list = NULL;
+	fz_drop_pixmap(ctx, w->pix);
+	w->pix = NULL;
+	fz_drop_bitmap(ctx, w->bit);
+	w->bit = NULL;
+	fz_drop_buffer(ctx, w->buf);
+	w->buf = NULL;
+}
+
+/* Wait for a worker to complete its page, and write the results out. */
+static void finish_worker(fz_context *ctx, worker_t *w)
+{
+	char filename_buf[512];
+	fz_output *output_file = NULL;
+
+	fz_var(output_file);
+
+	mu_wait_semaphore(&w->stop);
+
+	fz_try(ctx)
+	{
+		if (w->error)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot draw page %d in file '%s'", w->pagenum, w->filename);
+
+		if (output)
+		{
+			if (strcmp(output, "-"))
+				sprintf(filename_buf, output, w->pagenum);
+
+			if (w->buf)
+			{
+				if (!strcmp(output, "-"))
+					output_file = fz_new_output_with_file_ptr(ctx, stdout, 0);
+				else
+					output_file = fz_new_output_with_path(ctx, filename_buf, 0);
+				fz_write(ctx, output_file, w->buf->data, w->buf->len);
+			}
+			else if (output_format == OUT_PWG)
+			{
+				if (has_percent_d(output))
+					append = 0;
+				if (w->bit)
+					fz_save_bitmap_as_pwg(ctx, w->bit, filename_buf, append, NULL);
+				else
+					fz_save_pixmap_as_pwg(ctx, w->pix, filename_buf, append, NULL);
+				append = 1;
+			}
+			else if (output_format == OUT_PCL)
+			{
+				fz_pcl_options options;
+
+				fz_pcl_preset(ctx, &options, "ljet4");
+
+				if (has_percent_d(output))
+					append = 0;
+				if (w->bit)
+					fz_save_bitmap_as_pcl(ctx, w->bit, filename_buf, append, &options);
+				else
+					fz_save_pixmap_as_pcl(ctx, w->pix, filename_buf, append, &options);
+				append = 1;
+			}
+			else if (output_format == OUT_TGA)
+			{
+				int savealpha = (out_cs == CS_GRAY_ALPHA || out_cs == CS_RGB_ALPHA || out_cs == CS_CMYK_ALPHA);
+				fz_save_pixmap_as_tga(ctx, w->pix, filename_buf, savealpha);
+			}
+		}
+
+		if (showmd5 || showtime || showfeatures)
+			printf("page %s %d", w->filename, w->pagenum);
+
+		if (showfeatures)
+			printf(" %s", w->iscolor ? "color" : "grayscale");
+
+		if (showmd5)
+		{
+			int i;
+
+			printf(" ");
+			for (i = 0; i < 16; i++)
+				printf("%02x", w->digest[i]);
+		}
+
+		if (showtime)
+		{
+			int diff = w->interptime + w->rendertime;
+
+			if (diff < timing.min)
+			{
+				timing.min = diff;
+				timing.minpage = w->pagenum;
+				timing.minfilename = w->filename;
+			}
+			if (diff > timing.max)
+			{
+				timing.max = diff;
+				timing.maxpage = w->pagenum;
+				timing.maxfilename = w->filename;
+			}
+			timing.total += diff;
+			timing.count ++;
+
+			w->pages++;
+			w->total += w->rendertime;
+
+			printf(" %dms", diff);
+		}
+
+		if (showmd5 || showtime || showfeatures)
+			printf("\n");
+
+		if (showmemory)
+		{
+			fz_dump_glyph_cache_stats(ctx);
+			print_pool_stats(&w->pool);
+		}
+
+		fz_flush_warnings(ctx);
+
+		if (w->cookie.errors)
+			errored = 1;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, output_file);
+		drop_worker_results(ctx, w);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* Hand a display list over to the next worker in the rotation. */
+static void dispatch_page(fz_context *ctx, int pagenum, fz_display_list *list, const fz_matrix *ctm, const fz_rect *tbounds, const fz_irect *ibounds, const fz_cookie *cookie, int iscolor, int start)
+{
+	worker_t *w = &workers[dispatched % num_workers];
+
+	if (w->list)
+		finish_worker(ctx, w);
+
+	dispatched++;
+
+	w->list = list;
+	w->filename = filename;
+	w->pagenum = pagenum;
+	w->iscolor = iscolor;
+	w->ctm = *ctm;
+	w->tbounds = *tbounds;
+	w->ibounds = *ibounds;
+	w->cookie = *cookie;
+	w->error = 0;
+	w->interptime = showtime ? gettime() - start : 0;
+	w->rendertime = 0;
+	memset(&w->pool, 0, sizeof w->pool);
+
+	mu_trigger_semaphore(&w->start);
+}
+
+/* Finish every page in flight, in page order. With -i, a page that
+ * cannot be written does not stop the pages after it. */
+static void finish_workers(fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+	{
+		worker_t *w = &workers[(dispatched + i) % num_workers];
+		if (w->list)
+		{
+			fz_try(ctx)
+				finish_worker(ctx, w);
+			fz_catch(ctx)
+			{
+				if (!ignore_errors)
+					fz_rethrow(ctx);
+				fz_warn(ctx, "ignoring error on page %d in '%s'", w->pagenum, w->filename);
+			}
+		}
+	}
+}
+
+/* Wait for every page in flight, and throw the results away. */
+static void discard_workers(fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+	{
+		worker_t *w = &workers[i];
+		if (w->list)
+		{
+			mu_wait_semaphore(&w->stop);
+			drop_worker_results(ctx, w);
+		}
+	}
+}
+
+/* A display list saved with -L, opened as a document of one page. */
+typedef struct
+{
+	fz_document super;
+	fz_display_list *list;
+} list_document;
+
+typedef struct
+{
+	fz_page super;
+	fz_display_list *list;
+} list_page;
+
+static void list_drop_page(fz_context *ctx, fz_page *page_)
+{
+	list_page *page = (list_page *)page_;
+	fz_drop_display_list(ctx, page->list);
+}
+
+static fz_rect *list_bound_page(fz_context *ctx, fz_page *page_, fz_rect *bounds)
+{
+	list_page *page = (list_page *)page_;
+	return fz_bound_display_list(ctx, page->list, bounds);
+}
+
+static void list_run_page(fz_context *ctx, fz_page *page_, fz_device *dev, const fz_matrix *ctm, fz_cookie *cookie)
+{
+	list_page *page = (list_page *)page_;
+	fz_run_display_list(ctx, page->list, dev, ctm, &fz_infinite_rect, cookie);
+}
+
+static void list_close_document(fz_context *ctx, fz_document *doc_)
+{
+	list_document *doc = (list_document *)doc_;
+	fz_drop_display_list(ctx, doc->list);
+	fz_free(ctx, doc);
+}
+
+static int list_count_pages(fz_context *ctx, fz_document *doc)
+{
+	return 1;
+}
+
+static fz_page *list_load_page(fz_context *ctx, fz_document *doc_, int number)
+{
+	list_document *doc = (list_document *)doc_;
+	list_page *page;
+
+	if (number != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "display list has only one page");
+
+	page = fz_new_page(ctx, sizeof *page);
+	page->super.drop_page_imp = list_drop_page;
+	page->super.bound_page = list_bound_page;
+	page->super.run_page_contents = list_run_page;
+	page->list = fz_keep_display_list(ctx, doc->list);
+	return &page->super;
+}
+
+static fz_document *open_list_document(fz_context *ctx, const char *filename)
+{
+	fz_display_list *list = fz_load_display_list(ctx, filename);
+	list_document *doc;
+
+	fz_try(ctx)
+		doc = fz_new_document(ctx, sizeof *doc);
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	doc->super.close = list_close_document;
+	doc->super.count_pages = list_count_pages;
+	doc->super.load_page = list_load_page;
+	doc->list = list;
+	return &doc->super;
+}
+
 static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 {
 	fz_page *page;
 	fz_display_list *list = NULL;
 	fz_device *dev = NULL;
 	int start;
+	int iscolor = 0;
 	fz_cookie cookie = { 0 };
+	pool_stats pool = { 0 };
 
 	fz_var(list);
 	fz_var(dev);
@@ -259,16 +782,33 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	fz_catch(ctx)
 		fz_rethrow_message(ctx, "cannot load page %d in file '%s'", pagenum, filename);
 
-	if (showmd5 || showtime || showfeatures)
+	if (num_workers == 0 && (showmd5 || showtime || showfeatures))
 		printf("page %s %d", filename, pagenum);
 
-	if (uselist)
+	/* Replay a saved list as it is; running it as a page would wrap it
+	 * in a second pair of page marks. */
+	if (list_input)
+		list = fz_keep_display_list(ctx, ((list_page *)page)->list);
+	else if (uselist)
 	{
 		fz_try(ctx)
 		{
 			list = fz_new_display_list(ctx);
 			dev = fz_new_list_device(ctx, list);
 			fz_run_page(ctx, page, dev, &fz_identity, &cookie);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+			if (optimize)
+				fz_optimize_display_list(ctx, list);
+			if (list_output)
+			{
+				char buf[512];
+				sprintf(buf, list_output, pagenum);
+				fz_try(ctx)
+					fz_save_display_list(ctx, list, buf);
+				fz_catch(ctx)
+					fz_warn(ctx, "cannot save display list of page %d", pagenum);
+			}
 		}
 		fz_always(ctx)
 		{
@@ -285,7 +825,6 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 
 	if (showfeatures)
 	{
-		int iscolor;
 		dev = fz_new_test_device(ctx, &iscolor, 0.02f);
 		fz_try(ctx)
 		{
@@ -303,7 +842,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		{
 			fz_rethrow(ctx);
 		}
-		printf(" %s", iscolor ? "color" : "grayscale");
+		if (num_workers == 0)
+			printf(" %s", iscolor ? "color" : "grayscale");
 	}
 
 	if (output_format == OUT_TRACE)
@@ -467,11 +1007,13 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		fz_rect bounds, tbounds;
 		fz_irect ibounds;
 		fz_pixmap *pix = NULL;
+		fz_bitmap *bit = NULL;
 		int w, h;
 		fz_output *output_file = NULL;
 		fz_png_output_context *poc = NULL;
 
 		fz_var(pix);
+		fz_var(bit);
 		fz_var(poc);
 
 		fz_bound_page(ctx, page, &bounds);
@@ -533,6 +1075,20 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		fz_round_rect(&ibounds, &tbounds);
 		fz_rect_from_irect(&tbounds, &ibounds);
 
+		if (num_workers > 0)
+		{
+			fz_try(ctx)
+				dispatch_page(ctx, pagenum, list, &ctm, &tbounds, &ibounds, &cookie, iscolor, start);
+			fz_catch(ctx)
+			{
+				fz_drop_display_list(ctx, list);
+				fz_drop_page(ctx, page);
+				fz_rethrow(ctx);
+			}
+			fz_drop_page(ctx, page);
+			return;
+		}
+
 		/* TODO: banded rendering and multi-page ppm */
 		fz_try(ctx)
 		{
@@ -554,8 +1110,14 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				tbounds.y1 = tbounds.y0 + bandheight + 2;
 			}
 
-			pix = fz_new_pixmap_with_bbox(ctx, colorspace, &band_ibounds);
-			fz_pixmap_set_resolution(pix, resolution);
+			if (bands == 1)
+				bit = new_bitmap_from_list(ctx, list, &ctm, &tbounds, &ibounds, &cookie);
+			if (!bit)
+			{
+				/* Only keep an alpha plane if it is going to be saved */
+				pix = fz_new_pixmap_with_bbox_and_alpha(ctx, colorspace, &band_ibounds, savealpha);
+				fz_pixmap_set_resolution(pix, resolution);
+			}
 
 			if (output)
 			{
@@ -564,17 +1126,48 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				else
 				{
 					sprintf(filename_buf, output, pagenum);
-					output_file = fz_new_output_with_path(ctx, filename_buf, 0);
+					/* PWG and PCL open (and append to) the file themselves */
+					if (output_format != OUT_PWG && output_format != OUT_PCL)
+						output_file = fz_new_output_with_path(ctx, filename_buf, 0);
 				}
 
 				if (output_format == OUT_PGM || output_format == OUT_PPM || output_format == OUT_PNM)
-					fz_write_pnm_header(ctx, output_file, pix->w, totalheight, pix->n);
+					fz_write_pnm_header(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha);
 				else if (output_format == OUT_PAM)
-					fz_write_pam_header(ctx, output_file, pix->w, totalheight, pix->n, savealpha);
+					fz_write_pam_header(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha, savealpha);
 				else if (output_format == OUT_PNG)
-					poc = fz_write_png_header(ctx, output_file, pix->w, totalheight, pix->n, savealpha);
+					poc = fz_write_png_header(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha, savealpha);
 			}
 
+			if (bit)
+			{
+				if (output && output_format == OUT_PWG)
+				{
+					if (has_percent_d(output))
+						append = 0;
+					fz_save_bitmap_as_pwg(ctx, bit, filename_buf, append, NULL);
+					append = 1;
+				}
+				else if (output && output_format == OUT_PCL)
+				{
+					fz_pcl_options options;
+
+					fz_pcl_preset(ctx, &options, "ljet4");
+
+					if (has_percent_d(output))
+						append = 0;
+					fz_save_bitmap_as_pcl(ctx, bit, filename_buf, append, &options);
+					append = 1;
+				}
+				else if (output && output_format == OUT_PBM)
+					fz_write_bitmap_as_pbm(ctx, output_file, bit);
+				bands = 0; /* Already drawn; skip the pixmap bands */
+			}
+
+			/* Each band replays the list, so index it */
+			if (list && (bands > 1 || band_threads > 1))
+				fz_index_display_list(ctx, list);
+
 			for (band = 0; band < bands; band++)
 			{
 				if (savealpha)
@@ -582,15 +1175,31 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				else
 					fz_clear_pixmap_with_value(ctx, pix, 255);
 
-				dev = fz_new_draw_device(ctx, pix);
-				if (alphabits == 0)
-					fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
-				if (list)
-					fz_run_display_list(ctx, list, dev, &ctm, &tbounds, &cookie);
+				if (list && band_threads > 1)
+				{
+					int hits, misses;
+					size_t peak;
+
+					fz_draw_pool_stats(ctx, NULL, NULL, NULL);
+					fz_render_display_list_parallel(ctx, list, &ctm, pix, alphabits == 0 ? FZ_DONT_INTERPOLATE_IMAGES : 0, band_threads, &cookie);
+					fz_draw_pool_stats(ctx, &hits, &misses, &peak);
+					if (showmemory)
+						add_pool_counts(&pool, hits, misses, peak);
+				}
 				else
-					fz_run_page(ctx, page, dev, &ctm, &cookie);
-				fz_drop_device(ctx, dev);
-				dev = NULL;
+				{
+					dev = fz_new_draw_device(ctx, pix);
+					if (alphabits == 0)
+						fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
+					if (list)
+						fz_run_display_list(ctx, list, dev, &ctm, &tbounds, &cookie);
+					else
+						fz_run_page(ctx, page, dev, &ctm, &cookie);
+					if (showmemory)
+						add_pool_stats(ctx, dev, &pool);
+					fz_drop_device(ctx, dev);
+					dev = NULL;
+				}
 
 				if (invert)
 					fz_invert_pixmap(ctx, pix);
@@ -603,11 +1212,11 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 				if (output)
 				{
 					if (output_format == OUT_PGM || output_format == OUT_PPM || output_format == OUT_PNM)
-						fz_write_pnm_band(ctx, output_file, pix->w, totalheight, pix->n, band, drawheight, pix->samples);
+						fz_write_pnm_band(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha, band, drawheight, pix->samples);
 					else if (output_format == OUT_PAM)
-						fz_write_pam_band(ctx, output_file, pix->w, totalheight, pix->n, band, drawheight, pix->samples, savealpha);
+						fz_write_pam_band(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha, band, drawheight, pix->samples, savealpha);
 					else if (output_format == OUT_PNG)
-						fz_write_png_band(ctx, output_file, pix->w, totalheight, pix->n, band, drawheight, pix->samples, savealpha, poc);
+						fz_write_png_band(ctx, output_file, pix->w, totalheight, pix->n, pix->alpha, band, drawheight, pix->samples, savealpha, poc);
 					else if (output_format == OUT_PWG)
 					{
 						if (has_percent_d(output))
@@ -675,6 +1284,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 			fz_drop_device(ctx, dev);
 			dev = NULL;
 			fz_drop_pixmap(ctx, pix);
+			fz_drop_bitmap(ctx, bit);
 			if (output_file)
 				fz_drop_output(ctx, output_file);
 		}
@@ -720,6 +1330,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	if (showmemory)
 	{
 		fz_dump_glyph_cache_stats(ctx);
+		print_pool_stats(&pool);
 	}
 
 	fz_flush_warnings(ctx);
@@ -842,6 +1453,26 @@ trace_realloc(void *arg, void *p_, unsigned int size)
 	return &p[1];
 }
 
+static void mudraw_lock(void *user, int lock)
+{
+	mu_lock_mutex(&mutexes[lock]);
+}
+
+static void mudraw_unlock(void *user, int lock)
+{
+	mu_unlock_mutex(&mutexes[lock]);
+}
+
+static fz_locks_context mudraw_locks =
+{
+	NULL, mudraw_lock, mudraw_unlock
+};
+
+static fz_threads_context mudraw_threads =
+{
+	NULL, mu_run_jobs
+};
+
 #ifdef MUDRAW_STANDALONE
 int main(int argc, char **argv)
 #else
@@ -853,10 +1484,13 @@ int mudraw_main(int argc, char **argv)
 	int c;
 	fz_context *ctx;
 	fz_alloc_context alloc_ctx = { NULL, trace_malloc, trace_realloc, trace_free };
+	fz_locks_context *locks = NULL;
+	int elapsed = 0;
+	int i;
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:I:s:A:DiW:H:S:U:v")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:T:P:c:G:I:s:A:a:DL:OliW:H:S:U:v")) != -1)
 	{
 		switch (c)
 		{
@@ -873,6 +1507,8 @@ int mudraw_main(int argc, char **argv)
 		case 'h': height = atof(fz_optarg); break;
 		case 'f': fit = 1; break;
 		case 'B': bandheight = atoi(fz_optarg); break;
+		case 'T': num_workers = atoi(fz_optarg); break;
+		case 'P': band_threads = atoi(fz_optarg); break;
 
 		case 'c': out_cs = parse_colorspace(fz_optarg); break;
 		case 'G': gamma_value = atof(fz_optarg); break;
@@ -891,7 +1527,11 @@ int mudraw_main(int argc, char **argv)
 			break;
 
 		case 'A': alphabits = atoi(fz_optarg); break;
+		case 'a': rasterizer = !strcmp(fz_optarg, "cells") ? FZ_RASTERIZER_CELLS : FZ_RASTERIZER_EDGES; break;
 		case 'D': uselist = 0; break;
+		case 'L': list_output = fz_optarg; break;
+		case 'O': optimize = 1; break;
+		case 'l': list_input = 1; break;
 		case 'i': ignore_errors = 1; break;
 
 		case 'v': fprintf(stderr, "mudraw version %s\n", FZ_VERSION); return 1;
@@ -901,7 +1541,26 @@ int mudraw_main(int argc, char **argv)
 	if (fz_optind == argc)
 		usage();
 
-	ctx = fz_new_context((showmemory == 0 ? NULL : &alloc_ctx), NULL, FZ_STORE_DEFAULT);
+	if (num_workers < 0)
+	{
+		fprintf(stderr, "Number of threads must be >= 0\n");
+		exit(1);
+	}
+
+	if (num_workers > 0 || band_threads > 1)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+		{
+			if (mu_create_mutex(&mutexes[i]))
+			{
+				fprintf(stderr, "cannot create mutex\n");
+				exit(1);
+			}
+		}
+		locks = &mudraw_locks;
+	}
+
+	ctx = fz_new_context((showmemory == 0 ? NULL : &alloc_ctx), locks, FZ_STORE_DEFAULT);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -909,6 +1568,10 @@ int mudraw_main(int argc, char **argv)
 	}
 
 	fz_set_aa_level(ctx, alphabits);
+	fz_set_aa_rasterizer(ctx, rasterizer);
+
+	if (band_threads > 1)
+		fz_set_threads_context(ctx, &mudraw_threads);
 
 	if (layout_css)
 	{
@@ -962,6 +1625,13 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	/* These are saved by name, so cannot go to stdout */
+	if (output && !strcmp(output, "-") && (output_format == OUT_PWG || output_format == OUT_PCL || output_format == OUT_TGA))
+	{
+		fprintf(stderr, "PWG, PCL and TGA output cannot be written to stdout\n");
+		exit(1);
+	}
+
 	if (bandheight)
 	{
 		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG)
@@ -976,6 +1646,61 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (band_threads > 1)
+	{
+		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG &&
+			output_format != OUT_PBM && output_format != OUT_PWG && output_format != OUT_PCL && output_format != OUT_TGA)
+		{
+			fprintf(stderr, "Parallel bands only possible with raster outputs\n");
+			exit(1);
+		}
+		if (!uselist)
+		{
+			fprintf(stderr, "Parallel bands require the use of display lists\n");
+			exit(1);
+		}
+	}
+
+	if (num_workers > 0)
+	{
+		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG &&
+			output_format != OUT_PBM && output_format != OUT_PWG && output_format != OUT_PCL && output_format != OUT_TGA)
+		{
+			fprintf(stderr, "Threaded operation only possible with raster outputs\n");
+			exit(1);
+		}
+		if (bandheight)
+		{
+			fprintf(stderr, "Threaded operation not compatible with banded operation\n");
+			exit(1);
+		}
+		if (band_threads > 1)
+		{
+			fprintf(stderr, "Threaded operation not compatible with parallel bands\n");
+			exit(1);
+		}
+		if (!uselist)
+		{
+			fprintf(stderr, "Threaded operation requires the use of display lists\n");
+			exit(1);
+		}
+
+		workers = fz_calloc(ctx, num_workers, sizeof(*workers));
+		for (i = 0; i < num_workers; i++)
+		{
+			workers[i].num = i;
+			workers[i].ctx = fz_clone_context(ctx);
+			if (!workers[i].ctx ||
+				mu_create_semaphore(&workers[i].start) ||
+				mu_create_semaphore(&workers[i].stop) ||
+				mu_create_thread(&workers[i].thread, worker_thread, &workers[i]))
+			{
+				fprintf(stderr, "cannot create rendering thread\n");
+				exit(1);
+			}
+		}
+	}
+
 	{
 		int i, j;
 
@@ -1034,6 +1759,9 @@ int mudraw_main(int argc, char **argv)
 	timing.minfilename = "";
 	timing.maxfilename = "";
 
+	if (showtime)
+		elapsed = gettime();
+
 	if (output_format == OUT_TEXT || output_format == OUT_HTML || output_format == OUT_STEXT || output_format == OUT_TRACE)
 	{
 		if (output && output[0] != '-' && *output != 0)
@@ -1075,7 +1803,10 @@ int mudraw_main(int argc, char **argv)
 
 				fz_try(ctx)
 				{
-					doc = fz_open_document(ctx, filename);
+					if (list_input)
+						doc = open_list_document(ctx, filename);
+					else
+						doc = fz_open_document(ctx, filename);
 				}
 				fz_catch(ctx)
 				{
@@ -1102,6 +1833,7 @@ int mudraw_main(int argc, char **argv)
 						drawrange(ctx, doc, "1-");
 					if (fz_optind < argc && isrange(argv[fz_optind]))
 						drawrange(ctx, doc, argv[fz_optind++]);
+					finish_workers(ctx);
 				}
 
 				if (output_format == OUT_STEXT || output_format == OUT_TRACE)
@@ -1113,7 +1845,13 @@ int mudraw_main(int argc, char **argv)
 			fz_catch(ctx)
 			{
 				if (!ignore_errors)
+				{
+					discard_workers(ctx);
 					fz_rethrow(ctx);
+				}
+
+				/* Still write out the pages drawn before the error */
+				finish_workers(ctx);
 
 				fz_drop_document(ctx, doc);
 				doc = NULL;
@@ -1162,10 +1900,46 @@ int mudraw_main(int argc, char **argv)
 			printf("fastest page %d: %dms (%s)\n", timing.minpage, timing.min, timing.minfilename);
 			printf("slowest page %d: %dms (%s)\n", timing.maxpage, timing.max, timing.maxfilename);
 		}
+		if (num_workers > 0)
+		{
+			printf("elapsed %dms using %d threads\n", gettime() - elapsed, num_workers);
+			for (i = 0; i < num_workers; i++)
+			{
+				worker_t *w = &workers[i];
+				printf("thread %d: %d pages, rendering %dms", i, w->pages, w->total);
+				if (w->pages > 0)
+					printf(" for an average of %dms", w->total / w->pages);
+				printf("\n");
+			}
+		}
+	}
+
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].list = NULL;
+		mu_trigger_semaphore(&workers[i].start);
+		mu_destroy_thread(&workers[i].thread);
+		mu_destroy_semaphore(&workers[i].start);
+		mu_destroy_semaphore(&workers[i].stop);
+		fz_drop_context(workers[i].ctx);
+	}
+	fz_free(ctx, workers);
+
+	if (showmemory)
+	{
+		fz_output *stats_out = fz_new_output_with_file_ptr(ctx, stdout, 0);
+		fz_print_store_stats(ctx, stats_out);
+		fz_drop_output(ctx, stats_out);
 	}
 
 	fz_drop_context(ctx);
 
+	if (num_workers > 0 || band_threads > 1)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+			mu_destroy_mutex(&mutexes[i]);
+	}
+
 	if (showmemory)
 	{
 #if defined(_WIN64)
@@ -0,0 +1,137 @@
+/*
+ * Text index tool.
+ * Build a full text index of a document, or search one.
+ */
+
+#include "mupdf/fitz.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mutool index [options] input [output.idx]\n"
+		"\t-p -\tpassword\n"
+		"usage: mutool index -s text file.idx\n"
+		"\t-s -\tsearch the index for the text\n"
+		"\t-m -\tmaximum number of hits to print (default 1000)\n"
+		);
+	exit(1);
+}
+
+static int
+search_index(fz_context *ctx, const char *filename, const char *needle, int hit_max)
+{
+	fz_text_index *index = NULL;
+	fz_text_index_hit *hits = NULL;
+	int i, n = 0;
+
+	fz_var(index);
+	fz_var(hits);
+
+	fz_try(ctx)
+	{
+		index = fz_open_text_index(ctx, filename);
+		hits = fz_malloc_array(ctx, hit_max, sizeof *hits);
+		n = fz_search_text_index(ctx, index, needle, hits, hit_max);
+		for (i = 0; i < n; i++)
+			printf("page %d ofs %d: %g %g %g %g\n", hits[i].page + 1, hits[i].ofs,
+				hits[i].bbox.x0, hits[i].bbox.y0, hits[i].bbox.x1, hits[i].bbox.y1);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, hits);
+		fz_drop_text_index(ctx, index);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "cannot search text index: %s\n", filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+build_index(fz_context *ctx, const char *filename, const char *output, const char *password)
+{
+	fz_document *doc = NULL;
+	fz_output *out = NULL;
+	char *buf = NULL;
+
+	fz_var(doc);
+	fz_var(out);
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		if (!output)
+		{
+			buf = fz_malloc(ctx, strlen(filename) + 5);
+			sprintf(buf, "%s.idx", filename);
+			output = buf;
+		}
+
+		doc = fz_open_document(ctx, filename);
+		if (fz_needs_password(ctx, doc))
+		{
+			if (!fz_authenticate_password(ctx, doc, password))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password: %s", filename);
+		}
+
+		out = fz_new_output_with_path(ctx, output, 0);
+		fz_write_text_index(ctx, out, doc);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_document(ctx, doc);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "cannot index document: %s\n", filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+int muindex_main(int argc, char **argv)
+{
+	fz_context *ctx;
+	char *password = "";
+	char *needle = NULL;
+	int hit_max = 1000;
+	int c, ret;
+
+	while ((c = fz_getopt(argc, argv, "p:s:m:")) != -1)
+	{
+		switch (c)
+		{
+		case 'p': password = fz_optarg; break;
+		case 's': needle = fz_optarg; break;
+		case 'm': hit_max = atoi(fz_optarg); break;
+		default: usage(); break;
+		}
+	}
+
+	if (fz_optind == argc || argc - fz_optind > (needle ? 1 : 2) || hit_max <= 0)
+		usage();
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot initialise context\n");
+		exit(1);
+	}
+
+	if (needle)
+		ret = search_index(ctx, argv[fz_optind], needle, hit_max);
+	else
+	{
+		fz_register_document_handlers(ctx);
+		ret = build_index(ctx, argv[fz_optind], argc - fz_optind > 1 ? argv[fz_optind + 1] : NULL, password);
+	}
+
+	fz_drop_context(ctx);
+	return ret;
+}
@@ -9,6 +9,7 @@
 #endif
 
 int mudraw_main(int argc, char *argv[]);
+int muindex_main(int argc, char *argv[]);
 int pdfclean_main(int argc, char *argv[]);
 int pdfextract_main(int argc, char *argv[]);
 int pdfinfo_main(int argc, char *argv[]);
@@ -24,6 +25,7 @@ static struct {
 	{ mudraw_main, "draw", "convert document" },
 	{ pdfclean_main, "clean", "rewrite pdf file" },
 	{ pdfextract_main, "extract", "extract font and image resources" },
+	{ muindex_main, "index", "build or search a full text index" },
 	{ pdfinfo_main, "info", "show information about pdf resources" },
 	{ pdfpages_main, "pages", "show information about pdf pages" },
 	{ pdfposter_main, "poster", "split large page into many tiles" },
@@ -10,6 +10,7 @@
  */
 
 #include "mupdf/pdf.h"
+#include "mupdf/helpers/mu-threads.h"
 
 static void usage(void)
 {
@@ -26,11 +27,35 @@ static void usage(void)
 		"\t-f\ttoggle decompression of font streams\n"
 		"\t-a\tascii hex encode binary streams\n"
 		"\t-z\tdeflate uncompressed streams\n"
+		"\t-T -\tnumber of threads to use for deflating streams\n"
+		"\t-Z\tpack objects into object streams\n"
 		"\tpages\tcomma separated list of page numbers and ranges\n"
 		);
 	exit(1);
 }
 
+static mu_mutex mutexes[FZ_LOCK_MAX];
+
+static void pdfclean_lock(void *user, int lock)
+{
+	mu_lock_mutex(&mutexes[lock]);
+}
+
+static void pdfclean_unlock(void *user, int lock)
+{
+	mu_unlock_mutex(&mutexes[lock]);
+}
+
+static fz_locks_context pdfclean_locks =
+{
+	NULL, pdfclean_lock, pdfclean_unlock
+};
+
+static fz_threads_context pdfclean_threads =
+{
+	NULL, mu_run_jobs
+};
+
 int pdfclean_main(int argc, char **argv)
 {
 	char *infile;
@@ -40,6 +65,8 @@ int pdfclean_main(int argc, char **argv)
 	pdf_write_options opts;
 	int errors = 0;
 	fz_context *ctx;
+	fz_locks_context *locks = NULL;
+	int i;
 
 	opts.do_incremental = 0;
 	opts.do_garbage = 0;
@@ -50,8 +77,10 @@ int pdfclean_main(int argc, char **argv)
 	opts.continue_on_error = 1;
 	opts.errors = &errors;
 	opts.do_clean = 0;
+	opts.do_threads = 0;
+	opts.do_use_objstms = 0;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:sz")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilp:szT:Z")) != -1)
 	{
 		switch (c)
 		{
@@ -64,6 +93,8 @@ int pdfclean_main(int argc, char **argv)
 		case 'a': opts.do_ascii ++; break;
 		case 'z': opts.do_deflate ++; break;
 		case 's': opts.do_clean ++; break;
+		case 'T': opts.do_threads = atoi(fz_optarg); break;
+		case 'Z': opts.do_use_objstms ++; break;
 		default: usage(); break;
 		}
 	}
@@ -79,13 +110,29 @@ int pdfclean_main(int argc, char **argv)
 		outfile = argv[fz_optind++];
 	}
 
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (opts.do_threads > 1)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+		{
+			if (mu_create_mutex(&mutexes[i]))
+			{
+				fprintf(stderr, "cannot create mutex\n");
+				exit(1);
+			}
+		}
+		locks = &pdfclean_locks;
+	}
+
+	ctx = fz_new_context(NULL, locks, FZ_STORE_UNLIMITED);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
 		exit(1);
 	}
 
+	if (opts.do_threads > 1)
+		fz_set_threads_context(ctx, &pdfclean_threads);
+
 	fz_try(ctx)
 	{
 		pdf_clean_file(ctx, infile, outfile, password, &opts, &argv[fz_optind], argc - fz_optind);
@@ -96,5 +143,11 @@ int pdfclean_main(int argc, char **argv)
 	}
 	fz_drop_context(ctx);
 
+	if (opts.do_threads > 1)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+			mu_destroy_mutex(&mutexes[i]);
+	}
+
 	return errors != 0;
 }